@@ -0,0 +1,567 @@
+/***************************************************************
+                            daemon.cpp
+
+Keeps the flashcart open between runs, and lets other
+UNFLoader instances upload ROMs, send commands, and read
+the debug output through a local socket.
+***************************************************************/
+
+#ifdef LINUX
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <limits.h>
+    #include <signal.h>
+#endif
+#include "main.h"
+#include "daemon.h"
+#include "helper.h"
+#include "device.h"
+#include "debug.h"
+#include "term.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <mutex>
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define RECEIVE_SIZE  0x1000          // Size (in bytes) of the buffer we read from the socket with
+#define MAX_REQUEST   0x1000          // Longest request (in bytes) a client can send
+#define MAX_OUTBUFFER (4*1024*1024)   // Max size (in bytes) of the output waiting to be sent to a client, before it's disconnected
+
+
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    int         fd;
+    std::string in;         // Bytes received from the client that haven't been handled yet
+    std::string out;        // Bytes waiting to be sent to the client
+    bool        subscribed; // Whether the client wants the program output
+    bool        uploading;  // Whether the client is waiting for a ROM upload to finish
+    std::atomic<bool> closing; // Whether the client should be disconnected once its output is sent
+} DaemonClient;
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+#ifdef LINUX
+    static void daemon_accept();
+    static void daemon_handle(DaemonClient* client, std::string request);
+    static void daemon_reply(DaemonClient* client, const char* reply, ...);
+    static bool daemon_flush(DaemonClient* client);
+#endif
+
+
+/*********************************
+             Globals
+*********************************/
+
+static int         local_listenfd = -1;
+static std::string local_path;
+static char*       local_rompath = NULL;
+static std::mutex  local_clients_lock;
+static std::vector<DaemonClient*> local_clients;
+
+
+#ifdef LINUX
+
+    /*==============================
+        daemon_start
+        Starts listening for clients on a
+        Unix domain socket
+        @param The path of the socket
+    ==============================*/
+
+    void daemon_start(const char* path)
+    {
+        struct sockaddr_un addr;
+        int fd;
+
+        // Check the path fits in the socket address
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            terminate("Daemon socket path '%s' is too long.", path);
+        strcpy(addr.sun_path, path);
+
+        // If the socket already exists, make sure there isn't another daemon using it before replacing it
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            terminate("Unable to create daemon socket.");
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            close(fd);
+            terminate("Another daemon is already listening on '%s'.", path);
+        }
+        close(fd);
+        unlink(path);
+
+        // Open the socket. Only our user gets to talk to the cart
+        local_listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (local_listenfd < 0)
+            terminate("Unable to create daemon socket.");
+        if (bind(local_listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            terminate("Unable to bind daemon socket '%s'.", path);
+        chmod(path, S_IRUSR | S_IWUSR);
+        if (listen(local_listenfd, 8) < 0)
+            terminate("Unable to listen on daemon socket '%s'.", path);
+        fcntl(local_listenfd, F_SETFL, fcntl(local_listenfd, F_GETFL, 0) | O_NONBLOCK);
+        signal(SIGPIPE, SIG_IGN);
+        local_path = path;
+        log_simple("Daemon listening on '%s'.\n", path);
+    }
+
+
+    /*==============================
+        daemon_poll
+        Accepts new clients, handles their
+        requests, and sends them any pending
+        output. Must be called from the
+        program loop, as requests touch the
+        flashcart.
+    ==============================*/
+
+    void daemon_poll()
+    {
+        if (local_listenfd < 0)
+            return;
+        daemon_accept();
+
+        // Go through every client. New clients aren't added from any other thread, so the list can be walked without the lock
+        for (size_t i=0; i<local_clients.size(); i++)
+        {
+            DaemonClient* client = local_clients[i];
+            char buff[RECEIVE_SIZE];
+            ssize_t readsize = 1;
+
+            // Read everything the client sent us
+            while (!client->closing && (readsize = recv(client->fd, buff, RECEIVE_SIZE, MSG_DONTWAIT)) > 0)
+                client->in.append(buff, readsize);
+            if (readsize == 0 || (readsize < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                client->closing = true;
+
+            // Handle whole requests, one at a time, so that an upload finishes before the next request is looked at
+            while (!client->closing && !client->uploading && client->in.find('\n') != std::string::npos)
+            {
+                size_t end = client->in.find('\n');
+                std::string request = client->in.substr(0, end);
+                client->in.erase(0, end+1);
+                if (!request.empty() && request.back() == '\r')
+                    request.pop_back();
+                daemon_handle(client, request);
+            }
+            if (client->in.size() > MAX_REQUEST)
+                client->closing = true;
+        }
+
+        // Send the pending output, and get rid of the clients that left
+        std::lock_guard<std::mutex> lock(local_clients_lock);
+        for (size_t i=0; i<local_clients.size();)
+        {
+            DaemonClient* client = local_clients[i];
+            if (!daemon_flush(client) || (client->closing && client->out.empty()))
+            {
+                close(client->fd);
+                delete client;
+                local_clients.erase(local_clients.begin() + i);
+            }
+            else
+                i++;
+        }
+    }
+
+
+    /*==============================
+        daemon_accept
+        Accepts any clients waiting to
+        connect
+    ==============================*/
+
+    static void daemon_accept()
+    {
+        int fd;
+        while ((fd = accept(local_listenfd, NULL, NULL)) >= 0)
+        {
+            DaemonClient* client = new DaemonClient();
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            client->fd = fd;
+            client->subscribed = false;
+            client->uploading = false;
+            client->closing = false;
+            std::lock_guard<std::mutex> lock(local_clients_lock);
+            local_clients.push_back(client);
+        }
+    }
+
+
+    /*==============================
+        daemon_handle
+        Handles a request from a client
+        @param The client that sent the request
+        @param The request, without the newline
+    ==============================*/
+
+    static void daemon_handle(DaemonClient* client, std::string request)
+    {
+        size_t split = request.find(' ');
+        std::string command = request.substr(0, split);
+        std::string arg = (split != std::string::npos) ? request.substr(split+1) : "";
+
+        if (command == "upload")
+        {
+            char* oldrom = local_rompath;
+            struct stat path_stat;
+
+            // Check the ROM here, as the program loop would terminate if it was bad
+            if (stat(arg.c_str(), &path_stat) != 0 || !S_ISREG(path_stat.st_mode) || access(arg.c_str(), R_OK) != 0)
+            {
+                daemon_reply(client, "error '%s' is not a readable file.\n", arg.c_str());
+                return;
+            }
+            if ((uint64_t)path_stat.st_size > device_getmaxromsize())
+            {
+                daemon_reply(client, "error The %s only supports ROMs up to %d bytes.\n", cart_typetostr(device_getcart()), device_getmaxromsize());
+                return;
+            }
+
+            // Swap the ROM and let the program loop upload it
+            local_rompath = strdup(arg.c_str());
+            device_setrom(local_rompath);
+            free(oldrom);
+            client->uploading = true;
+            log_simple("Client requested upload of '%s'.\n", local_rompath);
+            program_event(PEV_NEWROM);
+        }
+        else if (command == "send")
+        {
+            if (arg.empty())
+            {
+                daemon_reply(client, "error Nothing to send.\n");
+                return;
+            }
+            debug_sendtext(&arg[0]);
+            daemon_reply(client, "ok\n");
+        }
+        else if (command == "subscribe")
+        {
+            daemon_reply(client, "ok\n");
+            std::lock_guard<std::mutex> lock(local_clients_lock);
+            client->subscribed = true;
+        }
+        else if (command == "stop")
+        {
+            daemon_reply(client, "ok\n");
+            while (get_escapelevel() > 0)
+                decrement_escapelevel();
+        }
+        else
+            daemon_reply(client, "error Unknown request '%s'.\n", command.c_str());
+    }
+
+
+    /*==============================
+        daemon_reply
+        Queues a reply for a client
+        @param The client to reply to
+        @param The reply
+        @param Variable arguments for the reply
+    ==============================*/
+
+    static void daemon_reply(DaemonClient* client, const char* reply, ...)
+    {
+        char buff[RECEIVE_SIZE];
+        va_list args;
+        va_start(args, reply);
+        vsnprintf(buff, RECEIVE_SIZE, reply, args);
+        va_end(args);
+        std::lock_guard<std::mutex> lock(local_clients_lock);
+        client->out += buff;
+    }
+
+
+    /*==============================
+        daemon_flush
+        Sends as much of a client's pending
+        output as the socket will take.
+        Expects the client lock to be held
+        @param  The client to send to
+        @return False if the client is gone
+    ==============================*/
+
+    static bool daemon_flush(DaemonClient* client)
+    {
+        while (!client->out.empty())
+        {
+            ssize_t sent = send(client->fd, client->out.data(), client->out.size(), MSG_DONTWAIT);
+            if (sent < 0)
+                return (errno == EAGAIN || errno == EWOULDBLOCK);
+            client->out.erase(0, sent);
+        }
+        return true;
+    }
+
+
+    /*==============================
+        daemon_uploaded
+        Tells the clients waiting on a ROM
+        upload that it finished
+        @param Whether the upload succeeded
+    ==============================*/
+
+    void daemon_uploaded(bool success)
+    {
+        for (size_t i=0; i<local_clients.size(); i++)
+        {
+            if (!local_clients[i]->uploading)
+                continue;
+            local_clients[i]->uploading = false;
+            if (success)
+                daemon_reply(local_clients[i], "ok\n");
+            else
+                daemon_reply(local_clients[i], "error Upload cancelled.\n");
+        }
+    }
+
+
+    /*==============================
+        daemon_output
+        Passes program output on to the
+        subscribed clients. Can be called
+        from any thread
+        @param The output
+        @param The size of the output
+    ==============================*/
+
+    void daemon_output(const char* str, size_t size)
+    {
+        char header[32];
+        if (size == 0)
+            return;
+
+        // Output is framed, so that the client can tell it apart from replies
+        snprintf(header, sizeof(header), "out %u\n", (uint32_t)size);
+        std::lock_guard<std::mutex> lock(local_clients_lock);
+        for (size_t i=0; i<local_clients.size(); i++)
+        {
+            DaemonClient* client = local_clients[i];
+            if (!client->subscribed || client->closing)
+                continue;
+            if (client->out.size() + size > MAX_OUTBUFFER)
+            {
+                client->closing = true;
+                continue;
+            }
+            client->out += header;
+            client->out.append(str, size);
+        }
+    }
+
+
+    /*==============================
+        daemon_isrunning
+        Checks if the daemon is listening
+        for clients
+        @return Whether the daemon is running
+    ==============================*/
+
+    bool daemon_isrunning()
+    {
+        return local_listenfd >= 0;
+    }
+
+
+    /*==============================
+        daemon_stop
+        Disconnects all the clients and
+        removes the socket
+    ==============================*/
+
+    void daemon_stop()
+    {
+        if (local_listenfd < 0)
+            return;
+        std::lock_guard<std::mutex> lock(local_clients_lock);
+        for (size_t i=0; i<local_clients.size(); i++)
+        {
+            daemon_flush(local_clients[i]);
+            close(local_clients[i]->fd);
+            delete local_clients[i];
+        }
+        local_clients.clear();
+        close(local_listenfd);
+        local_listenfd = -1;
+        unlink(local_path.c_str());
+    }
+
+
+    /*==============================
+        daemon_client
+        Connects to a daemon and makes requests
+        based on the program arguments. Prints
+        the replies and output to stdout
+        @param  The path of the daemon's socket
+        @param  A list of arguments
+        @return The program's exit code
+    ==============================*/
+
+    int daemon_client(const char* path, std::list<char*>* args)
+    {
+        struct sockaddr_un addr;
+        std::vector<std::string> requests;
+        std::string in;
+        bool subscribe = false;
+        int fd;
+
+        // Turn the arguments into requests
+        for (std::list<char*>::iterator it = args->begin(); it != args->end(); ++it)
+        {
+            char* command = (*it);
+            if (!strcmp(command, "-r") && std::next(it) != args->end())
+            {
+                char fullpath[PATH_MAX];
+                if (realpath(*(++it), fullpath) == NULL)
+                {
+                    fprintf(stderr, "Error: '%s' is not a file.\n", *it);
+                    return EXIT_FAILURE;
+                }
+                requests.push_back(std::string("upload ") + fullpath);
+            }
+            else if (!strcmp(command, "--send") && std::next(it) != args->end())
+                requests.push_back(std::string("send ") + *(++it));
+            else if (!strcmp(command, "--stop"))
+                requests.push_back("stop");
+            else if (!strcmp(command, "-d"))
+                subscribe = true;
+            else
+            {
+                fprintf(stderr, "Error: Unknown client command '%s'.\n", command);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Subscribe first, so that nothing the ROM prints after an upload is missed
+        if (subscribe)
+            requests.insert(requests.begin(), "subscribe");
+        if (requests.empty())
+        {
+            fprintf(stderr, "Error: Nothing to ask the daemon.\n");
+            return EXIT_FAILURE;
+        }
+
+        // Connect to the daemon
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            fprintf(stderr, "Error: Unable to connect to a daemon on '%s'.\n", path);
+            return EXIT_FAILURE;
+        }
+
+        // Make the requests one at a time, printing output while we wait for the replies
+        for (size_t i=0; i<=requests.size(); i++)
+        {
+            bool replied = false;
+            if (i < requests.size())
+            {
+                std::string request = requests[i] + "\n";
+                if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+                    break;
+            }
+            else if (!subscribe)
+                break;
+
+            // Read until we get a reply. Once all the requests are done, subscribers keep reading until the daemon goes away
+            while (!replied)
+            {
+                char buff[RECEIVE_SIZE];
+                size_t end = in.find('\n');
+                if (end == std::string::npos)
+                {
+                    ssize_t readsize = recv(fd, buff, RECEIVE_SIZE, 0);
+                    if (readsize <= 0)
+                    {
+                        close(fd);
+                        if (i < requests.size())
+                        {
+                            fprintf(stderr, "Error: The daemon closed the connection.\n");
+                            return EXIT_FAILURE;
+                        }
+                        return EXIT_SUCCESS;
+                    }
+                    in.append(buff, readsize);
+                    continue;
+                }
+
+                // Output frames are a header with the size, followed by the data
+                if (!in.compare(0, 4, "out "))
+                {
+                    size_t size = strtoul(in.c_str() + 4, NULL, 10);
+                    if (in.size() < end + 1 + size)
+                    {
+                        ssize_t readsize = recv(fd, buff, RECEIVE_SIZE, 0);
+                        if (readsize <= 0)
+                        {
+                            fprintf(stderr, "Error: The daemon closed the connection.\n");
+                            close(fd);
+                            return EXIT_FAILURE;
+                        }
+                        in.append(buff, readsize);
+                        continue;
+                    }
+                    fwrite(in.data() + end + 1, 1, size, stdout);
+                    fflush(stdout);
+                    in.erase(0, end + 1 + size);
+                    continue;
+                }
+
+                // Anything else is a reply
+                if (!in.compare(0, 6, "error "))
+                {
+                    fprintf(stderr, "Error: %s\n", in.substr(6, end-6).c_str());
+                    close(fd);
+                    return EXIT_FAILURE;
+                }
+                in.erase(0, end+1);
+                replied = true;
+            }
+        }
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+#else
+
+    void daemon_start(const char* path)
+    {
+        terminate("Daemon mode is not supported on Windows.");
+    }
+
+    void daemon_poll() {}
+    void daemon_uploaded(bool success) {}
+    void daemon_output(const char* str, size_t size) {}
+    bool daemon_isrunning() { return false; }
+    void daemon_stop() {}
+
+    int daemon_client(const char* path, std::list<char*>* args)
+    {
+        fprintf(stderr, "Error: Daemon mode is not supported on Windows.\n");
+        return EXIT_FAILURE;
+    }
+
+#endif
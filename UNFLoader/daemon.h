@@ -0,0 +1,30 @@
+#ifndef __DAEMON_HEADER
+#define __DAEMON_HEADER
+
+    #include <list>
+    #include <stddef.h>
+
+
+    /*********************************
+                  Macros
+    *********************************/
+
+    #define DEFAULT_DAEMONPATH "/tmp/unfloader.sock"
+
+
+    /*********************************
+            Function Prototypes
+    *********************************/
+
+    // Daemon side
+    void daemon_start(const char* path);
+    void daemon_poll();
+    void daemon_uploaded(bool success);
+    void daemon_output(const char* str, size_t size);
+    bool daemon_isrunning();
+    void daemon_stop();
+
+    // Client side
+    int  daemon_client(const char* path, std::list<char*>* args);
+
+#endif
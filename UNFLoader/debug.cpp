@@ -13,10 +13,15 @@
     #include <shlwapi.h>
 #endif
 #include <list>
-#include <queue>
+#include <map>
+#include <string>
+#include <deque>
 #include <thread>
 #include <iterator>
 #include <mutex>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 
 
 /*********************************
@@ -25,10 +30,46 @@
 
 #define HEADER_SIZE 16
 #define PATH_SIZE 512
+#define BULK_SIZE 4096 // Text messages larger than this (in bytes) are treated as bulk uploads
+#define SEGMENT_SIZE (1024*1024) // Files larger than this (in bytes) are sent to the console in segments of this size
+#define SEGMENT_HEADERSIZE 16
+#define STREAM_CHUNKSIZE (64*1024) // Size (in bytes) of the chunks that the file given with --stream is sent in
+#define STREAM_STATUSSIZE 12
+#define PATCH_CHUNKSIZE (1024*1024) // Patches larger than this (in bytes) are sent to the console in chunks of this size
+#define PATCH_HEADERSIZE 8
+#define PATCH_CHECKTIME 250 // Time (in milliseconds) between checks for changes to the files given with --patch
+#define FS_HEADERSIZE 12
+#define FS_REPLYHEADERSIZE 8
+#define FS_MAXREPLY (1024*1024) // Max size (in bytes) of an answer to a debug_fs_read request
+#define FS_READAHEAD (4*1024*1024) // How much (in bytes) is read from a file at once, so that sequential reads are served from memory
+#define FS_MAXFILES 32 // How many files are kept open for debug_fs_read
+#define PROFILE_HEADERSIZE 8
+#define PROFILE_SAMPLESIZE 12
+#define REPORT_WRITETIME 2000 // Time (in milliseconds) between rewrites of the files given with --profile and --heap
+#define ZONE_HEADERSIZE 12
+#define ZONE_EVENTSIZE 8
+#define HEAP_HEADERSIZE 4
+#define HEAP_EVENTSIZE 12
+#define CORE_HEADERSIZE 8
+#define CORE_THREADSIZE 424
+#define CORE_RDRAMADDRESS 0x80000000 // Where RDRAM is mapped in KSEG0. It's also mapped uncached at 0xA0000000
 
 // Max supported protocol versions
-#define USBPROTOCOL_VERSION PROTOCOL_VERSION2
-#define HEARTBEAT_VERSION   1
+#define USBPROTOCOL_VERSION PROTOCOL_VERSION3
+#define HEARTBEAT_VERSION   2
+
+
+/*********************************
+              Enums
+*********************************/
+
+// Outgoing messages are sent in order of priority, then in the order they were queued
+typedef enum {
+    PRIORITY_CONTROL = 0, // RDB packets and heartbeats
+    PRIORITY_INTERACTIVE, // Text commands from the user
+    PRIORITY_BULK,        // Files and other large uploads
+    PRIORITY_COUNT,
+} SendPriority;
 
 
 /*********************************
@@ -36,16 +77,21 @@
 *********************************/
 
 typedef struct {
-    char*       original;
-    byte*       data;
-    USBDataType type;
-    int32_t     size;
+    char*        original;
+    byte*        data;
+    USBDataType  type;
+    int32_t      size;
+    SendPriority priority;
+    DeviceIOVec* vec;      // If not NULL, the message is sent from this list of buffers and files instead of data
+    uint32_t     veccount;
+    uint32_t     sent;     // How many bytes have been sent so far, as segmented messages can be sent over several passes
+    uint32_t     transfer; // The transfer ID of a segmented message
 } SendData;
 
 typedef struct {
     char*    str;
     uint32_t strsize;
-    byte*    data;
+    FILE*    file;
     uint32_t datasize;
     bool     ispath;
 } ParseHelper;
@@ -55,20 +101,78 @@ typedef struct {
     uint32_t size;
 } RDBPacketChunk;
 
+typedef struct {
+    uint32_t address;
+    char*    path;
+    time_t   seenmodtime; // The file's modification time at the last check, as files are only sent once they stop changing
+    time_t   sentmodtime; // The file's modification time when it was last sent
+    FILE*    file;        // The file while it is being sent, or NULL
+    uint32_t size;
+    uint32_t sent;
+    uint64_t starttime;
+} Patch;
+
+typedef struct {
+    uint32_t    id;
+    uint32_t    offset;
+    uint32_t    size;
+    std::string path;
+} FSRequest;
+
+typedef struct {
+    FILE*             file;
+    uint32_t          size;
+    time_t            modtime;
+    std::vector<byte> cache;       // Data that was read ahead of what the console asked for
+    uint32_t          cacheoffset; // Where in the file the cache starts
+} FSFile;
+
+typedef struct {
+    std::string name;
+    uint32_t    size; // 0 if the ELF doesn't say, in which case the symbol lasts until the next one
+} ElfSymbol;
+
+typedef struct {
+    uint32_t size;
+    uint32_t caller;
+} HeapBlock;
+
 
 /*********************************
         Function Prototypes
 *********************************/
 
 static void push_mesg(SendData* mesg);
-static SendData* pop_mesg();
-
+static void requeue_mesg(SendData* mesg);
+static SendData* pop_mesg(bool allowbulk);
+static DeviceError debug_sendmesg(SendData* mesg);
+static DeviceError debug_sendsegments(SendData* mesg);
+static void debug_sendstream();
+static void debug_sendpatches();
+static void debug_sendfsreplies();
+static FSFile* debug_fs_getfile(const std::string& path);
+static void debug_loadsymbols(char* elfpath);
+static const char* debug_symbol(uint32_t address);
+static void debug_profile_write();
+static void debug_heap_write();
+static void debug_core_write();
+
+static void debug_handle_data(USBDataType command, uint32_t size, byte* buffer);
+static void debug_handle_channel(uint32_t size, byte* buffer);
 static void debug_handle_text(uint32_t size, byte* buffer);
 static void debug_handle_rawbinary(uint32_t size, byte* buffer);
 static void debug_handle_header(uint32_t size, byte* buffer);
 static void debug_handle_screenshot(uint32_t size, byte* buffer);
 static void debug_handle_heartbeat(uint32_t size, byte* buffer);
 static void debug_handle_rdbpacket(uint32_t size, byte* buffer);
+static void debug_handle_stream(uint32_t size, byte* buffer);
+static void debug_handle_fsrequest(uint32_t size, byte* buffer);
+static void debug_handle_profile(uint32_t size, byte* buffer);
+static void debug_handle_zones(uint32_t size, byte* buffer);
+static void debug_handle_zonename(uint32_t size, byte* buffer);
+static void debug_handle_heap(uint32_t size, byte* buffer);
+static void debug_handle_coreregs(uint32_t size, byte* buffer);
+static void debug_handle_coremem(uint32_t size, byte* buffer);
 
 
 /*********************************
@@ -82,9 +186,71 @@ static char* local_binaryoutfolderpath = NULL;
 // Other
 static int debug_headerdata[HEADER_SIZE];
 static std::mutex local_mesgqueue_lock;
-static std::queue<SendData*> local_mesgqueue;
+static std::deque<SendData*> local_mesgqueue[PRIORITY_COUNT];
 static std::list<RDBPacketChunk*> local_rdbpackets;
 
+// USB protocol 3
+static uint16_t local_channelsequence[CHANNEL_COUNT];
+static std::vector<byte> local_channeldata[CHANNEL_COUNT];
+
+// Streaming a file into the console's stream ring
+static char*    local_streampath = NULL;
+static FILE*    local_streamfile = NULL;
+static uint32_t local_streamsize = 0;
+static uint32_t local_streamcapacity = 0; // Size of the console's ring, or 0 if the console hasn't told us about it yet
+static uint32_t local_streamsent = 0;     // How many bytes of the file were sent so far
+static uint32_t local_streamread = 0;     // How many bytes the console said it has read from the ring
+
+// Patching files straight into the console's RDRAM
+static std::vector<Patch> local_patches;
+
+// Serving files to debug_fs_read
+static char* local_fsroot = NULL;
+static std::deque<FSRequest> local_fsrequests;
+static std::map<std::string, FSFile> local_fsfiles;
+
+// When the reports given with --profile and --heap were last written
+static uint64_t local_reportwritetime = 0;
+
+// Function symbols from the ELF given with --profile or --heap, by address
+static std::map<uint32_t, ElfSymbol> local_symbols;
+
+// Profiling the console's CPU
+static char*    local_profilepath = NULL;
+static uint64_t local_profilesamples = 0;
+static uint32_t local_profiledropped = 0;
+static bool     local_profiledirty = false; // Whether samples arrived since the file was last written
+static std::map<std::string, uint64_t> local_profilestacks; // How many samples were taken in each folded stack
+
+// Writing the console's zones as a Chrome trace
+static char*    local_tracepath = NULL;
+static FILE*    local_tracefile = NULL;
+static uint64_t local_traceevents = 0;
+static uint32_t local_tracedropped = 0;
+static bool     local_tracesynced = false;  // Whether the console's clock was lined up with ours since the last heartbeat
+static uint32_t local_tracelastcount = 0;   // The COUNT of the last event
+static uint64_t local_tracecount = 0;       // The COUNT of the last event, extended to 64 bits so that it doesn't wrap around
+static double   local_traceoffset = 0;      // Microseconds to add to the console's time to get the time in the trace
+static std::chrono::steady_clock::time_point local_tracestart;
+static std::map<uint16_t, std::string> local_tracenames;
+
+// Analyzing the console's heap
+static char*    local_heappath = NULL;
+static uint64_t local_heapevents = 0;
+static uint32_t local_heapdropped = 0;
+static uint64_t local_heapused = 0;         // Bytes in live blocks
+static uint64_t local_heappeak = 0;
+static uint64_t local_heapunknownfrees = 0; // Frees of memory that wasn't a live block
+static uint64_t local_heapoverlaps = 0;     // Allocations that overlapped a live block, which means that a free was missed
+static bool     local_heapdirty = false;    // Whether events arrived since the report was last written
+static std::map<uint32_t, HeapBlock> local_heapblocks; // Live blocks, by address
+
+// Writing the console's crash dumps to an ELF core file
+static char*    local_corepath = NULL;
+static uint32_t local_corememsize = 0;      // Size of the console's RDRAM, or 0 if no dump is being received
+static std::vector<byte> local_coreregs;    // The registers of every thread, as the console sent them
+static std::vector<byte> local_coremem;     // The RDRAM received so far
+
 
 /*==============================
     debug_main
@@ -96,26 +262,40 @@ void debug_main()
     byte*    outbuff = NULL;
     uint32_t dataheader = 0;
 
-    // If no ROM was uploaded, assume async, and switch to latest protocol
-    if (device_getrom() == NULL)
+    // If no ROM was uploaded, assume async, and switch to latest protocol (unless the heartbeat told us about a newer one)
+    if (device_getrom() == NULL && device_getprotocol() < USBPROTOCOL_LATEST)
         device_setprotocol(USBPROTOCOL_LATEST);
 
-    // Send data to USB if it exists
-    for (SendData* msg = pop_mesg(); msg != nullptr; msg = pop_mesg())
+    // Send data to USB if it exists. Only one bulk upload is sent per call, so that incoming data isn't held up by a backlog of them
+    bool sentbulk = false;
+    for (SendData* msg = pop_mesg(!sentbulk); msg != nullptr; msg = pop_mesg(!sentbulk))
     {
-        increment_escapelevel();
+        DeviceError err;
+        bool firstsend = (msg->sent == 0);
+        sentbulk = sentbulk || (msg->priority == PRIORITY_BULK);
+        if (firstsend)
+            increment_escapelevel();
         if (term_isusingcurses())
         {
-            std::thread t;
-            log_colored("Uploading command (ESC to cancel).\n", CRDEF_INPUT);
-            t = std::thread(progressthread, "Uploading command (ESC to cancel)");
-            handle_deviceerror(device_senddata(msg->type, msg->data, msg->size));
-            t.join();
+            if (firstsend)
+                log_colored("Uploading command (ESC to cancel).\n", CRDEF_INPUT);
+            progress_begin("Uploading command (ESC to cancel)");
+            err = debug_sendmesg(msg);
+            progress_end();
         }
         else
         {
-            log_simple("Uploading command (type 'cancel' to cancel).\n");
-            handle_deviceerror(device_senddata(msg->type, msg->data, msg->size));
+            if (firstsend)
+                log_simple("Uploading command (type 'cancel' to cancel).\n");
+            err = debug_sendmesg(msg);
+        }
+        handle_deviceerror(err);
+
+        // Segmented messages carry on once the console hands back the credits for the segments it has read
+        if (err == DEVICEERR_OK && !device_uploadcancelled() && msg->sent < (uint32_t)msg->size)
+        {
+            requeue_mesg(msg);
+            continue;
         }
 
         // Print success?
@@ -123,6 +303,8 @@ void debug_main()
         {
             if (msg->type == DATATYPE_TEXT)
                 log_replace("Sent command '%s'\n", CRDEF_INFO, msg->original);
+            else if (msg->type == DATATYPE_RDBPACKET && msg->data[0] == 'X')
+                log_replace("RDB sent packet '%.*s'\n", CRDEF_INFO, (int)strcspn((char*)msg->data, ":"), msg->data); // Don't print the binary data
             else if (msg->type == DATATYPE_RDBPACKET)
                 log_replace("RDB sent packet '%s'\n", CRDEF_INFO, msg->data);
             else
@@ -135,10 +317,22 @@ void debug_main()
         // Cleanup
         if (msg->original != NULL)
             free(msg->original);
+        if (msg->vec != NULL)
+        {
+            for (uint32_t i=0; i<msg->veccount; i++)
+                if (msg->vec[i].file != NULL)
+                    fclose(msg->vec[i].file);
+            free(msg->vec);
+        }
         free(msg->data);
         free(msg);
     }
 
+    // Keep the console's stream ring topped up, and send the patches whose files changed
+    debug_sendstream();
+    debug_sendpatches();
+    debug_sendfsreplies();
+
     // Read from USB
     do
     {
@@ -147,18 +341,7 @@ void debug_main()
         {
             uint32_t size = dataheader & 0xFFFFFF;
             USBDataType command = (USBDataType)((dataheader >> 24) & 0xFF);
-
-            // Decide what to do with the data based off the command type
-            switch (command)
-            {
-                case DATATYPE_TEXT:       debug_handle_text(size, outbuff); break;
-                case DATATYPE_RAWBINARY:  debug_handle_rawbinary(size, outbuff); break;
-                case DATATYPE_HEADER:     debug_handle_header(size, outbuff); break;
-                case DATATYPE_SCREENSHOT: debug_handle_screenshot(size, outbuff); break;
-                case DATATYPE_HEARTBEAT:  debug_handle_heartbeat(size, outbuff); break;
-                case DATATYPE_RDBPACKET:  debug_handle_rdbpacket(size, outbuff); break;
-                default:                  terminate("Unknown data type '%x'.", (uint32_t)command);
-            }
+            debug_handle_data(command, size, outbuff);
 
             // Cleanup
             free(outbuff);
@@ -166,40 +349,821 @@ void debug_main()
         }
     }
     while (dataheader > 0);
+
+    // Answer the files the console asked for straight away, as it waits for them
+    debug_sendfsreplies();
+
+    // Rewrite the reports every now and then, rather than for every batch of data that arrives
+    if (time_miliseconds() - local_reportwritetime >= REPORT_WRITETIME)
+        debug_writereports();
 }
 
 
 /*==============================
     push_mesg
-    Queues a GDB message
-    @param Pointer to GDB message. Must be dynamically allocated.
+    Queues a message, based on its priority
+    @param Pointer to the message. Must be dynamically allocated.
 ==============================*/
 
 static void push_mesg(SendData* mesg)
 {
     std::lock_guard<std::mutex> lock(local_mesgqueue_lock);
-    local_mesgqueue.push(mesg);
+
+    // Decide the message's priority
+    if (mesg->type == DATATYPE_RDBPACKET || mesg->type == DATATYPE_HEARTBEAT || mesg->type == DATATYPE_CREDIT)
+        mesg->priority = PRIORITY_CONTROL;
+    else if (mesg->type == DATATYPE_TEXT && mesg->size <= BULK_SIZE)
+        mesg->priority = PRIORITY_INTERACTIVE;
+    else
+        mesg->priority = PRIORITY_BULK;
+    local_mesgqueue[mesg->priority].push_back(mesg);
+}
+
+
+/*==============================
+    requeue_mesg
+    Puts a partially sent message back at
+    the front of its queue
+    @param Pointer to the message
+==============================*/
+
+static void requeue_mesg(SendData* mesg)
+{
+    std::lock_guard<std::mutex> lock(local_mesgqueue_lock);
+    local_mesgqueue[mesg->priority].push_front(mesg);
 }
 
 
 /*==============================
     pop_mesg
-    Returns the next GDB message, or null if there is none
-    @return Pointer to next GDB message
+    Returns the highest priority message that the console
+    has room for, or null if there is none
+    @param  Whether bulk messages can be returned
+    @return Pointer to next message
 ==============================*/
 
-static SendData* pop_mesg()
+static SendData* pop_mesg(bool allowbulk)
 {
     std::lock_guard<std::mutex> lock(local_mesgqueue_lock);
 
-    if (local_mesgqueue.empty())
+    for (int i=0; i<PRIORITY_COUNT; i++)
+    {
+        if (local_mesgqueue[i].empty() || (i == PRIORITY_BULK && !allowbulk))
+            continue;
+        SendData* mesg = local_mesgqueue[i].front();
+        if (!device_hascredit(device_getchannel(mesg->type)))
+            continue;
+        local_mesgqueue[i].pop_front();
+        return mesg;
+    }
+    return nullptr;
+}
+
+
+/*==============================
+    debug_sendmesg
+    Sends a message to the flashcart
+    @param  Pointer to the message
+    @return The device error, or OK
+==============================*/
+
+static DeviceError debug_sendmesg(SendData* mesg)
+{
+    if (mesg->type == DATATYPE_RAWBINARY && mesg->size > SEGMENT_SIZE)
+        return debug_sendsegments(mesg);
+    mesg->sent = mesg->size;
+    if (mesg->vec != NULL)
+        return device_senddatav(mesg->type, mesg->vec, mesg->veccount);
+    return device_senddata(mesg->type, mesg->data, mesg->size);
+}
+
+
+/*==============================
+    debug_sendsegments
+    Sends a large file to the console as a series of
+    DATATYPE_SEGMENT packets, which the console
+    reassembles. Each packet starts with the transfer
+    ID, the sequence number, the offset of the segment,
+    and the total size, as big endian 32-bit values.
+    Stops early if the console has no room for more
+    segments, in which case it should be called again
+    later to send the rest.
+    @param  Pointer to the message
+    @return The device error, or OK
+==============================*/
+
+static DeviceError debug_sendsegments(SendData* mesg)
+{
+    static uint32_t transfer = 0;
+    DeviceError  err = DEVICEERR_OK;
+    DeviceIOVec  single = {mesg->data, NULL, (uint32_t)mesg->size};
+    DeviceIOVec* vec = (mesg->vec != NULL) ? mesg->vec : &single;
+    uint32_t     veccount = (mesg->vec != NULL) ? mesg->veccount : 1;
+    uint32_t     vecindex = 0;
+    uint32_t     vecoffset = mesg->sent;
+    uint32_t     total = mesg->size;
+
+    // Start a new transfer, or skip the parts of the message that were already sent
+    if (mesg->sent == 0)
+        mesg->transfer = ++transfer;
+    while (vecindex < veccount && vecoffset > 0 && vecoffset >= vec[vecindex].size)
+        vecoffset -= vec[vecindex++].size;
+
+    while (mesg->sent < total && err == DEVICEERR_OK && !device_uploadcancelled() && device_hascredit(device_getchannel(DATATYPE_SEGMENT)))
+    {
+        byte header[SEGMENT_HEADERSIZE];
+        uint32_t offset = mesg->sent;
+        uint32_t values[4] = {mesg->transfer, offset/SEGMENT_SIZE, offset, total};
+        uint32_t left = (total - offset < SEGMENT_SIZE) ? total - offset : SEGMENT_SIZE;
+        std::vector<DeviceIOVec> segment;
+
+        // Build the segment header
+        for (int i=0; i<4; i++)
+        {
+            header[i*4+0] = (values[i] >> 24) & 0xFF;
+            header[i*4+1] = (values[i] >> 16) & 0xFF;
+            header[i*4+2] = (values[i] >> 8) & 0xFF;
+            header[i*4+3] = values[i] & 0xFF;
+        }
+        segment.push_back({header, NULL, SEGMENT_HEADERSIZE});
+
+        // Gather the pieces of the message that make up this segment
+        while (left > 0)
+        {
+            uint32_t bytes_do = vec[vecindex].size - vecoffset;
+            if (bytes_do > left)
+                bytes_do = left;
+            segment.push_back({(vec[vecindex].data != NULL) ? vec[vecindex].data + vecoffset : NULL, vec[vecindex].file, bytes_do});
+            vecoffset += bytes_do;
+            left -= bytes_do;
+            if (vecoffset == vec[vecindex].size)
+            {
+                vecindex++;
+                vecoffset = 0;
+            }
+        }
+
+        // Send the segment
+        device_setuploadrange(((float)offset)*100.0f/total, ((float)(offset + SEGMENT_SIZE < total ? offset + SEGMENT_SIZE : total))*100.0f/total);
+        err = device_senddatav(DATATYPE_SEGMENT, segment.data(), segment.size());
+        if (err != DEVICEERR_OK)
+            break; // Abort the transfer, the caller reports the error
+        mesg->sent = (offset + SEGMENT_SIZE < total) ? offset + SEGMENT_SIZE : total;
+    }
+    device_setuploadrange(0.0f, 100.0f);
+    return err;
+}
+
+
+/*==============================
+    debug_sendstream
+    Sends the next chunks of the file given with
+    --stream, as long as the console's stream ring
+    has room for them
+==============================*/
+
+static void debug_sendstream()
+{
+    DeviceError err = DEVICEERR_OK;
+
+    // Streams need USB protocol 3, and the console to have told us how big its ring is
+    if (local_streamfile == NULL || local_streamcapacity == 0 || device_getprotocol() < PROTOCOL_VERSION3)
+        return;
+
+    while (local_streamsent < local_streamsize && err == DEVICEERR_OK && device_hascredit(device_getchannel(DATATYPE_STREAM)))
+    {
+        uint32_t size = local_streamsize - local_streamsent;
+        DeviceIOVec vec;
+        if (size > STREAM_CHUNKSIZE)
+            size = STREAM_CHUNKSIZE;
+        if (size > local_streamcapacity)
+            size = local_streamcapacity;
+        if (size > device_getchannelmaxsize())
+            size = device_getchannelmaxsize();
+
+        // Stop once the ring is full, the console will tell us when it has read some of it
+        if (local_streamsent - local_streamread + size > local_streamcapacity)
+            break;
+        vec = {NULL, local_streamfile, size};
+        err = device_senddatav(DATATYPE_STREAM, &vec, 1);
+        handle_deviceerror(err);
+        local_streamsent += size;
+    }
+
+    // Close the file once it has all been sent
+    if (local_streamsent == local_streamsize)
+    {
+        if (term_isusingjsonl())
+            log_jsonl("stream", "\"size\":%u,\"path\":%s", local_streamsize, term_jsonstring(local_streampath, strlen(local_streampath)).c_str());
+        else
+            log_colored("Streamed %u bytes from '%s'.\n", CRDEF_INFO, local_streamsize, local_streampath);
+        fclose(local_streamfile);
+        local_streamfile = NULL;
+    }
+}
+
+
+/*==============================
+    debug_sendpatches
+    Sends the files given with --patch to the
+    console whenever they change. Large files
+    are sent in chunks, so that the console gets
+    to read other data in between.
+==============================*/
+
+static void debug_sendpatches()
+{
+    static uint64_t lastcheck = 0;
+    DeviceError err = DEVICEERR_OK;
+
+    // Older ROMs would treat patches as bad commands
+    if (local_patches.empty() || device_getprotocol() < PROTOCOL_VERSION2)
+        return;
+
+    // Look for files that changed, and wait until they stop changing so that half written files aren't sent
+    if (time_miliseconds() - lastcheck >= PATCH_CHECKTIME)
     {
-        return nullptr;
+        lastcheck = time_miliseconds();
+        for (Patch& patch : local_patches)
+        {
+            time_t modtime = file_lastmodtime(patch.path);
+            if (patch.file == NULL && modtime == patch.seenmodtime && modtime != patch.sentmodtime)
+            {
+                patch.sentmodtime = modtime;
+                patch.file = fopen(patch.path, "rb");
+                if (patch.file == NULL)
+                {
+                    log_colored("Error: Unable to open patch file '%s'.\n", CRDEF_ERROR, patch.path);
+                    continue;
+                }
+                fseek(patch.file, 0, SEEK_END);
+                patch.size = ftell(patch.file);
+                fseek(patch.file, 0, SEEK_SET);
+                patch.sent = 0;
+                patch.starttime = lastcheck;
+            }
+            patch.seenmodtime = modtime;
+        }
     }
 
-    SendData* mesg = local_mesgqueue.front();
-    local_mesgqueue.pop();
-    return mesg;
+    // Send the patches
+    for (Patch& patch : local_patches)
+    {
+        while (patch.file != NULL && err == DEVICEERR_OK && device_hascredit(device_getchannel(DATATYPE_PATCH)))
+        {
+            byte header[PATCH_HEADERSIZE];
+            uint32_t size = patch.size - patch.sent;
+            uint32_t values[2];
+            DeviceIOVec vec[2];
+            if (size > PATCH_CHUNKSIZE)
+                size = PATCH_CHUNKSIZE;
+            if (device_getprotocol() >= PROTOCOL_VERSION3 && size > device_getchannelmaxsize() - PATCH_HEADERSIZE)
+                size = device_getchannelmaxsize() - PATCH_HEADERSIZE;
+
+            // Build the patch header
+            values[0] = patch.address + patch.sent;
+            values[1] = size;
+            for (int i=0; i<2; i++)
+            {
+                header[i*4+0] = (values[i] >> 24) & 0xFF;
+                header[i*4+1] = (values[i] >> 16) & 0xFF;
+                header[i*4+2] = (values[i] >> 8) & 0xFF;
+                header[i*4+3] = values[i] & 0xFF;
+            }
+            vec[0] = {header, NULL, PATCH_HEADERSIZE};
+            vec[1] = {NULL, patch.file, size};
+            err = device_senddatav(DATATYPE_PATCH, vec, 2);
+            handle_deviceerror(err);
+            patch.sent += size;
+
+            // Close the file once it has all been sent
+            if (patch.sent == patch.size)
+            {
+                if (term_isusingjsonl())
+                    log_jsonl("patch", "\"address\":%u,\"size\":%u,\"path\":%s", patch.address, patch.size, term_jsonstring(patch.path, strlen(patch.path)).c_str());
+                else
+                    log_colored("Patched %u bytes at 0x%08X from '%s' in %llu ms.\n", CRDEF_INFO, patch.size, patch.address, patch.path, (unsigned long long)(time_miliseconds() - patch.starttime));
+                fclose(patch.file);
+                patch.file = NULL;
+            }
+        }
+    }
+}
+
+
+/*==============================
+    debug_sendfsreplies
+    Answers the console's debug_fs_read requests
+    with data from the folder given with --fs
+==============================*/
+
+static void debug_sendfsreplies()
+{
+    while (!local_fsrequests.empty() && device_hascredit(device_getchannel(DATATYPE_FSDATA)))
+    {
+        FSRequest req = local_fsrequests.front();
+        FSFile* file = debug_fs_getfile(req.path);
+        byte header[FS_REPLYHEADERSIZE];
+        int32_t result = -1;
+        DeviceIOVec vec[2];
+        local_fsrequests.pop_front();
+
+        // Work out how much of the file we can send
+        if (file != NULL)
+        {
+            uint32_t size = (req.offset < file->size) ? file->size - req.offset : 0;
+            if (size > req.size)
+                size = req.size;
+            if (size > FS_MAXREPLY)
+                size = FS_MAXREPLY;
+            if (device_getprotocol() >= PROTOCOL_VERSION3 && size > device_getchannelmaxsize() - FS_REPLYHEADERSIZE)
+                size = device_getchannelmaxsize() - FS_REPLYHEADERSIZE;
+            result = size;
+
+            // Read ahead if the data isn't in the cache, so that the next requests don't need to touch the disk
+            if (size > 0 && (req.offset < file->cacheoffset || req.offset + size > file->cacheoffset + file->cache.size()))
+            {
+                uint32_t readsize = file->size - req.offset;
+                if (readsize > FS_READAHEAD)
+                    readsize = FS_READAHEAD;
+                file->cache.resize(readsize);
+                file->cacheoffset = req.offset;
+                fseek(file->file, req.offset, SEEK_SET);
+                if (fread(file->cache.data(), 1, readsize, file->file) != readsize)
+                {
+                    file->cache.clear();
+                    result = -1;
+                }
+            }
+        }
+        else
+            log_colored("Error: Unable to read '%s' for the console.\n", CRDEF_ERROR, req.path.c_str());
+
+        // Send the answer
+        header[0] = (req.id >> 24) & 0xFF;
+        header[1] = (req.id >> 16) & 0xFF;
+        header[2] = (req.id >> 8) & 0xFF;
+        header[3] = req.id & 0xFF;
+        header[4] = (result >> 24) & 0xFF;
+        header[5] = (result >> 16) & 0xFF;
+        header[6] = (result >> 8) & 0xFF;
+        header[7] = result & 0xFF;
+        vec[0] = {header, NULL, FS_REPLYHEADERSIZE};
+        if (result > 0)
+            vec[1] = {file->cache.data() + (req.offset - file->cacheoffset), NULL, (uint32_t)result};
+        handle_deviceerror(device_senddatav(DATATYPE_FSDATA, vec, (result > 0) ? 2 : 1));
+    }
+}
+
+
+/*==============================
+    debug_fs_getfile
+    Opens a file in the folder given with --fs,
+    or finds it if it's already open
+    @param  The path of the file, relative to the folder
+    @return The file, or NULL if it can't be read
+==============================*/
+
+static FSFile* debug_fs_getfile(const std::string& path)
+{
+    std::string fullpath;
+    time_t modtime;
+    FSFile newfile = {};
+    std::map<std::string, FSFile>::iterator it;
+
+    // Keep the console inside the folder
+    if (local_fsroot == NULL || path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != std::string::npos)
+        return NULL;
+    for (size_t start = 0; start <= path.size();)
+    {
+        size_t end = path.find_first_of("/\\", start);
+        if (end == std::string::npos)
+            end = path.size();
+        if (path.compare(start, end - start, "..") == 0)
+            return NULL;
+        start = end + 1;
+    }
+    fullpath = std::string(local_fsroot) + "/" + path;
+
+    // Use the file we already have open, unless it changed since
+    modtime = file_lastmodtime(fullpath.c_str());
+    it = local_fsfiles.find(path);
+    if (it != local_fsfiles.end())
+    {
+        if (it->second.modtime == modtime)
+            return &it->second;
+        fclose(it->second.file);
+        local_fsfiles.erase(it);
+    }
+
+    // Don't keep too many files open
+    if (local_fsfiles.size() >= FS_MAXFILES)
+    {
+        for (it = local_fsfiles.begin(); it != local_fsfiles.end(); ++it)
+            fclose(it->second.file);
+        local_fsfiles.clear();
+    }
+
+    // Open the file
+    newfile.file = fopen(fullpath.c_str(), "rb");
+    if (newfile.file == NULL)
+        return NULL;
+    fseek(newfile.file, 0, SEEK_END);
+    newfile.size = ftell(newfile.file);
+    newfile.modtime = modtime;
+    return &(local_fsfiles[path] = newfile);
+}
+
+
+/*==============================
+    debug_loadsymbols
+    Reads the function symbols from an ELF file
+    @param The path to the ELF file
+==============================*/
+
+static void debug_loadsymbols(char* elfpath)
+{
+    FILE* fp = fopen(elfpath, "rb");
+    std::vector<byte> elf;
+    bool bigendian;
+    uint32_t shoff;
+    uint32_t shentsize;
+    uint32_t shnum;
+
+    // Read the whole ELF
+    if (fp == NULL)
+        terminate("Unable to open ELF file '%s'.", elfpath);
+    fseek(fp, 0, SEEK_END);
+    elf.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    if (fread(elf.data(), 1, elf.size(), fp) != elf.size())
+        terminate("Unable to read ELF file '%s'.", elfpath);
+    fclose(fp);
+
+    // N64 toolchains make 32-bit ELFs, which are usually big endian
+    if (elf.size() < 52 || memcmp(elf.data(), "\x7F" "ELF", 4) != 0 || elf[4] != 1)
+        terminate("'%s' is not a 32-bit ELF file.", elfpath);
+    bigendian = (elf[5] == 2);
+    auto read32 = [&](uint32_t offset) -> uint32_t
+    {
+        if (offset > elf.size() - 4)
+            terminate("ELF file '%s' is malformed.", elfpath);
+        if (bigendian)
+            return (elf[offset] << 24) | (elf[offset+1] << 16) | (elf[offset+2] << 8) | elf[offset+3];
+        return (elf[offset+3] << 24) | (elf[offset+2] << 16) | (elf[offset+1] << 8) | elf[offset];
+    };
+    auto read16 = [&](uint32_t offset) -> uint32_t
+    {
+        return bigendian ? (read32(offset) >> 16) : (read32(offset) & 0xFFFF);
+    };
+    shoff = read32(0x20);
+    shentsize = read16(0x2E);
+    shnum = read16(0x30);
+
+    // Collect the functions from every symbol table
+    for (uint32_t i=0; i<shnum; i++)
+    {
+        uint32_t section = shoff + i*shentsize;
+        uint32_t symoffset, symsize, strsection, stroffset, strsize;
+        if (read32(section + 0x04) != 2) // SHT_SYMTAB
+            continue;
+        symoffset = read32(section + 0x10);
+        symsize = read32(section + 0x14);
+        strsection = shoff + read32(section + 0x18)*shentsize;
+        stroffset = read32(strsection + 0x10);
+        strsize = read32(strsection + 0x14);
+        if (symoffset > elf.size() || symsize > elf.size() - symoffset || stroffset > elf.size() || strsize > elf.size() - stroffset)
+            terminate("ELF file '%s' is malformed.", elfpath);
+        for (uint32_t sym = symoffset; sym + 16 <= symoffset + symsize; sym += 16)
+        {
+            ElfSymbol symbol;
+            uint32_t name = read32(sym);
+            uint32_t address = read32(sym + 0x04);
+            if ((elf[sym + 0x0C] & 0x0F) != 2 || name >= strsize) // STT_FUNC
+                continue;
+            symbol.name = std::string((char*)&elf[stroffset + name], strnlen((char*)&elf[stroffset + name], strsize - name));
+            symbol.size = read32(sym + 0x08);
+            if (local_symbols.count(address) == 0 || local_symbols[address].size < symbol.size)
+                local_symbols[address] = symbol;
+        }
+    }
+    if (local_symbols.empty())
+        terminate("ELF file '%s' has no function symbols.", elfpath);
+}
+
+
+/*==============================
+    debug_symbol
+    Finds the function that an address is in
+    @param  The address to look up
+    @return The name of the function, or NULL
+            if the address isn't in one
+==============================*/
+
+static const char* debug_symbol(uint32_t address)
+{
+    std::map<uint32_t, ElfSymbol>::iterator it = local_symbols.upper_bound(address);
+    if (it == local_symbols.begin())
+        return NULL;
+    --it;
+    if (it->second.size != 0 && address - it->first >= it->second.size)
+        return NULL;
+    return it->second.name.c_str();
+}
+
+
+/*==============================
+    debug_profile_write
+    Writes the samples taken so far to the
+    profile file, as folded stacks
+==============================*/
+
+static void debug_profile_write()
+{
+    FILE* fp = fopen(local_profilepath, "w");
+    if (fp == NULL)
+        terminate("Unable to create profile file '%s'.", local_profilepath);
+    for (std::map<std::string, uint64_t>::iterator it = local_profilestacks.begin(); it != local_profilestacks.end(); ++it)
+        fprintf(fp, "%s %llu\n", it->first.c_str(), (unsigned long long)it->second);
+    fclose(fp);
+}
+
+
+/*==============================
+    debug_heap_write
+    Writes a report of the console's heap to the
+    heap file, with the live blocks grouped by the
+    function that allocated them
+==============================*/
+
+static void debug_heap_write()
+{
+    FILE* fp;
+    uint64_t gaps = 0;
+    uint64_t largestgap = 0;
+    std::map<uint32_t, std::pair<uint64_t, uint64_t>> callers; // Bytes and blocks that are still live, by caller
+    std::vector<std::pair<uint64_t, uint32_t>> sorted;
+    std::map<uint32_t, HeapBlock>::iterator prev = local_heapblocks.end();
+
+    // Measure the free space between the live blocks. Only the space between blocks is known, as the console
+    // doesn't say where its heap starts or ends
+    for (std::map<uint32_t, HeapBlock>::iterator it = local_heapblocks.begin(); it != local_heapblocks.end(); ++it)
+    {
+        if (prev != local_heapblocks.end())
+        {
+            uint64_t gap = it->first - (prev->first + prev->second.size);
+            gaps += gap;
+            if (gap > largestgap)
+                largestgap = gap;
+        }
+        callers[it->second.caller].first += it->second.size;
+        callers[it->second.caller].second++;
+        prev = it;
+    }
+    for (std::map<uint32_t, std::pair<uint64_t, uint64_t>>::iterator it = callers.begin(); it != callers.end(); ++it)
+        sorted.push_back(std::make_pair(it->second.first, it->first));
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+        return a.first > b.first;
+    });
+
+    // Write the report
+    fp = fopen(local_heappath, "w");
+    if (fp == NULL)
+        terminate("Unable to create heap file '%s'.", local_heappath);
+    fprintf(fp, "Events:          %llu (%u dropped by the console)\n", (unsigned long long)local_heapevents, local_heapdropped);
+    fprintf(fp, "Live:            %llu bytes in %llu blocks\n", (unsigned long long)local_heapused, (unsigned long long)local_heapblocks.size());
+    fprintf(fp, "Peak:            %llu bytes\n", (unsigned long long)local_heappeak);
+    fprintf(fp, "Fragmentation:   %.1f%% (%llu free bytes between live blocks, the largest gap is %llu bytes)\n", (gaps == 0) ? 0.0 : 100.0*(1.0 - (double)largestgap/gaps), (unsigned long long)gaps, (unsigned long long)largestgap);
+    fprintf(fp, "Unknown frees:   %llu\n", (unsigned long long)local_heapunknownfrees);
+    fprintf(fp, "Missed frees:    %llu\n", (unsigned long long)local_heapoverlaps);
+    fprintf(fp, "\nLive blocks by call site:\n");
+    fprintf(fp, "%12s %8s  %s\n", "Bytes", "Blocks", "Caller");
+    for (size_t i=0; i<sorted.size(); i++)
+    {
+        // The caller is the return address, which points after the call and its delay slot
+        const char* function = (sorted[i].second != 0) ? debug_symbol(sorted[i].second - 8) : NULL;
+        fprintf(fp, "%12llu %8llu  ", (unsigned long long)sorted[i].first, (unsigned long long)callers[sorted[i].second].second);
+        if (function != NULL)
+            fprintf(fp, "%s (0x%08X)\n", function, sorted[i].second);
+        else
+            fprintf(fp, "0x%08X\n", sorted[i].second);
+    }
+    fclose(fp);
+}
+
+
+/*==============================
+    debug_core_write
+    Writes the crash dump that was received to the
+    core file, as a big endian MIPS ELF core file. The
+    registers are stored the way Linux stores them, as
+    that's the layout that GDB knows how to read
+==============================*/
+
+static void debug_core_write()
+{
+    FILE* fp;
+    std::vector<byte> elf;
+    uint32_t threads = (uint32_t)(local_coreregs.size() - CORE_HEADERSIZE)/CORE_THREADSIZE;
+    uint32_t notesoffset = 52 + 3*32;
+    uint32_t notessize;
+    uint32_t memoffset;
+    auto put32 = [&](uint32_t offset, uint32_t value)
+    {
+        elf[offset] = (value >> 24) & 0xFF;
+        elf[offset+1] = (value >> 16) & 0xFF;
+        elf[offset+2] = (value >> 8) & 0xFF;
+        elf[offset+3] = value & 0xFF;
+    };
+    auto put16 = [&](uint32_t offset, uint32_t value)
+    {
+        elf[offset] = (value >> 8) & 0xFF;
+        elf[offset+1] = value & 0xFF;
+    };
+    auto putnote = [&](uint32_t offset, uint32_t type, uint32_t size)
+    {
+        put32(offset, 5);
+        put32(offset + 4, size);
+        put32(offset + 8, type);
+        memcpy(&elf[offset + 12], "CORE", 5);
+        return offset + 20;
+    };
+
+    // Every thread gets a NT_PRSTATUS note with its GPRs, and a NT_PRFPREG note with its FPRs
+    notessize = threads*((20 + 256) + (20 + 264));
+    memoffset = (notesoffset + notessize + 15) & ~15;
+    elf.resize(memoffset);
+
+    // ELF header
+    memcpy(&elf[0], "\x7F" "ELF", 4);
+    elf[4] = 1; // ELFCLASS32
+    elf[5] = 2; // ELFDATA2MSB
+    elf[6] = 1; // EV_CURRENT
+    put16(0x10, 4); // ET_CORE
+    put16(0x12, 8); // EM_MIPS
+    put32(0x14, 1);
+    put32(0x1C, 52);
+    put16(0x28, 52);
+    put16(0x2A, 32);
+    put16(0x2C, 3);
+
+    // Program headers. RDRAM is mapped at both KSEG0 and KSEG1, using the same data
+    put32(52, 4); // PT_NOTE
+    put32(52 + 0x04, notesoffset);
+    put32(52 + 0x10, notessize);
+    put32(52 + 0x1C, 4);
+    for (int i=0; i<2; i++)
+    {
+        uint32_t header = 52 + (i+1)*32;
+        put32(header, 1); // PT_LOAD
+        put32(header + 0x04, memoffset);
+        put32(header + 0x08, CORE_RDRAMADDRESS + i*0x20000000);
+        put32(header + 0x10, local_corememsize);
+        put32(header + 0x14, local_corememsize);
+        put32(header + 0x18, 7); // PF_R | PF_W | PF_X
+        put32(header + 0x1C, 16);
+    }
+
+    // Notes, with the thread that faulted first
+    for (uint32_t i=0, note=notesoffset; i<threads; i++)
+    {
+        byte* regs = &local_coreregs[CORE_HEADERSIZE + i*CORE_THREADSIZE];
+        auto reg32 = [&](int word) -> uint32_t
+        {
+            return (regs[word*4] << 24) | (regs[word*4+1] << 16) | (regs[word*4+2] << 8) | regs[word*4+3];
+        };
+
+        // The signal that stopped the thread is made up from the exception code in the cause register
+        note = putnote(note, 1, 256); // NT_PRSTATUS
+        if (i == 0)
+        {
+            uint32_t code = (reg32(72) >> 2) & 0x1F;
+            uint32_t signal = 11; // SIGSEGV
+            if (code == 6 || code == 7)
+                signal = 10; // SIGBUS
+            else if (code == 9 || code == 13)
+                signal = 5; // SIGTRAP
+            else if (code == 10 || code == 11)
+                signal = 4; // SIGILL
+            else if (code == 15)
+                signal = 8; // SIGFPE
+            put16(note + 12, signal);
+        }
+        put32(note + 24, reg32(0)); // The thread ID is used as the PID
+        for (int j=0; j<32; j++)
+            put32(note + 72 + (6+j)*4, reg32(2+j*2));
+        put32(note + 72 + 38*4, reg32(66)); // lo
+        put32(note + 72 + 39*4, reg32(68)); // hi
+        put32(note + 72 + 40*4, reg32(69)); // pc
+        put32(note + 72 + 41*4, reg32(70)); // badvaddr
+        put32(note + 72 + 42*4, reg32(71)); // sr
+        put32(note + 72 + 43*4, reg32(72)); // cause
+        put32(note + 252, 1);
+        note += 256;
+
+        // The console only saves the even FPRs, as doubles. GDB reads the odd FPRs from the upper half of those
+        note = putnote(note, 2, 264); // NT_PRFPREG
+        for (int j=0; j<32; j++)
+            put32(note + (j/2)*16 + (j%2)*4, reg32(74+j));
+        put32(note + 256, reg32(73)); // fcsr
+        note += 264;
+    }
+
+    // Write the core file
+    fp = fopen(local_corepath, "wb");
+    if (fp == NULL)
+        terminate("Unable to create core file '%s'.", local_corepath);
+    if (fwrite(elf.data(), 1, elf.size(), fp) != elf.size() || fwrite(local_coremem.data(), 1, local_coremem.size(), fp) != local_coremem.size())
+        terminate("Unable to write core file '%s'.", local_corepath);
+    fclose(fp);
+}
+
+
+/*==============================
+    debug_handle_data
+    Decides what to do with incoming data based
+    off its type
+    @param The type of the incoming data
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_data(USBDataType command, uint32_t size, byte* buffer)
+{
+    switch (command)
+    {
+        case DATATYPE_TEXT:       debug_handle_text(size, buffer); break;
+        case DATATYPE_RAWBINARY:  debug_handle_rawbinary(size, buffer); break;
+        case DATATYPE_HEADER:     debug_handle_header(size, buffer); break;
+        case DATATYPE_SCREENSHOT: debug_handle_screenshot(size, buffer); break;
+        case DATATYPE_HEARTBEAT:  debug_handle_heartbeat(size, buffer); break;
+        case DATATYPE_RDBPACKET:  debug_handle_rdbpacket(size, buffer); break;
+        case DATATYPE_CHANNEL:    debug_handle_channel(size, buffer); break;
+        case DATATYPE_CREDIT:     device_addcredits(buffer, size); break;
+        case DATATYPE_STREAM:     debug_handle_stream(size, buffer); break;
+        case DATATYPE_FSREQUEST:  debug_handle_fsrequest(size, buffer); break;
+        case DATATYPE_PROFILE:    debug_handle_profile(size, buffer); break;
+        case DATATYPE_ZONES:      debug_handle_zones(size, buffer); break;
+        case DATATYPE_ZONENAME:   debug_handle_zonename(size, buffer); break;
+        case DATATYPE_HEAP:       debug_handle_heap(size, buffer); break;
+        case DATATYPE_COREREGS:   debug_handle_coreregs(size, buffer); break;
+        case DATATYPE_COREMEM:    debug_handle_coremem(size, buffer); break;
+        default:                  terminate("Unknown data type '%x'.", (uint32_t)command);
+    }
+}
+
+
+/*==============================
+    debug_handle_channel
+    Handles DATATYPE_CHANNEL, which wraps the other
+    datatypes in USB protocol 3. Messages that were
+    split into chunks are reassembled before they're
+    handled.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_channel(uint32_t size, byte* buffer)
+{
+    USBDataType command;
+    uint8_t     channel;
+    uint16_t    sequence;
+    uint32_t    length, offset;
+
+    if (size < CHANNEL_HEADERSIZE)
+        terminate("Error: Malformed channel packet received");
+
+    // Read the channel header
+    command  = (USBDataType)buffer[0];
+    channel  = buffer[1];
+    sequence = (uint16_t)((buffer[2] << 8) | buffer[3]);
+    length   = (buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+    offset   = (buffer[8] << 24) | (buffer[9] << 16) | (buffer[10] << 8) | buffer[11];
+    if (channel >= CHANNEL_COUNT || command == DATATYPE_CHANNEL)
+        terminate("Error: Malformed channel packet received");
+
+    // Check that we didn't miss any packets on this channel
+    if (sequence != local_channelsequence[channel])
+        log_colored("Lost %d packet(s) from the console.\n", CRDEF_ERROR, (uint16_t)(sequence - local_channelsequence[channel]));
+    local_channelsequence[channel] = sequence + 1;
+
+    // Reassemble the message, dropping it if part of it was lost
+    std::vector<byte>& data = local_channeldata[channel];
+    if (offset == 0)
+        data.clear();
+    if (offset != data.size() || offset > length || size - CHANNEL_HEADERSIZE > length - offset)
+    {
+        data.clear();
+        return;
+    }
+    data.insert(data.end(), buffer + CHANNEL_HEADERSIZE, buffer + size);
+
+    // Handle the message once all of it has arrived
+    if (data.size() == length)
+    {
+        debug_handle_data(command, length, data.data());
+        data.clear();
+    }
 }
 
 
@@ -218,7 +1182,10 @@ static void debug_handle_text(uint32_t size, byte* buffer)
         terminate("Failed to allocate memory for incoming string.");
     memset(text, 0, size+1);
     strncpy(text, (char*)buffer, size);
-    log_stackable("%s", CRDEF_PRINT, text);
+    if (term_isusingjsonl())
+        log_jsonl("text", "\"text\":%s", term_jsonstring(text, strlen(text)).c_str());
+    else
+        log_stackable("%s", CRDEF_PRINT, text);
     free(text);
 }
 
@@ -248,7 +1215,10 @@ static void debug_handle_rawbinary(uint32_t size, byte* buffer)
 
     // Write the data to the file
     fwrite(buffer, 1, size, fp);
-    log_colored("Wrote %d bytes to '%s'.\n", CRDEF_INFO, size, filename);
+    if (term_isusingjsonl())
+        log_jsonl("binary", "\"size\":%u,\"path\":%s", size, term_jsonstring(filename, strlen(filename)).c_str());
+    else
+        log_colored("Wrote %d bytes to '%s'.\n", CRDEF_INFO, size, filename);
 
     // Cleanup
     fclose(fp);
@@ -332,7 +1302,10 @@ static void debug_handle_screenshot(uint32_t size, byte* buffer)
     // Close the file and free the dynamic memory used
     lodepng_encode32_file(filename, image, w, h);
     memset(debug_headerdata, 0, sizeof(int)*HEADER_SIZE);
-    log_colored("Wrote %dx%d pixels to '%s'.\n", CRDEF_INFO, w, h, filename);
+    if (term_isusingjsonl())
+        log_jsonl("screenshot", "\"width\":%u,\"height\":%u,\"path\":%s", w, h, term_jsonstring(filename, strlen(filename)).c_str());
+    else
+        log_colored("Wrote %dx%d pixels to '%s'.\n", CRDEF_INFO, w, h, filename);
     free(image);
     free(filename);
 }
@@ -361,12 +1334,37 @@ void debug_handle_heartbeat(uint32_t size, byte* buffer)
     // Ensure we support this protocol version
     if (device_getprotocol() > USBPROTOCOL_VERSION)
         terminate("USB protocol %d unsupported. Your UNFLoader is probably out of date.", device_getprotocol());
+    if (term_isusingjsonl())
+        log_jsonl("heartbeat", "\"protocol\":%d,\"version\":%d", (int)device_getprotocol(), heartbeat_version);
 
     // Handle the heartbeat by reading more stuff based on the version
-    // Currently, nothing here.
     switch(heartbeat_version)
     {
         case 0x01: break;
+        case 0x02:
+        {
+            byte hello[CHANNEL_COUNT] = {0};
+            if (size < 8 + CHANNEL_COUNT)
+                terminate("Error: Malformed heartbeat received");
+
+            // Reset the channels with the max packet size and credits the console gave us
+            device_setchannels((buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7], buffer + 8);
+            for (int i=0; i<CHANNEL_COUNT; i++)
+            {
+                local_channelsequence[i] = 0;
+                local_channeldata[i].clear();
+            }
+
+            // The console announces its stream ring again after a heartbeat, so wait for that before streaming more
+            local_streamcapacity = 0;
+
+            // The console might have been reset, so line its clock up with ours again
+            local_tracesynced = false;
+
+            // Let the console know that we speak protocol 3, so that it starts using it too
+            debug_send(DATATYPE_CREDIT, (char*)hello, CHANNEL_COUNT);
+            break;
+        }
         default:
             terminate("Heartbeat version %d unsupported. Your UNFLoader is probably out of date.", heartbeat_version);
             break;
@@ -397,11 +1395,12 @@ void debug_handle_rdbpacket(uint32_t size, byte* buffer)
 
         // Copy the data over
         for (std::list<RDBPacketChunk*>::iterator it = local_rdbpackets.begin(); it != local_rdbpackets.end(); ++it)
-            packet += (char*)(*it)->data;
+            packet.append((char*)(*it)->data, (*it)->size);
+        if (term_isusingjsonl())
+            log_jsonl("rdb", "\"packet\":%s", term_jsonstring(packet.data(), packet.size()).c_str());
 
         // Send it to GDB
-        log_colored("Replying with '%s'\n", CRDEF_INFO, packet.c_str());
-        gdb_reply((char*)packet.c_str());
+        gdb_reply(packet.data(), packet.size());
 
         // Cleanup
         for (std::list<RDBPacketChunk*>::iterator it = local_rdbpackets.begin(); it != local_rdbpackets.end(); ++it)
@@ -416,6 +1415,376 @@ void debug_handle_rdbpacket(uint32_t size, byte* buffer)
 }
 
 
+/*==============================
+    debug_handle_stream
+    Handles DATATYPE_STREAM, which the console sends
+    to tell us how much of its stream ring is in use
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_stream(uint32_t size, byte* buffer)
+{
+    uint32_t values[3];
+
+    if (size < STREAM_STATUSSIZE)
+        terminate("Error: Malformed stream status received");
+    for (int i=0; i<3; i++)
+        values[i] = (buffer[i*4] << 24) | (buffer[i*4+1] << 16) | (buffer[i*4+2] << 8) | buffer[i*4+3];
+
+    // When the console (re)announces its ring, carry on from however much of the file it already has
+    if (local_streamfile != NULL && values[0] != local_streamcapacity)
+    {
+        local_streamsent = (values[1] < local_streamsize) ? values[1] : local_streamsize;
+        fseek(local_streamfile, local_streamsent, SEEK_SET);
+    }
+    local_streamcapacity = values[0];
+    local_streamread = values[2];
+}
+
+
+/*==============================
+    debug_handle_fsrequest
+    Handles DATATYPE_FSREQUEST, which the console sends
+    from debug_fs_read. It holds the request ID, the
+    offset and size to read as big endian 32-bit values,
+    followed by the path of the file.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_fsrequest(uint32_t size, byte* buffer)
+{
+    FSRequest req;
+    uint32_t values[3];
+
+    if (size <= FS_HEADERSIZE)
+        terminate("Error: Malformed file request received");
+    for (int i=0; i<3; i++)
+        values[i] = (buffer[i*4] << 24) | (buffer[i*4+1] << 16) | (buffer[i*4+2] << 8) | buffer[i*4+3];
+    req.id = values[0];
+    req.offset = values[1];
+    req.size = values[2];
+    req.path = std::string((char*)buffer + FS_HEADERSIZE, strnlen((char*)buffer + FS_HEADERSIZE, size - FS_HEADERSIZE));
+    local_fsrequests.push_back(req);
+}
+
+
+/*==============================
+    debug_handle_profile
+    Handles DATATYPE_PROFILE, which holds a batch of
+    samples from the console's profiler. It starts with
+    the sample rate and how many samples were dropped so
+    far, followed by the PC, RA and thread ID of every
+    sample, all as big endian 32-bit values.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_profile(uint32_t size, byte* buffer)
+{
+    uint32_t dropped;
+    uint32_t count;
+
+    if (size < PROFILE_HEADERSIZE || (size - PROFILE_HEADERSIZE) % PROFILE_SAMPLESIZE != 0)
+        terminate("Error: Malformed profiler samples received");
+    if (local_profilepath == NULL)
+        return;
+    dropped = (buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+    count = (size - PROFILE_HEADERSIZE)/PROFILE_SAMPLESIZE;
+
+    // Turn every sample into a folded stack, with the thread at the bottom and the sampled function at the top
+    for (uint32_t i=0; i<count; i++)
+    {
+        uint32_t values[3];
+        std::string stack;
+        const char* function;
+        const char* caller = NULL;
+        byte* sample = buffer + PROFILE_HEADERSIZE + i*PROFILE_SAMPLESIZE;
+        for (int j=0; j<3; j++)
+            values[j] = (sample[j*4] << 24) | (sample[j*4+1] << 16) | (sample[j*4+2] << 8) | sample[j*4+3];
+        function = debug_symbol(values[0]);
+
+        // The return address points after the call and its delay slot. If it's inside the sampled function,
+        // the function already called something else, so the real caller isn't known
+        if (values[1] != 0)
+            caller = debug_symbol(values[1] - 8);
+        if (values[2] != 0)
+            stack = "thread " + std::to_string(values[2]) + ";";
+        if (caller != NULL && caller != function)
+            stack += std::string(caller) + ";";
+        stack += (function != NULL) ? function : "[unknown]";
+        local_profilestacks[stack]++;
+    }
+    local_profilesamples += count;
+
+    // Log the batch, and let the user know if the console couldn't keep up
+    if (term_isusingjsonl())
+        log_jsonl("profile", "\"samples\":%u,\"dropped\":%u,\"path\":%s", count, dropped, term_jsonstring(local_profilepath, strlen(local_profilepath)).c_str());
+    else if (local_profilesamples == count)
+        log_colored("Writing profiler samples to '%s'.\n", CRDEF_INFO, local_profilepath);
+    if (dropped > local_profiledropped && !term_isusingjsonl())
+        log_colored("The console dropped %u profiler samples so far.\n", CRDEF_ERROR, dropped);
+    local_profiledropped = dropped;
+    local_profiledirty = true;
+}
+
+
+/*==============================
+    debug_handle_zones
+    Handles DATATYPE_ZONES, which holds a batch of zone
+    events. It starts with the rate of the console's COUNT
+    register, its value when the batch was sent and how many
+    events were dropped so far. Every event then has the
+    COUNT, followed by the thread ID, the event type and the
+    zone ID. All values are big endian.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_zones(uint32_t size, byte* buffer)
+{
+    uint32_t values[3];
+    uint32_t count;
+    uint64_t sent;
+    double   now;
+    std::vector<uint64_t> times;
+
+    if (size < ZONE_HEADERSIZE || (size - ZONE_HEADERSIZE) % ZONE_EVENTSIZE != 0)
+        terminate("Error: Malformed zones received");
+    if (local_tracefile == NULL)
+        return;
+    for (int i=0; i<3; i++)
+        values[i] = (buffer[i*4] << 24) | (buffer[i*4+1] << 16) | (buffer[i*4+2] << 8) | buffer[i*4+3];
+    count = (size - ZONE_HEADERSIZE)/ZONE_EVENTSIZE;
+    if (values[0] == 0 || count == 0)
+        return;
+    now = (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - local_tracestart).count();
+
+    // Extend the 32-bit COUNT of every event, which wraps around every minute or so
+    if (!local_tracesynced)
+    {
+        local_tracelastcount = (buffer[ZONE_HEADERSIZE] << 24) | (buffer[ZONE_HEADERSIZE+1] << 16) | (buffer[ZONE_HEADERSIZE+2] << 8) | buffer[ZONE_HEADERSIZE+3];
+        local_tracecount = local_tracelastcount;
+    }
+    for (uint32_t i=0; i<count; i++)
+    {
+        byte* event = buffer + ZONE_HEADERSIZE + i*ZONE_EVENTSIZE;
+        uint32_t time = (event[0] << 24) | (event[1] << 16) | (event[2] << 8) | event[3];
+        local_tracecount += (uint32_t)(time - local_tracelastcount);
+        local_tracelastcount = time;
+        times.push_back(local_tracecount);
+    }
+
+    // After a heartbeat, line up the console's clock with ours, using the moment the batch was sent.
+    // Events can be recorded while a batch is being sent, so only the events move the extended COUNT forward
+    sent = local_tracecount + (uint32_t)(values[1] - local_tracelastcount);
+    if (!local_tracesynced)
+    {
+        local_traceoffset = now - (double)sent*1000000.0/values[0];
+        local_tracesynced = true;
+    }
+
+    // Write the events in Chrome's trace event format
+    for (uint32_t i=0; i<count; i++)
+    {
+        byte* event = buffer + ZONE_HEADERSIZE + i*ZONE_EVENTSIZE;
+        uint16_t id = (event[6] << 8) | event[7];
+        double timestamp = (double)times[i]*1000000.0/values[0] + local_traceoffset;
+        fprintf(local_tracefile, (local_traceevents == 0) ? "\n" : ",\n");
+        if (event[5] == 0)
+        {
+            std::string name = (local_tracenames.count(id) != 0) ? local_tracenames[id] : "zone " + std::to_string(id);
+            fprintf(local_tracefile, "{\"name\":%s,\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", term_jsonstring(name.data(), name.size()).c_str(), timestamp, event[4]);
+        }
+        else
+            fprintf(local_tracefile, "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", timestamp, event[4]);
+        local_traceevents++;
+    }
+    fflush(local_tracefile);
+
+    // Log the batch, and let the user know if the console couldn't keep up
+    if (term_isusingjsonl())
+        log_jsonl("trace", "\"events\":%u,\"dropped\":%u,\"path\":%s", count, values[2], term_jsonstring(local_tracepath, strlen(local_tracepath)).c_str());
+    else if (local_traceevents == count)
+        log_colored("Writing zones to '%s'.\n", CRDEF_INFO, local_tracepath);
+    if (values[2] > local_tracedropped && !term_isusingjsonl())
+        log_colored("The console dropped %u zone events so far.\n", CRDEF_ERROR, values[2]);
+    local_tracedropped = values[2];
+}
+
+
+/*==============================
+    debug_handle_zonename
+    Handles DATATYPE_ZONENAME, which holds a zone ID
+    as a big endian 16-bit value, followed by its name
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_zonename(uint32_t size, byte* buffer)
+{
+    if (size < 2)
+        terminate("Error: Malformed zone name received");
+    local_tracenames[(buffer[0] << 8) | buffer[1]] = std::string((char*)buffer + 2, strnlen((char*)buffer + 2, size - 2));
+}
+
+
+/*==============================
+    debug_handle_heap
+    Handles DATATYPE_HEAP, which holds a batch of heap
+    events. It starts with how many events were dropped
+    so far. Every event then has the address of the
+    memory, followed by the event type (0 for allocations
+    and 1 for frees) in the top byte and the size in the
+    rest, and then the address the allocator was called
+    from. All values are big endian 32-bit values.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_heap(uint32_t size, byte* buffer)
+{
+    uint32_t dropped;
+    uint32_t count;
+
+    if (size < HEAP_HEADERSIZE || (size - HEAP_HEADERSIZE) % HEAP_EVENTSIZE != 0)
+        terminate("Error: Malformed heap events received");
+    if (local_heappath == NULL)
+        return;
+    dropped = (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+    count = (size - HEAP_HEADERSIZE)/HEAP_EVENTSIZE;
+
+    // Replay the events on the map of live blocks. Live blocks never overlap, so the map
+    // sorted by address is enough to find the blocks around any address
+    for (uint32_t i=0; i<count; i++)
+    {
+        uint32_t values[3];
+        byte* event = buffer + HEAP_HEADERSIZE + i*HEAP_EVENTSIZE;
+        for (int j=0; j<3; j++)
+            values[j] = (event[j*4] << 24) | (event[j*4+1] << 16) | (event[j*4+2] << 8) | event[j*4+3];
+        if ((values[1] >> 24) == 0)
+        {
+            HeapBlock block = {values[1] & 0xFFFFFF, values[2]};
+            std::map<uint32_t, HeapBlock>::iterator it = local_heapblocks.lower_bound(values[0]);
+
+            // A new block that overlaps live ones means that their frees were missed, so forget about them
+            if (it != local_heapblocks.begin())
+            {
+                std::map<uint32_t, HeapBlock>::iterator prev = std::prev(it);
+                if (prev->first + prev->second.size > values[0])
+                    it = prev;
+            }
+            while (it != local_heapblocks.end() && (it->first < values[0] + block.size || it->first == values[0]))
+            {
+                local_heapused -= it->second.size;
+                local_heapoverlaps++;
+                it = local_heapblocks.erase(it);
+            }
+            local_heapblocks[values[0]] = block;
+            local_heapused += block.size;
+            if (local_heapused > local_heappeak)
+                local_heappeak = local_heapused;
+        }
+        else
+        {
+            std::map<uint32_t, HeapBlock>::iterator it = local_heapblocks.find(values[0]);
+            if (it == local_heapblocks.end())
+            {
+                local_heapunknownfrees++;
+                continue;
+            }
+            local_heapused -= it->second.size;
+            local_heapblocks.erase(it);
+        }
+    }
+    local_heapevents += count;
+
+    // Log the batch, and let the user know if the console couldn't keep up
+    if (term_isusingjsonl())
+        log_jsonl("heap", "\"events\":%u,\"dropped\":%u,\"used\":%llu,\"peak\":%llu,\"path\":%s", count, dropped, (unsigned long long)local_heapused, (unsigned long long)local_heappeak, term_jsonstring(local_heappath, strlen(local_heappath)).c_str());
+    else if (local_heapevents == count)
+        log_colored("Writing the heap report to '%s'.\n", CRDEF_INFO, local_heappath);
+    if (dropped > local_heapdropped && !term_isusingjsonl())
+        log_colored("The console dropped %u heap events so far.\n", CRDEF_ERROR, dropped);
+    local_heapdropped = dropped;
+    local_heapdirty = true;
+}
+
+
+/*==============================
+    debug_handle_coreregs
+    Handles DATATYPE_COREREGS, which starts a crash dump.
+    It holds the size of the console's RDRAM and how many
+    threads there are, followed by the ID, GPRs, lo, hi,
+    pc, badvaddr, sr, cause, fcsr and even FPRs of every
+    thread, all as big endian 32-bit values. The GPRs, lo,
+    hi and FPRs take two values each.
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_coreregs(uint32_t size, byte* buffer)
+{
+    uint32_t memsize;
+    uint32_t threads;
+
+    if (size < CORE_HEADERSIZE)
+        terminate("Error: Malformed crash dump received");
+    memsize = (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+    threads = (buffer[4] << 24) | (buffer[5] << 16) | (buffer[6] << 8) | buffer[7];
+    if (threads == 0 || size != CORE_HEADERSIZE + threads*CORE_THREADSIZE || memsize == 0 || memsize > 0x20000000)
+        terminate("Error: Malformed crash dump received");
+    if (local_corepath == NULL)
+    {
+        if (!term_isusingjsonl())
+            log_colored("The console is sending a crash dump. Use --core to save it.\n", CRDEF_INFO);
+        return;
+    }
+
+    // The RDRAM arrives next, in chunks
+    local_coreregs.assign(buffer, buffer + size);
+    local_coremem.clear();
+    local_coremem.reserve(memsize);
+    local_corememsize = memsize;
+    if (!term_isusingjsonl())
+        log_colored("Receiving a crash dump with %u threads and %u bytes of RDRAM.\n", CRDEF_INFO, threads, memsize);
+}
+
+
+/*==============================
+    debug_handle_coremem
+    Handles DATATYPE_COREMEM, which holds the next chunk
+    of RDRAM in a crash dump. Once all of RDRAM arrived,
+    the core file is written
+    @param The size of the incoming data
+    @param The buffer to read from
+==============================*/
+
+static void debug_handle_coremem(uint32_t size, byte* buffer)
+{
+    uint32_t threads;
+
+    if (local_corememsize == 0)
+        return;
+    if (size > local_corememsize - local_coremem.size())
+        terminate("Error: Malformed crash dump received");
+    local_coremem.insert(local_coremem.end(), buffer, buffer + size);
+    if (local_coremem.size() < local_corememsize)
+        return;
+
+    // Everything arrived, so write the core file
+    threads = (uint32_t)(local_coreregs.size() - CORE_HEADERSIZE)/CORE_THREADSIZE;
+    debug_core_write();
+    if (term_isusingjsonl())
+        log_jsonl("core", "\"threads\":%u,\"size\":%u,\"path\":%s", threads, local_corememsize, term_jsonstring(local_corepath, strlen(local_corepath)).c_str());
+    else
+        log_colored("Wrote the crash dump to '%s'.\n", CRDEF_INFO, local_corepath);
+    local_corememsize = 0;
+    local_coremem.clear();
+}
+
+
 /*==============================
     debug_send
     Sends data to the flashcart
@@ -438,6 +1807,10 @@ void debug_send(USBDataType type, char* data, size_t size)
 
     // Fill up the data
     mesg->original = NULL;
+    mesg->vec = NULL;
+    mesg->veccount = 0;
+    mesg->sent = 0;
+    mesg->transfer = 0;
     memcpy(mesg->data, data, size);
     mesg->type = type;
     mesg->size = size;
@@ -463,6 +1836,7 @@ void debug_sendtext(char* data)
     char*     token;
     SendData* mesg;
     uint32_t  datasize;
+    uint32_t  textsize = 0;
     uint32_t  padbytes = 0;
     uint32_t  tokcount = 0;
     bool      ispath = false;
@@ -489,7 +1863,7 @@ void debug_sendtext(char* data)
     if (mesg == NULL)
         terminate("Unable to malloc message for debug send.");
     mesg->type = DATATYPE_TEXT;
-    mesg->original = (char*)malloc(datasize);
+    mesg->original = (char*)malloc(datasize+1);
     if (mesg->original == NULL)
         terminate("Unable to malloc message for debug send.");
     strcpy(mesg->original, data);
@@ -500,7 +1874,7 @@ void debug_sendtext(char* data)
     if (data[0] == '@')
         ispath = true;
 
-    // Parse the text and append data as needed
+    // Parse the text and open the files as needed
     token = strtok(data, "@");
     datasize = 0;
     while (token != NULL)
@@ -528,8 +1902,8 @@ void debug_sendtext(char* data)
                 for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
                 {
                     ParseHelper* destroy = *it;
-                    if (destroy->data != NULL)
-                        free(destroy->data);
+                    if (destroy->file != NULL)
+                        fclose(destroy->file);
                     free(destroy->str);
                     free(destroy);
                 }
@@ -539,44 +1913,21 @@ void debug_sendtext(char* data)
                 return;
             }
 
-            // Get the data size
+            // Get the data size. The file is kept open, and is read from when the message is sent
             fseek(fp, 0, SEEK_END);
             size = ftell(fp);
             fseek(fp, 0, SEEK_SET);
             help->strsize = snprintf(NULL, 0, "@%d@", size);
             help->datasize = size;
-
-            // Make a copy of the data
-            help->data = (byte*)malloc(size);
+            help->file = fp;
             help->str = (char*)malloc(help->strsize+1);
-            if (help->data == NULL || help->str == NULL)
+            if (help->str == NULL)
                 terminate("Unable to malloc data for debug send.");
             sprintf(help->str, "@%d@", size);
-            if (fread(help->data, 1, size, fp) != size)
-            {
-                log_colored("Error: Unable to read file '%s'.\n", CRDEF_ERROR, token);
-                for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
-                {
-                    ParseHelper* destroy = *it;
-                    if (destroy->data != NULL)
-                        free(destroy->data);
-                    free(destroy->str);
-                    free(destroy);
-                }
-                free(mesg->original);
-                free(mesg);
-                free(help->str);
-                free(help);
-                fclose(fp);
-                return;
-            }
-
-            // Cleanup
-            fclose(fp);
         }
         datasplit.push_back(help);
         if (mesg->type == DATATYPE_TEXT)
-            datasize += help->strsize;
+            textsize += help->strsize;
         help->ispath = ispath;
         if (ispath)
             datasize += help->datasize;
@@ -586,42 +1937,49 @@ void debug_sendtext(char* data)
         ispath = !ispath;
     }
 
-    // Now we have a list of strings and data blocks, we combine all into one
-    // We can already assign these values to the mesg
+    // Now we have a list of strings and files, which we describe as a list of pieces to send
+    // The strings are combined into one buffer, and the files are streamed from disk when the message is sent
     if (mesg->type == DATATYPE_TEXT)
         padbytes = 1;
-    copy = (byte*)calloc(datasize+padbytes, 1);
-    if (copy == NULL)
+    copy = (byte*)calloc(textsize+padbytes, 1);
+    mesg->vec = (DeviceIOVec*)malloc(sizeof(DeviceIOVec)*(datasplit.size()*2+1));
+    if (copy == NULL || mesg->vec == NULL)
         terminate("Unable to malloc data for debug send.");
-    mesg->size = datasize+padbytes;
+    mesg->size = textsize+datasize+padbytes;
     mesg->data = copy;
+    mesg->veccount = 0;
+    mesg->sent = 0;
+    mesg->transfer = 0;
 
-    // Iterate the list, copy onto the copy buffer, and free the allocated memory
+    // Iterate the list, filling in the pieces, and free the allocated memory
     for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
     {
         ParseHelper* help = *it;
         if (mesg->type == DATATYPE_TEXT)
         {
-            strcpy((char*)copy, help->str);
+            DeviceIOVec vec = {copy, NULL, help->strsize};
+            memcpy(copy, help->str, help->strsize);
+            mesg->vec[mesg->veccount++] = vec;
             copy += help->strsize;
         }
         if (help->ispath)
         {
-            memcpy(copy, help->data, help->datasize);
-            copy += help->datasize;
+            DeviceIOVec vec = {NULL, help->file, help->datasize};
+            mesg->vec[mesg->veccount++] = vec;
         }
+        free(help->str);
+        free(help);
+    }
+
+    // Text needs to be null terminated
+    if (padbytes > 0)
+    {
+        DeviceIOVec vec = {copy, NULL, padbytes};
+        mesg->vec[mesg->veccount++] = vec;
     }
     
     // Done!
     push_mesg(mesg);
-    for (std::list<ParseHelper*>::iterator it = datasplit.begin(); it != datasplit.end(); ++it)
-    {
-        ParseHelper* help = *it;
-        if (help->data != NULL)
-            free(help->data);
-        free(help->str);
-        free(help);
-    }
 }
 
 
@@ -651,6 +2009,151 @@ void debug_setbinaryout(char* path)
 }
 
 
+/*==============================
+    debug_setstream
+    Sets the file that is streamed into the
+    console's stream ring
+    @param The path to the file to stream
+==============================*/
+
+void debug_setstream(char* path)
+{
+    local_streamfile = fopen(path, "rb");
+    if (local_streamfile == NULL)
+        terminate("Unable to open stream file '%s'.", path);
+    fseek(local_streamfile, 0, SEEK_END);
+    local_streamsize = ftell(local_streamfile);
+    fseek(local_streamfile, 0, SEEK_SET);
+    local_streampath = path;
+}
+
+
+/*==============================
+    debug_addpatch
+    Adds a file that is written straight into the
+    console's RDRAM, and again every time it changes
+    @param The RDRAM address to write the file to
+    @param The path to the file
+==============================*/
+
+void debug_addpatch(uint32_t address, char* path)
+{
+    Patch patch = {};
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        terminate("Unable to open patch file '%s'.", path);
+    fclose(fp);
+    patch.address = address;
+    patch.path = path;
+    local_patches.push_back(patch);
+}
+
+
+/*==============================
+    debug_setfsroot
+    Sets the folder that debug_fs_read
+    reads files from
+    @param The path to the folder
+==============================*/
+
+void debug_setfsroot(char* path)
+{
+    local_fsroot = path;
+}
+
+
+/*==============================
+    debug_setprofile
+    Loads the function symbols from the ELF that
+    profiler samples are matched against, and sets
+    the file that the folded stacks are written to
+    @param The path to the ROM's ELF
+    @param The path to the file to write
+==============================*/
+
+void debug_setprofile(char* elfpath, char* outpath)
+{
+    debug_loadsymbols(elfpath);
+    local_profilepath = gen_instancepath(outpath);
+}
+
+
+/*==============================
+    debug_settrace
+    Sets the file that the console's zones are
+    written to, in Chrome's trace event format
+    @param The path to the file to write
+==============================*/
+
+void debug_settrace(char* path)
+{
+    path = gen_instancepath(path);
+    local_tracefile = fopen(path, "w");
+    if (local_tracefile == NULL)
+        terminate("Unable to create trace file '%s'.", path);
+
+    // The array is left open, as the file is written while the events arrive. Trace viewers are fine with that
+    fprintf(local_tracefile, "[");
+    local_tracestart = std::chrono::steady_clock::now();
+    local_tracepath = path;
+}
+
+
+/*==============================
+    debug_setheap
+    Loads the function symbols from the ELF that
+    allocations are matched against, and sets the
+    file that the heap report is written to
+    @param The path to the ROM's ELF
+    @param The path to the file to write
+==============================*/
+
+void debug_setheap(char* elfpath, char* outpath)
+{
+    debug_loadsymbols(elfpath);
+    local_heappath = gen_instancepath(outpath);
+}
+
+
+/*==============================
+    debug_setcore
+    Sets the file that the console's crash dumps
+    are written to, as an ELF core file
+    @param The path to the file to write
+==============================*/
+
+void debug_setcore(char* path)
+{
+    local_corepath = gen_instancepath(path);
+}
+
+
+/*==============================
+    debug_writereports
+    Writes the reports that got new data since
+    they were last written. This is done every
+    REPORT_WRITETIME milliseconds, and when the
+    program ends
+==============================*/
+
+void debug_writereports()
+{
+    local_reportwritetime = time_miliseconds();
+
+    // The flags are cleared first, so that failing to write a report doesn't try to write it again while terminating
+    if (local_profiledirty)
+    {
+        local_profiledirty = false;
+        debug_profile_write();
+    }
+    if (local_heapdirty)
+    {
+        local_heapdirty = false;
+        debug_heap_write();
+    }
+}
+
+
 /*==============================
     debug_getdebugout
     Gets the file where debug logs are
@@ -9,8 +9,16 @@
     void  debug_sendtext(char* data);
     void  debug_setdebugout(char* path);
     void  debug_setbinaryout(char* path);
+    void  debug_setstream(char* path);
+    void  debug_addpatch(uint32_t address, char* path);
+    void  debug_setfsroot(char* path);
+    void  debug_setprofile(char* elfpath, char* outpath);
+    void  debug_settrace(char* path);
+    void  debug_setheap(char* elfpath, char* outpath);
+    void  debug_setcore(char* path);
     FILE* debug_getdebugout();
     char* debug_getbinaryout();
     void  debug_closedebugout();
+    void  debug_writereports();
 
 #endif 
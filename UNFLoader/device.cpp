@@ -16,6 +16,7 @@ Passes flashcart communication to more specific functions
     #include <shlwapi.h>
 #endif
 #include <atomic>
+#include <vector>
 
 
 /*********************************
@@ -28,7 +29,7 @@ DeviceError (*funcPointer_testdebug)(CartDevice*);
 uint32_t    (*funcPointer_rompadding)(uint32_t romsize);
 bool        (*funcPointer_explicitcic)(byte* bootcode);
 uint32_t    (*funcPointer_maxromsize)();
-DeviceError (*funcPointer_senddata)(CartDevice*, USBDataType datatype, byte* data, uint32_t size);
+DeviceError (*funcPointer_senddatav)(CartDevice*, USBDataType datatype, DeviceIOVec* vec, uint32_t count);
 DeviceError (*funcPointer_receivedata)(CartDevice*, uint32_t* dataheader, byte** buff);
 DeviceError (*funcPointer_close)(CartDevice*);
 
@@ -42,6 +43,8 @@ static void device_set_64drive2(CartDevice* cart);
 static void device_set_everdrive(CartDevice* cart);
 static void device_set_sc64(CartDevice* cart);
 static void device_set_gopher64(CartDevice* cart);
+static void device_beginupload(uint32_t size);
+static void device_finishupload();
 
 
 /*********************************
@@ -53,10 +56,22 @@ static char* local_rompath  = NULL;
 
 // Cart
 static CartDevice local_cart;
+static bool       local_sharedrom = false;
+static const char* local_emulatoraddr = DEFAULT_EMULATORADDR;
 
 // Upload
 std::atomic<bool> local_uploadcancelled (false);
 std::atomic<float> local_uploadprogress (0.0f);
+static float local_uploadrange_start = 0.0f;
+static float local_uploadrange_end = 100.0f;
+std::atomic<uint64_t> local_uploadbytes (0);
+static uint64_t local_uploadbase = 0;
+static uint32_t local_uploadsize = 0;
+
+// USB protocol 3
+static uint32_t local_channelmaxsize = 0;
+static uint16_t local_channelsequence[CHANNEL_COUNT];
+static uint32_t local_channelcredits[CHANNEL_COUNT];
 
 
 /*==============================
@@ -168,7 +183,7 @@ static void device_set_64drive1(CartDevice* cart)
     funcPointer_explicitcic = &device_explicitcic_64drive1;
     funcPointer_sendrom = &device_sendrom_64drive;
     funcPointer_testdebug = &device_testdebug_64drive;
-    funcPointer_senddata = &device_senddata_64drive;
+    funcPointer_senddatav = &device_senddatav_64drive;
     funcPointer_receivedata = &device_receivedata_64drive;
     funcPointer_close = &device_close_64drive;
 }
@@ -211,7 +226,7 @@ static void device_set_everdrive(CartDevice* cart)
     funcPointer_explicitcic = &device_explicitcic_everdrive;
     funcPointer_sendrom = &device_sendrom_everdrive;
     funcPointer_testdebug = &device_testdebug_everdrive;
-    funcPointer_senddata = &device_senddata_everdrive;
+    funcPointer_senddatav = &device_senddatav_everdrive;
     funcPointer_receivedata = &device_receivedata_everdrive;
     funcPointer_close = &device_close_everdrive;
 }
@@ -236,7 +251,7 @@ static void device_set_sc64(CartDevice* cart)
     funcPointer_explicitcic = &device_explicitcic_sc64;
     funcPointer_sendrom = &device_sendrom_sc64;
     funcPointer_testdebug = &device_testdebug_sc64;
-    funcPointer_senddata = &device_senddata_sc64;
+    funcPointer_senddatav = &device_senddatav_sc64;
     funcPointer_receivedata = &device_receivedata_sc64;
     funcPointer_close = &device_close_sc64;
 }
@@ -261,7 +276,7 @@ static void device_set_gopher64(CartDevice* cart)
     funcPointer_explicitcic = &device_explicitcic_gopher64;
     funcPointer_sendrom = &device_sendrom_gopher64;
     funcPointer_testdebug = &device_testdebug_gopher64;
-    funcPointer_senddata = &device_senddata_gopher64;
+    funcPointer_senddatav = &device_senddatav_gopher64;
     funcPointer_receivedata = &device_receivedata_gopher64;
     funcPointer_close = &device_close_gopher64;
 }
@@ -397,7 +412,9 @@ DeviceError device_sendrom(FILE* rom, uint32_t filesize)
             SWAP(rom_buffer[i], rom_buffer[i+1]);
 
     // Upload the ROM
+    device_beginupload(filesize);
     err = funcPointer_sendrom(&local_cart, rom_buffer, filesize);
+    device_finishupload();
     free(rom_buffer);
     if (err != DEVICEERR_OK)
         device_cancelupload();
@@ -428,7 +445,69 @@ DeviceError device_testdebug()
 
 DeviceError device_senddata(USBDataType datatype, byte* data, uint32_t size)
 {
-    return funcPointer_senddata(&local_cart, datatype, data, size);
+    DeviceIOVec vec = {data, NULL, size};
+    return device_senddatav(datatype, &vec, 1);
+}
+
+
+/*==============================
+    device_senddatav
+    Sends data to the connected flashcart, gathering
+    it from a list of buffers and files. The data is
+    streamed to the flashcart in blocks, so it never
+    needs to be all in memory at once. With USB protocol
+    3, the data is wrapped in a channel header, and uses
+    up one of the channel's credits.
+    @param  The datatype that is being sent
+    @param  The list of buffers and files to send
+    @param  The number of elements in the list
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_senddatav(USBDataType datatype, DeviceIOVec* vec, uint32_t count)
+{
+    byte        header[CHANNEL_HEADERSIZE];
+    uint32_t    size;
+    USBChannel  channel;
+    DeviceError err;
+    std::vector<DeviceIOVec> wrapped;
+
+    // Older protocols send the data as is
+    size = iovec_size(vec, count);
+    if (local_cart.protocol < PROTOCOL_VERSION3)
+    {
+        device_beginupload(size);
+        err = funcPointer_senddatav(&local_cart, datatype, vec, count);
+        device_finishupload();
+        return err;
+    }
+
+    // The console only accepts whole messages, so ensure this one fits
+    if (size > local_channelmaxsize)
+        return DEVICEERR_DATATOOBIG;
+
+    // Build the header
+    channel = device_getchannel(datatype);
+    header[0] = (byte)datatype;
+    header[1] = (byte)channel;
+    header[2] = (local_channelsequence[channel] >> 8) & 0xFF;
+    header[3] = local_channelsequence[channel] & 0xFF;
+    header[4] = (size >> 24) & 0xFF;
+    header[5] = (size >> 16) & 0xFF;
+    header[6] = (size >> 8) & 0xFF;
+    header[7] = size & 0xFF;
+    memset(header + 8, 0, 4);
+    local_channelsequence[channel]++;
+
+    // Send the header with the data after it
+    wrapped.push_back({header, NULL, CHANNEL_HEADERSIZE});
+    wrapped.insert(wrapped.end(), vec, vec + count);
+    device_beginupload(CHANNEL_HEADERSIZE + size);
+    err = funcPointer_senddatav(&local_cart, DATATYPE_CHANNEL, wrapped.data(), wrapped.size());
+    device_finishupload();
+    if (err == DEVICEERR_OK && local_channelcredits[channel] > 0)
+        local_channelcredits[channel]--;
+    return err;
 }
 
 
@@ -529,6 +608,33 @@ void device_setsave(SaveType save)
 }
 
 
+/*==============================
+    device_setsharedrom
+    Enables/disables handing the ROM to
+    emulators through shared memory,
+    instead of sending it over the socket
+    @param Whether to use shared memory
+==============================*/
+
+void device_setsharedrom(bool val)
+{
+    local_sharedrom = val;
+}
+
+
+/*==============================
+    device_setemulatoraddress
+    Sets the address of the emulator
+    to connect to
+    @param The address, as host:port
+==============================*/
+
+void device_setemulatoraddress(const char* addr)
+{
+    local_emulatoraddr = addr;
+}
+
+
 /*==============================
     device_getrom
     Gets the path of the ROM to load
@@ -554,6 +660,32 @@ CartType device_getcart()
 }
 
 
+/*==============================
+    device_getsharedrom
+    Checks if ROMs should be handed to
+    emulators through shared memory
+    @return Whether to use shared memory
+==============================*/
+
+bool device_getsharedrom()
+{
+    return local_sharedrom;
+}
+
+
+/*==============================
+    device_getemulatoraddress
+    Gets the address of the emulator
+    to connect to
+    @return The address, as host:port
+==============================*/
+
+const char* device_getemulatoraddress()
+{
+    return local_emulatoraddr;
+}
+
+
 /*==============================
     device_getcic
     Gets the current CIC
@@ -611,7 +743,24 @@ bool device_uploadcancelled()
 
 void device_setuploadprogress(float progress)
 {
-    local_uploadprogress = progress;
+    local_uploadprogress = local_uploadrange_start + progress*(local_uploadrange_end - local_uploadrange_start)/100.0f;
+    local_uploadbytes = local_uploadbase + (uint64_t)(local_uploadsize*progress/100.0f);
+}
+
+
+/*==============================
+    device_setuploadrange
+    Maps the progress reported by the next
+    uploads onto part of the progress bar,
+    for data that is sent in several pieces
+    @param The progress at the start of the range
+    @param The progress at the end of the range
+==============================*/
+
+void device_setuploadrange(float start, float end)
+{
+    local_uploadrange_start = start;
+    local_uploadrange_end = end;
 }
 
 
@@ -628,6 +777,50 @@ float device_getuploadprogress()
 }
 
 
+/*==============================
+    device_getuploadbytes
+    Returns how many bytes have been sent to
+    the flashcart since the program started.
+    Used to work out the upload speed.
+    @return The number of bytes sent
+==============================*/
+
+uint64_t device_getuploadbytes()
+{
+    return local_uploadbytes.load();
+}
+
+
+/*==============================
+    device_beginupload
+    Tells device_setuploadprogress how big the
+    data that is being sent is, so that it can
+    keep count of the bytes sent
+    @param The size of the data in bytes
+==============================*/
+
+static void device_beginupload(uint32_t size)
+{
+    local_uploadbase = local_uploadbytes.load();
+    local_uploadsize = size;
+}
+
+
+/*==============================
+    device_finishupload
+    Stops counting the bytes of the data that was
+    being sent, as the progress functions are also
+    used when receiving data
+==============================*/
+
+static void device_finishupload()
+{
+    local_uploadbase += local_uploadsize;
+    local_uploadsize = 0;
+    local_uploadbytes = local_uploadbase;
+}
+
+
 /*==============================
     device_setprotocol
     Sets the communication protocol version
@@ -652,6 +845,96 @@ ProtocolVer device_getprotocol()
 }
 
 
+/*==============================
+    device_setchannels
+    Resets the USB protocol 3 channels, after
+    the console describes them in its heartbeat
+    @param The largest packet the console accepts
+    @param The initial credits of each channel
+==============================*/
+
+void device_setchannels(uint32_t maxsize, byte* credits)
+{
+    local_channelmaxsize = maxsize;
+    for (int i=0; i<CHANNEL_COUNT; i++)
+    {
+        local_channelsequence[i] = 0;
+        local_channelcredits[i] = credits[i];
+    }
+}
+
+
+/*==============================
+    device_addcredits
+    Adds the credits that the console handed back
+    after reading our packets
+    @param The credits of each channel
+    @param The number of channels in the list
+==============================*/
+
+void device_addcredits(byte* credits, uint32_t count)
+{
+    for (uint32_t i=0; i<count && i<CHANNEL_COUNT; i++)
+        local_channelcredits[i] += credits[i];
+}
+
+
+/*==============================
+    device_hascredit
+    Checks if a packet can be sent on a channel
+    without overrunning the console
+    @param  The channel to check
+    @return Whether the channel has credits left
+==============================*/
+
+bool device_hascredit(USBChannel channel)
+{
+    if (local_cart.protocol < PROTOCOL_VERSION3)
+        return true;
+    return local_channelcredits[channel] > 0;
+}
+
+
+/*==============================
+    device_getchannelmaxsize
+    Gets the largest packet the console accepts
+    with USB protocol 3
+    @return The size of the largest packet, in bytes
+==============================*/
+
+uint32_t device_getchannelmaxsize()
+{
+    return local_channelmaxsize;
+}
+
+
+/*==============================
+    device_getchannel
+    Decides which channel outgoing data is sent on
+    @param  The datatype that is being sent
+    @return The channel to send the data on
+==============================*/
+
+USBChannel device_getchannel(USBDataType datatype)
+{
+    switch (datatype)
+    {
+        case DATATYPE_HEARTBEAT:
+        case DATATYPE_CREDIT:
+            return CHANNEL_CONTROL;
+        case DATATYPE_RDBPACKET:
+            return CHANNEL_RDB;
+        case DATATYPE_RAWBINARY:
+        case DATATYPE_SEGMENT:
+        case DATATYPE_STREAM:
+        case DATATYPE_PATCH:
+            return CHANNEL_BULK;
+        default:
+            return CHANNEL_USER;
+    }
+}
+
+
 /*==============================
     swap_endian
     Swaps the endianess of the data
@@ -689,6 +972,71 @@ uint32_t calc_padsize(uint32_t size)
 }
 
 
+/*==============================
+    iovec_size
+    Returns the total size of a list of buffers and files
+    @param  The list of buffers and files
+    @param  The number of elements in the list
+    @return The total size, in bytes
+==============================*/
+
+uint32_t iovec_size(DeviceIOVec* vec, uint32_t count)
+{
+    uint32_t size = 0;
+    for (uint32_t i=0; i<count; i++)
+        size += vec[i].size;
+    return size;
+}
+
+
+/*==============================
+    iovec_read
+    Copies a block of data from a list of buffers
+    and files. Files are read sequentially, so the
+    blocks must be read in order. Anything past the 
+    end of the list is zero padding.
+    @param  The list of buffers and files
+    @param  The number of elements in the list
+    @param  The offset into the list to read from
+    @param  The buffer to copy the data to
+    @param  The number of bytes to copy
+    @return The device error, or OK
+==============================*/
+
+DeviceError iovec_read(DeviceIOVec* vec, uint32_t count, uint32_t offset, byte* buff, uint32_t size)
+{
+    uint32_t start = 0;
+    for (uint32_t i=0; i<count && size > 0; i++)
+    {
+        uint32_t bytes_do;
+
+        // Skip the elements that come before the offset
+        if (offset >= start + vec[i].size)
+        {
+            start += vec[i].size;
+            continue;
+        }
+
+        // Copy as much as we can from this element
+        bytes_do = start + vec[i].size - offset;
+        if (bytes_do > size)
+            bytes_do = size;
+        if (vec[i].data != NULL)
+            memcpy(buff, vec[i].data + (offset - start), bytes_do);
+        else if (fread(buff, 1, bytes_do, vec[i].file) != bytes_do)
+            return DEVICEERR_FILEREADFAIL;
+        buff += bytes_do;
+        offset += bytes_do;
+        size -= bytes_do;
+        start += vec[i].size;
+    }
+
+    // Pad the rest with zeroes
+    memset(buff, 0, size);
+    return DEVICEERR_OK;
+}
+
+
 /*==============================
     romhash
     Returns an int with a simple hash of the inputted data
@@ -14,6 +14,9 @@
     *********************************/
 
     #define USBPROTOCOL_LATEST PROTOCOL_VERSION2
+    #define SENDDATA_CHUNKSIZE 0x8000 // Size (in bytes) of the blocks that data is streamed to the flashcart with
+    #define CHANNEL_HEADERSIZE 12     // Size (in bytes) of the header that USB protocol 3 puts in front of each packet
+    #define DEFAULT_EMULATORADDR "localhost:48646" // Where to look for the Gopher64 emulator
 
 
     /*********************************
@@ -61,13 +64,37 @@
         DATATYPE_RDBPACKET  = 0x06,
         DATATYPE_TCPTEST    = 0x07,
         DATATYPE_ROMUPLOAD  = 0x08,
+        DATATYPE_SEGMENT    = 0x09,
+        DATATYPE_CHANNEL    = 0x0A,
+        DATATYPE_CREDIT     = 0x0B,
+        DATATYPE_ROMSHARED  = 0x0C,
+        DATATYPE_STREAM     = 0x0D,
+        DATATYPE_PATCH      = 0x0E,
+        DATATYPE_FSREQUEST  = 0x0F,
+        DATATYPE_FSDATA     = 0x10,
+        DATATYPE_PROFILE    = 0x11,
+        DATATYPE_ZONES      = 0x12,
+        DATATYPE_ZONENAME   = 0x13,
+        DATATYPE_HEAP       = 0x14,
+        DATATYPE_COREREGS   = 0x15,
+        DATATYPE_COREMEM    = 0x16,
     } USBDataType;
 
     typedef enum {
         PROTOCOL_VERSION1   = 0x00, 
         PROTOCOL_VERSION2   = 0x02,
+        PROTOCOL_VERSION3   = 0x03,
     } ProtocolVer;
 
+    typedef enum {
+        CHANNEL_CONTROL = 0,
+        CHANNEL_LOG     = 1,
+        CHANNEL_RDB     = 2,
+        CHANNEL_BULK    = 3,
+        CHANNEL_USER    = 4,
+        CHANNEL_COUNT   = 5,
+    } USBChannel;
+
     typedef enum {
         DEVICEERR_OK = 0,
         DEVICEERR_NOTCART,
@@ -96,6 +123,7 @@
         DEVICEERR_BADPACKSIZE,
         DEVICEERR_MALLOCFAIL,
         DEVICEERR_UPLOADCANCELLED,
+        DEVICEERR_DATATOOBIG,
         DEVICEERR_TIMEOUT,
         DEVICEERR_POLLFAIL,
         DEVICEERR_64D_BADCMP,
@@ -118,6 +146,12 @@
 
     typedef uint8_t byte;
 
+    typedef struct {
+        byte*    data; // The data to send, or NULL to read it from the file instead
+        FILE*    file; // The file to read the data from, starting at its current position
+        uint32_t size;
+    } DeviceIOVec;
+
     typedef struct {
         CartType    carttype;
         CICType     cictype;
@@ -142,6 +176,7 @@
     DeviceError device_testdebug();
     DeviceError device_sendrom(FILE* rom, uint32_t filesize);
     DeviceError device_senddata(USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddatav(USBDataType datatype, DeviceIOVec* vec, uint32_t count);
     DeviceError device_receivedata(uint32_t* dataheader, byte** buff);
     DeviceError device_close();
 
@@ -150,26 +185,39 @@
     void     device_setcart(CartType cart);
     void     device_setcic(CICType cic);
     void     device_setsave(SaveType save);
+    void     device_setsharedrom(bool val);
+    void     device_setemulatoraddress(const char* addr);
     char*    device_getrom();
     CartType device_getcart();
     CICType  device_getcic();
     SaveType device_getsave();
+    bool     device_getsharedrom();
+    const char* device_getemulatoraddress();
 
     // Upload related
-    void  device_cancelupload();
-    bool  device_uploadcancelled();
-    void  device_setuploadprogress(float progress);
-    float device_getuploadprogress();
+    void     device_cancelupload();
+    bool     device_uploadcancelled();
+    void     device_setuploadprogress(float progress);
+    void     device_setuploadrange(float start, float end);
+    float    device_getuploadprogress();
+    uint64_t device_getuploadbytes();
 
     // Protocol version handling
     void        device_setprotocol(ProtocolVer version);
     ProtocolVer device_getprotocol();
-    
+    void        device_setchannels(uint32_t maxsize, byte* credits);
+    void        device_addcredits(byte* credits, uint32_t count);
+    bool        device_hascredit(USBChannel channel);
+    uint32_t    device_getchannelmaxsize();
+    USBChannel  device_getchannel(USBDataType datatype);
+
     // Helper functions
     #define  SWAP(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b))) // From https://graphics.stanford.edu/~seander/bithacks.html#SwappingValuesXOR
     #define  ALIGN(s, align) (((uint32_t)(s) + ((align)-1)) & ~((align)-1))
     uint32_t swap_endian(uint32_t val);
     uint32_t calc_padsize(uint32_t size);
+    uint32_t iovec_size(DeviceIOVec* vec, uint32_t count);
+    DeviceError iovec_read(DeviceIOVec* vec, uint32_t count, uint32_t offset, byte* buff, uint32_t size);
     uint32_t romhash(byte* buff, uint32_t len);
     CICType  cic_from_bootcode(byte *bootcode);
 
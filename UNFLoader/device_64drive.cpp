@@ -446,22 +446,25 @@ DeviceError device_sendrom_64drive(CartDevice* cart, byte* rom, uint32_t size)
 
 
 /*==============================
-    device_senddata_64drive
-    Sends data to the 64Drive
+    device_senddatav_64drive
+    Sends data to the 64Drive, streaming
+    it in blocks and padding it on the fly
     @param  A pointer to the cart context
     @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
+    @param  The list of buffers and files to send
+    @param  The number of elements in the list
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_senddata_64drive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size)
+DeviceError device_senddatav_64drive(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count)
 {
     N64DriveHandle* fthandle = (N64DriveHandle*) cart->structure;
     byte     buf[4];
     uint32_t cmp_magic;
+    uint32_t size = iovec_size(vec, count);
     uint32_t newsize = 0;
-    byte*    datacopy = NULL;
+    uint32_t bytes_done = 0;
+    byte*    block = NULL;
     DeviceError err;
 
     // Pad the data to be 512 byte aligned if it is large, if not then to 4 bytes
@@ -474,19 +477,28 @@ DeviceError device_senddata_64drive(CartDevice* cart, USBDataType datatype, byte
     if (newsize > 8*1024*1024)
         return DEVICEERR_64D_DATATOOBIG;
 
-    // Copy the data onto a temp variable
-    datacopy = (byte*) calloc(newsize, 1);
-    if (datacopy == NULL)
+    // Allocate a buffer to stream the data through
+    block = (byte*) malloc(SENDDATA_CHUNKSIZE);
+    if (block == NULL)
         return DEVICEERR_MALLOCFAIL;
-    memcpy(datacopy, data, size);
 
-    // Send this block of data
+    // Send the data in blocks
     device_setuploadprogress(0.0f);
     err = device_sendcmd_64drive(fthandle, DEV_CMD_USBRECV, false, NULL, 1, (newsize & 0x00FFFFFF) | datatype << 24, 0);
+    while (err == DEVICEERR_OK && bytes_done < newsize)
+    {
+        uint32_t bytes_do = SENDDATA_CHUNKSIZE;
+        if (newsize - bytes_done < bytes_do)
+            bytes_do = newsize - bytes_done;
+        err = iovec_read(vec, count, bytes_done, block, bytes_do);
+        if (err == DEVICEERR_OK && device_usb_write(fthandle->handle, block, bytes_do, &fthandle->bytes_written) != USB_OK)
+            err = DEVICEERR_WRITEFAIL;
+        bytes_done += bytes_do;
+        device_setuploadprogress((((float)bytes_done)/((float)newsize))*100.0f);
+    }
+    free(block);
     if (err != DEVICEERR_OK)
         return err;
-    if (device_usb_write(fthandle->handle, datacopy, newsize, &fthandle->bytes_written) != USB_OK)
-        return DEVICEERR_WRITEFAIL;
 
     // Read the CMP signal
     if (device_usb_read(fthandle->handle, buf, 4, &fthandle->bytes_read) != USB_OK)
@@ -495,9 +507,8 @@ DeviceError device_senddata_64drive(CartDevice* cart, USBDataType datatype, byte
     if (cmp_magic != 0x434D5040)
         return DEVICEERR_64D_BADCMP;
 
-    // Free used up resources
+    // Done
     device_setuploadprogress(100.0f);
-    free(datacopy);
     return DEVICEERR_OK;
 }
 
@@ -43,7 +43,7 @@
     bool        device_explicitcic_64drive1(byte* bootcode);
     bool        device_explicitcic_64drive2(byte* bootcode);
     DeviceError device_testdebug_64drive(CartDevice* cart);
-    DeviceError device_senddata_64drive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddatav_64drive(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count);
     DeviceError device_receivedata_64drive(CartDevice* cart, uint32_t* dataheader, byte** buff);
     DeviceError device_close_64drive(CartDevice* cart);
 
@@ -386,24 +386,26 @@ DeviceError device_testdebug_everdrive(CartDevice* cart)
 
 
 /*==============================
-    device_senddata_everdrive
-    Sends data to the EverDrive
+    device_senddatav_everdrive
+    Sends data to the EverDrive, streaming
+    it in blocks and padding it on the fly
     @param  A pointer to the cart context
     @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
+    @param  The list of buffers and files to send
+    @param  The number of elements in the list
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size)
+DeviceError device_senddatav_everdrive(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count)
 {
     ED64Handle* fthandle = (ED64Handle*)cart->structure;
     byte     buffer[16];
     uint32_t header;
-    uint32_t newsize = device_getprotocol() == PROTOCOL_VERSION2 ? ALIGN(size, 2) : ALIGN(size, 512);
-    byte*    datacopy = NULL;
+    uint32_t size = iovec_size(vec, count);
+    uint32_t newsize = device_getprotocol() >= PROTOCOL_VERSION2 ? ALIGN(size, 2) : ALIGN(size, 512);
+    byte*    block = NULL;
     uint32_t bytes_done = 0;
-    uint32_t bytes_left = newsize;
+    DeviceError err = DEVICEERR_OK;
 
     // Put in the DMA header along with length and type information in the buffer
     header = (size & 0xFFFFFF) | (((uint32_t)datatype) << 24);
@@ -416,36 +418,44 @@ DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, by
     buffer[6] = (header >> 8)  & 0xFF;
     buffer[7] = header & 0xFF;
 
+    // Allocate a buffer to stream the data through
+    block = (byte*) malloc(SENDDATA_CHUNKSIZE);
+    if (block == NULL)
+        return DEVICEERR_MALLOCFAIL;
+
     // Send the DMA message
     if (device_usb_write(fthandle->handle, buffer, 8, &fthandle->bytes_written) != USB_OK)
+    {
+        free(block);
         return DEVICEERR_WRITEFAIL;
+    }
 
     // Handle old protocol (doesn't matter what we sent, just needs to make the DMA message 16 bytes aligned)
     if (device_getprotocol() == PROTOCOL_VERSION1)
     {
         if (device_usb_write(fthandle->handle, buffer, 8, &fthandle->bytes_read) != USB_OK)
+        {
+            free(block);
             return DEVICEERR_READFAIL;
+        }
     }
 
-    // Copy the data onto a temp variable
-    datacopy = (byte*) calloc(newsize, 1);
-    if (datacopy == NULL)
-        return DEVICEERR_MALLOCFAIL;
-    memcpy(datacopy, data, size);
-
-    // Send the data in chunks
+    // Send the data in blocks
     device_setuploadprogress(0.0f);
-    while (bytes_left > 0)
+    while (err == DEVICEERR_OK && bytes_done < newsize)
     {
-        uint32_t bytes_do = 512;
-        if (bytes_left < 512)
-            bytes_do = bytes_left;
-        if (device_usb_write(fthandle->handle, datacopy+bytes_done, bytes_do, &fthandle->bytes_written) != USB_OK)
-            return DEVICEERR_WRITEFAIL;
-        bytes_left -= bytes_do;
+        uint32_t bytes_do = SENDDATA_CHUNKSIZE;
+        if (newsize - bytes_done < bytes_do)
+            bytes_do = newsize - bytes_done;
+        err = iovec_read(vec, count, bytes_done, block, bytes_do);
+        if (err == DEVICEERR_OK && device_usb_write(fthandle->handle, block, bytes_do, &fthandle->bytes_written) != USB_OK)
+            err = DEVICEERR_WRITEFAIL;
         bytes_done += bytes_do;
         device_setuploadprogress((((float)bytes_done)/((float)newsize))*100.0f);
     }
+    free(block);
+    if (err != DEVICEERR_OK)
+        return err;
 
     // Send the CMP signal
     buffer[0] = 'C';
@@ -462,9 +472,8 @@ DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, by
             return DEVICEERR_READFAIL;
     }
 
-    // Free used up resources
+    // Done
     device_setuploadprogress(100.0f);
-    free(datacopy);
     return DEVICEERR_OK;
 }
 
@@ -485,7 +494,7 @@ DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader,
 {
     ED64Handle* fthandle = (ED64Handle*)cart->structure;
     uint32_t size;
-    uint32_t alignment = device_getprotocol() == PROTOCOL_VERSION2 ? 2 : 16;
+    uint32_t alignment = device_getprotocol() >= PROTOCOL_VERSION2 ? 2 : 16;
 
     // First, check if we have data to read
     if (device_usb_getqueuestatus(fthandle->handle, &size) != USB_OK)
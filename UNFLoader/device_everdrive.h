@@ -15,7 +15,7 @@
     uint32_t    device_rompadding_everdrive(uint32_t romsize);
     bool        device_explicitcic_everdrive(byte* bootcode);
     DeviceError device_testdebug_everdrive(CartDevice* cart);
-    DeviceError device_senddata_everdrive(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddatav_everdrive(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count);
     DeviceError device_receivedata_everdrive(CartDevice* cart, uint32_t* dataheader, byte** buff);
     DeviceError device_close_everdrive(CartDevice* cart);
 
@@ -11,23 +11,63 @@ Handles Gopher64 TCP communication.
 #else
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #endif
 
 #include <sys/types.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <chrono>
-#include <thread>
 #include <vector>
+#include <deque>
+#include <utility>
+
+#define GOPHER64_TIMEOUT  5000    // Time (in milliseconds) to wait for the socket to take more data before giving up
+#define GOPHER64_CONNECTTIMEOUT 1000 // Time (in milliseconds) to wait for the connection to Gopher64 to go through
+#define GOPHER64_PROBETIMEOUT 500 // Time (in milliseconds) to wait for Gopher64 to answer during autodetection
+#define GOPHER64_DEFAULTPORT "48646"
+#define GOPHER64_RECVSIZE 0x10000 // Minimum free space (in bytes) in the receive buffer when reading from the socket
+#define GOPHER64_SHAREDTIMEOUT 2000 // Time (in milliseconds) to wait for Gopher64 to accept a ROM in shared memory, before sending it over the socket instead
+
+#ifdef _WIN32
+typedef WSABUF Gopher64Buf;
+#define GOPHER64_BUFDATA(b) ((b).buf)
+#define GOPHER64_BUFSIZE(b) ((b).len)
+#define GOPHER64_POLL WSAPoll
+#define GOPHER64_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define GOPHER64_INTERRUPTED() (false)
+#else
+typedef struct iovec Gopher64Buf;
+#define GOPHER64_BUFDATA(b) ((b).iov_base)
+#define GOPHER64_BUFSIZE(b) ((b).iov_len)
+#define GOPHER64_POLL poll
+#define GOPHER64_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+#define GOPHER64_INTERRUPTED() (errno == EINTR)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
 
 typedef struct
 {
     int sockfd;
-    std::vector<byte> buffer;
+    std::vector<byte> buffer; // Received data lives between the read and write cursors
+    size_t read_pos;
+    size_t write_pos;
     uint32_t data_type;
     uint32_t data_size;
+    std::deque<std::pair<uint32_t, byte *>> pending; // Data that arrived while waiting for a reply, to be returned later
+    bool shared_unsupported;
 } Gopher64Device;
 
+static DeviceError device_tcp_wait_gopher64(int sockfd, short events, int timeout);
+static DeviceError device_tcp_receive_gopher64(Gopher64Device *device, uint32_t *dataheader, byte **buff);
+static DeviceError device_sendrom_shared_gopher64(CartDevice *cart, byte *rom, uint32_t size, bool *accepted);
+
 /*==============================
     device_test_gopher64
     Attempts to find Gopher64 device
@@ -42,12 +82,31 @@ DeviceError device_test_gopher64(CartDevice *cart)
     if (device_open_gopher64(cart) == DEVICEERR_OK)
     {
         byte data[3] = {'N', '6', '4'};
-        if (device_senddata_gopher64(cart, DATATYPE_TCPTEST, data, 3) == DEVICEERR_OK)
+        DeviceIOVec vec = {data, NULL, 3};
+        if (device_senddatav_gopher64(cart, DATATYPE_TCPTEST, &vec, 1) == DEVICEERR_OK)
         {
             byte *buff = NULL;
             uint32_t dataheader = 0;
-            std::this_thread::sleep_for(std::chrono::milliseconds(500)); // give gopher64 time to respond
-            if (device_receivedata_gopher64(cart, &dataheader, &buff) == DEVICEERR_OK)
+            DeviceError err = DEVICEERR_OK;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            // Give Gopher64 time to respond, but stop waiting as soon as it does
+            while (err == DEVICEERR_OK && dataheader == 0)
+            {
+                err = device_receivedata_gopher64(cart, &dataheader, &buff);
+                int elapsed = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                if (err != DEVICEERR_OK || dataheader != 0 || elapsed >= GOPHER64_PROBETIMEOUT)
+                {
+                    break;
+                }
+                err = device_tcp_wait_gopher64(((Gopher64Device *)cart->structure)->sockfd, POLLIN, GOPHER64_PROBETIMEOUT - elapsed);
+                if (err == DEVICEERR_TIMEOUT)
+                {
+                    err = DEVICEERR_OK;
+                    break;
+                }
+            }
+            if (err == DEVICEERR_OK)
             {
                 USBDataType type = (USBDataType)(dataheader >> 24);
                 uint32_t size = dataheader & 0xFFFFFF;
@@ -151,64 +210,102 @@ DeviceError device_testdebug_gopher64(CartDevice *cart)
 
 DeviceError device_open_gopher64(CartDevice *cart)
 {
-    struct addrinfo hints, *res;
+    struct addrinfo hints, *res, *addr;
+    char host[256];
+    const char *port = GOPHER64_DEFAULTPORT;
     Gopher64Device *device = new Gopher64Device;
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_socktype = SOCK_STREAM; // TCP
-
-    // Resolve localhost and port
-    if (getaddrinfo("localhost", "48646", &hints, &res) != 0)
+    // Split the address into the host and port. IPv6 hosts need to be wrapped in brackets
+    strncpy(host, device_getemulatoraddress(), sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    char *colon = strrchr(host, ':');
+    if (host[0] == '[')
     {
-        delete device;
-        return DEVICEERR_NOTCART;
+        char *bracket = strchr(host, ']');
+        if (bracket != NULL)
+        {
+            if (bracket[1] == ':')
+            {
+                port = bracket + 2;
+            }
+            *bracket = '\0';
+            memmove(host, host + 1, strlen(host));
+        }
+    }
+    else if (colon != NULL && strchr(host, ':') == colon)
+    {
+        *colon = '\0';
+        port = colon + 1;
     }
 
-    // Create socket
-    device->sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_socktype = SOCK_STREAM; // TCP
 
-    if (device->sockfd < 0)
+    // Resolve the host and port
+    if (getaddrinfo(host, port, &hints, &res) != 0)
     {
-        freeaddrinfo(res);
         delete device;
         return DEVICEERR_NOTCART;
     }
 
-    // Connect
-    if (connect(device->sockfd, res->ai_addr, res->ai_addrlen) < 0)
+    // Try each of the addresses the host resolved to, without waiting on any of them for too long
+    device->sockfd = -1;
+    for (addr = res; addr != NULL && device->sockfd < 0; addr = addr->ai_next)
     {
+        device->sockfd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (device->sockfd < 0)
+        {
+            continue;
+        }
+
+        // Set the socket to non-blocking before connecting, so that we can time out
 #ifdef _WIN32
-        closesocket(device->sockfd);
+        u_long non_blocking = 1;
+        bool connected = (ioctlsocket(device->sockfd, FIONBIO, &non_blocking) == 0);
+        if (connected && connect(device->sockfd, addr->ai_addr, addr->ai_addrlen) != 0)
+        {
+            connected = GOPHER64_WOULDBLOCK();
+        }
 #else
-        close(device->sockfd);
+        int flags = fcntl(device->sockfd, F_GETFL, 0);
+        bool connected = (fcntl(device->sockfd, F_SETFL, flags | O_NONBLOCK) != -1);
+        if (connected && connect(device->sockfd, addr->ai_addr, addr->ai_addrlen) != 0)
+        {
+            connected = (errno == EINPROGRESS);
+        }
 #endif
-        freeaddrinfo(res);
-        delete device;
-        return DEVICEERR_NOTCART;
-    }
 
+        // Wait for the connection to go through, and check if it succeeded
+        if (connected && device_tcp_wait_gopher64(device->sockfd, POLLOUT, GOPHER64_CONNECTTIMEOUT) == DEVICEERR_OK)
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            connected = (getsockopt(device->sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &length) == 0 && error == 0);
+        }
+        else
+        {
+            connected = false;
+        }
+        if (!connected)
+        {
 #ifdef _WIN32
-    u_long non_blocking = 1;
-    // Set the socket to non-blocking
-    if (ioctlsocket(device->sockfd, FIONBIO, &non_blocking) != 0)
-    {
-        closesocket(device->sockfd);
-        freeaddrinfo(res);
-        delete device;
-        return DEVICEERR_NOTCART;
-    }
+            closesocket(device->sockfd);
 #else
-    int flags = fcntl(device->sockfd, F_GETFL, 0);
-    // Set the socket to non-blocking
-    if (fcntl(device->sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+            close(device->sockfd);
+#endif
+            device->sockfd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (device->sockfd < 0)
     {
-        close(device->sockfd);
-        freeaddrinfo(res);
         delete device;
         return DEVICEERR_NOTCART;
     }
-#endif
 
+    device->read_pos = 0;
+    device->write_pos = 0;
+    device->shared_unsupported = false;
     device->data_size = 0;
     device->data_type = 0;
     cart->structure = device;
@@ -226,64 +323,342 @@ DeviceError device_open_gopher64(CartDevice *cart)
 
 DeviceError device_sendrom_gopher64(CartDevice *cart, byte *rom, uint32_t size)
 {
-    return device_senddata_gopher64(cart, DATATYPE_ROMUPLOAD, rom, size);
+    Gopher64Device *device = (Gopher64Device *)cart->structure;
+    DeviceIOVec vec = {rom, NULL, size};
+
+    // Try handing the ROM over in shared memory first, and remember if Gopher64 doesn't support it
+    if (device_getsharedrom() && !device->shared_unsupported)
+    {
+        bool accepted = false;
+        DeviceError err = device_sendrom_shared_gopher64(cart, rom, size, &accepted);
+        if (err != DEVICEERR_OK || accepted)
+        {
+            return err;
+        }
+        device->shared_unsupported = true;
+    }
+    return device_senddatav_gopher64(cart, DATATYPE_ROMUPLOAD, &vec, 1);
 }
 
 /*==============================
-    device_tcp_send_gopher64
-    Sends TCP data to Gopher64
-    @param  socket file descriptor
-    @param  A pointer to the data to send
-    @param  The size of the data
+    device_sendrom_shared_gopher64
+    Places the ROM in shared memory and sends
+    Gopher64 its path and size, so that a local
+    emulator can map it instead of receiving it
+    over the socket. The message's data is the
+    ROM size as a big endian 32-bit value,
+    followed by the path. Gopher64 replies with
+    a DATATYPE_ROMSHARED message whose first
+    byte is 1 if it loaded the ROM.
+    @param  A pointer to the cart context
+    @param  A pointer to the ROM to send
+    @param  The size of the ROM
+    @param  A pointer to a bool which is set to
+            whether Gopher64 accepted the ROM
     @return The device error, or OK
 ==============================*/
 
-static DeviceError device_tcp_send_gopher64(int sockfd, void *data, uint32_t size)
+static DeviceError device_sendrom_shared_gopher64(CartDevice *cart, byte *rom, uint32_t size, bool *accepted)
 {
-    size_t total_sent = 0;
+    *accepted = false;
+#ifdef _WIN32
+    (void)(cart);
+    (void)(rom);
+    (void)(size);
+    return DEVICEERR_OK;
+#else
+    Gopher64Device *device = (Gopher64Device *)cart->structure;
+    DeviceError err = DEVICEERR_OK;
+    char path[64];
+    bool unlink_after = false;
+    int fd = -1;
+
+    // Use an anonymous memory file if we can, which the emulator opens through /proc
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("unfloader-rom", MFD_CLOEXEC);
+    if (fd >= 0)
+    {
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), fd);
+    }
+#endif
+    if (fd < 0)
+    {
+        snprintf(path, sizeof(path), "%s/unfloader-rom-XXXXXX", (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp");
+        fd = mkstemp(path);
+        if (fd < 0)
+        {
+            return DEVICEERR_OK;
+        }
+        unlink_after = true;
+    }
 
-    while (total_sent < size)
+    // Copy the ROM over
+    for (uint32_t bytes_done = 0; bytes_done < size;)
     {
-        int sent = send(sockfd, (const char *)data + total_sent, size - total_sent, 0);
-        if (sent > 0)
+        ssize_t written = write(fd, rom + bytes_done, size - bytes_done);
+        if (written <= 0 && errno != EINTR)
         {
-            total_sent += sent;
+            close(fd);
+            if (unlink_after)
+            {
+                unlink(path);
+            }
+            return DEVICEERR_OK;
+        }
+        if (written > 0)
+        {
+            bytes_done += written;
         }
     }
-    return DEVICEERR_OK;
+
+    // Send the handle
+    uint32_t swapped_size = swap_endian(size);
+    DeviceIOVec vec[2] = {{(byte *)&swapped_size, NULL, sizeof(uint32_t)}, {(byte *)path, NULL, (uint32_t)strlen(path)}};
+    err = device_senddatav_gopher64(cart, DATATYPE_ROMSHARED, vec, 2);
+
+    // Wait for Gopher64 to tell us whether it took the ROM, keeping anything else that arrives for later
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool replied = false;
+    while (err == DEVICEERR_OK && !replied)
+    {
+        uint32_t dataheader = 0;
+        byte *buff = NULL;
+        err = device_tcp_receive_gopher64(device, &dataheader, &buff);
+        if (err != DEVICEERR_OK)
+        {
+            break;
+        }
+        if (dataheader != 0)
+        {
+            if ((USBDataType)(dataheader >> 24) == DATATYPE_ROMSHARED)
+            {
+                *accepted = ((dataheader & 0xFFFFFF) >= 1 && buff[0] == 1);
+                replied = true;
+                free(buff);
+            }
+            else
+            {
+                device->pending.push_back(std::make_pair(dataheader, buff));
+            }
+            continue;
+        }
+        int elapsed = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        if (elapsed >= GOPHER64_SHAREDTIMEOUT)
+        {
+            break;
+        }
+        err = device_tcp_wait_gopher64(device->sockfd, POLLIN, GOPHER64_SHAREDTIMEOUT - elapsed);
+        if (err == DEVICEERR_TIMEOUT)
+        {
+            err = DEVICEERR_OK;
+            break;
+        }
+    }
+
+    // Gopher64 has its own copy or mapping by now, so the file can go
+    close(fd);
+    if (unlink_after)
+    {
+        unlink(path);
+    }
+    if (*accepted)
+    {
+        device_setuploadprogress(100.0f);
+    }
+    return err;
+#endif
 }
 
 /*==============================
-    device_senddata_gopher64
-    Sends data to Gopher64
-    @param  A pointer to the cart context
-    @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
-    @return The device error, or OK
+    device_tcp_wait_gopher64
+    Waits for the socket to be ready
+    @param  socket file descriptor
+    @param  The poll events to wait for
+    @param  The time to wait, in milliseconds
+    @return DEVICEERR_OK if the socket is ready,
+            DEVICEERR_TIMEOUT if it wasn't ready
+            in time, or DEVICEERR_POLLFAIL
 ==============================*/
 
-DeviceError device_senddata_gopher64(CartDevice *cart, USBDataType datatype, byte *data, uint32_t size)
+static DeviceError device_tcp_wait_gopher64(int sockfd, short events, int timeout)
 {
-    Gopher64Device *device = (Gopher64Device *)cart->structure;
+#ifdef _WIN32
+    WSAPOLLFD pfd;
+#else
+    struct pollfd pfd;
+#endif
+    pfd.fd = sockfd;
+    pfd.events = events;
+    pfd.revents = 0;
 
-    uint32_t data_type = swap_endian((uint32_t)datatype);
-    if (device_tcp_send_gopher64(device->sockfd, &data_type, sizeof(uint32_t)) != DEVICEERR_OK)
+    int result = GOPHER64_POLL(&pfd, 1, timeout);
+    if (result == 0)
     {
-        return DEVICEERR_WRITEFAIL;
+        return DEVICEERR_TIMEOUT;
     }
-    uint32_t swapped_size = swap_endian(size);
-    if (device_tcp_send_gopher64(device->sockfd, &swapped_size, sizeof(uint32_t)) != DEVICEERR_OK)
+    if (result < 0)
     {
-        return DEVICEERR_WRITEFAIL;
+        return GOPHER64_INTERRUPTED() ? DEVICEERR_OK : DEVICEERR_POLLFAIL;
     }
-    if (device_tcp_send_gopher64(device->sockfd, data, size) != DEVICEERR_OK)
+    return DEVICEERR_OK;
+}
+
+/*==============================
+    device_tcp_sendv_gopher64
+    Sends a list of buffers to Gopher64 with as
+    few system calls as possible, waiting for
+    the socket whenever it's full
+    @param  socket file descriptor
+    @param  The list of buffers to send. The
+            entries are modified as they're sent
+    @param  The number of buffers in the list
+    @param  A pointer to the number of bytes sent
+            so far, which is kept up to date
+    @param  The total number of bytes in the
+            message, for the upload progress
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_tcp_sendv_gopher64(int sockfd, Gopher64Buf *bufs, uint32_t count, uint32_t *bytes_done, uint32_t total)
+{
+    uint32_t index = 0;
+
+    while (index < count)
     {
-        return DEVICEERR_WRITEFAIL;
+        // Skip the buffers that were already sent
+        if (GOPHER64_BUFSIZE(bufs[index]) == 0)
+        {
+            index++;
+            continue;
+        }
+
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(sockfd, bufs + index, count - index, &sent, 0, NULL, NULL) != 0)
+        {
+            if (!GOPHER64_WOULDBLOCK())
+            {
+                return DEVICEERR_WRITEFAIL;
+            }
+            sent = 0;
+        }
+#else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = bufs + index;
+        msg.msg_iovlen = count - index;
+        ssize_t sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (!GOPHER64_WOULDBLOCK() && !GOPHER64_INTERRUPTED())
+            {
+                return DEVICEERR_WRITEFAIL;
+            }
+            sent = 0;
+        }
+#endif
+
+        // If the socket is full, wait until Gopher64 has read some of it
+        if (sent == 0)
+        {
+            DeviceError err = device_tcp_wait_gopher64(sockfd, POLLOUT, GOPHER64_TIMEOUT);
+            if (err != DEVICEERR_OK)
+            {
+                return err;
+            }
+            continue;
+        }
+
+        // Move past the data that was sent
+        *bytes_done += (uint32_t)sent;
+        device_setuploadprogress((((float)*bytes_done)/((float)total))*100.0f);
+        while (sent > 0)
+        {
+            size_t size = GOPHER64_BUFSIZE(bufs[index]);
+            if ((size_t)sent >= size)
+            {
+                sent -= size;
+                GOPHER64_BUFSIZE(bufs[index]) = 0;
+                index++;
+            }
+            else
+            {
+                GOPHER64_BUFDATA(bufs[index]) = (char *)GOPHER64_BUFDATA(bufs[index]) + sent;
+                GOPHER64_BUFSIZE(bufs[index]) -= sent;
+                sent = 0;
+            }
+        }
     }
     return DEVICEERR_OK;
 }
 
+/*==============================
+    device_senddatav_gopher64
+    Sends data to Gopher64. The header and the
+    buffers are sent together, files are
+    streamed in blocks.
+    @param  A pointer to the cart context
+    @param  The datatype that is being sent
+    @param  The list of buffers and files to send
+    @param  The number of elements in the list
+    @return The device error, or OK
+==============================*/
+
+DeviceError device_senddatav_gopher64(CartDevice *cart, USBDataType datatype, DeviceIOVec *vec, uint32_t count)
+{
+    Gopher64Device *device = (Gopher64Device *)cart->structure;
+    std::vector<Gopher64Buf> bufs;
+    DeviceError err;
+    uint32_t header[2];
+    uint32_t bytes_done = 0;
+    uint32_t total = sizeof(header) + iovec_size(vec, count);
+
+    header[0] = swap_endian((uint32_t)datatype);
+    header[1] = swap_endian(iovec_size(vec, count));
+    bufs.resize(1);
+    GOPHER64_BUFDATA(bufs[0]) = (char *)header;
+    GOPHER64_BUFSIZE(bufs[0]) = sizeof(header);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (vec[i].data != NULL)
+        {
+            Gopher64Buf buf;
+            GOPHER64_BUFDATA(buf) = (char *)vec[i].data;
+            GOPHER64_BUFSIZE(buf) = vec[i].size;
+            bufs.push_back(buf);
+            continue;
+        }
+
+        // Send what we have so far, then stream the file through a small buffer
+        err = device_tcp_sendv_gopher64(device->sockfd, bufs.data(), bufs.size(), &bytes_done, total);
+        if (err != DEVICEERR_OK)
+        {
+            return err;
+        }
+        bufs.clear();
+        byte block[SENDDATA_CHUNKSIZE];
+        for (uint32_t block_done = 0; block_done < vec[i].size; block_done += SENDDATA_CHUNKSIZE)
+        {
+            Gopher64Buf buf;
+            uint32_t bytes_do = vec[i].size - block_done;
+            if (bytes_do > SENDDATA_CHUNKSIZE)
+                bytes_do = SENDDATA_CHUNKSIZE;
+            if (fread(block, 1, bytes_do, vec[i].file) != bytes_do)
+            {
+                return DEVICEERR_FILEREADFAIL;
+            }
+            GOPHER64_BUFDATA(buf) = (char *)block;
+            GOPHER64_BUFSIZE(buf) = bytes_do;
+            err = device_tcp_sendv_gopher64(device->sockfd, &buf, 1, &bytes_done, total);
+            if (err != DEVICEERR_OK)
+            {
+                return err;
+            }
+        }
+    }
+    return device_tcp_sendv_gopher64(device->sockfd, bufs.data(), bufs.size(), &bytes_done, total);
+}
+
 /*==============================
     device_receivedata_gopher64
     Receives data from Gopher64
@@ -297,46 +672,108 @@ DeviceError device_senddata_gopher64(CartDevice *cart, USBDataType datatype, byt
 ==============================*/
 
 DeviceError device_receivedata_gopher64(CartDevice *cart, uint32_t *dataheader, byte **buff)
+{
+    Gopher64Device *device = (Gopher64Device *)cart->structure;
+
+    // Hand out the data that arrived while we were waiting for something else first
+    if (!device->pending.empty())
+    {
+        *dataheader = device->pending.front().first;
+        *buff = device->pending.front().second;
+        device->pending.pop_front();
+        return DEVICEERR_OK;
+    }
+    return device_tcp_receive_gopher64(device, dataheader, buff);
+}
+
+/*==============================
+    device_tcp_receive_gopher64
+    Reads whatever the socket has, and returns
+    the next message if all of it has arrived
+    @param  A pointer to the Gopher64 device
+    @param  A pointer to an 32-bit value where
+            the received data header will be
+            stored, or 0 if no message is ready.
+    @param  A pointer to a byte buffer pointer
+            where the data will be malloc'ed into.
+    @return The device error, or OK
+==============================*/
+
+static DeviceError device_tcp_receive_gopher64(Gopher64Device *device, uint32_t *dataheader, byte **buff)
 {
     *dataheader = 0;
     *buff = NULL;
 
-    Gopher64Device *device = (Gopher64Device *)cart->structure;
-    char local_buffer[4096];
-
+    // Read everything the socket has straight into the buffer, after the write cursor
     while (true)
     {
-        int n = recv(device->sockfd, &local_buffer[0], sizeof(local_buffer), 0);
+        if (device->read_pos == device->write_pos)
+        {
+            device->read_pos = 0;
+            device->write_pos = 0;
+        }
+        if (device->buffer.size() - device->write_pos < GOPHER64_RECVSIZE)
+        {
+            // Move the unread data back to the start if that frees up at least half the buffer, otherwise grow it
+            if (device->read_pos > 0 && device->read_pos >= device->buffer.size() / 2)
+            {
+                memmove(device->buffer.data(), device->buffer.data() + device->read_pos, device->write_pos - device->read_pos);
+                device->write_pos -= device->read_pos;
+                device->read_pos = 0;
+            }
+            else
+            {
+                device->buffer.resize(device->buffer.size() * 2 + GOPHER64_RECVSIZE);
+            }
+        }
+
+        int n = recv(device->sockfd, (char *)device->buffer.data() + device->write_pos, device->buffer.size() - device->write_pos, 0);
         if (n > 0)
-            device->buffer.insert(device->buffer.end(), &local_buffer[0], &local_buffer[n]);
-        else
+        {
+            device->write_pos += n;
+        }
+        else if (n == 0)
+        {
+            return DEVICEERR_READFAIL; // Gopher64 closed the connection
+        }
+        else if (GOPHER64_WOULDBLOCK())
+        {
             break;
+        }
+        else if (!GOPHER64_INTERRUPTED())
+        {
+            return DEVICEERR_READFAIL;
+        }
     }
 
-    if (device->data_type == 0 && device->buffer.size() >= sizeof(uint32_t))
+    // Parse the header, then wait for the whole payload
+    size_t available = device->write_pos - device->read_pos;
+    if (device->data_type == 0 && available >= sizeof(uint32_t))
     {
-        memcpy(&device->data_type, device->buffer.data(), sizeof(uint32_t));
+        memcpy(&device->data_type, device->buffer.data() + device->read_pos, sizeof(uint32_t));
         device->data_type = swap_endian(device->data_type);
-        device->buffer.erase(device->buffer.begin(), device->buffer.begin() + sizeof(uint32_t));
+        device->read_pos += sizeof(uint32_t);
+        available -= sizeof(uint32_t);
     }
-    if (device->data_type != 0 && device->data_size == 0 && device->buffer.size() >= sizeof(uint32_t))
+    if (device->data_type != 0 && device->data_size == 0 && available >= sizeof(uint32_t))
     {
-        memcpy(&device->data_size, device->buffer.data(), sizeof(uint32_t));
+        memcpy(&device->data_size, device->buffer.data() + device->read_pos, sizeof(uint32_t));
         device->data_size = swap_endian(device->data_size);
-        device->buffer.erase(device->buffer.begin(), device->buffer.begin() + sizeof(uint32_t));
+        device->read_pos += sizeof(uint32_t);
+        available -= sizeof(uint32_t);
     }
-    if (device->data_type != 0 && device->data_size != 0)
+    if (device->data_type != 0 && device->data_size != 0 && available >= device->data_size)
     {
-        if (device->buffer.size() >= device->data_size)
-        {
-            *dataheader = ((device->data_type & 0xFF) << 24) | (device->data_size & 0xFFFFFF);
-            *buff = (byte *)malloc(device->data_size);
-            memcpy(*buff, device->buffer.data(), device->data_size);
-            device->buffer.erase(device->buffer.begin(), device->buffer.begin() + device->data_size);
-            device->data_type = 0;
-            device->data_size = 0;
-            return DEVICEERR_OK;
+        *dataheader = ((device->data_type & 0xFF) << 24) | (device->data_size & 0xFFFFFF);
+        *buff = (byte *)malloc(device->data_size);
+        if (*buff == NULL)
+        {
+            return DEVICEERR_MALLOCFAIL;
         }
+        memcpy(*buff, device->buffer.data() + device->read_pos, device->data_size);
+        device->read_pos += device->data_size;
+        device->data_type = 0;
+        device->data_size = 0;
     }
     return DEVICEERR_OK;
 }
@@ -356,7 +793,11 @@ DeviceError device_close_gopher64(CartDevice *cart)
 #else
     close(device->sockfd);
 #endif
-    free(device);
+    for (size_t i = 0; i < device->pending.size(); i++)
+    {
+        free(device->pending[i].second);
+    }
+    delete device;
     cart->structure = NULL;
     return DEVICEERR_OK;
 }
@@ -15,7 +15,7 @@
     bool        device_explicitcic_gopher64(byte* bootcode);
     DeviceError device_sendrom_gopher64(CartDevice* cart, byte* rom, uint32_t size);
     DeviceError device_testdebug_gopher64(CartDevice* cart);
-    DeviceError device_senddata_gopher64(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddatav_gopher64(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count);
     DeviceError device_receivedata_gopher64(CartDevice* cart, uint32_t* dataheader, byte** buff);
     DeviceError device_close_gopher64(CartDevice* cart);
 
@@ -674,22 +674,47 @@ DeviceError device_sendrom_sc64(CartDevice *cart, byte *rom, uint32_t size)
 }
 
 /*==============================
-    device_senddata_sc64
-    Sends data to the SC64
+    device_senddatav_sc64
+    Sends data to the SC64, streaming
+    it in blocks
     @param  A pointer to the cart context
     @param  The datatype that is being sent
-    @param  A buffer containing said data
-    @param  The size of the data
+    @param  The list of buffers and files to send
+    @param  The number of elements in the list
     @return The device error, or OK
 ==============================*/
 
-DeviceError device_senddata_sc64(CartDevice *cart, USBDataType datatype, byte *data, uint32_t size)
+DeviceError device_senddatav_sc64(CartDevice *cart, USBDataType datatype, DeviceIOVec *vec, uint32_t count)
 {
     DeviceError err;
     SC64Device *device = (SC64Device *)cart->structure;
+    uint32_t size = iovec_size(vec, count);
+    uint32_t bytes_done = 0;
+    byte *block;
+
+    // Allocate a buffer to stream the data through
+    block = (byte *)malloc(SENDDATA_CHUNKSIZE);
+    if (block == NULL)
+        return DEVICEERR_MALLOCFAIL;
 
+    // Send the command header, followed by the data in blocks
     device_setuploadprogress(0.0f);
-    err = device_execute_command_sc64(device, CMD_DEBUG_WRITE, datatype, size, data, size, NULL);
+    err = device_send_command_sc64(device, CMD_DEBUG_WRITE, datatype, size);
+    while (err == DEVICEERR_OK && bytes_done < size)
+    {
+        uint32_t bytes;
+        uint32_t bytes_do = SENDDATA_CHUNKSIZE;
+        if (size - bytes_done < bytes_do)
+            bytes_do = size - bytes_done;
+        err = iovec_read(vec, count, bytes_done, block, bytes_do);
+        if (err == DEVICEERR_OK && device_usb_write(device->handle, block, bytes_do, &bytes) != USB_OK)
+            err = DEVICEERR_WRITEFAIL;
+        else if (err == DEVICEERR_OK && bytes != bytes_do)
+            err = DEVICEERR_TXREPLYMISMATCH;
+        bytes_done += bytes_do;
+        device_setuploadprogress((((float)bytes_done)/((float)size))*100.0f);
+    }
+    free(block);
     if (err != DEVICEERR_OK)
         return err;
     device_setuploadprogress(100.0f);
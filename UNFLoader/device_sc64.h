@@ -15,7 +15,7 @@
     bool        device_explicitcic_sc64(byte* bootcode);
     DeviceError device_sendrom_sc64(CartDevice* cart, byte* rom, uint32_t size);
     DeviceError device_testdebug_sc64(CartDevice* cart);
-    DeviceError device_senddata_sc64(CartDevice* cart, USBDataType datatype, byte* data, uint32_t size);
+    DeviceError device_senddatav_sc64(CartDevice* cart, USBDataType datatype, DeviceIOVec* vec, uint32_t count);
     DeviceError device_receivedata_sc64(CartDevice* cart, uint32_t* dataheader, byte** buff);
     DeviceError device_close_sc64(CartDevice* cart);
 
@@ -9,6 +9,8 @@ Handles basic GDB communication
     #include <arpa/inet.h>
     #include <netinet/tcp.h>
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
     #include <signal.h>
 #endif
 #include "main.h"
@@ -23,6 +25,8 @@ Handles basic GDB communication
 #include <chrono>
 #include <string>
 #include <queue>
+#include <map>
+#include <mutex>
 
 
 /*********************************
@@ -32,9 +36,21 @@ Handles basic GDB communication
 #define TIMEOUT 3
 #define VERBOSE 0
 
+#define PACKET_SIZE  0x4000 // Largest packet (in bytes) we tell GDB it can send us
+#define RECEIVE_SIZE 0x1000 // Size (in bytes) of the buffer we read from the socket with
+#define POLL_TIMEOUT 500    // Time (in milliseconds) to wait for GDB before checking if we're still connected
+
+#define CACHE_PAGESIZE 256 // Size (in bytes) of the target memory pages kept in the cache
+#define REGISTER_SIZE  16  // Size (in hex characters) of a register in a 'g' reply
+
 #ifdef LINUX
     #define SOCKET          int
     #define INVALID_SOCKET  -1
+    #define SOCKET_POLL     poll
+    #define SOCKET_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+#else
+    #define SOCKET_POLL     WSAPoll
+    #define SOCKET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
 #endif
 
 
@@ -50,6 +66,27 @@ typedef enum {
 } ParseState;
 
 
+/*********************************
+            Structures
+*********************************/
+
+typedef struct {
+    char     type;      // The GDB packet whose reply we're waiting for, or '\0' if the reply isn't cacheable
+    char     fetchtype; // The packet that was actually sent to the console to fetch memory ('m' or 'x')
+    uint64_t addr;
+    uint32_t size;
+    uint64_t fetchaddr;
+    uint32_t fetchsize;
+} CacheRequest;
+
+
+/*********************************
+        Function Prototypes
+*********************************/
+
+static void gdb_sendpacket(std::string data, bool binary, bool cached);
+
+
 /*********************************
              Globals
 *********************************/
@@ -59,6 +96,16 @@ static std::string local_packetchecksum = "";
 static std::string local_lastreply = "";
 static ParseState  local_parserstate = STATE_SEARCHING;
 static SOCKET      local_socket = INVALID_SOCKET;
+static std::mutex  local_socket_lock;
+static bool        local_noack = false;
+
+// Target cache, only valid while the target is stopped
+static std::mutex   local_cache_lock;
+static CacheRequest local_cache_request = {'\0', '\0', 0, 0, 0, 0};
+static std::map<uint64_t, std::string> local_cache_pages;
+static std::string  local_cache_registers = "";        // The console's 'g' reply, as it was sent
+static std::string  local_cache_registersdecoded = ""; // The 'g' reply without run-length encoding, for 'p'
+static bool         local_cache_binarysupported = false;
 
 
 /*==============================
@@ -140,6 +187,14 @@ static int socket_connect(char* address, char* port)
     optval = 1;
     setsockopt(local_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&optval, sizeof(optval));
 
+    // Make the socket non-blocking, we'll poll it for events instead
+    #ifndef LINUX
+        u_long mode = 1;
+        ioctlsocket(local_socket, FIONBIO, &mode);
+    #else
+        fcntl(local_socket, F_SETFL, fcntl(local_socket, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+
     // Cleanup
     #ifndef LINUX
         closesocket(sock);
@@ -153,23 +208,38 @@ static int socket_connect(char* address, char* port)
 
 /*==============================
     socket_send
-    Sends data to a socket
+    Sends data to a socket, waiting for it to 
+    become writable if need be
     @param  The socket
     @param  The data 
     @param  The size of the data
     @return -1 if error, otherwise the number of bytes sent is returned
 ==============================*/
 
-static int socket_send(SOCKET sock, char* data, size_t size)
+static int socket_send(SOCKET sock, const char* data, size_t size)
 {
-    int ret = -1;
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT;
-    tv.tv_usec = 0;
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(tv)) < 0)
-        return -1;
-    ret = send(sock, data, size, 0);
-    return ret;
+    size_t sent = 0;
+    std::lock_guard<std::mutex> lock(local_socket_lock);
+    while (sent < size)
+    {
+        int ret = send(sock, data+sent, size-sent, 0);
+        if (ret < 0)
+        {
+            struct pollfd pfd;
+            if (!SOCKET_WOULDBLOCK())
+                return -1;
+
+            // The socket's send buffer is full, wait for it to drain
+            pfd.fd = sock;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            if (SOCKET_POLL(&pfd, 1, TIMEOUT*1000) <= 0)
+                return -1;
+            continue;
+        }
+        sent += ret;
+    }
+    return (int)sent;
 }
 
 
@@ -179,19 +249,13 @@ static int socket_send(SOCKET sock, char* data, size_t size)
     @param  The socket
     @param  A buffer to receive data from
     @param  The size of the buffer
-    @return -1 if error, otherwise the number of bytes received is returned
+    @return -1 if error, 0 if the socket was closed,
+            otherwise the number of bytes received is returned
 ==============================*/
 
 static int socket_receive(SOCKET sock, char* data, size_t size)
 {
-    int ret = -1;
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT;
-    tv.tv_usec = 0;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(tv)) < 0)
-        return -1;
-    ret = recv(sock, data, size, 0);
-    return ret;
+    return recv(sock, data, size, 0);
 }
 
 
@@ -212,6 +276,260 @@ static uint8_t packet_getchecksum(std::string packet)
 }
 
 
+/*==============================
+    packet_escape
+    Escapes binary data so that it can be
+    sent inside a GDB packet
+    @param  The binary data
+    @return The escaped data
+==============================*/
+
+static std::string packet_escape(std::string data)
+{
+    std::string escaped;
+    escaped.reserve(data.size() + data.size()/8);
+    for (uint32_t i=0; i<data.size(); i++)
+    {
+        char c = data[i];
+        if (c == '#' || c == '$' || c == '}' || c == '*')
+        {
+            escaped += '}';
+            c ^= 0x20;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+
+/*==============================
+    packet_unescape
+    Removes the escaping from the binary data
+    of an 'X' packet, in place
+    @param The packet string
+==============================*/
+
+static void packet_unescape(std::string& packet)
+{
+    size_t read, write;
+    size_t start = packet.find(':');
+    if (start == std::string::npos)
+        return;
+    write = start+1;
+    for (read=start+1; read<packet.size(); read++)
+    {
+        if (packet[read] == '}' && read+1 < packet.size())
+            packet[write++] = packet[++read] ^ 0x20;
+        else
+            packet[write++] = packet[read];
+    }
+    packet.resize(write);
+}
+
+
+/*==============================
+    packet_rledecode
+    Expands the run-length encoding in a reply
+    @param  The reply
+    @return The reply without run-length encoding
+==============================*/
+
+static std::string packet_rledecode(std::string data)
+{
+    std::string decoded;
+    decoded.reserve(data.size());
+    for (size_t i=0; i<data.size(); i++)
+    {
+        // A '*' repeats the previous character, as many times as the next character's value minus 29
+        if (data[i] == '*' && i+1 < data.size() && data[i+1] >= 29 && decoded.size() > 0)
+            decoded.append((size_t)(data[++i] - 29), decoded.back());
+        else
+            decoded += data[i];
+    }
+    return decoded;
+}
+
+
+/*==============================
+    packet_tohex
+    Converts binary data to a hex string
+    @param  The binary data
+    @return The hex string
+==============================*/
+
+static std::string packet_tohex(std::string data)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(data.size()*2);
+    for (uint32_t i=0; i<data.size(); i++)
+    {
+        hex += hexdigits[((uint8_t)data[i]) >> 4];
+        hex += hexdigits[((uint8_t)data[i]) & 0x0F];
+    }
+    return hex;
+}
+
+
+/*==============================
+    packet_fromhex
+    Converts a hex string to binary data
+    @param  The hex string
+    @return The binary data
+==============================*/
+
+static std::string packet_fromhex(std::string hex)
+{
+    std::string data;
+    data.reserve(hex.size()/2);
+    for (uint32_t i=0; i+1<hex.size(); i+=2)
+    {
+        char byte[3] = {hex[i], hex[i+1], '\0'};
+        data += (char)strtol(byte, NULL, 16);
+    }
+    return data;
+}
+
+
+/*==============================
+    cache_invalidate
+    Throws away everything we know about the
+    target's memory and registers. The cache
+    lock must be held by the caller.
+==============================*/
+
+static void cache_invalidate()
+{
+    local_cache_pages.clear();
+    local_cache_registers = "";
+    local_cache_registersdecoded = "";
+}
+
+
+/*==============================
+    cache_readmemory
+    Reads target memory from the cache. The cache
+    lock must be held by the caller.
+    @param  The address to read from
+    @param  The number of bytes to read
+    @param  The string to store the bytes in
+    @return Whether every page in the range was cached
+==============================*/
+
+static bool cache_readmemory(uint64_t addr, uint32_t size, std::string* out)
+{
+    out->clear();
+    while (out->size() < size)
+    {
+        uint64_t page = (addr + out->size()) & ~((uint64_t)CACHE_PAGESIZE-1);
+        uint32_t offset = (uint32_t)((addr + out->size()) - page);
+        uint32_t count = CACHE_PAGESIZE - offset;
+        std::map<uint64_t, std::string>::iterator it = local_cache_pages.find(page);
+        if (it == local_cache_pages.end())
+            return false;
+        if (count > size - out->size())
+            count = size - out->size();
+        out->append(it->second, offset, count);
+    }
+    return true;
+}
+
+
+/*==============================
+    cache_storememory
+    Stores page aligned target memory in the
+    cache. The cache lock must be held by the
+    caller.
+    @param The page aligned address of the data
+    @param The data to store
+==============================*/
+
+static void cache_storememory(uint64_t addr, std::string data)
+{
+    for (uint32_t i=0; i+CACHE_PAGESIZE<=data.size(); i+=CACHE_PAGESIZE)
+        local_cache_pages[addr+i] = data.substr(i, CACHE_PAGESIZE);
+}
+
+
+/*==============================
+    cache_handlepacket
+    Answers a GDB packet from the cache if possible.
+    Otherwise, it remembers what the reply is for so
+    gdb_reply can cache it, and packets which change
+    the target's state invalidate the cache.
+    Memory reads are widened to whole pages.
+    @param  The GDB packet, which may be rewritten
+    @return The reply if the packet was answered from
+            the cache, or an empty string if it must
+            be sent to the console
+==============================*/
+
+static std::string cache_handlepacket(std::string& packet)
+{
+    std::lock_guard<std::mutex> lock(local_cache_lock);
+    local_cache_request.type = '\0';
+    switch (packet[0])
+    {
+        case 'm':
+        case 'x':
+        {
+            std::string data;
+            char* end;
+            uint64_t addr = (uint32_t)strtoull(packet.c_str()+1, &end, 16); // The console only looks at the lower 32 bits
+            uint32_t size = (*end == ',') ? (uint32_t)strtoul(end+1, NULL, 16) : 0;
+            uint64_t fetchaddr = addr & ~((uint64_t)CACHE_PAGESIZE-1);
+            uint64_t fetchend = (addr + size + CACHE_PAGESIZE-1) & ~((uint64_t)CACHE_PAGESIZE-1);
+            char fetch[64];
+
+            // Can't cache zero sized reads, or reads which wrap around the address space
+            if (size == 0 || fetchend <= addr)
+                return "";
+
+            // Answer from the cache if we have all the pages
+            if (cache_readmemory(addr, size, &data))
+                return (packet[0] == 'm') ? packet_tohex(data) : "b" + data;
+
+            // Otherwise, fetch the whole pages from the console
+            local_cache_request.type = packet[0];
+            local_cache_request.fetchtype = local_cache_binarysupported ? 'x' : 'm';
+            local_cache_request.addr = addr;
+            local_cache_request.size = size;
+            local_cache_request.fetchaddr = fetchaddr;
+            local_cache_request.fetchsize = (uint32_t)(fetchend - fetchaddr);
+            sprintf(fetch, "%c%llx,%x", local_cache_request.fetchtype, (unsigned long long)fetchaddr, local_cache_request.fetchsize);
+            packet = fetch;
+            return "";
+        }
+        case 'g':
+            if (local_cache_registers.size() > 0)
+                return local_cache_registers;
+            local_cache_request.type = 'g';
+            return "";
+        case 'p':
+        {
+            // The console doesn't support 'p', but we can answer it from a cached 'g'
+            uint32_t reg = (uint32_t)strtoul(packet.c_str()+1, NULL, 16);
+            if ((reg+1)*REGISTER_SIZE <= local_cache_registersdecoded.size())
+                return local_cache_registersdecoded.substr(reg*REGISTER_SIZE, REGISTER_SIZE);
+            return "";
+        }
+        case 'q':
+            if (packet.compare(0, 10, "qSupported") == 0)
+                local_cache_request.type = 'q';
+            else if (packet.compare(0, 5, "qRcmd") == 0)
+                cache_invalidate();
+            return "";
+        case 'H':
+        case 'T':
+        case '?':
+            return "";
+        default: // Continuing, stepping, writing, breakpoints, etc...
+            cache_invalidate();
+            return "";
+    }
+}
+
+
 /*==============================
     gdb_connect
     Connects to GDB from a given address (IP:Port)
@@ -272,6 +590,12 @@ void gdb_disconnect()
         shutdown(local_socket, SHUT_RDWR);
     #endif
     local_socket = INVALID_SOCKET;
+
+    // The next session might be debugging a different target state
+    std::lock_guard<std::mutex> lock(local_cache_lock);
+    cache_invalidate();
+    local_cache_binarysupported = false;
+    local_noack = false;
 }
 
 
@@ -292,14 +616,21 @@ static void gdb_parsepacket(char* buff, int buffsize)
             case STATE_SEARCHING:
                 while (left > 0 && buff[read] != '$')
                 {
-                    if (buff[read] == '-') // Resend last packet in case of failure
-                        socket_send(local_socket, (char*)local_lastreply.c_str(), local_lastreply.size()+1);
+                    if (buff[read] == '-' && !local_noack) // Resend last packet in case of failure
+                    {
+                        std::lock_guard<std::mutex> lock(local_cache_lock);
+                        socket_send(local_socket, local_lastreply.c_str(), local_lastreply.size());
+                    }
                     if (buff[read] == '\x03') // CTRL+C from GDB
+                    {
+                        std::lock_guard<std::mutex> lock(local_cache_lock);
+                        cache_invalidate();
                         debug_send(DATATYPE_RDBPACKET, (char*)"\x03", 1+1);
+                    }
                     read++;
                     left--;
                 }
-                if (buff[read] == '$')
+                if (left > 0 && buff[read] == '$')
                     local_parserstate = STATE_HEADER;
                 break;
             case STATE_HEADER:
@@ -311,15 +642,17 @@ static void gdb_parsepacket(char* buff, int buffsize)
                 }
                 break;
             case STATE_PACKETDATA:
-                while (left > 0 && buff[read] != '#') // Read bytes until we hit a checksum marker, or we run out of bytes
-                {
-                    local_packetdata += buff[read];
-                    read++;
-                    left--;
-                }
-                if (buff[read] == '#')
+            {
+                // Read bytes until we hit a checksum marker, or we run out of bytes
+                char* marker = (char*)memchr(buff+read, '#', left);
+                int count = (marker != NULL) ? (int)(marker - (buff+read)) : left;
+                local_packetdata.append(buff+read, count);
+                read += count;
+                left -= count;
+                if (marker != NULL)
                     local_parserstate = STATE_CHECKSUM;
                 break;
+            }
             case STATE_CHECKSUM:
                 if (left > 0)
                 {
@@ -333,14 +666,38 @@ static void gdb_parsepacket(char* buff, int buffsize)
                             // Check if the checksum failed, if it didn't then send the packet
                             if (checksum == strtol(local_packetchecksum.c_str(), NULL, 16L))
                             {
-                                debug_send(DATATYPE_RDBPACKET, (char*)local_packetdata.c_str(), local_packetdata.size()+1);
+                                std::string cached;
+
+                                // Acknowledge the packet straight away, so GDB isn't left waiting on the console
+                                if (!local_noack)
+                                    socket_send(local_socket, "+", 1);
+
+                                // Binary memory writes are sent to the console unescaped
+                                if (local_packetdata[0] == 'X')
+                                    packet_unescape(local_packetdata);
+
+                                // No-ack mode is handled by us, the console doesn't need to know about it
+                                if (local_packetdata == "QStartNoAckMode")
+                                {
+                                    std::lock_guard<std::mutex> lock(local_cache_lock);
+                                    gdb_sendpacket("OK", false, false);
+                                    local_noack = true;
+                                }
+                                else if ((cached = cache_handlepacket(local_packetdata)).size() > 0)
+                                {
+                                    std::lock_guard<std::mutex> lock(local_cache_lock);
+                                    gdb_sendpacket(cached, cached[0] == 'b' && local_packetdata[0] == 'x', true);
+                                }
+                                else
+                                    debug_send(DATATYPE_RDBPACKET, (char*)local_packetdata.c_str(), local_packetdata.size()+1);
                             }
                             else
                             {
                                 #if VERBOSE
                                     log_simple("GDB Packet checksum failed. Expected %x, got %x\n", checksum, strtol(local_packetchecksum.c_str(), NULL, 16L));
                                 #endif
-                                socket_send(local_socket, (char*)"-", 2);
+                                if (!local_noack)
+                                    socket_send(local_socket, "-", 1);
                             }
 
                             // Finish
@@ -359,31 +716,118 @@ static void gdb_parsepacket(char* buff, int buffsize)
 
 
 /*==============================
-    gdb_reply
-    Sends data to GDB
-    @param The reply to send
+    gdb_sendpacket
+    Frames a reply and sends it to GDB
+    @param The reply data
+    @param Whether the reply is binary data which needs escaping
+    @param Whether the reply came from the cache
 ==============================*/
 
-void gdb_reply(char* reply)
+static void gdb_sendpacket(std::string data, bool binary, bool cached)
 {
-    if (!gdb_isconnected())
-        return;
-
     char chk[3];
-    std::string str = "+$";
+    std::string str = "$";
+
+    // Log the reply
+    if (binary)
+    {
+        #if VERBOSE
+            log_colored("Replying with %d bytes of binary data%s\n", CRDEF_INFO, (int)data.size()-1, cached ? " (cached)" : "");
+        #endif
+        data = packet_escape(data);
+    }
+    #if VERBOSE
+        else
+            log_colored("Replying with '%s'%s\n", CRDEF_INFO, data.c_str(), cached ? " (cached)" : "");
+    #endif
 
     // Build the reply packet
-    sprintf(chk, "%02x", packet_getchecksum(reply));
-    str += reply;
+    sprintf(chk, "%02x", packet_getchecksum(data));
+    str += data;
     str += "#";
     str += chk;
     local_lastreply = str;
 
-    // Send the packet to GDB and pop the message from our queue
+    // Send the packet to GDB
     #if VERBOSE
         log_simple("Sending to GDB: %s\n", str.c_str());
     #endif
-    socket_send(local_socket, (char*)str.c_str(), str.size()+1);
+    socket_send(local_socket, str.c_str(), str.size());
+}
+
+
+/*==============================
+    gdb_reply
+    Sends data from the console to GDB
+    @param The reply to send
+    @param The size of the reply
+==============================*/
+
+void gdb_reply(const char* reply, size_t size)
+{
+    if (!gdb_isconnected())
+        return;
+
+    std::string data = "";
+    std::lock_guard<std::mutex> lock(local_cache_lock);
+    CacheRequest request = local_cache_request;
+    local_cache_request.type = '\0';
+
+    // Replies to binary memory reads are raw data. Everything else is text, which the console sends as NUL terminated chunks
+    if ((request.type == 'm' || request.type == 'x') && request.fetchtype == 'x' && size > 0 && reply[0] == 'b')
+        data = std::string(reply, size);
+    else
+        for (size_t i=0; i<size; i++)
+            if (reply[i] != '\0')
+                data += reply[i];
+
+    // Cache the reply, if we were waiting on one
+    switch (request.type)
+    {
+        case 'm':
+        case 'x':
+        {
+            std::string memory;
+            if (request.fetchtype == 'x' && data.size() == request.fetchsize+1 && data[0] == 'b')
+                memory = data.substr(1);
+            else if (request.fetchtype == 'm' && data.size() == request.fetchsize*2)
+                memory = packet_fromhex(data);
+            else // Errors are passed through to GDB as is
+                break;
+
+            // Store the pages, and only give GDB the part it asked for
+            cache_storememory(request.fetchaddr, memory);
+            memory = memory.substr((size_t)(request.addr - request.fetchaddr), request.size);
+            if (request.type == 'm')
+                gdb_sendpacket(packet_tohex(memory), false, false);
+            else
+                gdb_sendpacket("b" + memory, true, false);
+            return;
+        }
+        case 'g':
+            if (data.size() > 0 && data[0] != 'E')
+            {
+                local_cache_registers = data;
+                local_cache_registersdecoded = packet_rledecode(data);
+            }
+            break;
+        case 'q':
+        {
+            char features[64];
+            local_cache_binarysupported = (data.find("binary-upload+") != std::string::npos);
+
+            // Append the features that we handle ourselves
+            sprintf(features, "%sPacketSize=%x;QStartNoAckMode+", (data.size() > 0) ? ";" : "", PACKET_SIZE);
+            data += features;
+            break;
+        }
+        default:
+            // A stop reply we weren't waiting on means the target was running
+            if (data.size() > 0 && (data[0] == 'T' || data[0] == 'S'))
+                cache_invalidate();
+            break;
+    }
+    gdb_sendpacket(data, false, false);
 }
 
 
@@ -406,20 +850,29 @@ void gdb_thread(char* addr)
     while (gdb_isconnected())
     {
         int readsize;
-        char buff[512];
-        memset(buff, 0, 512*sizeof(char));
+        char buff[RECEIVE_SIZE];
+        struct pollfd pfd;
+
+        // Wait for GDB to send us something
+        pfd.fd = local_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (SOCKET_POLL(&pfd, 1, POLL_TIMEOUT) <= 0)
+            continue;
 
         // Read packets from GDB
-        readsize = socket_receive(local_socket, buff, 512);
+        readsize = socket_receive(local_socket, buff, RECEIVE_SIZE);
         if (readsize > 0)
         {
             #if VERBOSE
-                log_simple("Received from GDB: %s\n", buff);
+                log_simple("Received from GDB: %.*s\n", readsize, buff);
             #endif
             gdb_parsepacket(buff, readsize);
         }
-
-        // Sleep for a bit
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        else if (readsize == 0 || !SOCKET_WOULDBLOCK())
+        {
+            log_simple("GDB disconnected\n");
+            gdb_disconnect();
+        }
     }
 }
\ No newline at end of file
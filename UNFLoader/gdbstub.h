@@ -3,7 +3,7 @@
 
     void gdb_thread(char* addr);
     void gdb_connect(char* fulladdr);
-    void gdb_reply(char* reply);
+    void gdb_reply(const char* reply, size_t size);
     bool gdb_isconnected();
     void gdb_disconnect();
 
@@ -3,6 +3,7 @@
 #include "term.h"
 #include "device.h"
 #include "debug.h"
+#include "daemon.h"
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +19,8 @@
 #endif
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
 
 
 /*********************************
@@ -39,6 +42,14 @@ const int   cic_strcount = sizeof(cic_strings)/sizeof(cic_strings[0]);
 const char* save_strings[] = {"EEPROM 4Kbit", "EEPROM 16Kbit", "SRAM 256Kbit", "FlashRAM 1Mbit", "SRAM 768Kbit", "FlashRAM 1Mbit (PokeStdm2)"}; // In order of the SaveType enums
 const int   save_strcount = sizeof(save_strings)/sizeof(save_strings[0]);
 
+// Progress worker
+static std::mutex              local_progress_lock;
+static std::condition_variable local_progress_cond;
+static const char* local_progress_msg = NULL;
+static bool        local_progress_active = false;
+static bool        local_progress_drawing = false;
+static bool        local_progress_started = false;
+
 
 /*==============================
     terminate
@@ -63,6 +74,9 @@ void terminate(const char* reason, ...)
     log_colored("\n", CRDEF_ERROR);
     va_end(args);
 
+    // Write whatever the reports are missing
+    debug_writereports();
+
     // Close output debug file if it exists
     if (debug_getdebugout() != NULL)
         debug_closedebugout();
@@ -71,6 +85,9 @@ void terminate(const char* reason, ...)
     if (device_isopen())
         device_close();
 
+    // Stop the daemon
+    daemon_stop();
+
     // Pause the program
     if (term_isusingcurses())
     {
@@ -126,86 +143,94 @@ void pauseprogram()
 
     // End
     global_terminating = true;
+    term_end();
     exit(-1);
 }
 
 
 /*==============================
     progressthread
-    Draws the upload progress bar
-    in a separate thread
-    @param The message to print next to the progress bar
+    Shows the upload progress in the terminal's
+    status line whenever an upload is active,
+    and handles cancelling it. Runs for the
+    lifetime of the program, see progress_begin.
 ==============================*/
 
-void progressthread(const char* msg)
+static void progressthread()
 {
-    int esclevel = get_escapelevel();
-    float lastprog = 0;
-
-    // Wait for the upload to finish
-    while(device_getuploadprogress() < 99.99f && !device_uploadcancelled())
+    std::unique_lock<std::mutex> lock(local_progress_lock);
+    while (!global_terminating)
     {
-        // If the device was closed, stop
-        if (!device_isopen())
-            return;
+        int esclevel;
 
-        // Draw the progress bar
-        if (device_getuploadprogress() != lastprog)
-        {
-            progressbar_draw(msg, CRDEF_INPUT, device_getuploadprogress() / 100.0f);
-            lastprog = device_getuploadprogress();
-        }
+        // Wait for an upload to start
+        local_progress_cond.wait(lock, []{return local_progress_active;});
+        local_progress_drawing = true;
+        term_showprogress(local_progress_msg, CRDEF_INPUT);
+        esclevel = get_escapelevel();
 
-        // Handle upload cancelling
-        if (get_escapelevel() < esclevel)
+        // Wait for the upload to finish. The terminal thread draws the progress by itself
+        while (local_progress_active && device_getuploadprogress() < 99.99f && !device_uploadcancelled())
         {
-            device_cancelupload();
-            break;
+            // If the device was closed, stop
+            if (!device_isopen())
+                break;
+
+            // Handle upload cancelling
+            if (get_escapelevel() < esclevel)
+            {
+                device_cancelupload();
+                break;
+            }
+
+            // Sleep for a bit to be kind to the CPU, but wake up as soon as the upload ends
+            local_progress_cond.wait_for(lock, std::chrono::milliseconds(100));
         }
 
-        // Sleep for a bit to be kind to the CPU
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // Let progress_end know we're done drawing
+        term_hideprogress();
+        local_progress_active = false;
+        local_progress_drawing = false;
+        local_progress_cond.notify_all();
     }
 }
 
 
 /*==============================
-    progressbar_draw
-    Draws a fancy progress bar
-    @param The text to print before the progress bar
-    @param The color to draw the progress bar with
-    @param The percentage of completion, from 0 to 1
+    progress_begin
+    Starts drawing the upload progress bar.
+    The drawing thread is only created once,
+    and is reused by every upload after.
+    @param The message to print next to the progress bar
 ==============================*/
 
-void progressbar_draw(const char* text, short color, float percent)
+void progress_begin(const char* msg)
 {
-    int i;
-    int prog_size = 16;
-    int blocks_done = (int)(percent*prog_size);
-
-    // Print the head of the progress bar
-    log_replace("%s [", color, text);
-
-    // Draw the progress bar itself
-    for(i=0; i<blocks_done; i++) 
-    {
-        #ifndef LINUX
-            log_colored(u8"\u2588", color);
-        #else
-            log_colored("\xe2\x96\x88", color);
-        #endif
-    }
-    for(; i<prog_size; i++) 
+    std::lock_guard<std::mutex> lock(local_progress_lock);
+    if (!local_progress_started)
     {
-        #ifndef LINUX
-            log_colored(u8"\u2591", color);
-        #else
-            log_colored("\xe2\x96\x91", color);
-        #endif
+        std::thread t = std::thread(progressthread);
+        t.detach();
+        local_progress_started = true;
     }
+    local_progress_msg = msg;
+    local_progress_active = true;
+    local_progress_cond.notify_all();
+}
+
 
-    // Print the butt of the progress bar
-    log_colored("] %.02f%%\n", color, percent*100.0f);
+/*==============================
+    progress_end
+    Stops drawing the upload progress bar, and
+    waits for the drawing thread to finish up
+==============================*/
+
+void progress_end()
+{
+    std::unique_lock<std::mutex> lock(local_progress_lock);
+    local_progress_active = false;
+    local_progress_cond.notify_all();
+    local_progress_cond.wait(lock, []{return !local_progress_drawing;});
 }
 
 
@@ -427,6 +452,14 @@ char* gen_filename(const char* filename, const char* fileext)
     sprintf(extraname, "%02d%02d%02d%02d%02d%02d%02d", 
                  (tmp->tm_year+1900)%100, tmp->tm_mon+1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec, increment%100);
 
+    // Keep the files from different emulator instances apart
+    if (global_instance > 0)
+    {
+        char temp[DATESIZE];
+        snprintf(temp, DATESIZE, "%d-%s", global_instance, extraname);
+        strcpy(extraname, temp);
+    }
+
     // Generate the final name
     if (debug_getbinaryout() != NULL)
     {
@@ -453,6 +486,30 @@ char* gen_filename(const char* filename, const char* fileext)
 }
 
 
+/*==============================
+    gen_instancepath
+    Gives an output path its own name in every
+    copy of the program that --emulators started,
+    by appending the copy's number to it
+    @param  The path given by the user
+    @return The path to use. It's the same path if
+            there's only one emulator, otherwise
+            it's kept until the program ends
+==============================*/
+
+char* gen_instancepath(char* path)
+{
+    char* instancepath;
+    if (global_instance == 0)
+        return path;
+    instancepath = (char*)malloc(snprintf(NULL, 0, "%s.%d", path, global_instance) + 1);
+    if (instancepath == NULL)
+        terminate("Unable to allocate memory for path '%s'.", path);
+    sprintf(instancepath, "%s.%d", path, global_instance);
+    return instancepath;
+}
+
+
 /*==============================
     trimwhitespace
     Removes the trailing whitespace from
@@ -578,6 +635,9 @@ void handle_deviceerror(DeviceError err)
         case DEVICEERR_UPLOADCANCELLED:
             log_replace("Upload cancelled by the user.\n", CRDEF_ERROR);
             return;
+        case DEVICEERR_DATATOOBIG:
+            log_colored("Data is too big for the console to receive.\n", CRDEF_ERROR);
+            return;
         case DEVICEERR_TIMEOUT:
             SHOULDIE("Flashcart timed out.");
             break;
@@ -13,11 +13,12 @@
     // Useful
     void     terminate(const char* reason, ...);
     void     pauseprogram();
-    void     progressthread(const char* msg);
-    void     progressbar_draw(const char* text, short color, float percent);
+    void     progress_begin(const char* msg);
+    void     progress_end();
     uint64_t time_miliseconds();
     time_t   file_lastmodtime(const char* path);
     char*    gen_filename(const char* filename, const char* fileext);
+    char*    gen_instancepath(char* path);
     char*    trimwhitespace(char* str);
     void     handle_deviceerror(DeviceError err);
     
@@ -10,10 +10,16 @@ UNFLoader Entrypoint
 #include "device.h"
 #include "debug.h"
 #include "gdbstub.h"
+#include "daemon.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifdef LINUX
+    #include <sys/wait.h>
+#endif
 #include <list>
+#include <vector>
+#include <string>
 #include <iterator>
 #include <thread>
 #include <chrono>
@@ -38,6 +44,7 @@ UNFLoader Entrypoint
 static void parse_args_priority(std::list<char*>* args);
 static void parse_args(std::list<char*>* args);
 static void program_loop();
+static void fanout_emulators();
 static void autodetect_romheader();
 static void show_title();
 static void show_args();
@@ -54,6 +61,7 @@ FILE* global_debugoutptr = NULL;
 bool  global_badpackets = true;
 char* global_gdbaddr = (char*)"";
 std::atomic<bool> global_terminating (false);
+int   global_instance = 0;
 
 // Local globals
 static bool              local_autodetect = true;
@@ -63,6 +71,9 @@ static int               local_timeout = -1;
 static std::list<char*>  local_args;
 static std::atomic<int>  local_esclevel (0);
 static std::atomic<bool> local_reupload (false);
+static std::atomic<bool> local_newrom (false);
+static const char*       local_daemonpath = NULL;
+static std::vector<char*> local_emulators;
 
 
 /*==============================
@@ -81,8 +92,14 @@ int main(int argc, char* argv[])
     // Parse priority arguments
     parse_args_priority(&local_args);
 
+    // Give each emulator its own copy of the program
+    if (local_emulators.size() > 1)
+        fanout_emulators();
+
     // Initialize the program
     device_initialize();
+    if (!local_emulators.empty())
+        device_setcart(CART_GOPHER64);
     term_initialize();
     term_allowinput(false);
     show_title();
@@ -140,6 +157,31 @@ static void parse_args_priority(std::list<char*>* args)
 {
     std::list<char*>::iterator it;
 
+    // Client invocations hand the rest of the arguments to the daemon, without touching the flashcart or the terminal
+    for (it = args->begin(); it != args->end(); ++it)
+    {
+        char* command = (*it);
+        if (!strcmp(command, "--client") || !strncmp(command, "--client=", 9))
+        {
+            const char* path = (command[8] == '=') ? command+9 : DEFAULT_DAEMONPATH;
+            args->erase(it);
+            exit(daemon_client(path, args));
+        }
+    }
+
+    // Check if we should run as a daemon
+    for (it = args->begin(); it != args->end(); ++it)
+    {
+        char* command = (*it);
+        if (!strcmp(command, "--daemon") || !strncmp(command, "--daemon=", 9))
+        {
+            local_daemonpath = (command[8] == '=') ? command+9 : DEFAULT_DAEMONPATH;
+            local_debugmode = true;
+            args->erase(it);
+            break;
+        }
+    }
+
     // Check if curses should be disabled
     for (it = args->begin(); it != args->end(); ++it)
     {
@@ -152,6 +194,41 @@ static void parse_args_priority(std::list<char*>* args)
         }
     }
 
+    // Check the output format
+    for (it = args->begin(); it != args->end(); ++it)
+    {
+        char* command = (*it);
+        if (!strncmp(command, "--output=", 9))
+        {
+            if (!strcmp(command+9, "jsonl"))
+                term_usejsonl(true);
+            else if (strcmp(command+9, "text"))
+                terminate("Unknown output format '%s'.", command+9);
+            args->erase(it);
+            break;
+        }
+    }
+
+    // Check for emulator addresses. Several addresses means the ROM goes to all of them
+    for (it = args->begin(); it != args->end(); ++it)
+    {
+        char* command = (*it);
+        if (!strncmp(command, "--gopher64=", 11))
+        {
+            for (char* addr = strtok(command+11, ","); addr != NULL; addr = strtok(NULL, ","))
+                local_emulators.push_back(addr);
+            if (local_emulators.empty())
+                terminate("Missing parameter(s) for command '--gopher64'.");
+            if (local_emulators.size() > 1 && local_daemonpath != NULL)
+                terminate("Daemon mode can only use one emulator.");
+            if (local_emulators.size() > 1)
+                term_usecurses(false);
+            device_setemulatoraddress(local_emulators[0]);
+            args->erase(it);
+            break;
+        }
+    }
+
     // Check for the forced terminal size
     if (term_isusingcurses())
     {
@@ -235,6 +312,76 @@ static void parse_args(std::list<char*>* args)
                 terminate("Unknown command '%s'", command);
         }
 
+        // Handle the long commands
+        if (!strcmp(command, "--sharedrom"))
+        {
+            device_setsharedrom(true);
+            continue;
+        }
+        if (!strcmp(command, "--patch"))
+        {
+            uint32_t address;
+            char* end;
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            address = strtoul(*it, &end, 0);
+            if (*end != '\0')
+                terminate("'%s' is not an address.", *it);
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            local_debugmode = true;
+            debug_addpatch(address, *it);
+            continue;
+        }
+        if (!strcmp(command, "--profile"))
+        {
+            char* elfpath;
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            elfpath = *it;
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            local_debugmode = true;
+            debug_setprofile(elfpath, *it);
+            continue;
+        }
+        if (!strcmp(command, "--heap"))
+        {
+            char* elfpath;
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            elfpath = *it;
+            if (!nextarg_isvalid(it, args))
+                terminate("Missing parameter(s) for command '%s'.", command);
+            local_debugmode = true;
+            debug_setheap(elfpath, *it);
+            continue;
+        }
+        if (!strncmp(command, "--fs=", 5) && command[5] != '\0')
+        {
+            local_debugmode = true;
+            debug_setfsroot(command + 5);
+            continue;
+        }
+        if (!strncmp(command, "--trace=", 8) && command[8] != '\0')
+        {
+            local_debugmode = true;
+            debug_settrace(command + 8);
+            continue;
+        }
+        if (!strncmp(command, "--core=", 7) && command[7] != '\0')
+        {
+            local_debugmode = true;
+            debug_setcore(command + 7);
+            continue;
+        }
+        if (!strncmp(command, "--stream=", 9) && command[9] != '\0')
+        {
+            local_debugmode = true;
+            debug_setstream(command + 9);
+            continue;
+        }
+
         // Handle the rest of the commands
         switch(command[1])
         {
@@ -283,6 +430,7 @@ static void parse_args(std::list<char*>* args)
                 local_debugmode = true;
                 if (nextarg_isvalid(it, args))
                 {
+                    *it = gen_instancepath(*it); // Each emulator instance gets its own file
                     debug_setdebugout(*it);
                     log_simple("Debug logging to file '%s'\n", *it);
                 }
@@ -393,6 +541,71 @@ static void show_title()
 }
 
 
+/*==============================
+    fanout_emulators
+    Starts a copy of the program for each emulator
+    address, which deploys the ROM and captures the
+    output of its own emulator. The output of each
+    copy is written to gopher64-<n>.log. Only
+    returns in the copies.
+==============================*/
+
+static void fanout_emulators()
+{
+    #ifndef LINUX
+        terminate("Using several emulators at once is not supported on Windows.");
+    #else
+        std::vector<pid_t> children;
+        int failed = 0;
+
+        for (size_t i=0; i<local_emulators.size(); i++)
+        {
+            char logname[32];
+            pid_t pid;
+            snprintf(logname, sizeof(logname), "gopher64-%d.log", (int)i+1);
+            fflush(stdout);
+            pid = fork();
+            if (pid < 0)
+                terminate("Unable to start a copy of the program for emulator '%s'.", local_emulators[i]);
+
+            // The copy carries on like a normal UNFLoader, but with one emulator, and without a terminal
+            if (pid == 0)
+            {
+                if (freopen(logname, "w", stdout) == NULL || freopen("/dev/null", "r", stdin) == NULL)
+                    exit(EXIT_FAILURE);
+                setvbuf(stdout, NULL, _IOLBF, 0);
+                global_instance = (int)i+1;
+                device_setemulatoraddress(local_emulators[i]);
+                local_emulators.resize(1);
+                return;
+            }
+            children.push_back(pid);
+        }
+
+        // Wait for all the copies to finish
+        term_initialize();
+        term_allowinput(false);
+        for (size_t i=0; i<children.size(); i++)
+            log_simple("Emulator %d (%s) logging to 'gopher64-%d.log'.\n", (int)i+1, local_emulators[i], (int)i+1);
+        for (size_t i=0; i<children.size(); i++)
+        {
+            int status = 0;
+            waitpid(children[i], &status, 0);
+            if (WIFEXITED(status))
+                log_simple("Emulator %d (%s) finished with exit code %d.\n", (int)i+1, local_emulators[i], WEXITSTATUS(status));
+            else
+            {
+                log_colored("Emulator %d (%s) was stopped by signal %d.\n", CRDEF_ERROR, (int)i+1, local_emulators[i], WTERMSIG(status));
+                failed++;
+            }
+        }
+        global_terminating = true;
+        term_end();
+        exit(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    #endif
+}
+
+
 /*==============================
     program_loop
     The main UNFLoader program 
@@ -442,6 +655,10 @@ static void program_loop()
     if (local_debugmode)
         handle_deviceerror(device_testdebug());
 
+    // Start listening for clients
+    if (local_daemonpath != NULL)
+        daemon_start(local_daemonpath);
+
     // If listen or debug mode is enabled, increment escape level so that
     // The user must press esc to exit
     if (local_listenmode || local_debugmode)
@@ -469,6 +686,15 @@ static void program_loop()
             uint32_t filesize = 0; // I could use stat, but it doesn't work in WinXP (more info below)
             local_reupload = false;
 
+            // If a daemon client gave us a new ROM, check its CIC and save type like we did with the first one
+            if (local_newrom)
+            {
+                local_newrom = false;
+                if (device_explicitcic())
+                    log_simple("CIC set automatically to '%s'.\n", cic_typetostr(device_getcic()));
+                autodetect_romheader();
+            }
+
             // Try multiple times to open the file, because sometimes does not work the first time in Listen mode
             for (int i=0; i<5; i++) 
             {
@@ -498,13 +724,12 @@ static void program_loop()
             // Upload the ROM
             increment_escapelevel();
             uploadtime = time_miliseconds();
-            if (term_isusingcurses()) // If curses is being used, spawn a thread to draw a progress bar
+            if (term_isusingcurses()) // If curses is being used, draw a progress bar
             {
-                std::thread t;
                 log_colored("Uploading ROM (ESC to cancel)\n", CRDEF_INPUT);
-                t = std::thread(progressthread, "Uploading ROM (ESC to cancel)");
+                progress_begin("Uploading ROM (ESC to cancel)");
                 handle_deviceerror(device_sendrom(fp, filesize));
-                t.join();
+                progress_end();
             }
             else
             {
@@ -524,6 +749,8 @@ static void program_loop()
             // Update variables and close the file
             lastmodtime = newmodtime;
             fclose(fp);
+            if (daemon_isrunning())
+                daemon_uploaded(!device_uploadcancelled());
         }
 
         // If this was the first run through the loop, initialize some stuff
@@ -560,6 +787,10 @@ static void program_loop()
             firstupload = false;
         }
 
+        // Handle daemon clients
+        if (daemon_isrunning())
+            daemon_poll();
+
         // Handle debug mode
         debug_main();
 
@@ -597,6 +828,10 @@ void program_event(ProgEvent key)
         case PEV_REUPLOAD:
             local_reupload = true;
             break;
+        case PEV_NEWROM:
+            local_newrom = true;
+            local_reupload = true;
+            break;
     }
 }
 
@@ -750,6 +985,21 @@ static void show_args()
     log_simple("  -m\t\t\t   Always show duplicate prints in debug mode.\n");
     log_simple("  -p\t\t\t   Do not terminate on bad USB packets.\n");
     log_simple("  -b\t\t\t   Disable ncurses.\n");
+    log_simple("  --output=jsonl\t   Write the output as one JSON object per line (disables ncurses).\n");
+    log_simple("  --gopher64=<addr>[,...]   Use Gopher64 at host:port (default: %s).\n", DEFAULT_EMULATORADDR);
+    log_simple(            "\t\t\t   Several addresses deploy to all of them at once.\n");
+    log_simple("  --sharedrom\t\t   Hand ROMs to Gopher64 through shared memory (Linux and macOS).\n");
+    log_simple("  --stream=<file>\t   Stream a file into the ROM's stream ring (implies -d).\n");
+    log_simple("  --patch <addr> <file>\t   Write a file into RDRAM, and again when it changes (implies -d).\n");
+    log_simple("  --fs=<directory>\t   Serve the files in a folder to debug_fs_read (implies -d).\n");
+    log_simple("  --profile <elf> <file>   Write the ROM's profiler samples as folded stacks (implies -d).\n");
+    log_simple("  --trace=<file>\t   Write the ROM's zones as a Chrome trace (implies -d).\n");
+    log_simple("  --heap <elf> <file>\t   Write a report of the ROM's heap (implies -d).\n");
+    log_simple("  --core=<file>\t\t   Write the ROM's crash dumps as an ELF core file (implies -d).\n");
+    log_simple("  --daemon[=socket]\t   Keep the flashcart open and take requests from clients.\n");
+    log_simple("  --client[=socket] ...\t   Make requests to a daemon (default socket: %s):\n", DEFAULT_DAEMONPATH);
+    log_simple(            "\t\t\t   -r <file> to upload a ROM, --send <text> to send a command,\n");
+    log_simple(            "\t\t\t   -d to print the debug output, --stop to stop the daemon.\n");
 }
 
 
@@ -34,7 +34,8 @@
     
     typedef enum {
         PEV_ESCAPE,
-        PEV_REUPLOAD
+        PEV_REUPLOAD,
+        PEV_NEWROM
     } ProgEvent;
 
 
@@ -46,6 +47,7 @@
     extern bool    global_badpackets;
     extern char*   global_gdbaddr;
     extern std::atomic<bool> global_terminating;
+    extern int     global_instance;
 
 
     /*********************************
@@ -8,6 +8,7 @@ Handles terminal I/O, both with and without curses.
 #include "helper.h"
 #include "term.h"
 #include "debug.h"
+#include "daemon.h"
 #ifndef LINUX
     #include "Include/curses.h"
     #include "Include/curspriv.h"
@@ -27,6 +28,9 @@ Handles terminal I/O, both with and without curses.
 #include <list>
 #include <iterator>
 #include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
 
 
 /*********************************
@@ -35,6 +39,10 @@ Handles terminal I/O, both with and without curses.
 
 #define BLINKRATE   500
 #define MAXINPUT    256
+#define FRAMETIME   33  // Minimum time (in milliseconds) between redraws of the output window
+#define TABWIDTH    8
+#define STATUSBAR   16  // Number of blocks in the status line's progress bar
+#define JSONL_MAXBUFFER (16*1024*1024) // Max size (in bytes) of JSONL output waiting to be written, before records are dropped
 
 #define CH_ESCAPE    27
 #define CH_ENTER     '\n'
@@ -52,6 +60,12 @@ typedef struct {
     bool    stack;
 } Output;
 
+typedef struct {
+    std::string text;   // The characters in the line
+    std::string colors; // The color of each character in text
+    int         cols;   // How many columns the line takes up on the screen
+} OutputLine;
+
 
 /*********************************
         Function Prototypes
@@ -60,15 +74,25 @@ typedef struct {
 #define ctrl(a) (a & 0x1F)
 
 static void push_mesg(Output* mesg);
-static Output* pop_mesg();
+static void pop_mesgs(std::queue<Output*>* out);
+
+static OutputLine* scrollback_line(uint32_t index);
+static void scrollback_truncate(OutputLine* line, int cols);
+static void scrollback_newline();
+static void scrollback_moveup(int32_t count);
+static void scrollback_write(const char* str, short color);
 
 static void termthread();
 static void termthread_simple();
 static void handle_input();
 static void scroll_output(int value);
+static int  output_rows();
 static void refresh_output();
+static void refresh_status();
 static void refresh_input();
 static void term_clearinput();
+static void jsonlthread();
+static void push_jsonl(const std::string& record);
 #ifdef LINUX
     static void handle_resize(int sig);
 #endif
@@ -81,6 +105,7 @@ static void term_clearinput();
 // Thread globals
 static std::thread thread_input;
 static std::thread thread_terminate;
+static std::thread thread_jsonl;
 
 // NCurses globals
 bool    local_usecurses     = true;
@@ -88,15 +113,29 @@ WINDOW* local_terminal      = NULL;
 WINDOW* local_inputwin      = NULL;
 WINDOW* local_outputwin     = NULL;
 WINDOW* local_scrolltextwin = NULL;
+WINDOW* local_statuswin     = NULL;
 int     local_termwforced   = -1;
 int     local_termhforced   = -1;
 static std::atomic<bool> local_resizesignal (false);
 static std::atomic<bool> local_keypressed (false);
 
 // Output window globals
-static std::atomic<int> local_padbottom (-1);
 static std::atomic<int> local_scrolly (0);
+static std::vector<OutputLine> local_scrollback; // Ring buffer with the lines of the output window
+static uint32_t local_scrollback_start = 0;     // Index of the oldest line in the ring
+static uint32_t local_scrollback_count = 0;     // Number of lines in the ring
+static uint32_t local_cursorline = 0;           // The line being written to, counting from the oldest
+static uint64_t local_lastframe = 0;
 static std::mutex local_mesgqueue_lock;
+
+// Status line globals
+static std::mutex  local_status_lock;
+static const char* local_status_text = NULL; // The text shown in the status line, or NULL if it's hidden
+static short       local_status_color = CR_NONE;
+static uint64_t    local_status_starttime = 0;
+static uint64_t    local_status_startbytes = 0;
+static float       local_status_startprog = 0;
+static bool        local_status_shown = false;
 static std::queue<Output*> local_mesgqueue;
 static uint32_t local_historysize = DEFAULT_HISTORYSIZE;
 static char* local_laststackable = NULL;
@@ -116,6 +155,15 @@ static int      local_inputpadleft = 0;
 static std::list<char*> local_inputhistory;
 static std::list<char*>::iterator local_currhistory;
 
+// JSONL output globals
+static bool        local_usejsonl = false;
+static std::mutex  local_jsonl_lock;
+static std::condition_variable local_jsonl_cond;
+static std::string local_jsonl_buffer;   // Records waiting for the writer thread
+static uint32_t    local_jsonl_dropped = 0;
+static bool        local_jsonl_stop = false;
+static std::chrono::steady_clock::time_point local_jsonl_start = std::chrono::steady_clock::now();
+
 
 /*==============================
     term_initialize
@@ -158,11 +206,15 @@ void term_initialize()
             sigaction(SIGWINCH, &sa, NULL);
         #endif
 
-        // Setup our console windows
-        local_outputwin = newpad(h+local_historysize, w);
+        // Setup the scrollback, which holds a screen's worth of lines on top of the history
+        local_scrollback.resize(h+local_historysize);
+        local_scrollback_start = 0;
+        local_scrollback_count = 1;
+        local_cursorline = 0;
+
+        // Setup our console windows. The output window only holds what's on screen, as it's redrawn from the scrollback
+        local_outputwin = newpad(h, w);
         local_inputwin = newpad(1, MAXINPUT);
-        scrollok(local_outputwin, TRUE);
-        idlok(local_outputwin, TRUE);
         keypad(local_inputwin, TRUE);
         wtimeout(local_inputwin, 0);
         #ifdef LINUX
@@ -192,6 +244,10 @@ void term_initialize()
         thread_input = std::thread(termthread_simple);
         thread_input.detach();
     }
+
+    // Writing JSONL to stdout is left to its own thread, so that a slow reader doesn't hold up the USB
+    if (local_usejsonl)
+        thread_jsonl = std::thread(jsonlthread);
 }
 
 
@@ -214,6 +270,17 @@ void term_end()
         curs_set(TRUE);
         endwin();
     }
+
+    // Write out whatever JSONL is left
+    if (thread_jsonl.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(local_jsonl_lock);
+            local_jsonl_stop = true;
+        }
+        local_jsonl_cond.notify_one();
+        thread_jsonl.join();
+    }
 }
 
 
@@ -231,23 +298,149 @@ static void push_mesg(Output* mesg)
 
 
 /*==============================
-    pop_mesg
-    Returns the next terminal message, or null if there is none
-    @return Pointer to next terminal message
+    pop_mesgs
+    Takes all the queued terminal messages at once
+    @param Pointer to an empty queue to move the messages to
 ==============================*/
 
-static Output* pop_mesg()
+static void pop_mesgs(std::queue<Output*>* out)
 {
     std::lock_guard<std::mutex> lock(local_mesgqueue_lock);
+    std::swap(*out, local_mesgqueue);
+}
+
 
-    if (local_mesgqueue.empty())
+/*==============================
+    scrollback_line
+    Returns a line from the scrollback
+    @param  The index of the line, counting from the oldest
+    @return Pointer to the line
+==============================*/
+
+static OutputLine* scrollback_line(uint32_t index)
+{
+    return &local_scrollback[(local_scrollback_start + index) % local_scrollback.size()];
+}
+
+
+/*==============================
+    scrollback_truncate
+    Removes everything in a line past a given column
+    @param Pointer to the line
+    @param The number of columns to keep
+==============================*/
+
+static void scrollback_truncate(OutputLine* line, int cols)
+{
+    size_t i = 0;
+    int found = 0;
+
+    // Find where the column starts, skipping over the rest of UTF-8 characters
+    for (; i<line->text.size(); i++)
     {
-        return nullptr;
+        if ((line->text[i] & 0xC0) == 0x80)
+            continue;
+        if (found == cols)
+            break;
+        found++;
     }
+    line->text.resize(i);
+    line->colors.resize(i);
+    line->cols = found;
+}
 
-    Output* mesg = local_mesgqueue.front();
-    local_mesgqueue.pop();
-    return mesg;
+
+/*==============================
+    scrollback_newline
+    Moves the cursor to the start of the next line,
+    reusing the oldest line if the scrollback is full
+==============================*/
+
+static void scrollback_newline()
+{
+    if (local_cursorline + 1 < local_scrollback_count)
+        local_cursorline++;
+    else
+    {
+        if (local_scrollback_count < local_scrollback.size())
+            local_scrollback_count++;
+        else
+            local_scrollback_start = (local_scrollback_start + 1) % local_scrollback.size();
+        local_cursorline = local_scrollback_count - 1;
+
+        // Keep the view still if the user scrolled up
+        if (local_scrolly != 0)
+            local_scrolly++;
+    }
+    scrollback_truncate(scrollback_line(local_cursorline), 0);
+}
+
+
+/*==============================
+    scrollback_moveup
+    Moves the cursor up, so that the lines can be
+    replaced. Whatever was after the cursor's column
+    is removed.
+    @param The number of lines to move up by
+==============================*/
+
+static void scrollback_moveup(int32_t count)
+{
+    int cols = scrollback_line(local_cursorline)->cols;
+    if ((uint32_t)count > local_cursorline)
+        local_cursorline = 0;
+    else
+        local_cursorline -= count;
+    scrollback_truncate(scrollback_line(local_cursorline), cols);
+}
+
+
+/*==============================
+    scrollback_write
+    Writes a string to the scrollback, wrapping
+    it at the edge of the screen like curses would
+    @param The string to write
+    @param The color to use
+==============================*/
+
+static void scrollback_write(const char* str, short color)
+{
+    int w = getmaxx(local_terminal);
+
+    for (const char* c = str; *c != '\0'; c++)
+    {
+        OutputLine* line = scrollback_line(local_cursorline);
+        bool continuation = ((*c & 0xC0) == 0x80);
+
+        // Handle control characters
+        if (*c == '\n')
+        {
+            scrollback_newline();
+            continue;
+        }
+        if (*c == '\t')
+        {
+            do
+                scrollback_write(" ", color);
+            while (scrollback_line(local_cursorline)->cols % TABWIDTH != 0);
+            continue;
+        }
+        if ((unsigned char)*c < 0x20)
+            continue;
+
+        // Wrap the line if it's reached the edge of the screen
+        if (!continuation && line->cols >= w)
+        {
+            scrollback_newline();
+            line = scrollback_line(local_cursorline);
+        }
+
+        // Store the character
+        line->text.push_back(*c);
+        line->colors.push_back((char)color);
+        if (!continuation)
+            line->cols++;
+    }
 }
 
 
@@ -258,20 +451,21 @@ static Output* pop_mesg()
 
 static void termthread()
 {
+    bool wroteout = false;
+
     while (!global_terminating)
     {
-        bool wroteout = false;
+        std::queue<Output*> pending;
 
         // If a resize message was received, clear the screen to redraw it all again
         if (local_resizesignal)
             refresh();
 
-        // Output stuff
-        for (Output* msg = pop_mesg(); msg != nullptr; msg = pop_mesg())
+        // Output stuff. Every pending message is written to the scrollback first, so that they're all drawn at once
+        pop_mesgs(&pending);
+        for (; !pending.empty(); pending.pop())
         {
-            // Disable all the colors
-            for (int i=0; i<TOTAL_COLORS; i++)
-                wattroff(local_outputwin, COLOR_PAIR(i+1));
+            Output* msg = pending.front();
 
             // Handle message stacking
             if (local_allowstack && msg->stack)
@@ -312,21 +506,12 @@ static void termthread()
                 local_stackcount = 0;
             }
 
-            // If a color is specified, use it
-            if (msg->col != CR_NONE)
-                wattron(local_outputwin, COLOR_PAIR(msg->col));
-
             // If a y offset is given, then perform a replacement
             if (msg->y != 0)
-            {
-                int y, x;
-                getyx(local_outputwin, y, x);
-                wmove(local_outputwin, y-msg->y, x);
-                refresh_output();
-            }
+                scrollback_moveup(msg->y);
 
             // Print the string and its args
-            wprintw(local_outputwin, "%s", msg->str);
+            scrollback_write(msg->str, msg->col);
             wroteout = true;
 
             // Cleanup
@@ -334,9 +519,13 @@ static void termthread()
             free(msg);
         }
 
-        // Refresh if needed
-        if (wroteout || local_resizesignal)
+        // Redraw if needed, but not more often than the frame time
+        if ((wroteout && time_miliseconds() - local_lastframe >= FRAMETIME) || local_resizesignal)
+        {
             refresh_output();
+            wroteout = false;
+        }
+        refresh_status();
 
         // Deal with input
         handle_input();
@@ -368,7 +557,18 @@ void __log_output(const short color, const int32_t y, const bool allowstack, con
     va_start(args, str);
 
     // Perform the print
-    if (local_terminal != NULL)
+    if (local_usejsonl)
+    {
+        static const char* levels[] = {"program", "error", "input", "print", "info", "special"};
+        std::string text;
+        text.resize(vsnprintf(NULL, 0, str, args) + 1);
+        va_end(args);
+        va_start(args, str);
+        vsnprintf(&text[0], text.size(), str, args);
+        text.pop_back();
+        log_jsonl("log", "\"level\":\"%s\",\"text\":%s", levels[(color >= 0 && color <= TOTAL_COLORS) ? color : 0], term_jsonstring(text.data(), text.size()).c_str());
+    }
+    else if (local_terminal != NULL)
     {
         Output* mesg = (Output*)malloc(sizeof(Output));
         if (mesg == NULL)
@@ -399,6 +599,176 @@ void __log_output(const short color, const int32_t y, const bool allowstack, con
         vfprintf(debug_getdebugout(), str, args);
         va_end(args);
     }
+
+    // Pass it on to the daemon's clients (JSONL records are passed on when they're queued)
+    if (daemon_isrunning() && !local_usejsonl)
+    {
+        std::string text;
+        va_start(args, str);
+        text.resize(vsnprintf(NULL, 0, str, args) + 1);
+        va_end(args);
+        va_start(args, str);
+        vsnprintf(&text[0], text.size(), str, args);
+        va_end(args);
+        daemon_output(text.data(), text.size()-1);
+    }
+}
+
+
+/*==============================
+    __log_jsonl
+    Queues a JSONL record for the writer
+    thread. Every record gets a monotonic
+    timestamp (in microseconds since the
+    program started) and a type
+    @param The type of the record
+    @param The record's other fields, already
+           in JSON, or NULL
+    @param Variable arguments for the fields
+==============================*/
+
+void __log_jsonl(const char* type, const char* fields, ...)
+{
+    char header[64];
+    std::string record;
+    long long elapsed = (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - local_jsonl_start).count();
+
+    // Build the record
+    snprintf(header, sizeof(header), "{\"time_us\":%lld,\"type\":", elapsed);
+    record = header;
+    record += term_jsonstring(type, strlen(type));
+    if (fields != NULL)
+    {
+        va_list args;
+        std::string temp;
+        va_start(args, fields);
+        temp.resize(vsnprintf(NULL, 0, fields, args) + 1);
+        va_end(args);
+        va_start(args, fields);
+        vsnprintf(&temp[0], temp.size(), fields, args);
+        va_end(args);
+        temp.pop_back();
+        record += ",";
+        record += temp;
+    }
+    record += "}\n";
+    push_jsonl(record);
+}
+
+
+/*==============================
+    push_jsonl
+    Hands a finished record to the writer
+    thread. If stdout has fallen too far
+    behind, the record is dropped instead,
+    and the writer is told how many were
+    lost once it catches up
+    @param The record to write
+==============================*/
+
+static void push_jsonl(const std::string& record)
+{
+    {
+        std::lock_guard<std::mutex> lock(local_jsonl_lock);
+        if (local_jsonl_buffer.size() + record.size() > JSONL_MAXBUFFER)
+        {
+            local_jsonl_dropped++;
+            return;
+        }
+        if (local_jsonl_dropped > 0)
+        {
+            char dropped[64];
+            snprintf(dropped, sizeof(dropped), "{\"type\":\"dropped\",\"count\":%u}\n", local_jsonl_dropped);
+            local_jsonl_buffer += dropped;
+            local_jsonl_dropped = 0;
+        }
+        local_jsonl_buffer += record;
+    }
+    local_jsonl_cond.notify_one();
+    if (daemon_isrunning())
+        daemon_output(record.data(), record.size());
+}
+
+
+/*==============================
+    jsonlthread
+    Writes queued JSONL records to stdout
+==============================*/
+
+static void jsonlthread()
+{
+    std::string out;
+    while (true)
+    {
+        // Take everything that's queued in one go, so the lock isn't held while writing
+        {
+            std::unique_lock<std::mutex> lock(local_jsonl_lock);
+            local_jsonl_cond.wait(lock, []{return !local_jsonl_buffer.empty() || local_jsonl_stop;});
+            if (local_jsonl_buffer.empty())
+                return;
+            out.swap(local_jsonl_buffer);
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+        out.clear();
+    }
+}
+
+
+/*==============================
+    term_jsonstring
+    Converts a buffer into a quoted JSON string.
+    Bytes that aren't valid UTF-8 are treated
+    as Latin-1
+    @param  The buffer to convert
+    @param  The size of the buffer
+    @return The JSON string
+==============================*/
+
+std::string term_jsonstring(const char* str, size_t size)
+{
+    static const char* hex = "0123456789abcdef";
+    const unsigned char* data = (const unsigned char*)str;
+    std::string out = "\"";
+
+    for (size_t i=0; i<size; i++)
+    {
+        unsigned char c = data[i];
+        switch (c)
+        {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c >= 0x20 && c < 0x7F)
+                    out += (char)c;
+                else
+                {
+                    size_t len = (c >= 0xC2 && c <= 0xDF) ? 2 : (c >= 0xE0 && c <= 0xEF) ? 3 : (c >= 0xF0 && c <= 0xF4) ? 4 : 0;
+                    size_t j = 1;
+
+                    // Copy valid UTF-8 sequences as they are, and escape everything else
+                    while (len > 0 && j < len && i+j < size && (data[i+j] & 0xC0) == 0x80)
+                        j++;
+                    if (len > 0 && j == len)
+                    {
+                        out.append(str + i, len);
+                        i += len-1;
+                    }
+                    else
+                    {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0x0F];
+                    }
+                }
+                break;
+        }
+    }
+    out += "\"";
+    return out;
 }
 
 
@@ -416,44 +786,76 @@ void __log_output(const short color, const int32_t y, const bool allowstack, con
         // Clear doesn't do anything until refresh(), which can't be called here because threads
 
         local_resizesignal = true;
-        local_padbottom = -1;
     }
 #endif
 
 
+/*==============================
+    output_rows
+    Returns how many rows of the terminal
+    the output window can use
+    @return The number of rows
+==============================*/
+
+static int output_rows()
+{
+    return getmaxy(local_terminal) - (local_status_shown ? 2 : 1);
+}
+
+
 /*==============================
     refresh_output
-    Refreshes the output pad to
-    deal with scrolling
+    Redraws the output pad from the
+    scrollback to deal with scrolling
 ==============================*/
 
 static void refresh_output()
 {
-    int w, h, x, y;
+    int w, h, rows, maxscroll, first;
     static int scrolltextlen = 0;
     static int scrolltextlen_old = 0;
 
     // Get the terminal size
     getmaxyx(local_terminal, h, w);
+    rows = output_rows();
+    if (getmaxy(local_outputwin) != h || getmaxx(local_outputwin) != w)
+        wresize(local_outputwin, h, w);
+
+    // Work out which lines are visible
+    maxscroll = ((int)local_scrollback_count > rows) ? (int)local_scrollback_count - rows : 0;
+    if (local_scrolly > maxscroll)
+        local_scrolly = maxscroll;
+    first = maxscroll - local_scrolly;
+
+    // Draw the visible lines, switching colors only when they change
+    werase(local_outputwin);
+    for (int i=0; i<rows && first+i < (int)local_scrollback_count; i++)
+    {
+        OutputLine* line = scrollback_line(first+i);
+        size_t end = 0;
 
-    // Initialize padbottom if it hasn't been yet
-    if (local_padbottom == -1)
-        local_padbottom = h-2;
-
-    // Get the cursor position
-    getyx(local_outputwin, y, x);
+        // Don't draw past the edge of the screen, in case the line was wrapped before a resize
+        for (int cols = 0; end < line->text.size(); end++)
+            if ((line->text[end] & 0xC0) != 0x80 && cols++ == w)
+                break;
 
-    // Perform scrolling if needed
-    if (y > local_padbottom)
-    {
-        int newlinecount = y - local_padbottom;
-        local_padbottom += newlinecount;
-        if (local_scrolly != 0)
-            local_scrolly += newlinecount;
+        // Draw the line in runs of the same color
+        wmove(local_outputwin, i, 0);
+        for (size_t start = 0, j = 1; start < end; j++)
+        {
+            if (j == end || line->colors[j] != line->colors[start])
+            {
+                wattrset(local_outputwin, (line->colors[start] != CR_NONE) ? COLOR_PAIR(line->colors[start]) : A_NORMAL);
+                waddnstr(local_outputwin, line->text.c_str() + start, j - start);
+                start = j;
+            }
+        }
+        wattrset(local_outputwin, A_NORMAL);
     }
 
     // Refresh the output window
-    prefresh(local_outputwin, local_padbottom - (h-2) - local_scrolly, 0, 0, 0, h-2, w-1);
+    prefresh(local_outputwin, 0, 0, 0, 0, rows-1, w-1);
+    local_lastframe = time_miliseconds();
 
     // Print scroll text
     if (local_scrolly != 0)
@@ -461,22 +863,21 @@ static void refresh_output()
         char scrolltext[40 + 1];
 
         // Initialize the scroll text and the window to render the text to
-        sprintf(scrolltext, "%d/%d", local_padbottom.load() - local_scrolly.load()-h+2, local_padbottom.load()-h+2);
+        sprintf(scrolltext, "%d/%d", first, maxscroll);
         scrolltextlen = strlen(scrolltext);
 
         // Initialize the scroll text window if necessary
         if (local_scrolltextwin == NULL)
         {
-            local_scrolltextwin = newwin(1, scrolltextlen, h-2, w-scrolltextlen);
+            local_scrolltextwin = newwin(1, scrolltextlen, rows-1, w-scrolltextlen);
             wattron(local_scrolltextwin, COLOR_PAIR(CRDEF_SPECIAL));
         }
 
-        // Handle terminal resize/text size change
-        if (local_resizesignal || scrolltextlen_old != scrolltextlen)
+        // Handle terminal resize/text size change/the status line being toggled
+        if (local_resizesignal || scrolltextlen_old != scrolltextlen || getbegy(local_scrolltextwin) != rows-1)
         {
-            getmaxyx(local_terminal, h, w);
             wresize(local_scrolltextwin, 1, scrolltextlen);
-            mvwin(local_scrolltextwin, h-2, w-scrolltextlen);
+            mvwin(local_scrolltextwin, rows-1, w-scrolltextlen);
         }
 
         // Print the scroll text
@@ -495,6 +896,96 @@ static void refresh_output()
 }
 
 
+/*==============================
+    refresh_status
+    Redraws the status line with the
+    upload progress, speed and ETA
+==============================*/
+
+static void refresh_status()
+{
+    static uint64_t lastdraw = 0;
+    std::lock_guard<std::mutex> lock(local_status_lock);
+    bool     shown = (local_status_text != NULL);
+    uint64_t now = time_miliseconds();
+    std::string bar;
+    char     eta[32] = "--:--";
+    char*    text;
+    float    progress;
+    uint64_t elapsed;
+    double   speed = 0;
+    int      w, h, size, blocks;
+
+    // Give the status line's row to the output window (or take it back) when it's hidden or shown
+    if (shown != local_status_shown)
+    {
+        local_status_shown = shown;
+        if (!shown && local_statuswin != NULL)
+        {
+            delwin(local_statuswin);
+            local_statuswin = NULL;
+        }
+        refresh_output();
+        lastdraw = 0;
+    }
+    if (!shown || (now - lastdraw < FRAMETIME && !local_resizesignal))
+        return;
+    lastdraw = now;
+
+    // If a new upload started since the last time, start measuring from here
+    progress = device_getuploadprogress();
+    if (progress < local_status_startprog)
+    {
+        local_status_starttime = now;
+        local_status_startbytes = device_getuploadbytes();
+        local_status_startprog = progress;
+    }
+
+    // Work out the speed and the time left
+    elapsed = now - local_status_starttime;
+    if (elapsed > 0)
+        speed = ((double)(device_getuploadbytes() - local_status_startbytes)/(1024.0*1024.0))/(elapsed/1000.0);
+    if (elapsed > 0 && progress > local_status_startprog)
+    {
+        uint64_t left = (uint64_t)((100.0f - progress)*elapsed/(progress - local_status_startprog))/1000;
+        sprintf(eta, "%d:%02d", (int)(left/60), (int)(left%60));
+    }
+
+    // Build the progress bar
+    blocks = (int)(progress*STATUSBAR/100.0f);
+    for (int i=0; i<STATUSBAR; i++)
+    {
+        #ifndef LINUX
+            bar += (i < blocks) ? u8"\u2588" : u8"\u2591";
+        #else
+            bar += (i < blocks) ? "\xe2\x96\x88" : "\xe2\x96\x91";
+        #endif
+    }
+    size = snprintf(NULL, 0, "%s [%s] %.02f%% %.02f MB/s ETA %s", local_status_text, bar.c_str(), progress, speed, eta);
+    text = (char*)malloc(size + 1);
+    if (text == NULL)
+        return;
+    sprintf(text, "%s [%s] %.02f%% %.02f MB/s ETA %s", local_status_text, bar.c_str(), progress, speed, eta);
+
+    // Initialize the status window if necessary, and handle terminal resizes
+    getmaxyx(local_terminal, h, w);
+    if (local_statuswin == NULL)
+        local_statuswin = newwin(1, w, h-2, 0);
+    else if (local_resizesignal || getmaxx(local_statuswin) != w || getbegy(local_statuswin) != h-2)
+    {
+        wresize(local_statuswin, 1, w);
+        mvwin(local_statuswin, h-2, 0);
+    }
+
+    // Draw the status line in place
+    werase(local_statuswin);
+    wattrset(local_statuswin, (local_status_color != CR_NONE) ? COLOR_PAIR(local_status_color) : A_NORMAL);
+    waddnstr(local_statuswin, text, -1);
+    wrefresh(local_statuswin);
+    free(text);
+}
+
+
 /*==============================
     refresh_input
     Refreshes the input pad to
@@ -537,8 +1028,8 @@ static void handle_input()
     {
         case KEY_PPAGE: scroll_output(1); break;
         case KEY_NPAGE: scroll_output(-1); break;
-        case KEY_HOME: scroll_output(local_padbottom); break;
-        case KEY_END: scroll_output(-local_padbottom); break;
+        case KEY_HOME: scroll_output(local_scrollback_count); break;
+        case KEY_END: scroll_output(-(int)local_scrollback_count); break;
         case KEY_DOWN:
             if (!local_allowinput)
                 break;
@@ -622,7 +1113,7 @@ static void handle_input()
             }
             break;
         case CH_ESCAPE:
-            scroll_output(-local_padbottom);
+            scroll_output(-(int)local_scrollback_count);
             program_event(PEV_ESCAPE);
             local_keypressed = false;
             term_clearinput();
@@ -761,16 +1252,16 @@ static void termthread_simple()
 
 static void scroll_output(int value)
 {
-    int h = getmaxy(local_terminal);
+    int maxscroll = (int)local_scrollback_count - output_rows();
 
     // Check if we can scroll
-    if (local_padbottom < h)
+    if (maxscroll <= 0)
         return;
 
     // Perform the scrolling
     local_scrolly += value;
-    if (local_scrolly > local_padbottom-(h-2))
-        local_scrolly = local_padbottom.load()-(h-2);
+    if (local_scrolly > maxscroll)
+        local_scrolly = maxscroll;
     else if (local_scrolly < 0)
         local_scrolly = 0;
 
@@ -831,6 +1322,36 @@ bool term_isusingcurses()
 }
 
 
+/*==============================
+    term_usejsonl
+    Enables/disables writing the output as
+    one JSON object per line, which also
+    disables curses
+    @param Whether to enable/disable JSONL
+==============================*/
+
+void term_usejsonl(bool val)
+{
+    local_usejsonl = val;
+    if (val)
+        local_usecurses = false;
+}
+
+
+/*==============================
+    term_isusingjsonl
+    Checks if the program is writing
+    its output as JSONL
+    @return Whether the program is 
+            using JSONL or not
+==============================*/
+
+bool term_isusingjsonl()
+{
+    return local_usejsonl;
+}
+
+
 /*==============================
     term_allowinput
     Enables/disables input reading
@@ -877,12 +1398,11 @@ void term_setsize(int h, int w)
         return;
     resize_term(h, w);
     wresize(local_terminal, h, w);
-    wresize(local_outputwin, h + local_historysize, w);
+    wresize(local_outputwin, h, w);
     wresize(local_inputwin, 1, w);
     mvwin(local_inputwin, h-1, 0);
     wrefresh(local_terminal);
     refresh_input();
-    local_padbottom = -1;
     local_scrolly = 0;
     local_resizesignal = true;
 }
@@ -933,4 +1453,36 @@ int term_geth()
 bool term_waskeypressed()
 {
     return local_keypressed.load();
+}
+
+
+/*==============================
+    term_showprogress
+    Shows the upload progress in a status line
+    above the input, which the terminal thread
+    keeps up to date by itself
+    @param The text to show before the progress bar
+    @param The color to draw the status line with
+==============================*/
+
+void term_showprogress(const char* text, short color)
+{
+    std::lock_guard<std::mutex> lock(local_status_lock);
+    local_status_text = text;
+    local_status_color = color;
+    local_status_starttime = time_miliseconds();
+    local_status_startbytes = device_getuploadbytes();
+    local_status_startprog = device_getuploadprogress();
+}
+
+
+/*==============================
+    term_hideprogress
+    Hides the status line
+==============================*/
+
+void term_hideprogress()
+{
+    std::lock_guard<std::mutex> lock(local_status_lock);
+    local_status_text = NULL;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef __TERM_HEADER
 #define __TERM_HEADER 
 
+    #include <string>
+
 
     /*********************************
                   Macros
@@ -38,16 +40,22 @@
     void term_setsize(int h, int w);
     void term_sethistorysize(int val);
     void term_usecurses(bool val);
+    void term_usejsonl(bool val);
     void term_allowinput(bool val);
     void term_enablestacking(bool val);
     void term_end();
 
     // Terminal checking
     bool term_isusingcurses();
+    bool term_isusingjsonl();
     int  term_getw();
     int  term_geth();
     bool term_waskeypressed();
 
+    // Status line
+    void term_showprogress(const char* text, short color);
+    void term_hideprogress();
+
     // Printing
     #include "term_internal.h"
     #define log_simple(string, ...) __log_output(CRDEF_PROGRAM, 0, false, string, ##__VA_ARGS__)
@@ -55,4 +63,8 @@
     #define log_stackable(string, color, ...) __log_output(color, 0, true, string, ##__VA_ARGS__)
     #define log_replace(string, color, ...) __log_output(color, 1, false, string, ##__VA_ARGS__)
 
+    // JSONL output
+    #define log_jsonl(type, fields, ...) __log_jsonl(type, fields, ##__VA_ARGS__)
+    std::string term_jsonstring(const char* str, size_t size);
+
 #endif
\ No newline at end of file
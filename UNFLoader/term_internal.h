@@ -2,5 +2,6 @@
 #define __TERM_INTERNAL_HEADER
 
 	void __log_output(const short color, const int32_t y, const bool allowstack, const char* str, ...);
+	void __log_jsonl(const char* type, const char* fields, ...);
 
 #endif
\ No newline at end of file
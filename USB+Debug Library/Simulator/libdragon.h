@@ -0,0 +1,83 @@
+/***************************************************************
+                          libdragon.h
+
+Stands in for libdragon when building the USB and debug library
+for the PC. Only provides the parts of libdragon that the
+libraries use, which are implemented by the PI bus simulator.
+***************************************************************/
+
+#ifndef UNFL_PISIM_LIBDRAGON_H
+#define UNFL_PISIM_LIBDRAGON_H
+
+    #include <stdint.h>
+    #include <stddef.h>
+
+
+    /*********************************
+                 Macros
+    *********************************/
+
+    #define TICKS_READ()         pisim_ticks()
+    #define C0_READ_EPC()        pisim_epc()
+    #define C0_COUNT()           pisim_ticks()
+    #define TICKS_PER_SECOND     PISIM_TICKRATE
+    #define TICKS_FROM_MS(ms)    ((uint32_t)((ms)*(PISIM_TICKRATE/1000)))
+    #define TIMER_TICKS(us)      ((int)(((long long)(us)*(PISIM_TICKRATE/1000))/1000))
+    #define TF_ONE_SHOT          0
+    #define TF_CONTINUOUS        1
+    #define PhysicalAddr(a)      ((unsigned long)(a)&0x1FFFFFFF)
+
+
+    /*********************************
+                 Structs
+    *********************************/
+
+    // The remote debugger isn't supported by the simulator, but debug.c always needs the type
+    typedef struct
+    {
+        int type;
+        int code;
+    } exception_t;
+
+    typedef struct
+    {
+        int ticks;
+        int left;
+        int flags;
+        void (*callback)(int ovfl);
+    } timer_link_t;
+
+
+    /*********************************
+               Functions
+    *********************************/
+
+    // PI
+    extern uint32_t io_read(uint32_t pi_address);
+    extern void     io_write(uint32_t pi_address, uint32_t data);
+    extern void     dma_read(void* ram_address, unsigned long pi_address, unsigned long len);
+    extern void     dma_write(const void* ram_address, unsigned long pi_address, unsigned long len);
+    extern void     dma_read_raw_async(void* ram_address, unsigned long pi_address, unsigned long len);
+    extern void     dma_write_raw_async(const void* ram_address, unsigned long pi_address, unsigned long len);
+    extern void     dma_wait(void);
+
+    // Caches (the PC keeps them coherent for us)
+    extern void data_cache_hit_writeback(volatile const void* addr, unsigned long length);
+    extern void data_cache_hit_invalidate(volatile void* addr, unsigned long length);
+    extern void data_cache_hit_writeback_invalidate(volatile void* addr, unsigned long length);
+    extern void inst_cache_hit_invalidate(volatile void* addr, unsigned long length);
+    extern int  get_memory_size(void);
+
+    // Timers and interrupts
+    extern uint32_t      pisim_ticks(void);
+    extern uint32_t      pisim_epc(void);
+    extern long long     timer_ticks(void);
+    extern void          timer_init(void);
+    extern timer_link_t* new_timer(int ticks, int flags, void (*callback)(int ovfl));
+    extern void          disable_interrupts(void);
+    extern void          enable_interrupts(void);
+    extern void          wait_ms(unsigned long ms);
+
+    #include "pisim.h"
+
+#endif
@@ -0,0 +1,553 @@
+/***************************************************************
+                             main.c
+
+Runs the USB and debug library on the PC, on top of the PI bus
+simulator. Either waits for UNFLoader to connect and then behaves
+like a ROM with a command interpreter, or benchmarks the library.
+***************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libdragon.h"
+#include "debug.h"
+
+
+/*********************************
+              Macros
+*********************************/
+
+#define BENCH_WRITESIZE   (1024*1024)
+#define BENCH_WRITECOUNT  16
+#define BENCH_READSIZE    (64*1024)
+#define BENCH_READCOUNT   64
+#define BENCH_PRINTCOUNT  100000
+#define BENCH_STREAMSIZE  (16*1024*1024)
+#define BENCH_STREAMCHUNK 65535 // Odd sizes make sure the ring handles odd addresses
+#define BENCH_STREAMREAD  3001
+#define BENCH_PATCHADDR   0x00100000 // Physical RDRAM address that the patch benchmark writes to
+#define BENCH_FSPATH      "bench.bin"
+#define BENCH_FSSIZE      (4*1024*1024+123) // Not a multiple of the read size, so that the last read is cut short
+#define BENCH_FSMAXREPLY  (1024*1024)
+#define BENCH_PROFILECOUNT 100000
+#define BENCH_PROFILEPC   0x80000400 // The first address that the simulated EPC register holds
+#define BENCH_ZONECOUNT   100000
+#define BENCH_HEAPCOUNT   100000
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+/*********************************
+             Globals
+*********************************/
+
+static unsigned long long bench_received = 0;
+static unsigned long long bench_corrupt = 0;
+static unsigned char      bench_buffer[BENCH_WRITESIZE];
+static unsigned int       bench_streamcapacity = 0;
+static unsigned int       bench_streamread = 0;
+static unsigned long long bench_patched = 0;
+static unsigned int       bench_profilepc = BENCH_PROFILEPC;
+static unsigned int       bench_zones = 0;
+static unsigned int       bench_zonetime = 0;
+static unsigned int       bench_heapevents = 0;
+
+
+/*********************************
+        Command Functions
+*********************************/
+
+/*==============================
+    command_echo
+    Prints the text that was sent with the command
+    @return NULL, or an error message
+==============================*/
+
+static char* command_echo()
+{
+    char text[256];
+    int size = debug_sizecommand();
+    if (size <= 0 || size >= (int)sizeof(text))
+        return "Expected some text up to 255 characters long";
+    debug_parsecommand(text);
+    text[size] = '\0';
+    debug_printf("%s\n", text);
+    return NULL;
+}
+
+
+/*==============================
+    command_ping
+    Answers with pong
+    @return NULL
+==============================*/
+
+static char* command_ping()
+{
+    debug_printf("pong\n");
+    return NULL;
+}
+
+
+/*********************************
+        Benchmark Functions
+*********************************/
+
+/*==============================
+    bench_streambyte
+    Gets what a byte of the benchmark's stream and file should be
+    @param  The offset of the byte in the stream
+    @return The value of the byte
+==============================*/
+
+static unsigned char bench_streambyte(unsigned int offset)
+{
+    return (unsigned char)(offset*13 + (offset>>9));
+}
+
+
+/*==============================
+    bench_receive
+    Receives the data that the N64 sent, standing in for UNFLoader
+    @param The DATATYPE of the data
+    @param A buffer with the data
+    @param The size of the data
+==============================*/
+
+static void bench_receive(int datatype, const void* data, int size)
+{
+    int i;
+    const unsigned char* bytes = (const unsigned char*)data;
+    
+    // Look inside USB protocol 3 packets
+    if (datatype == DATATYPE_CHANNEL && size >= 12)
+    {
+        datatype = bytes[0];
+        bytes += 12;
+        data = bytes;
+        size -= 12;
+    }
+    
+    // Answer debug_fs_read requests like UNFLoader would, from a made up file
+    if (datatype == DATATYPE_FSREQUEST && size > 12)
+    {
+        static unsigned char reply[8+BENCH_FSMAXREPLY];
+        unsigned int offset = (bytes[4]<<24) | (bytes[5]<<16) | (bytes[6]<<8) | bytes[7];
+        unsigned int length = (bytes[8]<<24) | (bytes[9]<<16) | (bytes[10]<<8) | bytes[11];
+        int result = -1;
+        if (!strncmp((const char*)bytes+12, BENCH_FSPATH, size-12))
+        {
+            result = (offset < BENCH_FSSIZE) ? MIN(length, BENCH_FSSIZE-offset) : 0;
+            result = MIN(result, BENCH_FSMAXREPLY);
+            for (i=0; i<result; i++)
+                reply[8+i] = bench_streambyte(offset+i);
+        }
+        memcpy(reply, bytes, 4);
+        reply[4] = (result >> 24) & 0xFF;
+        reply[5] = (result >> 16) & 0xFF;
+        reply[6] = (result >> 8) & 0xFF;
+        reply[7] = result & 0xFF;
+        pisim_hostsend(DATATYPE_FSDATA, reply, 8 + ((result > 0) ? result : 0));
+        return;
+    }
+    
+    // Keep track of the stream ring like UNFLoader would
+    if (datatype == DATATYPE_STREAM && size >= 12)
+    {
+        bench_streamcapacity = (bytes[0]<<24) | (bytes[1]<<16) | (bytes[2]<<8) | bytes[3];
+        bench_streamread = (bytes[8]<<24) | (bytes[9]<<16) | (bytes[10]<<8) | bytes[11];
+        return;
+    }
+    
+    // Make sure that no profiler samples were lost or reordered
+    if (datatype == DATATYPE_PROFILE && size >= 8)
+    {
+        unsigned int dropped = (bytes[4]<<24) | (bytes[5]<<16) | (bytes[6]<<8) | bytes[7];
+        if (dropped != 0)
+            bench_corrupt++;
+        for (i=8; i+12<=size; i+=12, bench_profilepc += 4)
+            if (((bytes[i]<<24) | (bytes[i+1]<<16) | (bytes[i+2]<<8) | bytes[i+3]) != bench_profilepc)
+                bench_corrupt++;
+    }
+    
+    // Make sure that no zone events were lost, and that they're in order
+    if (datatype == DATATYPE_ZONES && size >= 12)
+    {
+        unsigned int dropped = (bytes[8]<<24) | (bytes[9]<<16) | (bytes[10]<<8) | bytes[11];
+        if (dropped != 0)
+            bench_corrupt++;
+        for (i=12; i+8<=size; i+=8, bench_zones++)
+        {
+            unsigned int time = (bytes[i]<<24) | (bytes[i+1]<<16) | (bytes[i+2]<<8) | bytes[i+3];
+            unsigned int type = bytes[i+5];
+            unsigned int id = (bytes[i+6]<<8) | bytes[i+7];
+            if ((int)(time - bench_zonetime) < 0 || type != (bench_zones & 1) || (type == 0 && id != ((bench_zones/2) & 0xFFFF)))
+                bench_corrupt++;
+            bench_zonetime = time;
+        }
+    }
+    
+    // Make sure that no heap events were lost, and that every allocation is followed by its free
+    if (datatype == DATATYPE_HEAP && size >= 4)
+    {
+        static unsigned int lastptr;
+        unsigned int dropped = (bytes[0]<<24) | (bytes[1]<<16) | (bytes[2]<<8) | bytes[3];
+        if (dropped != 0)
+            bench_corrupt++;
+        for (i=4; i+12<=size; i+=12, bench_heapevents++)
+        {
+            unsigned int ptr = (bytes[i]<<24) | (bytes[i+1]<<16) | (bytes[i+2]<<8) | bytes[i+3];
+            unsigned int type = bytes[i+4];
+            unsigned int alloc = (bytes[i+5]<<16) | (bytes[i+6]<<8) | bytes[i+7];
+            if (type != (bench_heapevents & 1) || (type == 0 && alloc != (bench_heapevents/2) % 256 + 1) || (type == 1 && ptr != lastptr))
+                bench_corrupt++;
+            lastptr = ptr;
+        }
+    }
+    bench_received += size;
+    if (datatype == DATATYPE_RAWBINARY && size >= BENCH_WRITESIZE && memcmp(data, bench_buffer, BENCH_WRITESIZE) != 0)
+        bench_corrupt++;
+}
+
+
+/*==============================
+    bench_patch
+    Counts the bytes that UNFLoader patched into RDRAM
+    @param The patched address
+    @param The size of the patch
+==============================*/
+
+static void bench_patch(void* address, unsigned int size)
+{
+    (void)address;
+    bench_patched += size;
+}
+
+
+/*==============================
+    bench_now
+    Gets the current time
+    @return The time in microseconds
+==============================*/
+
+static double bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000.0 + now.tv_nsec/1000.0;
+}
+
+
+/*==============================
+    bench_report
+    Prints the results of a benchmark
+    @param The name of the benchmark
+    @param The number of bytes that were transferred
+    @param When the benchmark started, in microseconds
+==============================*/
+
+static void bench_report(const char* name, unsigned long long bytes, double start)
+{
+    double elapsed = bench_now() - start;
+    PISimStats* stats = pisim_stats();
+    printf("%-14s %10llu %10.0f %9.1f %10llu %10llu %8llu %8llu %8llu %10llu %8llu\n", name, bytes, elapsed,
+        elapsed > 0 ? bytes/elapsed : 0.0, stats->io_reads, stats->io_writes, stats->dma_reads,
+        stats->dma_writes, stats->dma_async, stats->dma_bytes, stats->rejected);
+    memset(stats, 0, sizeof(PISimStats));
+}
+
+
+/*==============================
+    bench_run
+    Benchmarks the USB and debug library
+==============================*/
+
+static void bench_run()
+{
+    int i;
+    double start;
+    unsigned long long bytes;
+    static unsigned char readbuffer[BENCH_READSIZE];
+
+    for (i=0; i<BENCH_WRITESIZE; i++)
+        bench_buffer[i] = (unsigned char)(i*7);
+    pisim_loopback(bench_receive);
+    debug_profile(0);
+    debug_initialize();
+    pisim_firetimers();
+    memset(pisim_stats(), 0, sizeof(PISimStats));
+    printf("USB buffer size: %d bytes, stream ring size: %d bytes\n", USB_BUFFER_SIZE, USB_STREAM_SIZE);
+    printf("%-14s %10s %10s %9s %10s %10s %8s %8s %8s %10s %8s\n", "Benchmark", "Bytes", "Time (us)", "MB/s",
+        "IO reads", "IO writes", "DMA in", "DMA out", "Async", "DMA bytes", "Rejected");
+
+    // usb_write
+    bench_received = 0;
+    start = bench_now();
+    for (i=0; i<BENCH_WRITECOUNT; i++)
+        usb_write(DATATYPE_RAWBINARY, bench_buffer, BENCH_WRITESIZE);
+    bench_report("usb_write", bench_received, start);
+
+    // usb_read
+    bytes = 0;
+    for (i=0; i<BENCH_READCOUNT; i++)
+        pisim_hostsend(DATATYPE_RAWBINARY, bench_buffer, BENCH_READSIZE);
+    start = bench_now();
+    while (usb_poll() != 0)
+    {
+        int total = USBHEADER_GETSIZE(usb_poll());
+        int size = MIN(total, BENCH_READSIZE);
+        usb_read(readbuffer, size);
+        if (memcmp(readbuffer, bench_buffer, size) != 0)
+            bench_corrupt++;
+        bytes += size;
+
+        // Reading the whole packet already moves on to the next one, so only purge what's left over
+        if (size < total)
+            usb_purge();
+    }
+    bench_report("usb_read", bytes, start);
+
+    // debug_printf, which goes through the ring buffer and debug_thread_usb
+    bench_received = 0;
+    start = bench_now();
+    for (i=0; i<BENCH_PRINTCOUNT; i++)
+        debug_printf("Benchmark message %d\n", i);
+    pisim_firetimers();
+    bench_report("debug_printf", bench_received, start);
+
+    // debug_dumpbinary, which goes through debug_thread_usb
+    bench_received = 0;
+    start = bench_now();
+    for (i=0; i<BENCH_WRITECOUNT; i++)
+        debug_dumpbinary(bench_buffer, BENCH_WRITESIZE);
+    bench_report("debug_dump", bench_received, start);
+    
+    // Memory patches, which debug_pollcommands writes straight into RDRAM
+    if (get_memory_size() > 0)
+    {
+        static unsigned char patch[8+BENCH_READSIZE];
+        debug_patchhandler(bench_patch);
+        memcpy(patch+8, bench_buffer, BENCH_READSIZE);
+        for (i=0; i<BENCH_READCOUNT; i++)
+        {
+            unsigned int address = BENCH_PATCHADDR + i*BENCH_READSIZE;
+            patch[0] = (address >> 24) & 0xFF;
+            patch[1] = (address >> 16) & 0xFF;
+            patch[2] = (address >> 8) & 0xFF;
+            patch[3] = address & 0xFF;
+            patch[4] = (BENCH_READSIZE >> 24) & 0xFF;
+            patch[5] = (BENCH_READSIZE >> 16) & 0xFF;
+            patch[6] = (BENCH_READSIZE >> 8) & 0xFF;
+            patch[7] = BENCH_READSIZE & 0xFF;
+            pisim_hostsend(DATATYPE_PATCH, patch, 8+BENCH_READSIZE);
+        }
+        start = bench_now();
+        debug_pollcommands();
+        for (i=0; i<BENCH_READCOUNT; i++)
+            if (memcmp((void*)(0x80000000UL + BENCH_PATCHADDR + i*BENCH_READSIZE), bench_buffer, BENCH_READSIZE) != 0)
+                bench_corrupt++;
+        bench_report("debug_patch", bench_patched, start);
+    }
+    
+    // debug_fs_read, which waits for each answer before asking for more
+    bytes = 0;
+    start = bench_now();
+    for (;;)
+    {
+        int got = debug_fs_read(BENCH_FSPATH, bytes, BENCH_READSIZE, readbuffer);
+        if (got <= 0)
+            break;
+        for (i=0; i<got; i++)
+            if (readbuffer[i] != bench_streambyte(bytes+i))
+                bench_corrupt++;
+        bytes += got;
+    }
+    if (bytes != BENCH_FSSIZE || debug_fs_read("missing.bin", 0, 1, readbuffer) != -1)
+        bench_corrupt++;
+    bench_report("debug_fs_read", bytes, start);
+    
+    // The profiler, which takes a sample every time the timers run
+    #if USE_PROFILER
+        bench_received = 0;
+        debug_profile(1);
+        start = bench_now();
+        for (i=0; i<BENCH_PROFILECOUNT; i++)
+            pisim_firetimers();
+        debug_pollcommands();
+        debug_profile(0);
+        if (bench_profilepc != BENCH_PROFILEPC + BENCH_PROFILECOUNT*4)
+            bench_corrupt++;
+        bench_report("debug_profile", bench_received, start);
+    #endif
+    
+    // Zones, which the flush timer sends once half of the zone ring is in use
+    #if USE_ZONES
+        bench_received = 0;
+        bench_zonetime = pisim_ticks();
+        start = bench_now();
+        for (i=0; i<BENCH_ZONECOUNT; i++)
+        {
+            debug_zone_begin(i & 0xFFFF);
+            debug_zone_end();
+            if (i % (ZONE_RING/8) == 0)
+                pisim_firetimers();
+        }
+        debug_pollcommands();
+        if (bench_zones != BENCH_ZONECOUNT*2)
+            bench_corrupt++;
+        bench_report("debug_zone", bench_received, start);
+    #endif
+    
+    // Heap tracing, with every allocation freed straight away
+    #if USE_HEAPTRACE
+        bench_received = 0;
+        start = bench_now();
+        for (i=0; i<BENCH_HEAPCOUNT; i++)
+        {
+            debug_free(debug_malloc(i%256 + 1));
+            if (i % (HEAP_RING/8) == 0)
+                pisim_firetimers();
+        }
+        debug_pollcommands();
+        if (bench_heapevents != BENCH_HEAPCOUNT*2)
+            bench_corrupt++;
+        bench_report("debug_heap", bench_received, start);
+    #endif
+    
+    // usb_stream_read, with the data sent in chunks whenever the ring has room for them
+    #if USB_STREAM_SIZE > 0
+    {
+        unsigned int sent = 0;
+        unsigned int consumed = 0;
+        static unsigned char chunk[12+BENCH_STREAMCHUNK];
+        
+        // Streams are sent with USB protocol 3, so that the 64Drive's padding doesn't end up in the stream
+        memset(chunk, 0, 12+USBCHANNEL_COUNT);
+        chunk[0] = DATATYPE_CREDIT;
+        chunk[7] = USBCHANNEL_COUNT;
+        pisim_hostsend(DATATYPE_CHANNEL, chunk, 12+USBCHANNEL_COUNT);
+        usb_poll();
+        start = bench_now();
+        while (consumed < BENCH_STREAMSIZE)
+        {
+            int got;
+            unsigned int size = MIN(BENCH_STREAMCHUNK, BENCH_STREAMSIZE-sent);
+            if (sent < BENCH_STREAMSIZE && sent - bench_streamread + size <= bench_streamcapacity)
+            {
+                chunk[0] = DATATYPE_STREAM;
+                chunk[1] = USBCHANNEL_BULK;
+                chunk[4] = (size >> 24) & 0xFF;
+                chunk[5] = (size >> 16) & 0xFF;
+                chunk[6] = (size >> 8) & 0xFF;
+                chunk[7] = size & 0xFF;
+                for (i=0; i<(int)size; i++)
+                    chunk[12+i] = bench_streambyte(sent+i);
+                pisim_hostsend(DATATYPE_CHANNEL, chunk, 12+size);
+                sent += size;
+            }
+            usb_poll();
+            got = usb_stream_read(readbuffer, BENCH_STREAMREAD);
+            for (i=0; i<got; i++)
+                if (readbuffer[i] != bench_streambyte(consumed+i))
+                    bench_corrupt++;
+            consumed += got;
+        }
+        bench_report("usb_stream", consumed, start);
+    }
+    #endif
+
+    if (bench_corrupt > 0)
+        printf("%llu transfers were corrupted\n", bench_corrupt);
+}
+
+
+/*********************************
+             Program
+*********************************/
+
+/*==============================
+    show_help
+    Prints how to use the program
+    @param The name of the program
+==============================*/
+
+static void show_help(const char* name)
+{
+    printf("Usage: %s [-c 64drive|everdrive|sc64] [-p port] [-b]\n", name);
+    printf("  -c  The flashcart to simulate (default 64drive)\n");
+    printf("  -p  The port to wait for UNFLoader on (default %d)\n", PISIM_DEFAULTPORT);
+    printf("  -b  Benchmark the library instead of waiting for UNFLoader\n");
+}
+
+
+/*==============================
+    main
+    Runs the simulated N64
+    @param  The number of arguments
+    @param  The arguments
+    @return The exit code
+==============================*/
+
+int main(int argc, char* argv[])
+{
+    int i;
+    int cart = CART_64DRIVE;
+    int port = PISIM_DEFAULTPORT;
+    int bench = 0;
+
+    // Parse the arguments
+    for (i=1; i<argc; i++)
+    {
+        if (!strcmp(argv[i], "-b"))
+            bench = 1;
+        else if (!strcmp(argv[i], "-p") && i+1 < argc)
+            port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i+1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "64drive"))
+                cart = CART_64DRIVE;
+            else if (!strcmp(argv[i], "everdrive"))
+                cart = CART_EVERDRIVE;
+            else if (!strcmp(argv[i], "sc64"))
+                cart = CART_SC64;
+            else
+            {
+                show_help(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            show_help(argv[0]);
+            return 1;
+        }
+    }
+    pisim_initialize(cart);
+
+    // Benchmark the library if requested
+    if (bench)
+    {
+        bench_run();
+        return 0;
+    }
+
+    // Otherwise, boot once UNFLoader has uploaded a ROM
+    if (!pisim_listen(port))
+        return 1;
+    debug_initialize();
+    debug_addcommand("echo", "Prints the text that was sent", command_echo);
+    debug_addcommand("ping", "Answers with pong", command_ping);
+    debug_printcommands();
+
+    // Service the USB until UNFLoader disconnects
+    while (pisim_connected())
+    {
+        debug_pollcommands();
+        pisim_update();
+        usleep(1000);
+    }
+    return 0;
+}
@@ -0,0 +1,1524 @@
+/***************************************************************
+                            pisim.c
+
+Simulates the PI bus and the USB registers of the 64Drive,
+EverDrive and SC64, so that the USB and debug library can run
+on a PC. The flashcart's USB port is either connected to
+UNFLoader, which talks to the simulator like it would to the
+Gopher64 emulator, or to a function in the same program.
+https://github.com/buu342/N64-UNFLoader
+***************************************************************/
+
+#include "libdragon.h"
+#include "usb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/*********************************
+           Data macros
+*********************************/
+
+#define PI_ADDRESS_MASK  0x1FFFFFFF
+#define PI_CART_BASE     0x10000000
+
+// Useful
+#define MIN(a, b)          ((a) < (b) ? (a) : (b))
+#define ALIGN(value, align) (((value) + ((align) - 1)) & ~((align) - 1))
+
+// Gopher64 message types, which UNFLoader uses to talk to the simulator
+#define GOPHER64_TCPTEST   0x07
+#define GOPHER64_ROMUPLOAD 0x08
+#define GOPHER64_ROMSHARED 0x0C
+#define GOPHER64_RECVSIZE  0x10000
+
+
+/*********************************
+          64Drive macros
+*********************************/
+
+#define D64_REGS_BASE             0x18000000
+#define D64_REGS_BASE_EXTENDED    0x1F800000
+#define D64_REGS_SIZE             0x1000
+
+#define D64_REG_STATUS            0x0200
+#define D64_REG_COMMAND           0x0208
+#define D64_REG_MAGIC             0x02EC
+#define D64_REG_BUTTON            0x02F8
+#define D64_REG_USBCOMSTAT        0x0400
+#define D64_REG_USBP0R0           0x0404
+#define D64_REG_USBP1R1           0x0408
+
+#define D64_MAGIC                 0x55444556
+
+#define D64_CI_ENABLE_ROMWR       0xF0
+#define D64_CI_DISABLE_ROMWR      0xF1
+#define D64_CI_ENABLE_EXTADDR     0xF8
+#define D64_CI_DISABLE_EXTADDR    0xF9
+
+#define D64_CUI_ARM               0x0A
+#define D64_CUI_DISARM            0x0F
+#define D64_CUI_WRITE             0x08
+
+#define D64_CUI_ARM_IDLE          0x00
+#define D64_CUI_ARM_ARMED         0x01
+#define D64_CUI_ARM_UNARMED_DATA  0x02
+
+
+/*********************************
+         EverDrive macros
+*********************************/
+
+#define ED_REGS_BASE      0x1F800000
+#define ED_REGS_SIZE      0x10000
+
+#define ED_REG_USBCFG     0x0004
+#define ED_REG_VERSION    0x0014
+#define ED_REG_USBDAT     0x0400
+#define ED_REG_SYSCFG     0x8000
+#define ED_REG_KEY        0x8004
+
+#define ED_USBDAT_SIZE    512
+
+#define ED_USBMODE_MASK   0xFE00
+#define ED_USBMODE_RDNOP  0xC400
+#define ED_USBMODE_RD     0xC600
+#define ED_USBMODE_WRNOP  0xC000
+#define ED_USBMODE_WR     0xC200
+
+#define ED_USBSTAT_RXF    0x0400
+#define ED_USBSTAT_POWER  0x1000
+
+#define ED_REGKEY         0xAA55
+#define ED_VERSION        0xED640008 // V3
+
+
+/*********************************
+           SC64 macros
+*********************************/
+
+#define SC64_REGS_BASE              0x1FFF0000
+#define SC64_REGS_SIZE              0x14
+
+#define SC64_REG_SR_CMD             0x00
+#define SC64_REG_DATA_0             0x04
+#define SC64_REG_DATA_1             0x08
+#define SC64_REG_IDENTIFIER         0x0C
+#define SC64_REG_KEY                0x10
+
+#define SC64_SR_CMD_ERROR           (1 << 30)
+
+#define SC64_V2_IDENTIFIER          0x53437632
+
+#define SC64_KEY_RESET              0x00000000
+#define SC64_KEY_UNLOCK_1           0x5F554E4C
+#define SC64_KEY_UNLOCK_2           0x4F434B5F
+
+#define SC64_CMD_CONFIG_SET         'C'
+#define SC64_CMD_USB_WRITE_STATUS   'U'
+#define SC64_CMD_USB_WRITE          'M'
+#define SC64_CMD_USB_READ_STATUS    'u'
+#define SC64_CMD_USB_READ           'm'
+
+#define SC64_CFG_ROM_WRITE_ENABLE   1
+
+
+/*********************************
+             Structs
+*********************************/
+
+// Data sent by the host that the flashcart hasn't taken yet
+typedef struct PISimPacket
+{
+    int datatype;
+    int size;
+    unsigned char* data;
+    struct PISimPacket* next;
+} PISimPacket;
+
+// A growable byte buffer
+typedef struct
+{
+    unsigned char* data;
+    size_t size;
+    size_t read_pos;
+    size_t write_pos;
+} PISimBuffer;
+
+
+/*********************************
+             Globals
+*********************************/
+
+// Simulator globals
+static int            pisim_cart = CART_NONE;
+static unsigned char* pisim_sdram = NULL;
+static unsigned char* pisim_rdram = NULL;
+static PISimStats     pisim_statistics;
+static PISimPacket*   pisim_queue = NULL;
+static PISimPacket*   pisim_queuetail = NULL;
+
+// Connection globals
+static void (*pisim_receive)(int datatype, const void* data, int size) = NULL;
+static int         pisim_listenfd = -1;
+static int         pisim_clientfd = -1;
+static int         pisim_rombooted = 0;
+static PISimBuffer pisim_recvbuffer;
+
+// Timer globals
+static timer_link_t       pisim_timers[PISIM_MAXTIMERS];
+static unsigned long long pisim_timerdue[PISIM_MAXTIMERS];
+static int                pisim_timercount = 0;
+static int                pisim_intdisabled = 0;
+static int                pisim_intimer = 0;
+static struct timespec    pisim_starttime;
+
+// 64Drive globals
+static uint32_t d64_armstate = D64_CUI_ARM_IDLE;
+static uint32_t d64_p0r0 = 0;
+static uint32_t d64_p1r1 = 0;
+static int      d64_writable = 0;
+static int      d64_extended = 0;
+static int      d64_quiet = 0;
+
+// EverDrive globals
+static int           ed_unlocked = 0;
+static unsigned char ed_usbdat[ED_USBDAT_SIZE];
+static PISimBuffer   ed_rxbuffer;
+static PISimBuffer   ed_txbuffer;
+
+// SC64 globals
+static int      sc64_unlockstep = 0;
+static uint32_t sc64_sr = 0;
+static uint32_t sc64_data[2];
+static int      sc64_writable = 0;
+
+
+/*********************************
+        Buffer Functions
+*********************************/
+
+/*==============================
+    pisim_buffer_append
+    Appends bytes to the end of a buffer, growing it if needed
+    @param The buffer to append to
+    @param The bytes to append, or NULL for zeroes
+    @param The number of bytes to append
+==============================*/
+
+static void pisim_buffer_append(PISimBuffer* buff, const void* data, size_t size)
+{
+    // Move the unread data to the front before growing the buffer
+    if (buff->read_pos > 0 && buff->write_pos+size > buff->size)
+    {
+        memmove(buff->data, buff->data+buff->read_pos, buff->write_pos-buff->read_pos);
+        buff->write_pos -= buff->read_pos;
+        buff->read_pos = 0;
+    }
+    if (buff->write_pos+size > buff->size)
+    {
+        size_t newsize = buff->size ? buff->size : 1024;
+        while (newsize < buff->write_pos+size)
+            newsize *= 2;
+        buff->data = (unsigned char*)realloc(buff->data, newsize);
+        if (buff->data == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory for the PI simulator.\n");
+            exit(1);
+        }
+        buff->size = newsize;
+    }
+    if (data != NULL)
+        memcpy(buff->data+buff->write_pos, data, size);
+    else
+        memset(buff->data+buff->write_pos, 0, size);
+    buff->write_pos += size;
+}
+
+
+/*==============================
+    pisim_buffer_left
+    Gets how many unread bytes a buffer has
+    @param  The buffer to check
+    @return The number of unread bytes
+==============================*/
+
+static size_t pisim_buffer_left(PISimBuffer* buff)
+{
+    return buff->write_pos - buff->read_pos;
+}
+
+
+/*==============================
+    pisim_buffer_consume
+    Marks bytes at the front of a buffer as read
+    @param The buffer to consume from
+    @param The number of bytes to consume
+==============================*/
+
+static void pisim_buffer_consume(PISimBuffer* buff, size_t size)
+{
+    buff->read_pos += size;
+    if (buff->read_pos == buff->write_pos)
+    {
+        buff->read_pos = 0;
+        buff->write_pos = 0;
+    }
+}
+
+
+/*********************************
+        Helper Functions
+*********************************/
+
+/*==============================
+    pisim_read32
+    Reads a big endian 32-bit value from a buffer
+    @param  The buffer to read from
+    @return The 32-bit value
+==============================*/
+
+static uint32_t pisim_read32(const unsigned char* buff)
+{
+    return (buff[0] << 24) | (buff[1] << 16) | (buff[2] << 8) | buff[3];
+}
+
+
+/*==============================
+    pisim_write32
+    Writes a big endian 32-bit value to a buffer
+    @param The buffer to write to
+    @param The 32-bit value
+==============================*/
+
+static void pisim_write32(unsigned char* buff, uint32_t value)
+{
+    buff[0] = (value >> 24) & 0xFF;
+    buff[1] = (value >> 16) & 0xFF;
+    buff[2] = (value >> 8) & 0xFF;
+    buff[3] = value & 0xFF;
+}
+
+
+/*==============================
+    pisim_sdramaddr
+    Translates a PI address in the cartridge
+    domain into a pointer to the SDRAM
+    @param  The PI address
+    @param  The number of bytes that will be accessed
+    @return A pointer to the SDRAM, or NULL if out of bounds
+==============================*/
+
+static unsigned char* pisim_sdramaddr(uint32_t pi_address, size_t size)
+{
+    pi_address &= PI_ADDRESS_MASK;
+    if (pi_address < PI_CART_BASE || pi_address-PI_CART_BASE+size > PISIM_SDRAMSIZE)
+    {
+        fprintf(stderr, "PI access out of bounds at 0x%08X (%d bytes)\n", pi_address, (int)size);
+        return NULL;
+    }
+    return pisim_sdram + (pi_address - PI_CART_BASE);
+}
+
+
+/*==============================
+    pisim_elapsed
+    Gets the time since the simulator started
+    @return The time in simulated COUNT ticks
+==============================*/
+
+static unsigned long long pisim_elapsed(void)
+{
+    struct timespec now;
+    unsigned long long ns;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (unsigned long long)(now.tv_sec - pisim_starttime.tv_sec)*1000000000ULL + now.tv_nsec - pisim_starttime.tv_nsec;
+    return (ns*(PISIM_TICKRATE/1000))/1000000ULL;
+}
+
+
+/*********************************
+       Connection Functions
+*********************************/
+
+/*==============================
+    pisim_disconnect
+    Closes the connection to UNFLoader
+==============================*/
+
+static void pisim_disconnect(void)
+{
+    if (pisim_clientfd != -1)
+        close(pisim_clientfd);
+    pisim_clientfd = -1;
+    pisim_recvbuffer.read_pos = 0;
+    pisim_recvbuffer.write_pos = 0;
+}
+
+
+/*==============================
+    pisim_sendtcp
+    Sends a message to UNFLoader
+    @param The message type
+    @param A buffer with the data to send
+    @param The size of the data
+==============================*/
+
+static void pisim_sendtcp(int datatype, const void* data, int size)
+{
+    unsigned char header[8];
+    const unsigned char* parts[2];
+    size_t sizes[2];
+    int i;
+
+    if (pisim_clientfd == -1)
+        return;
+    pisim_write32(header, datatype);
+    pisim_write32(header+4, size);
+    parts[0] = header;
+    sizes[0] = 8;
+    parts[1] = (const unsigned char*)data;
+    sizes[1] = size;
+    for (i=0; i<2; i++)
+    {
+        size_t sent = 0;
+        while (sent < sizes[i])
+        {
+            ssize_t ret = send(pisim_clientfd, parts[i]+sent, sizes[i]-sent, MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+            {
+                pisim_disconnect();
+                return;
+            }
+            sent += ret;
+        }
+    }
+}
+
+
+/*==============================
+    pisim_tohost
+    Hands data sent by the flashcart to the host
+    @param The DATATYPE of the data
+    @param A buffer with the data
+    @param The size of the data
+==============================*/
+
+static void pisim_tohost(int datatype, const void* data, int size)
+{
+    pisim_statistics.tohost_packets++;
+    pisim_statistics.tohost_bytes += size;
+    if (pisim_receive != NULL)
+        pisim_receive(datatype, data, size);
+    else
+        pisim_sendtcp(datatype, data, size);
+}
+
+
+/*==============================
+    pisim_handlemessage
+    Handles a message that arrived from UNFLoader
+    @param The message type
+    @param A buffer with the data
+    @param The size of the data
+==============================*/
+
+static void pisim_handlemessage(int datatype, const unsigned char* data, int size)
+{
+    unsigned char refuse = 0;
+    switch (datatype)
+    {
+        case GOPHER64_TCPTEST:
+            pisim_sendtcp(GOPHER64_TCPTEST, data, size);
+            break;
+        case GOPHER64_ROMUPLOAD:
+            printf("Received a %d byte ROM\n", size);
+            fflush(stdout);
+            pisim_rombooted = 1;
+            break;
+        case GOPHER64_ROMSHARED:
+            pisim_sendtcp(GOPHER64_ROMSHARED, &refuse, 1); // Have UNFLoader send the ROM over the socket instead
+            break;
+        default:
+            pisim_hostsend(datatype, data, size);
+            break;
+    }
+}
+
+
+/*==============================
+    pisim_pump
+    Accepts UNFLoader's connection and reads the
+    messages that it sent
+    @param How long to wait for something to happen, in milliseconds
+==============================*/
+
+static void pisim_pump(int timeout)
+{
+    struct pollfd pfd;
+
+    // Accept a new connection if we don't have one
+    if (pisim_clientfd == -1)
+    {
+        if (pisim_listenfd == -1)
+            return;
+        pfd.fd = pisim_listenfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0)
+        {
+            int one = 1;
+            pisim_clientfd = accept(pisim_listenfd, NULL, NULL);
+            if (pisim_clientfd != -1)
+                setsockopt(pisim_clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return;
+    }
+
+    // Read whatever has arrived
+    pfd.fd = pisim_clientfd;
+    pfd.events = POLLIN;
+    while (pisim_clientfd != -1 && poll(&pfd, 1, timeout) > 0)
+    {
+        ssize_t ret;
+        pisim_buffer_append(&pisim_recvbuffer, NULL, GOPHER64_RECVSIZE);
+        pisim_recvbuffer.write_pos -= GOPHER64_RECVSIZE;
+        ret = recv(pisim_clientfd, pisim_recvbuffer.data+pisim_recvbuffer.write_pos, GOPHER64_RECVSIZE, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            pisim_disconnect();
+            return;
+        }
+        pisim_recvbuffer.write_pos += ret;
+        timeout = 0;
+
+        // Handle every complete message
+        while (pisim_buffer_left(&pisim_recvbuffer) >= 8)
+        {
+            unsigned char* header = pisim_recvbuffer.data+pisim_recvbuffer.read_pos;
+            uint32_t size = pisim_read32(header+4);
+            if (pisim_buffer_left(&pisim_recvbuffer) < 8+size)
+                break;
+            pisim_handlemessage(pisim_read32(header), header+8, size);
+            if (pisim_clientfd == -1)
+                return;
+            pisim_buffer_consume(&pisim_recvbuffer, 8+size);
+        }
+    }
+}
+
+
+/*==============================
+    pisim_service
+    Reads any data from UNFLoader while the
+    N64 is polling a status register
+==============================*/
+
+static inline void pisim_service(void)
+{
+    if (pisim_receive == NULL && pisim_queue == NULL)
+        pisim_pump(0);
+}
+
+
+/*==============================
+    pisim_takepacket
+    Removes the oldest packet from the host queue
+    @return The packet, which must be freed, or NULL
+==============================*/
+
+static PISimPacket* pisim_takepacket(void)
+{
+    PISimPacket* packet = pisim_queue;
+    if (packet == NULL)
+        return NULL;
+    pisim_queue = packet->next;
+    if (pisim_queue == NULL)
+        pisim_queuetail = NULL;
+    pisim_statistics.fromhost_packets++;
+    pisim_statistics.fromhost_bytes += packet->size;
+    return packet;
+}
+
+
+/*==============================
+    pisim_freepacket
+    Frees a packet taken from the host queue
+    @param The packet to free
+==============================*/
+
+static void pisim_freepacket(PISimPacket* packet)
+{
+    free(packet->data);
+    free(packet);
+}
+
+
+/*********************************
+         64Drive Functions
+*********************************/
+
+/*==============================
+    d64_arm
+    Arms the CUI, which takes the next
+    packet from the host if there is one
+==============================*/
+
+static void d64_arm(void)
+{
+    uint32_t offset = d64_p0r0 << 1;
+    uint32_t limit = d64_p1r1 & 0x00FFFFFF;
+    uint32_t size;
+    unsigned char* dest;
+    PISimPacket* packet = pisim_takepacket();
+
+    if (packet == NULL)
+    {
+        d64_armstate = D64_CUI_ARM_ARMED;
+        return;
+    }
+
+    // UNFLoader pads the data the same way for the real 64Drive, with an extra 512 bytes to work around a firmware bug
+    if (packet->size > 512)
+        size = ALIGN(packet->size, 512) + 512;
+    else
+        size = ALIGN(packet->size, 4);
+    if (size > limit)
+        size = limit;
+
+    // Copy the data into SDRAM
+    dest = pisim_sdramaddr(PI_CART_BASE + offset, size);
+    if (dest != NULL)
+    {
+        uint32_t copy = MIN((uint32_t)packet->size, size);
+        memcpy(dest, packet->data, copy);
+        memset(dest+copy, 0, size-copy);
+    }
+    d64_p0r0 = (packet->datatype << 24) | size;
+    d64_p1r1 = 0;
+    d64_armstate = D64_CUI_ARM_UNARMED_DATA;
+    pisim_freepacket(packet);
+}
+
+
+/*==============================
+    d64_write
+    Sends data from SDRAM through the CUI
+==============================*/
+
+static void d64_write(void)
+{
+    uint32_t offset = d64_p0r0 << 1;
+    uint32_t size = d64_p1r1 & 0x00FFFFFF;
+    unsigned char* src = pisim_sdramaddr(PI_CART_BASE + offset, size);
+    if (src != NULL)
+        pisim_tohost(d64_p1r1 >> 24, src, size);
+}
+
+
+/*==============================
+    d64_io_read
+    Reads a 64Drive register
+    @param  The register offset
+    @return The register value
+==============================*/
+
+static uint32_t d64_io_read(uint32_t reg)
+{
+    switch (reg)
+    {
+        case D64_REG_STATUS:
+            return 0;
+        case D64_REG_MAGIC:
+            return D64_MAGIC;
+        case D64_REG_BUTTON:
+            return 0xFFFFFFFF;
+        case D64_REG_USBCOMSTAT:
+            if (d64_quiet)
+            {
+                d64_quiet = 0;
+                return d64_armstate;
+            }
+            pisim_service();
+            if (d64_armstate == D64_CUI_ARM_IDLE && pisim_queue != NULL)
+                return D64_CUI_ARM_UNARMED_DATA;
+            return d64_armstate;
+        case D64_REG_USBP0R0:
+            return d64_p0r0;
+        case D64_REG_USBP1R1:
+            return d64_p1r1;
+        default:
+            return 0;
+    }
+}
+
+
+/*==============================
+    d64_io_write
+    Writes a 64Drive register
+    @param The register offset
+    @param The value to write
+==============================*/
+
+static void d64_io_write(uint32_t reg, uint32_t value)
+{
+    switch (reg)
+    {
+        case D64_REG_COMMAND:
+            if (value == D64_CI_ENABLE_ROMWR || value == D64_CI_DISABLE_ROMWR)
+                d64_writable = (value == D64_CI_ENABLE_ROMWR);
+            else if (value == D64_CI_ENABLE_EXTADDR || value == D64_CI_DISABLE_EXTADDR)
+                d64_extended = (value == D64_CI_ENABLE_EXTADDR);
+            break;
+        case D64_REG_USBCOMSTAT:
+            if (value == D64_CUI_ARM)
+                d64_arm();
+            else if (value == D64_CUI_DISARM)
+            {
+                d64_armstate = D64_CUI_ARM_IDLE;
+                d64_quiet = 1; // Don't report new data until the N64 has seen the disarm go through
+            }
+            else if (value == D64_CUI_WRITE)
+                d64_write();
+            break;
+        case D64_REG_USBP0R0:
+            d64_p0r0 = value;
+            break;
+        case D64_REG_USBP1R1:
+            d64_p1r1 = value;
+            break;
+    }
+}
+
+
+/*********************************
+        EverDrive Functions
+*********************************/
+
+/*==============================
+    ed_fillrx
+    Moves the next packet from the host into
+    the USB receive FIFO, framed like
+    UNFLoader does for the real EverDrive
+==============================*/
+
+static void ed_fillrx(void)
+{
+    unsigned char header[8];
+    PISimPacket* packet;
+
+    if (pisim_buffer_left(&ed_rxbuffer) > 0)
+        return;
+    pisim_service();
+    packet = pisim_takepacket();
+    if (packet == NULL)
+        return;
+    memcpy(header, "DMA@", 4);
+    pisim_write32(header+4, (packet->datatype << 24) | (packet->size & 0x00FFFFFF));
+    pisim_buffer_append(&ed_rxbuffer, header, 8);
+    pisim_buffer_append(&ed_rxbuffer, packet->data, packet->size);
+    pisim_buffer_append(&ed_rxbuffer, NULL, packet->size % 2);
+    pisim_buffer_append(&ed_rxbuffer, "CMPH", 4);
+    pisim_freepacket(packet);
+}
+
+
+/*==============================
+    ed_parsetx
+    Looks for complete packets in the data
+    the N64 sent through the USB
+==============================*/
+
+static void ed_parsetx(void)
+{
+    while (pisim_buffer_left(&ed_txbuffer) >= 8)
+    {
+        unsigned char* data = ed_txbuffer.data+ed_txbuffer.read_pos;
+        uint32_t header, size, total;
+
+        // Skip anything that isn't a packet, like the padding at the end of the last one
+        if (memcmp(data, "DMA@", 4) != 0)
+        {
+            pisim_buffer_consume(&ed_txbuffer, 1);
+            continue;
+        }
+
+        // Wait until we have the whole packet
+        header = pisim_read32(data+4);
+        size = header & 0x00FFFFFF;
+        total = 8 + size + 4;
+        if (pisim_buffer_left(&ed_txbuffer) < total)
+            return;
+        if (memcmp(data+8+size, "CMPH", 4) != 0)
+            fprintf(stderr, "EverDrive packet is missing its CMPH signal\n");
+        else
+            pisim_tohost(header >> 24, data+8, size);
+        pisim_buffer_consume(&ed_txbuffer, total);
+    }
+}
+
+
+/*==============================
+    ed_io_read
+    Reads an EverDrive register
+    @param  The register offset
+    @return The register value
+==============================*/
+
+static uint32_t ed_io_read(uint32_t reg)
+{
+    if (!ed_unlocked)
+        return 0;
+    switch (reg)
+    {
+        case ED_REG_VERSION:
+            return ED_VERSION;
+        case ED_REG_USBCFG:
+            ed_fillrx();
+            return ED_USBSTAT_POWER | (pisim_buffer_left(&ed_rxbuffer) == 0 ? ED_USBSTAT_RXF : 0);
+        default:
+            if (reg >= ED_REG_USBDAT && reg < ED_REG_USBDAT+ED_USBDAT_SIZE)
+                return pisim_read32(ed_usbdat + ((reg - ED_REG_USBDAT) & ~3));
+            return 0;
+    }
+}
+
+
+/*==============================
+    ed_io_write
+    Writes an EverDrive register
+    @param The register offset
+    @param The value to write
+==============================*/
+
+static void ed_io_write(uint32_t reg, uint32_t value)
+{
+    uint32_t addr = value & (ED_USBDAT_SIZE-1);
+    if (reg == ED_REG_KEY)
+    {
+        ed_unlocked = (value == ED_REGKEY);
+        return;
+    }
+    if (!ed_unlocked || reg != ED_REG_USBCFG)
+        return;
+    switch (value & ED_USBMODE_MASK)
+    {
+        case ED_USBMODE_RD & ED_USBMODE_MASK:
+        {
+            // Move data from the receive FIFO into the USB buffer
+            uint32_t size = ED_USBDAT_SIZE - addr;
+            uint32_t copy;
+            ed_fillrx();
+            copy = MIN(size, (uint32_t)pisim_buffer_left(&ed_rxbuffer));
+            memcpy(ed_usbdat+addr, ed_rxbuffer.data+ed_rxbuffer.read_pos, copy);
+            memset(ed_usbdat+addr+copy, 0, size-copy);
+            pisim_buffer_consume(&ed_rxbuffer, copy);
+            break;
+        }
+        case ED_USBMODE_WR & ED_USBMODE_MASK:
+            pisim_buffer_append(&ed_txbuffer, ed_usbdat+addr, ED_USBDAT_SIZE-addr);
+            ed_parsetx();
+            break;
+    }
+}
+
+
+/*********************************
+          SC64 Functions
+*********************************/
+
+/*==============================
+    sc64_execute
+    Executes an SC64 controller command
+    @param The command ID
+==============================*/
+
+static void sc64_execute(uint32_t cmd)
+{
+    sc64_sr = 0;
+    switch (cmd)
+    {
+        case SC64_CMD_CONFIG_SET:
+            if (sc64_data[0] == SC64_CFG_ROM_WRITE_ENABLE)
+            {
+                uint32_t previous = sc64_writable;
+                sc64_writable = (sc64_data[1] != 0);
+                sc64_data[1] = previous;
+            }
+            else
+                sc64_sr = SC64_SR_CMD_ERROR;
+            break;
+        case SC64_CMD_USB_WRITE_STATUS:
+            sc64_data[0] = 0;
+            sc64_data[1] = 0;
+            break;
+        case SC64_CMD_USB_WRITE:
+        {
+            uint32_t size = sc64_data[1] & 0x00FFFFFF;
+            unsigned char* src = pisim_sdramaddr(sc64_data[0], size);
+            if (src == NULL)
+                sc64_sr = SC64_SR_CMD_ERROR;
+            else
+                pisim_tohost(sc64_data[1] >> 24, src, size);
+            break;
+        }
+        case SC64_CMD_USB_READ_STATUS:
+            pisim_service();
+            if (pisim_queue != NULL)
+            {
+                sc64_data[0] = pisim_queue->datatype;
+                sc64_data[1] = pisim_queue->size;
+            }
+            else
+            {
+                sc64_data[0] = 0;
+                sc64_data[1] = 0;
+            }
+            break;
+        case SC64_CMD_USB_READ:
+        {
+            PISimPacket* packet = pisim_takepacket();
+            unsigned char* dest;
+            if (packet == NULL)
+            {
+                sc64_sr = SC64_SR_CMD_ERROR;
+                break;
+            }
+            dest = pisim_sdramaddr(sc64_data[0], packet->size);
+            if (dest != NULL)
+                memcpy(dest, packet->data, MIN((uint32_t)packet->size, sc64_data[1]));
+            pisim_freepacket(packet);
+            break;
+        }
+        default:
+            sc64_sr = SC64_SR_CMD_ERROR;
+            break;
+    }
+}
+
+
+/*==============================
+    sc64_io_read
+    Reads an SC64 register
+    @param  The register offset
+    @return The register value
+==============================*/
+
+static uint32_t sc64_io_read(uint32_t reg)
+{
+    if (sc64_unlockstep != 2 && reg != SC64_REG_KEY)
+        return 0;
+    switch (reg)
+    {
+        case SC64_REG_SR_CMD:
+            return sc64_sr;
+        case SC64_REG_DATA_0:
+            return sc64_data[0];
+        case SC64_REG_DATA_1:
+            return sc64_data[1];
+        case SC64_REG_IDENTIFIER:
+            return SC64_V2_IDENTIFIER;
+        default:
+            return 0;
+    }
+}
+
+
+/*==============================
+    sc64_io_write
+    Writes an SC64 register
+    @param The register offset
+    @param The value to write
+==============================*/
+
+static void sc64_io_write(uint32_t reg, uint32_t value)
+{
+    if (reg == SC64_REG_KEY)
+    {
+        if (value == SC64_KEY_RESET)
+            sc64_unlockstep = 0;
+        else if (value == SC64_KEY_UNLOCK_1 && sc64_unlockstep == 0)
+            sc64_unlockstep = 1;
+        else if (value == SC64_KEY_UNLOCK_2 && sc64_unlockstep == 1)
+            sc64_unlockstep = 2;
+        else
+            sc64_unlockstep = 0;
+        return;
+    }
+    if (sc64_unlockstep != 2)
+        return;
+    switch (reg)
+    {
+        case SC64_REG_SR_CMD:
+            sc64_execute(value & 0xFF);
+            break;
+        case SC64_REG_DATA_0:
+            sc64_data[0] = value;
+            break;
+        case SC64_REG_DATA_1:
+            sc64_data[1] = value;
+            break;
+    }
+}
+
+
+/*********************************
+          PI Functions
+*********************************/
+
+/*==============================
+    io_read
+    Reads a 32-bit value from the PI bus
+    @param  The address to read from
+    @return The value that was read
+==============================*/
+
+uint32_t io_read(uint32_t pi_address)
+{
+    uint32_t d64base = d64_extended ? D64_REGS_BASE_EXTENDED : D64_REGS_BASE;
+    pi_address &= PI_ADDRESS_MASK;
+    pisim_statistics.io_reads++;
+    switch (pisim_cart)
+    {
+        case CART_64DRIVE:
+            if (pi_address >= d64base && pi_address < d64base+D64_REGS_SIZE)
+                return d64_io_read(pi_address - d64base);
+            break;
+        case CART_EVERDRIVE:
+            if (pi_address >= ED_REGS_BASE && pi_address < ED_REGS_BASE+ED_REGS_SIZE)
+                return ed_io_read(pi_address - ED_REGS_BASE);
+            break;
+        case CART_SC64:
+            if (pi_address >= SC64_REGS_BASE && pi_address < SC64_REGS_BASE+SC64_REGS_SIZE)
+                return sc64_io_read(pi_address - SC64_REGS_BASE);
+            break;
+    }
+    if (pi_address >= PI_CART_BASE && pi_address < PI_CART_BASE+PISIM_SDRAMSIZE)
+        return pisim_read32(pisim_sdram + ((pi_address - PI_CART_BASE) & ~3));
+    return 0;
+}
+
+
+/*==============================
+    io_write
+    Writes a 32-bit value to the PI bus
+    @param The address to write to
+    @param The value to write
+==============================*/
+
+void io_write(uint32_t pi_address, uint32_t data)
+{
+    uint32_t d64base = d64_extended ? D64_REGS_BASE_EXTENDED : D64_REGS_BASE;
+    pi_address &= PI_ADDRESS_MASK;
+    pisim_statistics.io_writes++;
+    switch (pisim_cart)
+    {
+        case CART_64DRIVE:
+            if (pi_address >= d64base && pi_address < d64base+D64_REGS_SIZE)
+                d64_io_write(pi_address - d64base, data);
+            break;
+        case CART_EVERDRIVE:
+            if (pi_address >= ED_REGS_BASE && pi_address < ED_REGS_BASE+ED_REGS_SIZE)
+                ed_io_write(pi_address - ED_REGS_BASE, data);
+            break;
+        case CART_SC64:
+            if (pi_address >= SC64_REGS_BASE && pi_address < SC64_REGS_BASE+SC64_REGS_SIZE)
+                sc64_io_write(pi_address - SC64_REGS_BASE, data);
+            break;
+    }
+}
+
+
+/*==============================
+    dma_read
+    Copies data from the PI bus into RDRAM
+    @param The buffer to copy to
+    @param The address to copy from
+    @param The number of bytes to copy
+==============================*/
+
+void dma_read(void* ram_address, unsigned long pi_address, unsigned long len)
+{
+    unsigned char* src;
+    pi_address &= PI_ADDRESS_MASK;
+    pisim_statistics.dma_reads++;
+    pisim_statistics.dma_bytes += len;
+    if (pisim_cart == CART_EVERDRIVE && pi_address >= ED_REGS_BASE+ED_REG_USBDAT && pi_address+len <= ED_REGS_BASE+ED_REG_USBDAT+ED_USBDAT_SIZE)
+    {
+        memcpy(ram_address, ed_usbdat + (pi_address - (ED_REGS_BASE+ED_REG_USBDAT)), len);
+        return;
+    }
+    src = pisim_sdramaddr(pi_address, len);
+    if (src != NULL)
+        memcpy(ram_address, src, len);
+}
+
+
+/*==============================
+    dma_write
+    Copies data from RDRAM onto the PI bus
+    @param The buffer to copy from
+    @param The address to copy to
+    @param The number of bytes to copy
+==============================*/
+
+void dma_write(const void* ram_address, unsigned long pi_address, unsigned long len)
+{
+    unsigned char* dest;
+    pi_address &= PI_ADDRESS_MASK;
+    pisim_statistics.dma_writes++;
+    pisim_statistics.dma_bytes += len;
+    if (pisim_cart == CART_EVERDRIVE && pi_address >= ED_REGS_BASE+ED_REG_USBDAT && pi_address+len <= ED_REGS_BASE+ED_REG_USBDAT+ED_USBDAT_SIZE)
+    {
+        memcpy(ed_usbdat + (pi_address - (ED_REGS_BASE+ED_REG_USBDAT)), ram_address, len);
+        return;
+    }
+
+    // The 64Drive and SC64 ignore writes to SDRAM unless they were enabled
+    if ((pisim_cart == CART_64DRIVE && !d64_writable) || (pisim_cart == CART_SC64 && !sc64_writable))
+    {
+        pisim_statistics.rejected++;
+        return;
+    }
+    dest = pisim_sdramaddr(pi_address, len);
+    if (dest != NULL)
+        memcpy(dest, ram_address, len);
+}
+
+
+/*==============================
+    dma_read_raw_async
+    Starts copying data from the PI bus into RDRAM.
+    The simulator finishes the copy right away
+    @param The buffer to copy to
+    @param The address to copy from
+    @param The number of bytes to copy
+==============================*/
+
+void dma_read_raw_async(void* ram_address, unsigned long pi_address, unsigned long len)
+{
+    pisim_statistics.dma_async++;
+    dma_read(ram_address, pi_address, len);
+}
+
+
+/*==============================
+    dma_write_raw_async
+    Starts copying data from RDRAM onto the PI bus.
+    The simulator finishes the copy right away
+    @param The buffer to copy from
+    @param The address to copy to
+    @param The number of bytes to copy
+==============================*/
+
+void dma_write_raw_async(const void* ram_address, unsigned long pi_address, unsigned long len)
+{
+    pisim_statistics.dma_async++;
+    dma_write(ram_address, pi_address, len);
+}
+
+
+/*==============================
+    dma_wait
+    Waits for the PI DMA to finish, which
+    the simulator does instantly
+==============================*/
+
+void dma_wait(void)
+{
+}
+
+
+/*==============================
+    data_cache_hit_writeback
+    Writes the data cache back to RDRAM,
+    which the PC does on its own
+==============================*/
+
+void data_cache_hit_writeback(volatile const void* addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+
+/*==============================
+    data_cache_hit_invalidate
+    Invalidates the data cache,
+    which the PC does on its own
+==============================*/
+
+void data_cache_hit_invalidate(volatile void* addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+
+/*==============================
+    data_cache_hit_writeback_invalidate
+    Writes back and invalidates the data cache,
+    which the PC does on its own
+==============================*/
+
+void data_cache_hit_writeback_invalidate(volatile void* addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+
+/*==============================
+    inst_cache_hit_invalidate
+    Invalidates the instruction cache, which
+    the PC does on its own
+==============================*/
+
+void inst_cache_hit_invalidate(volatile void* addr, unsigned long length)
+{
+    (void)addr;
+    (void)length;
+}
+
+
+/*==============================
+    get_memory_size
+    Gets the size of the simulated RDRAM
+    @return The size of RDRAM, or 0 if it couldn't be mapped
+==============================*/
+
+int get_memory_size(void)
+{
+    return (pisim_rdram != NULL) ? PISIM_RDRAMSIZE : 0;
+}
+
+
+/*********************************
+         Timer Functions
+*********************************/
+
+/*==============================
+    pisim_ticks
+    Reads the simulated COUNT register
+    @return The COUNT register value
+==============================*/
+
+uint32_t pisim_ticks(void)
+{
+    return (uint32_t)pisim_elapsed();
+}
+
+
+/*==============================
+    timer_ticks
+    Gets the time since the simulator started
+    @return The time in COUNT ticks
+==============================*/
+
+long long timer_ticks(void)
+{
+    return (long long)pisim_elapsed();
+}
+
+
+/*==============================
+    pisim_epc
+    Reads the simulated EPC register, which holds the address
+    that the CPU was interrupted at. Every read moves on to the
+    next instruction, so that samples can be told apart
+    @return The EPC register value
+==============================*/
+
+uint32_t pisim_epc(void)
+{
+    static uint32_t epc = 0x80000400;
+    uint32_t value = epc;
+    epc += 4;
+    return value;
+}
+
+
+/*==============================
+    timer_init
+    Initializes the timer subsystem
+==============================*/
+
+void timer_init(void)
+{
+}
+
+
+/*==============================
+    new_timer
+    Creates a timer, which runs during pisim_update
+    @param  The number of ticks between calls
+    @param  TF_CONTINUOUS or TF_ONE_SHOT
+    @param  The function to call
+    @return The timer, or NULL if there are too many
+==============================*/
+
+timer_link_t* new_timer(int ticks, int flags, void (*callback)(int ovfl))
+{
+    timer_link_t* timer;
+    if (pisim_timercount == PISIM_MAXTIMERS)
+        return NULL;
+    timer = &pisim_timers[pisim_timercount];
+    timer->ticks = ticks;
+    timer->left = ticks;
+    timer->flags = flags;
+    timer->callback = callback;
+    pisim_timerdue[pisim_timercount] = pisim_elapsed() + ticks;
+    pisim_timercount++;
+    return timer;
+}
+
+
+/*==============================
+    disable_interrupts
+    Stops timers from running
+==============================*/
+
+void disable_interrupts(void)
+{
+    pisim_intdisabled++;
+}
+
+
+/*==============================
+    enable_interrupts
+    Allows timers to run again
+==============================*/
+
+void enable_interrupts(void)
+{
+    if (pisim_intdisabled > 0)
+        pisim_intdisabled--;
+}
+
+
+/*==============================
+    wait_ms
+    Waits while servicing the simulator
+    @param The time to wait, in milliseconds
+==============================*/
+
+void wait_ms(unsigned long ms)
+{
+    unsigned long long end = pisim_elapsed() + (unsigned long long)ms*(PISIM_TICKRATE/1000);
+    while (pisim_elapsed() < end)
+    {
+        pisim_pump(1);
+        pisim_update();
+    }
+}
+
+
+/*==============================
+    pisim_runtimers
+    Runs the timers that are due
+    @param Whether to run every timer, even if it isn't due
+==============================*/
+
+static void pisim_runtimers(int force)
+{
+    int i;
+    unsigned long long now = pisim_elapsed();
+
+    // Timers are interrupts, so they can't interrupt each other or code that disabled them
+    if (pisim_intimer || pisim_intdisabled)
+        return;
+    pisim_intimer = 1;
+    for (i=0; i<pisim_timercount; i++)
+    {
+        if (pisim_timers[i].callback == NULL || (!force && now < pisim_timerdue[i]))
+            continue;
+        pisim_timers[i].callback(0);
+        pisim_timerdue[i] = now + pisim_timers[i].ticks;
+        if (pisim_timers[i].flags != TF_CONTINUOUS)
+            pisim_timers[i].callback = NULL;
+    }
+    pisim_intimer = 0;
+}
+
+
+/*********************************
+       Simulator Functions
+*********************************/
+
+/*==============================
+    pisim_initialize
+    Selects which flashcart the PI bus pretends to have plugged in
+    @param The CART macro of the flashcart to simulate
+==============================*/
+
+void pisim_initialize(int cart)
+{
+    pisim_cart = cart;
+    clock_gettime(CLOCK_MONOTONIC, &pisim_starttime);
+    if (pisim_sdram == NULL)
+        pisim_sdram = (unsigned char*)calloc(1, PISIM_SDRAMSIZE);
+    if (pisim_sdram == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for the PI simulator.\n");
+        exit(1);
+    }
+
+    // Put RDRAM where the N64 has it, so that KSEG0 addresses work. If that's taken, patches will be refused instead
+    if (pisim_rdram == NULL)
+    {
+        void* rdram = mmap((void*)0x80000000UL, PISIM_RDRAMSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (rdram == (void*)0x80000000UL)
+            pisim_rdram = (unsigned char*)rdram;
+        else if (rdram != MAP_FAILED)
+            munmap(rdram, PISIM_RDRAMSIZE);
+    }
+}
+
+
+/*==============================
+    pisim_listen
+    Waits for UNFLoader to connect and upload a ROM. UNFLoader
+    talks to the simulator like it would to the Gopher64 emulator
+    @param  The TCP port to listen on
+    @return 1 once a ROM was uploaded, 0 on failure
+==============================*/
+
+int pisim_listen(int port)
+{
+    int one = 1;
+    struct sockaddr_in addr;
+
+    // Open the socket
+    pisim_listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (pisim_listenfd == -1)
+    {
+        perror("socket");
+        return 0;
+    }
+    setsockopt(pisim_listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(pisim_listenfd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(pisim_listenfd, 1) == -1)
+    {
+        perror("bind");
+        close(pisim_listenfd);
+        pisim_listenfd = -1;
+        return 0;
+    }
+
+    // Wait for a ROM to boot, answering UNFLoader's autodetection in the meantime
+    printf("Waiting for UNFLoader on port %d\n", port);
+    fflush(stdout);
+    while (!pisim_rombooted)
+        pisim_pump(100);
+    return 1;
+}
+
+
+/*==============================
+    pisim_loopback
+    Connects the flashcart's USB port to a function
+    instead of UNFLoader
+    @param The function that receives the data the N64 sends
+==============================*/
+
+void pisim_loopback(void (*receive)(int datatype, const void* data, int size))
+{
+    pisim_receive = receive;
+}
+
+
+/*==============================
+    pisim_hostsend
+    Queues data on the flashcart's USB port, as if
+    it was sent by the host
+    @param The DATATYPE of the data
+    @param A buffer with the data to send
+    @param The size of the data
+==============================*/
+
+void pisim_hostsend(int datatype, const void* data, int size)
+{
+    PISimPacket* packet = (PISimPacket*)malloc(sizeof(PISimPacket));
+    if (packet != NULL)
+        packet->data = (unsigned char*)malloc(size > 0 ? size : 1);
+    if (packet == NULL || packet->data == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for the PI simulator.\n");
+        exit(1);
+    }
+    memcpy(packet->data, data, size);
+    packet->datatype = datatype;
+    packet->size = size;
+    packet->next = NULL;
+    if (pisim_queuetail != NULL)
+        pisim_queuetail->next = packet;
+    else
+        pisim_queue = packet;
+    pisim_queuetail = packet;
+}
+
+
+/*==============================
+    pisim_update
+    Services the connection to UNFLoader and runs
+    any libdragon timers that are due
+==============================*/
+
+void pisim_update(void)
+{
+    if (pisim_receive == NULL)
+        pisim_pump(0);
+    pisim_runtimers(0);
+}
+
+
+/*==============================
+    pisim_firetimers
+    Runs every libdragon timer right away, regardless
+    of whether they are due
+==============================*/
+
+void pisim_firetimers(void)
+{
+    pisim_runtimers(1);
+}
+
+
+/*==============================
+    pisim_connected
+    Checks whether UNFLoader is still connected
+    @return 1 if it is, 0 if not
+==============================*/
+
+int pisim_connected(void)
+{
+    return pisim_clientfd != -1;
+}
+
+
+/*==============================
+    pisim_stats
+    Gets the PI bus statistics
+    @return A pointer to the statistics, which can be cleared
+==============================*/
+
+PISimStats* pisim_stats(void)
+{
+    return &pisim_statistics;
+}
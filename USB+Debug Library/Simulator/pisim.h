@@ -0,0 +1,117 @@
+#ifndef UNFL_PISIM_H
+#define UNFL_PISIM_H
+
+    /*********************************
+             Settings macros
+    *********************************/
+
+    #define PISIM_DEFAULTPORT 48646             // The port UNFLoader looks for Gopher64 on
+    #define PISIM_SDRAMSIZE   (64*1024*1024)    // Size of the simulated cartridge SDRAM
+    #define PISIM_RDRAMSIZE   (8*1024*1024)     // Size of the simulated RDRAM, which is mapped at 0x80000000 so that patches can be written to it
+    #define PISIM_TICKRATE    46875000          // Rate of the simulated COUNT register (half of the CPU clock)
+    #define PISIM_MAXTIMERS   8                 // How many libdragon timers can be created
+
+
+    /*********************************
+                 Structs
+    *********************************/
+
+    // PI bus statistics
+    typedef struct
+    {
+        unsigned long long io_reads;
+        unsigned long long io_writes;
+        unsigned long long dma_reads;   // Cart to RDRAM
+        unsigned long long dma_writes;  // RDRAM to cart
+        unsigned long long dma_bytes;
+        unsigned long long dma_async;   // DMAs that the library didn't wait on straight away
+        unsigned long long rejected;    // DMA writes to SDRAM while it was write protected
+        unsigned long long tohost_packets;
+        unsigned long long tohost_bytes;
+        unsigned long long fromhost_packets;
+        unsigned long long fromhost_bytes;
+    } PISimStats;
+
+
+    /*********************************
+           Simulator Functions
+    *********************************/
+
+    /*==============================
+        pisim_initialize
+        Selects which flashcart the PI bus pretends to have plugged in
+        @param The CART macro of the flashcart to simulate
+    ==============================*/
+
+    extern void pisim_initialize(int cart);
+
+
+    /*==============================
+        pisim_listen
+        Waits for UNFLoader to connect and upload a ROM. UNFLoader
+        talks to the simulator like it would to the Gopher64 emulator
+        @param  The TCP port to listen on
+        @return 1 once a ROM was uploaded, 0 on failure
+    ==============================*/
+
+    extern int pisim_listen(int port);
+
+
+    /*==============================
+        pisim_loopback
+        Connects the flashcart's USB port to a function
+        instead of UNFLoader
+        @param The function that receives the data the N64 sends
+    ==============================*/
+
+    extern void pisim_loopback(void (*receive)(int datatype, const void* data, int size));
+
+
+    /*==============================
+        pisim_hostsend
+        Queues data on the flashcart's USB port, as if
+        it was sent by the host
+        @param The DATATYPE of the data
+        @param A buffer with the data to send
+        @param The size of the data
+    ==============================*/
+
+    extern void pisim_hostsend(int datatype, const void* data, int size);
+
+
+    /*==============================
+        pisim_update
+        Services the connection to UNFLoader and runs
+        any libdragon timers that are due
+    ==============================*/
+
+    extern void pisim_update(void);
+
+
+    /*==============================
+        pisim_firetimers
+        Runs every libdragon timer right away, regardless
+        of whether they are due
+    ==============================*/
+
+    extern void pisim_firetimers(void);
+
+
+    /*==============================
+        pisim_connected
+        Checks whether UNFLoader is still connected
+        @return 1 if it is, 0 if not
+    ==============================*/
+
+    extern int pisim_connected(void);
+
+
+    /*==============================
+        pisim_stats
+        Gets the PI bus statistics
+        @return A pointer to the statistics, which can be cleared
+    ==============================*/
+
+    extern PISimStats* pisim_stats(void);
+
+#endif
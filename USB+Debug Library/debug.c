@@ -29,12 +29,17 @@ https://github.com/buu342/N64-UNFLoader
     #define MSG_FAULT  0x10
     #define MSG_READ   0x11
     #define MSG_WRITE  0x12
+    #define MSG_FLUSH  0x13
+    #define MSG_STREAM 0x14
+    #define MSG_FSREAD 0x15
     
     #define USBERROR_NONE     0
     #define USBERROR_NOTTEXT  1
     #define USBERROR_UNKNOWN  2
     #define USBERROR_TOOMUCH  3
     #define USBERROR_CUSTOM   4
+    #define USBERROR_SEGMENT  5
+    #define USBERROR_PATCH    6
     
     // RDB thread messages (Libultra)
     #ifndef LIBDRAGON
@@ -52,8 +57,24 @@ https://github.com/buu342/N64-UNFLoader
     #define HASHTABLE_SIZE  7
     #define COMMAND_TOKENS  10
     #define BUFFER_SIZE     256
+    #define FS_HEADERSIZE   12  // Request ID, offset and size of a debug_fs_read request, followed by the path
+    #define PROFILE_HEADERSIZE 8  // Sample rate and dropped sample count, at the start of every batch of samples
+    #define PROFILE_SAMPLESIZE 12 // PC, RA and thread ID of every sample
+    #define ZONE_HEADERSIZE 12    // COUNT rate, COUNT when sent and dropped event count, at the start of every batch of zone events
+    #define ZONE_EVENTSIZE  8     // COUNT, then the thread ID, event type and zone ID of every zone event
+    #define ZONE_BEGIN      0
+    #define ZONE_END        1
+    #define HEAP_HEADERSIZE 4     // Dropped event count, at the start of every batch of heap events
+    #define HEAP_EVENTSIZE  12    // Pointer, then the event type and size, then the caller of every heap event
+    #define HEAP_ALLOC      0
+    #define HEAP_FREE       1
+    #define CORE_HEADERSIZE 8     // RDRAM size and thread count, at the start of a core dump
+    #define CORE_THREADSIZE 424   // ID, GPRs, lo, hi, pc, badvaddr, sr, cause, fpcsr and FPRs of every thread in a core dump
+    #define CORE_MAXTHREADS 16    // Max amount of threads whose registers are put in a core dump
+    #define CORE_CHUNKSIZE  (1024*1024) // RDRAM is sent in DMAs of this size when a core is dumped
     #define REGISTER_COUNT  72  // 32 GPRs + 6 SPRs + 16 FPRs + fsr + fir (fcr0)
     #define REGISTER_SIZE   16  // GDB expects the registers to be 64-bits
+    #define HEX2NIBBLE(c)   (debug_hexvalues[(c) & 0x1F])
     
     
     /*********************************
@@ -148,6 +169,20 @@ https://github.com/buu342/N64-UNFLoader
         u32  instruction;
     } bPoint;
     
+    // Virtual filesystem read struct
+    typedef struct
+    {
+        const char* path;
+        u32  offset;
+        u32  size;
+        u8*  buffer;
+        u32  read;     // How many bytes have arrived so far
+        u32  id;       // The ID of the request that is waiting for an answer, or 0 if the next one needs to be sent
+        u64  sendtime; // When the request was sent
+        char done;
+        char failed;
+    } debugFSRead;
+    
     
     /*********************************
             Function Prototypes
@@ -158,11 +193,23 @@ https://github.com/buu342/N64-UNFLoader
     #ifndef LIBDRAGON
         #if USE_FAULTTHREAD
             static void debug_thread_fault(void* arg);
+            #if USE_COREDUMP
+                static void debug_coredump(OSThread* faulted);
+            #endif
+        #endif
+        #if USE_PROFILER
+            static void debug_thread_profiler(void* arg);
         #endif
     #else
         #if AUTOPOLL_ENABLED
             static void debug_timer_usb(int overflow);
         #endif
+        #if PRINT_RING_SIZE || USE_PROFILER || USE_ZONES || USE_HEAPTRACE
+            static void debug_timer_flush(int overflow);
+        #endif
+        #if USE_PROFILER
+            static void debug_timer_profiler(int overflow);
+        #endif
     #endif
     #if USE_RDBTHREAD
         #ifndef LIBDRAGON
@@ -178,6 +225,8 @@ https://github.com/buu342/N64-UNFLoader
         static void debug_rdb_writeregisters(OSThread* t);
         static void debug_rdb_readmemory(OSThread* t);
         static void debug_rdb_writememory(OSThread* t);
+        static void debug_rdb_readmemorybinary(OSThread* t);
+        static void debug_rdb_writememorybinary(OSThread* t);
         static void debug_rdb_addbreakpoint(OSThread* t);
         static void debug_rdb_removebreakpoint(OSThread* t);
         static void debug_rdb_continue(OSThread* t);
@@ -191,6 +240,27 @@ https://github.com/buu342/N64-UNFLoader
         #endif
     #endif
     static inline void debug_handle_64drivebutton();
+    static char debug_handle_segment(int header);
+    static char debug_handle_patch(int header);
+    static void debug_handle_fsdata(int header);
+    static char debug_fs_service(debugFSRead* req);
+    #if PRINT_RING_SIZE
+        static void debug_ring_push(const char* str, u32 len);
+        static void debug_ring_flush();
+        static void debug_ring_wake();
+    #endif
+    #if USE_PROFILER
+        static void debug_profile_push(u32 pc, u32 ra, u32 thread);
+        static void debug_profile_flush();
+    #endif
+    #if USE_ZONES
+        static void debug_zone_push(u32 type, u32 id);
+        static void debug_zone_flush();
+    #endif
+    #if USE_HEAPTRACE
+        static void debug_heap_push(u32 type, u32 ptr, u32 size, u32 caller);
+        static void debug_heap_flush();
+    #endif
     
     
     /*********************************
@@ -203,11 +273,18 @@ https://github.com/buu342/N64-UNFLoader
         #if OVERWRITE_OSPRINT
             extern void* __printfunc;
         #endif
+        #if USE_PROFILER
+            extern OSThread* __osRunQueue;
+        #endif
     #endif
     
     // Debug globals
     static char  debug_initialized = 0;
     static char  debug_buffer[BUFFER_SIZE];
+    #ifdef LIBDRAGON
+        static vu8 debug_usbbusy = FALSE; // Stops timers from using the USB while the program is already doing so
+        static vu8 debug_flushpending = FALSE; // Set once a ring is half full, so that the flush timer sends it
+    #endif
     
     // Commands hashtable related
     static debugCommand* debug_commands_hashtable[HASHTABLE_SIZE];
@@ -221,6 +298,21 @@ https://github.com/buu342/N64-UNFLoader
     static int   debug_command_incoming_size[COMMAND_TOKENS];
     static char* debug_command_error = NULL;
     
+    // Segmented transfer related
+    static void (*debug_segment_func)(unsigned int, unsigned int, unsigned int, unsigned int) = NULL;
+    static void (*debug_segment_complete)(unsigned int, unsigned int) = NULL;
+    static u8*  debug_segment_buffer = NULL;
+    static u32  debug_segment_buffersize = 0;
+    static u32  debug_segment_transfer = 0;
+    static u32  debug_segment_next = 0;
+    
+    // Memory patch related
+    static void (*debug_patch_func)(void*, unsigned int) = NULL;
+    
+    // Virtual filesystem related
+    static debugFSRead* debug_fs_current = NULL;
+    static u32          debug_fs_lastid = 0;
+    
     // Assertion globals
     static int         assert_line = 0;
     static const char* assert_file = NULL;
@@ -231,6 +323,52 @@ https://github.com/buu342/N64-UNFLoader
     static u64   debug_64dbut_debounce = 0;
     static u64   debug_64dbut_hold = 0;
     
+    // Print ring buffer globals
+    #if PRINT_RING_SIZE
+        static char    debug_ring[PRINT_RING_SIZE];
+        static vu32    debug_ring_write = 0; // Bytes copied into the ring (free running)
+        static vu32    debug_ring_read = 0; // Bytes sent through USB (free running)
+        static vu32    debug_ring_dropped = 0;
+        static usbMesg debug_ring_mesg = {MSG_FLUSH, DATATYPE_TEXT, NULL, 0};
+    #endif
+    
+    // Profiler globals
+    #if USE_PROFILER
+        static vu32    debug_profile_ring[PROFILER_RING*3]; // PC, RA and thread ID of every sample
+        static vu32    debug_profile_write = 0; // Samples taken (free running)
+        static vu32    debug_profile_read = 0; // Samples sent through USB (free running)
+        static vu32    debug_profile_dropped = 0; // Samples lost because the ring was full (free running)
+        static vu8     debug_profile_enabled = TRUE;
+        static u8      debug_profile_packet[PROFILE_HEADERSIZE + (PROFILER_RING/2)*PROFILE_SAMPLESIZE];
+        #ifndef LIBDRAGON
+            static usbMesg debug_profile_mesg = {MSG_FLUSH, DATATYPE_PROFILE, NULL, 0};
+        #endif
+    #endif
+    
+    // Zone globals
+    #if USE_ZONES
+        static vu32    debug_zone_ring[ZONE_RING*2]; // COUNT, then the thread ID, type and zone ID of every event
+        static vu32    debug_zone_write = 0; // Events recorded (free running)
+        static vu32    debug_zone_read = 0; // Events sent through USB (free running)
+        static vu32    debug_zone_dropped = 0; // Events lost because the ring was full (free running)
+        static u8      debug_zone_packet[ZONE_HEADERSIZE + (ZONE_RING/2)*ZONE_EVENTSIZE];
+        #ifndef LIBDRAGON
+            static usbMesg debug_zone_mesg = {MSG_FLUSH, DATATYPE_ZONES, NULL, 0};
+        #endif
+    #endif
+    
+    // Heap tracing globals
+    #if USE_HEAPTRACE
+        static vu32    debug_heap_ring[HEAP_RING*3]; // Pointer, type and size, then caller of every event
+        static vu32    debug_heap_write = 0; // Events recorded (free running)
+        static vu32    debug_heap_read = 0; // Events sent through USB (free running)
+        static vu32    debug_heap_dropped = 0; // Events lost because the ring was full (free running)
+        static u8      debug_heap_packet[HEAP_HEADERSIZE + (HEAP_RING/2)*HEAP_EVENTSIZE];
+        #ifndef LIBDRAGON
+            static usbMesg debug_heap_mesg = {MSG_FLUSH, DATATYPE_HEAP, NULL, 0};
+        #endif
+    #endif
+    
     #ifndef LIBDRAGON
         
         // USB thread globals
@@ -241,6 +379,18 @@ https://github.com/buu342/N64-UNFLoader
         #if AUTOPOLL_ENABLED
             static OSTimer usbThreadTimer;
         #endif
+        #if PRINT_RING_SIZE
+            static OSTimer usbRingTimer;
+        #endif
+        
+        // Profiler thread globals
+        #if USE_PROFILER
+            static OSMesgQueue profilerMessageQ;
+            static OSMesg      profilerMessageBuf;
+            static OSThread    profilerThread;
+            static OSTimer     profilerTimer;
+            static u64         profilerThreadStack[PROFILER_THREAD_STACK/sizeof(u64)];
+        #endif
         
         // Fault thread globals
         #if USE_FAULTTHREAD
@@ -248,6 +398,9 @@ https://github.com/buu342/N64-UNFLoader
             static OSMesg      faultMessageBuf;
             static OSThread    faultThread;
             static u64         faultThreadStack[FAULT_THREAD_STACK/sizeof(u64)];
+            #if USE_COREDUMP
+                static u8          debug_corepacket[CORE_HEADERSIZE + CORE_MAXTHREADS*CORE_THREADSIZE];
+            #endif
         
             // List of error causes
             static regDesc causeDesc[] = {
@@ -364,6 +517,14 @@ https://github.com/buu342/N64-UNFLoader
         #endif
         static bPoint     debug_bpoints[BPOINT_COUNT];
 
+        // Hexadecimal conversion tables. The value table is indexed with the lower 5 bits of the character,
+        // which puts '0'-'9' at 0x10-0x19, and both 'a'-'f' and 'A'-'F' at 0x01-0x06
+        static const char debug_hexdigits[] = "0123456789abcdef";
+        static const u8   debug_hexvalues[32] = {
+            0, 10, 11, 12, 13, 14, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0,  1,  2,  3,  4,  5,  6, 7, 8, 9, 0, 0, 0, 0, 0, 0
+        };
+        
         // Remote debugger packet lookup table
         RDBPacketLUT lut_rdbpackets[] = {
             // Due to the use of strncmp, the order of strings matters!
@@ -373,6 +534,8 @@ https://github.com/buu342/N64-UNFLoader
             {"G", debug_rdb_writeregisters},
             {"m", debug_rdb_readmemory},
             {"M", debug_rdb_writememory},
+            {"x", debug_rdb_readmemorybinary},
+            {"X", debug_rdb_writememorybinary},
             {"Z0", debug_rdb_addbreakpoint},
             {"z0", debug_rdb_removebreakpoint},
             {"c", debug_rdb_continue},
@@ -415,6 +578,20 @@ https://github.com/buu342/N64-UNFLoader
             #if AUTOPOLL_ENABLED
                 osSetTimer(&usbThreadTimer, 0, OS_USEC_TO_CYCLES(AUTOPOLL_TIME*1000), &usbMessageQ, (OSMesg)NULL);
             #endif
+            #if PRINT_RING_SIZE
+                osSetTimer(&usbRingTimer, 0, OS_USEC_TO_CYCLES(PRINT_RING_FLUSH*1000), &usbMessageQ, (OSMesg)&debug_ring_mesg);
+            #endif
+            
+            // Initialize the profiler thread
+            #if USE_PROFILER
+                osCreateMesgQueue(&profilerMessageQ, &profilerMessageBuf, 1);
+                osCreateThread(&profilerThread, PROFILER_THREAD_ID, debug_thread_profiler, 0, 
+                                (profilerThreadStack+PROFILER_THREAD_STACK/sizeof(u64)), 
+                                PROFILER_THREAD_PRI);
+                osStartThread(&profilerThread);
+                if (debug_profile_enabled)
+                    osSetTimer(&profilerTimer, 0, OS_USEC_TO_CYCLES(1000000/PROFILER_RATE), &profilerMessageQ, (OSMesg)NULL);
+            #endif
             
             // Initialize the fault thread
             #if USE_FAULTTHREAD
@@ -445,6 +622,12 @@ https://github.com/buu342/N64-UNFLoader
             #if AUTOPOLL_ENABLED
                 new_timer(TIMER_TICKS(AUTOPOLL_TIME*1000), TF_CONTINUOUS, debug_timer_usb);
             #endif
+            #if PRINT_RING_SIZE || USE_PROFILER || USE_ZONES || USE_HEAPTRACE
+                new_timer(TIMER_TICKS(PRINT_RING_FLUSH*1000), TF_CONTINUOUS, debug_timer_flush);
+            #endif
+            #if USE_PROFILER
+                new_timer(TIMER_TICKS(1000000/PROFILER_RATE), TF_CONTINUOUS, debug_timer_profiler);
+            #endif
             #if USE_RDBTHREAD
                 memset(debug_bpoints, 0, BPOINT_COUNT*sizeof(bPoint));
                 register_exception_handler(debug_thread_rdb);
@@ -490,8 +673,13 @@ https://github.com/buu342/N64-UNFLoader
     void debug_printf(const char* message, ...)
     {
         int len = 0;
-        usbMesg msg;
         va_list args;
+        #if PRINT_RING_SIZE
+            char buff[BUFFER_SIZE];
+        #else
+            usbMesg msg;
+            char* buff = debug_buffer;
+        #endif
         
         // Stop if debug mode isn't initialized
         if (!debug_initialized)
@@ -500,29 +688,757 @@ https://github.com/buu342/N64-UNFLoader
         // Use the internal libultra printf function to format the string
         va_start(args, message);
         #ifndef LIBDRAGON
-            len = _Printf(&printf_handler, debug_buffer, message, args);
+            len = _Printf(&printf_handler, buff, message, args);
         #else
-            len = vsprintf(debug_buffer, message, args);
+            len = vsnprintf(buff, BUFFER_SIZE, message, args);
+            if (len >= BUFFER_SIZE)
+                len = BUFFER_SIZE-1;
         #endif
         va_end(args);
         
         // Attach the '\0' if necessary
         if (0 <= len)
-            debug_buffer[len] = '\0';
+            buff[len] = '\0';
         
-        // Send the printf to the usb thread
-        msg.msgtype = MSG_WRITE;
-        msg.datatype = DATATYPE_TEXT;
-        msg.buff = debug_buffer;
-        msg.size = len+1;
+        // Queue the printf in the ring buffer, which the USB thread will send later
+        #if PRINT_RING_SIZE
+            if (len > 0)
+                debug_ring_push(buff, len);
+        #else
+            
+            // Send the printf to the usb thread
+            msg.msgtype = MSG_WRITE;
+            msg.datatype = DATATYPE_TEXT;
+            msg.buff = buff;
+            msg.size = len+1;
+            #ifndef LIBDRAGON
+                osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+            #else
+                debug_thread_usb(&msg);
+            #endif
+        #endif
+    }
+    
+    
+    /*==============================
+        debug_ring_lock
+        Stops the current thread from being preempted while
+        a ring buffer's indices are being modified
+        @return The previous interrupt mask
+    ==============================*/
+    
+    static inline u32 debug_ring_lock()
+    {
         #ifndef LIBDRAGON
-            osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+            return osSetIntMask(OS_IM_NONE);
         #else
-            debug_thread_usb(&msg);
+            disable_interrupts();
+            return 0;
+        #endif
+    }
+    
+    
+    /*==============================
+        debug_ring_unlock
+        Restores the interrupts disabled by debug_ring_lock
+        @param The interrupt mask returned by debug_ring_lock
+    ==============================*/
+    
+    static inline void debug_ring_unlock(u32 mask)
+    {
+        #ifndef LIBDRAGON
+            osSetIntMask(mask);
+        #else
+            (void)mask;
+            enable_interrupts();
         #endif
     }
     
     
+    #if PRINT_RING_SIZE
+        
+        /*==============================
+            debug_ring_push
+            Copies a string into the print ring buffer. Any thread
+            (or interrupt) can call this at the same time, as the
+            string is copied with interrupts disabled, so callers
+            must keep each push to at most BUFFER_SIZE bytes.
+            If the string doesn't fit, it is dropped and counted.
+            @param The string to queue
+            @param The length of the string, without the '\0'
+        ==============================*/
+        
+        static void debug_ring_push(const char* str, u32 len)
+        {
+            u32 mask;
+            u32 start;
+            u32 split;
+            u8  wake;
+            
+            // Drop the message if there isn't enough space for it
+            mask = debug_ring_lock();
+            if (len > PRINT_RING_SIZE-(debug_ring_write-debug_ring_read))
+            {
+                debug_ring_dropped++;
+                debug_ring_unlock(mask);
+                return;
+            }
+            
+            // Copy the string into the ring, wrapping around the end of it if needed. This is done inside
+            // the lock, so that a thread that gets preempted can never hold back what other threads printed
+            start = debug_ring_write & (PRINT_RING_SIZE-1);
+            split = PRINT_RING_SIZE-start;
+            if (split > len)
+                split = len;
+            memcpy(&debug_ring[start], str, split);
+            memcpy(&debug_ring[0], str+split, len-split);
+            debug_ring_write += len;
+            wake = (debug_ring_write-debug_ring_read) >= PRINT_RING_SIZE/2;
+            debug_ring_unlock(mask);
+            
+            // If the ring is getting full, don't wait for the flush timer
+            if (wake)
+                debug_ring_wake();
+        }
+        
+        
+        /*==============================
+            debug_ring_flush
+            Sends the contents of the print ring buffer through USB.
+            Must only be called from the USB thread.
+        ==============================*/
+        
+        static void debug_ring_flush()
+        {
+            u32 read = debug_ring_read;
+            u32 write = debug_ring_write;
+            u32 dropped = debug_ring_dropped;
+            
+            // Nothing to do if the ring is empty
+            if (read == write && dropped == 0)
+                return;
+            if (usb_timedout())
+                usb_sendheartbeat();
+            
+            // Send the data in as few USB packets as possible (two at most, if it wraps around)
+            while (read != write)
+            {
+                u32 start = read & (PRINT_RING_SIZE-1);
+                u32 size = write-read;
+                if (size > PRINT_RING_SIZE-start)
+                    size = PRINT_RING_SIZE-start;
+                if (usb_write(DATATYPE_TEXT, &debug_ring[start], size) != 1)
+                    return; // Try again on the next flush
+                read += size;
+                debug_ring_read = read;
+            }
+            
+            // Let the developer know if any messages were lost
+            if (dropped != 0)
+            {
+                u32 mask;
+                char warning[64];
+                sprintf(warning, "Warning: %d debug_printf messages were dropped\n", (int)dropped);
+                if (usb_write(DATATYPE_TEXT, warning, strlen(warning)+1) != 1)
+                    return;
+                mask = debug_ring_lock();
+                debug_ring_dropped -= dropped;
+                debug_ring_unlock(mask);
+            }
+        }
+        
+        
+        /*==============================
+            debug_ring_wake
+            Requests the USB thread to flush the print ring buffer.
+            On libdragon, the flush timer does it on its next tick
+        ==============================*/
+        
+        static void debug_ring_wake()
+        {
+            #ifndef LIBDRAGON
+                osSendMesg(&usbMessageQ, (OSMesg)&debug_ring_mesg, OS_MESG_NOBLOCK);
+            #else
+                debug_flushpending = TRUE;
+            #endif
+        }
+    #endif
+    
+    
+    #if USE_PROFILER
+        
+        /*==============================
+            debug_profile
+            Pauses or resumes the profiler
+            @param 1 to resume the profiler, 0 to pause it
+        ==============================*/
+        
+        void debug_profile(char enable)
+        {
+            // The timer is started by debug_initialize, so only touch it after that
+            #ifndef LIBDRAGON
+                if (debug_initialized && enable && !debug_profile_enabled)
+                    osSetTimer(&profilerTimer, 0, OS_USEC_TO_CYCLES(1000000/PROFILER_RATE), &profilerMessageQ, (OSMesg)NULL);
+                else if (debug_initialized && !enable && debug_profile_enabled)
+                    osStopTimer(&profilerTimer);
+            #endif
+            debug_profile_enabled = (enable != 0);
+        }
+        
+        
+        /*==============================
+            debug_profile_push
+            Stores a sample in the profiler's ring. Only the
+            profiler thread (or timer) may call this. If the
+            ring is full, the sample is dropped and counted.
+            @param The program counter of the sampled thread
+            @param The return address of the sampled thread
+            @param The ID of the sampled thread
+        ==============================*/
+        
+        static void debug_profile_push(u32 pc, u32 ra, u32 thread)
+        {
+            u32 write = debug_profile_write;
+            u32 index;
+            
+            // Drop the sample if the USB thread hasn't caught up
+            if (write-debug_profile_read >= PROFILER_RING)
+            {
+                debug_profile_dropped++;
+                return;
+            }
+            
+            // Store the sample, and only then publish it
+            index = (write & (PROFILER_RING-1))*3;
+            debug_profile_ring[index] = pc;
+            debug_profile_ring[index+1] = ra;
+            debug_profile_ring[index+2] = thread;
+            debug_profile_write = write+1;
+            
+            // Have the USB thread send the samples once half of the ring is in use
+            if (write+1-debug_profile_read >= PROFILER_RING/2)
+            {
+                #ifndef LIBDRAGON
+                    osSendMesg(&usbMessageQ, (OSMesg)&debug_profile_mesg, OS_MESG_NOBLOCK);
+                #else
+                    debug_flushpending = TRUE; // This runs inside the profiler timer, so leave the USB to the flush timer
+                #endif
+            }
+        }
+        
+        
+        /*==============================
+            debug_profile_flush
+            Sends the samples in the profiler's ring through USB,
+            in batches of up to half the ring.
+            Must only be called from the USB thread.
+        ==============================*/
+        
+        static void debug_profile_flush()
+        {
+            u32 read = debug_profile_read;
+            u32 write = debug_profile_write;
+            
+            while (read != write)
+            {
+                u32 i;
+                u32 count = write-read;
+                u8* out = debug_profile_packet;
+                if (count > PROFILER_RING/2)
+                    count = PROFILER_RING/2;
+                
+                // Every batch starts with the sample rate and the number of samples dropped so far,
+                // followed by the samples themselves. All values are big endian
+                for (i=0; i<(PROFILE_HEADERSIZE+count*PROFILE_SAMPLESIZE)/4; i++)
+                {
+                    u32 value;
+                    if (i == 0)
+                        value = PROFILER_RATE;
+                    else if (i == 1)
+                        value = debug_profile_dropped;
+                    else
+                        value = debug_profile_ring[((read+(i-2)/3) & (PROFILER_RING-1))*3 + (i-2)%3];
+                    *out++ = (value >> 24) & 0xFF;
+                    *out++ = (value >> 16) & 0xFF;
+                    *out++ = (value >> 8) & 0xFF;
+                    *out++ = value & 0xFF;
+                }
+                if (usb_write(DATATYPE_PROFILE, debug_profile_packet, PROFILE_HEADERSIZE+count*PROFILE_SAMPLESIZE) != 1)
+                    return; // Try again on the next pass of the USB thread
+                read += count;
+                debug_profile_read = read;
+            }
+        }
+        
+        #ifndef LIBDRAGON
+            
+            /*==============================
+                debug_thread_profiler
+                Handles the profiler thread (Libultra). It's woken up
+                by the profiler timer, after which the thread that the
+                timer interrupted is the first one in the run queue.
+                Threads with the same priority as that one which were
+                already waiting come before it though, so their time
+                is counted in its place.
+                @param Arbitrary data that the thread can receive (unused)
+            ==============================*/
+            
+            static void debug_thread_profiler(void *arg)
+            {
+                (void)arg; // To prevent unused variable errors
+                while (1)
+                {
+                    OSThread* sampled;
+                    osRecvMesg(&profilerMessageQ, NULL, OS_MESG_BLOCK);
+                    
+                    // The end of the run queue is marked by a thread with a priority of -1
+                    sampled = __osRunQueue;
+                    if (debug_profile_enabled && sampled != NULL && sampled->priority >= 0)
+                        debug_profile_push(sampled->context.pc, (u32)sampled->context.ra, (u32)sampled->id);
+                }
+            }
+        #else
+            
+            /*==============================
+                debug_timer_profiler
+                A function that's called by the profiler timer. As it
+                runs inside the timer interrupt, EPC holds the address
+                that was interrupted. Libdragon doesn't give timers the
+                interrupted registers, so the return address isn't known.
+                @param How many ticks the timer overflew by (unused)
+            ==============================*/
+            
+            static void debug_timer_profiler(int overflow)
+            {
+                (void)overflow; // To prevent unused variable errors
+                if (debug_profile_enabled)
+                    debug_profile_push(C0_READ_EPC(), 0, 0);
+            }
+        #endif
+    #endif
+    
+    
+    #if USE_ZONES
+        
+        /*==============================
+            debug_zone_begin
+            Marks the start of a zone
+            @param The ID of the zone
+        ==============================*/
+        
+        void debug_zone_begin(unsigned short id)
+        {
+            debug_zone_push(ZONE_BEGIN, id);
+        }
+        
+        
+        /*==============================
+            debug_zone_end
+            Marks the end of the zone that was begun last
+            on the current thread
+        ==============================*/
+        
+        void debug_zone_end()
+        {
+            debug_zone_push(ZONE_END, 0);
+        }
+        
+        
+        /*==============================
+            debug_zone_name
+            Tells UNFLoader the name of a zone ID
+            @param The ID of the zone
+            @param The name of the zone
+        ==============================*/
+        
+        void debug_zone_name(unsigned short id, const char* name)
+        {
+            usbMesg msg;
+            char buffer[BUFFER_SIZE];
+            int len = strlen(name);
+            
+            // Stop if debug mode isn't initialized
+            if (!debug_initialized)
+                return;
+            
+            // The name is sent after the zone ID, as a big endian 16-bit value
+            if (len > BUFFER_SIZE-3)
+                len = BUFFER_SIZE-3;
+            buffer[0] = (id >> 8) & 0xFF;
+            buffer[1] = id & 0xFF;
+            memcpy(buffer+2, name, len);
+            buffer[2+len] = '\0';
+            
+            // Send the name to the usb thread
+            msg.msgtype = MSG_WRITE;
+            msg.datatype = DATATYPE_ZONENAME;
+            msg.buff = buffer;
+            msg.size = len+3;
+            #ifndef LIBDRAGON
+                osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+            #else
+                debug_thread_usb(&msg);
+            #endif
+        }
+        
+        
+        /*==============================
+            debug_zone_push
+            Records a zone event in the zone ring. Any thread
+            can call this. If the ring is full, the event is
+            dropped and counted.
+            @param ZONE_BEGIN or ZONE_END
+            @param The ID of the zone
+        ==============================*/
+        
+        static void debug_zone_push(u32 type, u32 id)
+        {
+            u32 mask;
+            u32 write;
+            u32 thread;
+            u32 index;
+            u8  wake;
+            
+            // Stop if debug mode isn't initialized
+            if (!debug_initialized)
+                return;
+            #ifndef LIBDRAGON
+                thread = (u32)osGetThreadId(NULL);
+            #else
+                thread = 0;
+            #endif
+            
+            // The time is read inside the lock, so that the events in the ring are always in order
+            mask = debug_ring_lock();
+            write = debug_zone_write;
+            if (write-debug_zone_read >= ZONE_RING)
+            {
+                debug_zone_dropped++;
+                debug_ring_unlock(mask);
+                return;
+            }
+            index = (write & (ZONE_RING-1))*2;
+            #ifndef LIBDRAGON
+                debug_zone_ring[index] = osGetCount();
+            #else
+                debug_zone_ring[index] = C0_COUNT();
+            #endif
+            debug_zone_ring[index+1] = ((thread & 0xFF) << 24) | (type << 16) | (id & 0xFFFF);
+            debug_zone_write = write+1;
+            wake = (write+1-debug_zone_read) >= ZONE_RING/2;
+            debug_ring_unlock(mask);
+            
+            // Have the USB thread send the events once half of the ring is in use
+            if (wake)
+            {
+                #ifndef LIBDRAGON
+                    osSendMesg(&usbMessageQ, (OSMesg)&debug_zone_mesg, OS_MESG_NOBLOCK);
+                #else
+                    debug_flushpending = TRUE;
+                #endif
+            }
+        }
+        
+        
+        /*==============================
+            debug_zone_flush
+            Sends the events in the zone ring through USB,
+            in batches of up to half the ring.
+            Must only be called from the USB thread.
+        ==============================*/
+        
+        static void debug_zone_flush()
+        {
+            u32 read = debug_zone_read;
+            u32 write = debug_zone_write;
+            
+            while (read != write)
+            {
+                u32 i;
+                u32 count = write-read;
+                u8* out = debug_zone_packet;
+                if (count > ZONE_RING/2)
+                    count = ZONE_RING/2;
+                
+                // Every batch starts with the rate of the COUNT register, its value right now (which
+                // UNFLoader uses to line up the console's time with its own) and the number of events
+                // dropped so far, followed by the events themselves. All values are big endian
+                for (i=0; i<(ZONE_HEADERSIZE+count*ZONE_EVENTSIZE)/4; i++)
+                {
+                    u32 value;
+                    if (i == 0)
+                    {
+                        #ifndef LIBDRAGON
+                            value = OS_CPU_COUNTER;
+                        #else
+                            value = TICKS_PER_SECOND;
+                        #endif
+                    }
+                    else if (i == 1)
+                    {
+                        #ifndef LIBDRAGON
+                            value = osGetCount();
+                        #else
+                            value = C0_COUNT();
+                        #endif
+                    }
+                    else if (i == 2)
+                        value = debug_zone_dropped;
+                    else
+                        value = debug_zone_ring[((read+(i-3)/2) & (ZONE_RING-1))*2 + (i-3)%2];
+                    *out++ = (value >> 24) & 0xFF;
+                    *out++ = (value >> 16) & 0xFF;
+                    *out++ = (value >> 8) & 0xFF;
+                    *out++ = value & 0xFF;
+                }
+                if (usb_write(DATATYPE_ZONES, debug_zone_packet, ZONE_HEADERSIZE+count*ZONE_EVENTSIZE) != 1)
+                    return; // Try again on the next pass of the USB thread
+                read += count;
+                debug_zone_read = read;
+            }
+        }
+    #endif
+    
+    
+    #if USE_HEAPTRACE
+        
+        /*==============================
+            debug_heap_alloc
+            Tells UNFLoader's --heap about an allocation
+            @param The allocated memory
+            @param The size of the allocation
+            @param The address the allocator was called from
+        ==============================*/
+        
+        void debug_heap_alloc(void* ptr, unsigned int size, void* caller)
+        {
+            if (ptr != NULL)
+                debug_heap_push(HEAP_ALLOC, (u32)(unsigned long)ptr, size, (u32)(unsigned long)caller);
+        }
+        
+        
+        /*==============================
+            debug_heap_free
+            Tells UNFLoader's --heap that memory was freed
+            @param The freed memory
+            @param The address the allocator was called from
+        ==============================*/
+        
+        void debug_heap_free(void* ptr, void* caller)
+        {
+            if (ptr != NULL)
+                debug_heap_push(HEAP_FREE, (u32)(unsigned long)ptr, 0, (u32)(unsigned long)caller);
+        }
+        
+        #ifdef LIBDRAGON
+            
+            /*==============================
+                debug_malloc
+                Calls malloc, and records the allocation
+                @param  The size to allocate
+                @return The allocated memory, or NULL
+            ==============================*/
+            
+            void* debug_malloc(unsigned int size)
+            {
+                void* ptr = malloc(size);
+                debug_heap_alloc(ptr, size, __builtin_return_address(0));
+                return ptr;
+            }
+            
+            
+            /*==============================
+                debug_calloc
+                Calls calloc, and records the allocation
+                @param  The number of elements to allocate
+                @param  The size of each element
+                @return The allocated memory, or NULL
+            ==============================*/
+            
+            void* debug_calloc(unsigned int count, unsigned int size)
+            {
+                void* ptr;
+                
+                // Don't let the total size overflow
+                if (size != 0 && count > 0xFFFFFFFF/size)
+                    return NULL;
+                ptr = calloc(count, size);
+                debug_heap_alloc(ptr, count*size, __builtin_return_address(0));
+                return ptr;
+            }
+            
+            
+            /*==============================
+                debug_realloc
+                Calls realloc, and records the free and
+                the new allocation
+                @param  The memory to reallocate, or NULL
+                @param  The new size
+                @return The reallocated memory, or NULL
+            ==============================*/
+            
+            #if __GNUC__ >= 12
+                #pragma GCC diagnostic push
+                #pragma GCC diagnostic ignored "-Wuse-after-free" // Only the old address is recorded, the old memory is never touched
+            #endif
+            void* debug_realloc(void* ptr, unsigned int size)
+            {
+                void* caller = __builtin_return_address(0);
+                u32 oldptr = (u32)(unsigned long)ptr;
+                void* newptr = realloc(ptr, size);
+                
+                // If realloc fails, the old memory is left alone
+                if (newptr == NULL && size != 0)
+                    return NULL;
+                if (oldptr != 0)
+                    debug_heap_push(HEAP_FREE, oldptr, 0, (u32)(unsigned long)caller);
+                debug_heap_alloc(newptr, size, caller);
+                return newptr;
+            }
+            #if __GNUC__ >= 12
+                #pragma GCC diagnostic pop
+            #endif
+            
+            
+            /*==============================
+                debug_free
+                Calls free, and records the free
+                @param The memory to free
+            ==============================*/
+            
+            void debug_free(void* ptr)
+            {
+                debug_heap_free(ptr, __builtin_return_address(0));
+                free(ptr);
+            }
+        #else
+            
+            /*==============================
+                debug_osMalloc
+                Calls osMalloc, and records the allocation
+                @param  The region to allocate from
+                @return The allocated buffer, or NULL
+            ==============================*/
+            
+            void* debug_osMalloc(void* region)
+            {
+                void* ptr = osMalloc(region);
+                debug_heap_alloc(ptr, osGetRegionBufSize(region), __builtin_return_address(0));
+                return ptr;
+            }
+            
+            
+            /*==============================
+                debug_osFree
+                Calls osFree, and records the free
+                @param The region the buffer belongs to
+                @param The buffer to free
+            ==============================*/
+            
+            void debug_osFree(void* region, void* addr)
+            {
+                debug_heap_free(addr, __builtin_return_address(0));
+                osFree(region, addr);
+            }
+        #endif
+        
+        
+        /*==============================
+            debug_heap_push
+            Records a heap event in the heap ring. Any thread
+            can call this. If the ring is full, the event is
+            dropped and counted.
+            @param HEAP_ALLOC or HEAP_FREE
+            @param The address of the allocated or freed memory
+            @param The size of the allocation
+            @param The address the allocator was called from
+        ==============================*/
+        
+        static void debug_heap_push(u32 type, u32 ptr, u32 size, u32 caller)
+        {
+            u32 mask;
+            u32 write;
+            u32 index;
+            u8  wake;
+            
+            // Stop if debug mode isn't initialized
+            if (!debug_initialized)
+                return;
+            
+            // Sizes are stored in 24 bits, which is more than the RDRAM of any N64. Larger ones are saturated
+            if (size > 0xFFFFFF)
+                size = 0xFFFFFF;
+            mask = debug_ring_lock();
+            write = debug_heap_write;
+            if (write-debug_heap_read >= HEAP_RING)
+            {
+                debug_heap_dropped++;
+                debug_ring_unlock(mask);
+                return;
+            }
+            index = (write & (HEAP_RING-1))*3;
+            debug_heap_ring[index] = ptr;
+            debug_heap_ring[index+1] = (type << 24) | (size & 0xFFFFFF);
+            debug_heap_ring[index+2] = caller;
+            debug_heap_write = write+1;
+            wake = (write+1-debug_heap_read) >= HEAP_RING/2;
+            debug_ring_unlock(mask);
+            
+            // Have the USB thread send the events once half of the ring is in use
+            if (wake)
+            {
+                #ifndef LIBDRAGON
+                    osSendMesg(&usbMessageQ, (OSMesg)&debug_heap_mesg, OS_MESG_NOBLOCK);
+                #else
+                    debug_flushpending = TRUE;
+                #endif
+            }
+        }
+        
+        
+        /*==============================
+            debug_heap_flush
+            Sends the events in the heap ring through USB,
+            in batches of up to half the ring.
+            Must only be called from the USB thread.
+        ==============================*/
+        
+        static void debug_heap_flush()
+        {
+            u32 read = debug_heap_read;
+            u32 write = debug_heap_write;
+            
+            while (read != write)
+            {
+                u32 i;
+                u32 count = write-read;
+                u8* out = debug_heap_packet;
+                if (count > HEAP_RING/2)
+                    count = HEAP_RING/2;
+                
+                // Every batch starts with the number of events dropped so far, followed by
+                // the events themselves. All values are big endian
+                for (i=0; i<(HEAP_HEADERSIZE+count*HEAP_EVENTSIZE)/4; i++)
+                {
+                    u32 value;
+                    if (i == 0)
+                        value = debug_heap_dropped;
+                    else
+                        value = debug_heap_ring[((read+(i-1)/3) & (HEAP_RING-1))*3 + (i-1)%3];
+                    *out++ = (value >> 24) & 0xFF;
+                    *out++ = (value >> 16) & 0xFF;
+                    *out++ = (value >> 8) & 0xFF;
+                    *out++ = value & 0xFF;
+                }
+                if (usb_write(DATATYPE_HEAP, debug_heap_packet, HEAP_HEADERSIZE+count*HEAP_EVENTSIZE) != 1)
+                    return; // Try again on the next pass of the USB thread
+                read += count;
+                debug_heap_read = read;
+            }
+        }
+    #endif
+    
+    
     /*==============================
         debug_dumpbinary
         Dumps a binary file through USB
@@ -628,6 +1544,10 @@ https://github.com/buu342/N64-UNFLoader
         // If on libdragon, print where the assertion failed
         #ifdef LIBDRAGON
             debug_printf("Assertion failed in file '%s', line %d.\n", assert_file, assert_line);
+            #if PRINT_RING_SIZE
+                if (!debug_usbbusy)
+                    debug_thread_usb(&debug_ring_mesg); // The flush timer won't run after the crash, so send it now
+            #endif
         #endif
     
         // Intentionally cause a TLB exception on load/instruction fetch
@@ -658,6 +1578,48 @@ https://github.com/buu342/N64-UNFLoader
     }
     
     
+    /*==============================
+        debug_segmenthandler
+        Assigns a function to receive files sent by UNFLoader
+        @param The function pointer to execute
+    ==============================*/
+    
+    void debug_segmenthandler(void(*execute)(unsigned int transfer, unsigned int offset, unsigned int size, unsigned int total))
+    {
+        debug_segment_func = execute;
+        debug_segment_buffer = NULL;
+    }
+    
+    
+    /*==============================
+        debug_segmentbuffer
+        Reassembles files sent by UNFLoader into a buffer
+        @param The buffer to reassemble the file in
+        @param The size of the buffer
+        @param The function pointer to execute when the file arrives
+    ==============================*/
+    
+    void debug_segmentbuffer(void* buffer, unsigned int size, void(*complete)(unsigned int transfer, unsigned int total))
+    {
+        debug_segment_func = NULL;
+        debug_segment_buffer = (u8*)buffer;
+        debug_segment_buffersize = size;
+        debug_segment_complete = complete;
+    }
+    
+    
+    /*==============================
+        debug_patchhandler
+        Assigns a function to call after UNFLoader patches RDRAM
+        @param The function pointer to execute
+    ==============================*/
+    
+    void debug_patchhandler(void(*execute)(void* address, unsigned int size))
+    {
+        debug_patch_func = execute;
+    }
+    
+    
     /*==============================
         debug_addcommand
         Adds a command for the USB to listen for
@@ -682,69 +1644,358 @@ https://github.com/buu342/N64-UNFLoader
             return;
         }
         
-        // Look for an empty spot in the hash table
-        if (slot != NULL)
-        {
-            while (slot->next != NULL)
-                slot = slot->next;
-            slot->next = &debug_commands_elements[debug_commands_count];
-        }
-        else
-            debug_commands_hashtable[entry] = &debug_commands_elements[debug_commands_count];
-            
-        // Fill this spot with info about this command
-        debug_commands_elements[debug_commands_count].command     = command;
-        debug_commands_elements[debug_commands_count].description = description;
-        debug_commands_elements[debug_commands_count].execute     = execute;
-        debug_commands_count++;
+        // Look for an empty spot in the hash table
+        if (slot != NULL)
+        {
+            while (slot->next != NULL)
+                slot = slot->next;
+            slot->next = &debug_commands_elements[debug_commands_count];
+        }
+        else
+            debug_commands_hashtable[entry] = &debug_commands_elements[debug_commands_count];
+            
+        // Fill this spot with info about this command
+        debug_commands_elements[debug_commands_count].command     = command;
+        debug_commands_elements[debug_commands_count].description = description;
+        debug_commands_elements[debug_commands_count].execute     = execute;
+        debug_commands_count++;
+    }
+    
+    
+    /*==============================
+        debug_printcommands
+        Prints a list of commands to the developer's command prompt.
+    ==============================*/
+    
+    void debug_printcommands()
+    {
+        int i;
+        
+        // Ensure debug mode is initialized
+        if (!debug_initialized)
+            return;
+        
+        // Ensure there are commands to print
+        if (debug_commands_count == 0)
+            return;
+        
+        // Print the commands
+        debug_printf("Available USB commands\n----------------------\n");
+        for (i=0; i<debug_commands_count; i++)
+            debug_printf("%d. %s\n\t%s\n", i+1, debug_commands_elements[i].command, debug_commands_elements[i].description);
+        debug_printf("\n");
+    }
+    
+    
+    /*==============================
+        debug_pollcommands
+        Check the USB for incoming commands
+    ==============================*/
+    
+    void debug_pollcommands()
+    {
+        usbMesg msg;
+    
+        // Ensure debug mode is initialized
+        if (!debug_initialized)
+            return;
+        
+        // Send a read message to the USB thread
+        msg.msgtype = MSG_READ;
+        #ifndef LIBDRAGON
+            osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+        #else
+            debug_thread_usb(&msg);
+        #endif
+    }
+    
+    
+    /*==============================
+        debug_streamread
+        Reads streamed data through the USB thread
+        @param  The buffer to put the read data in
+        @param  The number of bytes to read
+        @return The number of bytes that were read
+    ==============================*/
+    
+    int debug_streamread(void* buffer, int size)
+    {
+        usbMesg msg;
+    
+        // Ensure debug mode is initialized
+        if (!debug_initialized)
+            return 0;
+        
+        // Send a stream message to the USB thread, which replaces the size with how much it read
+        msg.msgtype = MSG_STREAM;
+        msg.buff = buffer;
+        msg.size = size;
+        #ifndef LIBDRAGON
+            osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+        #else
+            debug_thread_usb(&msg);
+        #endif
+        return msg.size;
+    }
+    
+    
+    /*==============================
+        debug_fs_read
+        Reads part of a file that UNFLoader serves with --fs
+        @param  The path of the file
+        @param  The offset in the file to start reading from
+        @param  The number of bytes to read
+        @param  The buffer to put the read data in
+        @return The number of bytes that were read, or -1
+    ==============================*/
+    
+    int debug_fs_read(const char* path, unsigned int offset, unsigned int size, void* buffer)
+    {
+        usbMesg msg;
+        debugFSRead req;
+    
+        // Ensure debug mode is initialized, and that the path fits in a request
+        if (!debug_initialized || strlen(path) >= BUFFER_SIZE)
+            return -1;
+        
+        // Send a filesystem message to the USB thread, which keeps asking UNFLoader for the data until it all arrives
+        req.path = path;
+        req.offset = offset;
+        req.size = size;
+        req.buffer = (u8*)buffer;
+        req.read = 0;
+        req.id = 0;
+        req.done = FALSE;
+        req.failed = FALSE;
+        msg.msgtype = MSG_FSREAD;
+        msg.buff = &req;
+        #ifndef LIBDRAGON
+            osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+        #else
+            debug_thread_usb(&msg);
+        #endif
+        return req.failed ? -1 : (int)req.read;
+    }
+    
+    
+    /*==============================
+        debug_handle_segment
+        Hands an incoming file segment to the user.
+        DATATYPE_SEGMENT packets start with a header of four
+        u32s: the transfer ID, the segment's sequence number,
+        the segment's offset, and the total size. Files small
+        enough to fit in one packet are sent as DATATYPE_RAWBINARY
+        instead, and are handled as a transfer with one segment.
+        @param  The USB header of the incoming data
+        @return 1 if the segment was handled, 0 if it was not
+    ==============================*/
+    
+    static char debug_handle_segment(int header)
+    {
+        u32 info[4];
+        u32 size;
+        
+        // Ensure there's somewhere to put the data
+        if (debug_segment_func == NULL && debug_segment_buffer == NULL)
+            return 0;
+        
+        // Get the segment information
+        if (USBHEADER_GETTYPE(header) == DATATYPE_SEGMENT)
+        {
+            usb_read(info, sizeof(info));
+            size = USBHEADER_GETSIZE(header) - sizeof(info);
+        }
+        else
+        {
+            size = USBHEADER_GETSIZE(header);
+            info[0] = debug_segment_transfer+1;
+            info[1] = 0;
+            info[2] = 0;
+            info[3] = size;
+        }
+        
+        // A new transfer starts with the first segment, and the rest must follow in order
+        if (info[1] == 0)
+            debug_segment_transfer = info[0];
+        else if (info[0] != debug_segment_transfer || info[1] != debug_segment_next)
+            return 0;
+        debug_segment_next = info[1]+1;
+        
+        // Give the data to the user
+        if (debug_segment_func != NULL)
+            debug_segment_func(info[0], info[2], size, info[3]);
+        else
+        {
+            if (info[2] > debug_segment_buffersize || size > debug_segment_buffersize - info[2])
+                return 0;
+            usb_read(debug_segment_buffer+info[2], size);
+            if (info[2]+size == info[3] && debug_segment_complete != NULL)
+                debug_segment_complete(info[0], info[3]);
+        }
+        return 1;
+    }
+    
+    
+    /*==============================
+        debug_handle_patch
+        Writes an incoming memory patch into RDRAM.
+        DATATYPE_PATCH packets start with a header of two
+        big endian u32s: the address to write to, and the
+        size of the data that follows. The address can be
+        physical, KSEG0 or KSEG1.
+        @param  The USB header of the incoming data
+        @return 1 if the patch was applied, 0 if it was not
+    ==============================*/
+    
+    static char debug_handle_patch(int header)
+    {
+        u8  info[8];
+        u32 addr;
+        u32 size;
+        u32 end;
+        #ifdef LIBDRAGON
+            u32 osMemSize = get_memory_size();
+        #endif
+        
+        // Get the patch information
+        if (USBHEADER_GETSIZE(header) < sizeof(info))
+            return 0;
+        usb_read(info, sizeof(info));
+        addr = (info[0] << 24) | (info[1] << 16) | (info[2] << 8) | info[3];
+        size = (info[4] << 24) | (info[5] << 16) | (info[6] << 8) | info[7];
+        
+        // Ensure the patch is in RDRAM, without letting the address plus the size overflow
+        addr = (u32)OS_PHYSICAL_TO_K0(addr & 0x1FFFFFFF);
+        end = 0x80000000 + osMemSize;
+        if (size > USBHEADER_GETSIZE(header) - sizeof(info) || addr < 0x80000000 || addr >= end || size > end - addr)
+            return 0;
+        
+        // Large patches are DMA'd straight into place by usb_read, the rest is copied through the data cache
+        usb_read((void*)addr, size);
+        #ifndef LIBDRAGON
+            osWritebackDCache((u32*)addr, size);
+            osInvalICache((u32*)addr, size);
+        #else
+            data_cache_hit_writeback((u32*)addr, size);
+            inst_cache_hit_invalidate((u32*)addr, size);
+        #endif
+        
+        // Let the user know, so that they can reload whatever was patched
+        if (debug_patch_func != NULL)
+            debug_patch_func((void*)addr, size);
+        return 1;
     }
     
     
     /*==============================
-        debug_printcommands
-        Prints a list of commands to the developer's command prompt.
+        debug_handle_fsdata
+        Reads UNFLoader's answer to a debug_fs_read request.
+        DATATYPE_FSDATA packets start with a header of two
+        big endian values: the request ID, and the number of
+        bytes that follow (or -1 if the file couldn't be read).
+        @param The USB header of the incoming data
     ==============================*/
     
-    void debug_printcommands()
+    static void debug_handle_fsdata(int header)
     {
-        int i;
+        u8  info[8];
+        u32 id;
+        s32 result;
+        debugFSRead* req = debug_fs_current;
         
-        // Ensure debug mode is initialized
-        if (!debug_initialized)
+        // Get the answer information
+        if (USBHEADER_GETSIZE(header) < sizeof(info))
             return;
+        usb_read(info, sizeof(info));
+        id = (info[0] << 24) | (info[1] << 16) | (info[2] << 8) | info[3];
+        result = (s32)((info[4] << 24) | (info[5] << 16) | (info[6] << 8) | info[7]);
         
-        // Ensure there are commands to print
-        if (debug_commands_count == 0)
+        // Ignore answers to requests that we gave up on
+        if (req == NULL || req->id == 0 || id != req->id)
             return;
+        req->id = 0;
         
-        // Print the commands
-        debug_printf("Available USB commands\n----------------------\n");
-        for (i=0; i<debug_commands_count; i++)
-            debug_printf("%d. %s\n\t%s\n", i+1, debug_commands_elements[i].command, debug_commands_elements[i].description);
-        debug_printf("\n");
+        // Stop if the file couldn't be read. An empty answer means we reached the end of the file
+        if (result < 0 || (u32)result > req->size - req->read || (u32)result > USBHEADER_GETSIZE(header) - sizeof(info))
+        {
+            req->failed = (req->read == 0);
+            req->done = TRUE;
+            return;
+        }
+        usb_read(req->buffer + req->read, result);
+        req->read += result;
+        if (result == 0 || req->read == req->size)
+            req->done = TRUE;
     }
     
     
     /*==============================
-        debug_pollcommands
-        Check the USB for incoming commands
+        debug_fs_service
+        Asks UNFLoader for the rest of the data of a
+        debug_fs_read, and checks if it has all arrived
+        @param  The read to service
+        @return TRUE if the USB thread needs to call this
+                again, FALSE if the read is finished
     ==============================*/
     
-    void debug_pollcommands()
+    static char debug_fs_service(debugFSRead* req)
     {
-        usbMesg msg;
-    
-        // Ensure debug mode is initialized
-        if (!debug_initialized)
-            return;
+        u64 curtime;
+        #ifndef LIBDRAGON
+            curtime = osGetTime();
+        #else
+            curtime = timer_ticks();
+        #endif
         
-        // Send a read message to the USB thread
-        msg.msgtype = MSG_READ;
+        // Stop once all the data arrived, or there's no more of it
+        if (req->done || req->read == req->size)
+        {
+            debug_fs_current = NULL;
+            return FALSE;
+        }
+        
+        // Ask for the data that's left
+        if (req->id == 0)
+        {
+            int i;
+            u8  request[FS_HEADERSIZE+BUFFER_SIZE];
+            u32 values[3];
+            int pathsize = strlen(req->path)+1;
+            if (++debug_fs_lastid == 0)
+                debug_fs_lastid = 1;
+            values[0] = debug_fs_lastid;
+            values[1] = req->offset + req->read;
+            values[2] = req->size - req->read;
+            for (i=0; i<3; i++)
+            {
+                request[i*4+0] = (values[i] >> 24) & 0xFF;
+                request[i*4+1] = (values[i] >> 16) & 0xFF;
+                request[i*4+2] = (values[i] >> 8) & 0xFF;
+                request[i*4+3] = values[i] & 0xFF;
+            }
+            memcpy(request+FS_HEADERSIZE, req->path, pathsize);
+            if (usb_timedout())
+                usb_sendheartbeat();
+            if (usb_write(DATATYPE_FSREQUEST, request, FS_HEADERSIZE+pathsize) != 1) // If the write failed, try again
+                return TRUE;
+            req->id = debug_fs_lastid;
+            req->sendtime = curtime;
+            debug_fs_current = req;
+            return TRUE;
+        }
+        
+        // Give up if UNFLoader takes too long to answer
         #ifndef LIBDRAGON
-            osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+            if (curtime - req->sendtime > OS_USEC_TO_CYCLES(FS_TIMEOUT*1000))
         #else
-            debug_thread_usb(&msg);
+            if (curtime - req->sendtime > TIMER_TICKS(FS_TIMEOUT*1000))
         #endif
+        {
+            req->failed = (req->read == 0);
+            debug_fs_current = NULL;
+            return FALSE;
+        }
+        return TRUE;
     }
     
     
@@ -951,10 +2202,39 @@ https://github.com/buu342/N64-UNFLoader
             {
                 usbMesg msg;
                 (void)overflow; // To prevent unused variable errors
+                if (debug_usbbusy)
+                    return;
                 msg.msgtype = MSG_READ;
                 debug_thread_usb(&msg);
             }
         #endif
+        #if PRINT_RING_SIZE || USE_PROFILER || USE_ZONES || USE_HEAPTRACE
+            
+            /*==============================
+                debug_timer_flush
+                A function that's called by the flush timer. Sends
+                the print ring if it has anything in it, and the
+                other rings once one of them is half full
+                @param How many ticks the timer overflew by (unused)
+            ==============================*/
+            
+            static void debug_timer_flush(int overflow)
+            {
+                usbMesg msg;
+                (void)overflow; // To prevent unused variable errors
+                if (debug_usbbusy)
+                    return;
+                #if PRINT_RING_SIZE
+                    if (debug_ring_write != debug_ring_read || debug_ring_dropped != 0)
+                        debug_flushpending = TRUE;
+                #endif
+                if (!debug_flushpending)
+                    return;
+                debug_flushpending = FALSE;
+                msg.msgtype = MSG_FLUSH;
+                debug_thread_usb(&msg);
+            }
+        #endif
     #endif
     
     
@@ -976,6 +2256,7 @@ https://github.com/buu342/N64-UNFLoader
         #else
             // Set the received thread message to the argument
             threadMsg = (usbMesg*)arg;
+            debug_usbbusy = TRUE;
         #endif
         
         // Thread loop
@@ -985,6 +2266,12 @@ https://github.com/buu342/N64-UNFLoader
                 // Wait for a USB message to arrive
                 if (!retry)
                     osRecvMesg(&usbMessageQ, (OSMesg *)&threadMsg, OS_MESG_BLOCK);
+                
+                // Don't bother touching the USB if the flush timer went off with nothing to print
+                #if PRINT_RING_SIZE
+                    if (threadMsg == &debug_ring_mesg && debug_ring_write == debug_ring_read && debug_ring_dropped == 0)
+                        continue;
+                #endif
             #endif
             
             // Ensure there's no data in the USB (which handles MSG_READ)
@@ -1016,6 +2303,36 @@ https://github.com/buu342/N64-UNFLoader
                     }
                 #endif
                 
+                // Files are handed to the user
+                if (USBHEADER_GETTYPE(header) == DATATYPE_SEGMENT || USBHEADER_GETTYPE(header) == DATATYPE_RAWBINARY)
+                {
+                    if (!debug_handle_segment(header))
+                        errortype = USBERROR_SEGMENT;
+                    usb_purge();
+                    if (errortype != USBERROR_NONE)
+                        break;
+                    continue;
+                }
+                
+                // Answers to debug_fs_read
+                if (USBHEADER_GETTYPE(header) == DATATYPE_FSDATA)
+                {
+                    debug_handle_fsdata(header);
+                    usb_purge();
+                    continue;
+                }
+                
+                // Memory patches are written straight into RDRAM
+                if (USBHEADER_GETTYPE(header) == DATATYPE_PATCH)
+                {
+                    if (!debug_handle_patch(header))
+                        errortype = USBERROR_PATCH;
+                    usb_purge();
+                    if (errortype != USBERROR_NONE)
+                        break;
+                    continue;
+                }
+                
                 // Ensure we're receiving a text command
                 if (USBHEADER_GETTYPE(header) != DATATYPE_TEXT)
                 {
@@ -1085,6 +2402,12 @@ https://github.com/buu342/N64-UNFLoader
                     case USBERROR_TOOMUCH:
                         usb_write(DATATYPE_TEXT, "Error: Command too large\n", 25+1);
                         break;
+                    case USBERROR_SEGMENT:
+                        usb_write(DATATYPE_TEXT, "Error: Unable to receive file\n", 30+1);
+                        break;
+                    case USBERROR_PATCH:
+                        usb_write(DATATYPE_TEXT, "Error: Unable to apply patch\n", 29+1);
+                        break;
                     case USBERROR_CUSTOM:
                         usb_write(DATATYPE_TEXT, debug_command_error, strlen(debug_command_error)+1);
                         usb_write(DATATYPE_TEXT, "\n", 1+1);
@@ -1093,6 +2416,19 @@ https://github.com/buu342/N64-UNFLoader
                 errortype = USBERROR_NONE;
             }
             
+            // Send any queued prints first, so that they arrive in order with other writes
+            #if PRINT_RING_SIZE
+                debug_ring_flush();
+            #endif
+            #if USE_PROFILER
+                debug_profile_flush();
+            #endif
+            #if USE_ZONES
+                debug_zone_flush();
+            #endif
+            #if USE_HEAPTRACE
+                debug_heap_flush();
+            #endif
             
             // Handle the other USB messages
             if (threadMsg != NULL)
@@ -1107,6 +2443,12 @@ https://github.com/buu342/N64-UNFLoader
                         else
                             retry = FALSE;
                         break;
+                    case MSG_STREAM:
+                        threadMsg->size = usb_stream_read(threadMsg->buff, threadMsg->size);
+                        break;
+                    case MSG_FSREAD:
+                        retry = debug_fs_service((debugFSRead*)threadMsg->buff);
+                        break;
                 }
             }
             
@@ -1116,6 +2458,9 @@ https://github.com/buu342/N64-UNFLoader
                     break;
             #endif
         }
+        #ifdef LIBDRAGON
+            debug_usbbusy = FALSE;
+        #endif
     }
     
     #ifndef LIBDRAGON
@@ -1132,22 +2477,38 @@ https://github.com/buu342/N64-UNFLoader
             
             static void* debug_osSyncPrintf_implementation(void *unused, const char *str, size_t len)
             {
-                void* ret;
-                usbMesg msg;
-                
-                // Clear the debug buffer and copy the formatted string to it
-                memset(debug_buffer, 0, len+1);
-                ret =  ((char *) memcpy(debug_buffer, str, len) + len);
-                
-                // Send the printf to the usb thread
-                msg.msgtype = MSG_WRITE;
-                msg.datatype = DATATYPE_TEXT;
-                msg.buff = debug_buffer;
-                msg.size = len+1;
-                osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
-                
-                // Return the end of the buffer
-                return ret;
+                #if PRINT_RING_SIZE
+                    const char* end = str + len;
+                    
+                    // Queue the string in the ring buffer, in pieces so that interrupts are never masked for long.
+                    // _Printf only needs a non-NULL return to continue
+                    while (str != end)
+                    {
+                        u32 size = end-str;
+                        if (size > BUFFER_SIZE)
+                            size = BUFFER_SIZE;
+                        debug_ring_push(str, size);
+                        str += size;
+                    }
+                    return (void*)end;
+                #else
+                    void* ret;
+                    usbMesg msg;
+                    
+                    // Clear the debug buffer and copy the formatted string to it
+                    memset(debug_buffer, 0, len+1);
+                    ret =  ((char *) memcpy(debug_buffer, str, len) + len);
+                    
+                    // Send the printf to the usb thread
+                    msg.msgtype = MSG_WRITE;
+                    msg.datatype = DATATYPE_TEXT;
+                    msg.buff = debug_buffer;
+                    msg.size = len+1;
+                    osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+                    
+                    // Return the end of the buffer
+                    return ret;
+                #endif
             }
             
         #endif
@@ -1181,6 +2542,109 @@ https://github.com/buu342/N64-UNFLoader
             }
             
             
+            #if USE_COREDUMP
+                
+                /*==============================
+                    debug_coredump_thread
+                    Writes the registers of a thread to a core dump,
+                    as big endian 32-bit values
+                    @param Where to write the registers to
+                    @param The thread whose registers to write
+                ==============================*/
+                
+                static void debug_coredump_thread(u8* out, OSThread* thread)
+                {
+                    int i;
+                    u32 words[CORE_THREADSIZE/4];
+                    __OSThreadContext* context = &thread->context;
+                    u64* gprs = &context->at; // at to t9, then gp, sp, s8 and ra, as k0 and k1 aren't saved
+                    u32* fprs = (u32*)&context->fp0; // The even FPRs, as doubles
+                    
+                    // GPRs, lo and hi are stored as 64-bit values, with the upper half first
+                    words[0] = thread->id;
+                    for (i=0; i<32; i++)
+                    {
+                        u64 value = 0;
+                        if (i >= 1 && i <= 25)
+                            value = gprs[i-1];
+                        else if (i >= 28)
+                            value = gprs[i-3];
+                        words[1+i*2] = (u32)(value >> 32);
+                        words[2+i*2] = (u32)value;
+                    }
+                    words[65] = (u32)(context->lo >> 32);
+                    words[66] = (u32)context->lo;
+                    words[67] = (u32)(context->hi >> 32);
+                    words[68] = (u32)context->hi;
+                    words[69] = context->pc;
+                    words[70] = context->badvaddr;
+                    words[71] = context->sr;
+                    words[72] = context->cause;
+                    words[73] = context->fpcsr;
+                    for (i=0; i<32; i++)
+                        words[74+i] = fprs[i];
+                    for (i=0; i<CORE_THREADSIZE/4; i++)
+                    {
+                        *out++ = (words[i] >> 24) & 0xFF;
+                        *out++ = (words[i] >> 16) & 0xFF;
+                        *out++ = (words[i] >> 8) & 0xFF;
+                        *out++ = words[i] & 0xFF;
+                    }
+                }
+                
+                
+                /*==============================
+                    debug_coredump
+                    Sends the registers of every thread, followed by
+                    all of RDRAM, so that UNFLoader can write them
+                    to an ELF core file
+                    @param The thread that faulted
+                ==============================*/
+                
+                static void debug_coredump(OSThread* faulted)
+                {
+                    usbMesg msg;
+                    OSThread* thread;
+                    u32 count = 1;
+                    u32 offset;
+                    
+                    // The faulted thread goes first, so that it's the one GDB starts in.
+                    // This thread is skipped, as its registers were never saved
+                    debug_coredump_thread(debug_corepacket + CORE_HEADERSIZE, faulted);
+                    for (thread = __osGetActiveQueue(); thread->priority != -1 && count < CORE_MAXTHREADS; thread = thread->tlnext)
+                    {
+                        if (thread == faulted || thread == &faultThread)
+                            continue;
+                        debug_coredump_thread(debug_corepacket + CORE_HEADERSIZE + count*CORE_THREADSIZE, thread);
+                        count++;
+                    }
+                    for (offset=0; offset<4; offset++)
+                    {
+                        debug_corepacket[offset] = (osMemSize >> (24-offset*8)) & 0xFF;
+                        debug_corepacket[4+offset] = (count >> (24-offset*8)) & 0xFF;
+                    }
+                    
+                    // Send the registers to the usb thread. It has a higher priority than this one, so it sends them right away
+                    msg.msgtype = MSG_WRITE;
+                    msg.datatype = DATATYPE_COREREGS;
+                    msg.buff = debug_corepacket;
+                    msg.size = CORE_HEADERSIZE + count*CORE_THREADSIZE;
+                    osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+                    
+                    // Then send RDRAM in large chunks, which are DMA'd straight from it
+                    osWritebackDCacheAll();
+                    for (offset=0; offset<osMemSize; offset+=CORE_CHUNKSIZE)
+                    {
+                        msg.msgtype = MSG_WRITE;
+                        msg.datatype = DATATYPE_COREMEM;
+                        msg.buff = (void*)(0x80000000 + offset);
+                        msg.size = (osMemSize - offset < CORE_CHUNKSIZE) ? (osMemSize - offset) : CORE_CHUNKSIZE;
+                        osSendMesg(&usbMessageQ, (OSMesg)&msg, OS_MESG_BLOCK);
+                    }
+                }
+            #endif
+            
+            
             /*==============================
                 debug_thread_fault
                 Handles the fault thread
@@ -1259,6 +2723,11 @@ https://github.com/buu342/N64-UNFLoader
                         debug_printf("d20 %.15e\td22 %.15e\n", context->fp20.d, context->fp22.d);
                         debug_printf("d24 %.15e\td26 %.15e\n", context->fp24.d, context->fp26.d);
                         debug_printf("d28 %.15e\td30 %.15e\n", context->fp28.d, context->fp30.d);
+                        
+                        // Send the rest for UNFLoader's --core
+                        #if USE_COREDUMP
+                            debug_coredump(curr);
+                        #endif
                     }
                 }
             }
@@ -1440,7 +2909,7 @@ https://github.com/buu342/N64-UNFLoader
         
         static void debug_rdb_qsupported(OSThread* t)
         {
-            sprintf(debug_buffer, "swbreak+");
+            sprintf(debug_buffer, "swbreak+;binary-upload+");
             usb_purge();
             usb_write(DATATYPE_RDBPACKET, debug_buffer, strlen(debug_buffer)+1);
         }
@@ -1692,14 +3161,7 @@ https://github.com/buu342/N64-UNFLoader
             u64 ret = 0;
             while (addr[i] != '\0')
             {
-                u32 val;
-                if (addr[i] <= '9')
-                    val = addr[i]-'0';
-                else if (addr[i] <= 'F')
-                    val = 10 + addr[i] - 'A';
-                else
-                    val = 10 + addr[i] - 'a';
-                ret = (ret << 4) | (val & 0xF);
+                ret = (ret << 4) | HEX2NIBBLE(addr[i]);
                 i++;
             }
             return ret;
@@ -1789,6 +3251,43 @@ https://github.com/buu342/N64-UNFLoader
         }
         
         
+        /*==============================
+            debug_rdb_parsememory
+            Reads the address and size from a GDB memory packet
+            (m, M, x, or X) that is stored in the debug buffer
+            @param  A pointer to store the translated address in
+            @param  A pointer to store the size in
+            @returns The offset of the packet's data in the debug
+                     buffer, or 0 if the address is invalid
+        ==============================*/
+        
+        static u32 debug_rdb_parsememory(u32* addr, u32* size)
+        {
+            u32 i = 1; // Skip the command character
+            #ifdef LIBDRAGON
+                u32 osMemSize = get_memory_size();
+            #endif
+            
+            // Extract the address and size values
+            *addr = 0;
+            *size = 0;
+            while (i < BUFFER_SIZE && debug_buffer[i] != ',')
+                *addr = ((*addr) << 4) | HEX2NIBBLE(debug_buffer[i++]);
+            i++;
+            while (i < BUFFER_SIZE && debug_buffer[i] != ':' && debug_buffer[i] != '\0')
+                *size = ((*size) << 4) | HEX2NIBBLE(debug_buffer[i++]);
+            i++;
+            
+            // We need to translate the address before trying to access it
+            *addr = debug_rdb_translateaddr(*addr);
+            
+            // Ensure we are accessing a valid memory address, without letting the address plus the size overflow
+            if (*addr < 0x80000000 || *addr >= 0x80000000 + osMemSize || *size > 0x80000000 + osMemSize - *addr)
+                return 0;
+            return i;
+        }
+        
+        
         /*==============================
             debug_rdb_readmemory
             Responds to GDB with a memory read
@@ -1797,74 +3296,60 @@ https://github.com/buu342/N64-UNFLoader
         
         static void debug_rdb_readmemory(OSThread* t)
         {
-            int i;
             u32 written = 0;
             u32 read = 0;
             u32 addr;
             u32 size;
             u32 chunkcount;
             u32 header[2];
-            u8 validaddress = FALSE;
-            char command[32];
-            char* commandp = &command[0];
-            #ifdef LIBDRAGON
-                u32 osMemSize = get_memory_size();
-            #endif
-            strcpy(commandp, debug_buffer);
+            u8 validaddress;
             
-            // Skip the 'm' at the start of the command
-            commandp++;
+            // Get the address and size of the memory to read
+            validaddress = (debug_rdb_parsememory(&addr, &size) != 0);
             
-            // Extract the address value
-            strtok(commandp, ",");
-            addr = (u32)hex2u64(commandp);
+            // Each chunk holds as many bytes as fit in the debug buffer once hex encoded, plus the '\0'
+            chunkcount = (size+((BUFFER_SIZE-2)/2)-1)/((BUFFER_SIZE-2)/2);
+            if (chunkcount == 0)
+                chunkcount = 1;
             
-            // Extract the size value
-            commandp = strtok(NULL, ",");
-            size = (u32)hex2u64(commandp);
-            chunkcount = 2+size/128;
-                    
-            // Start by sending a HEADER packet with the chunk count
+            // Start by sending a HEADER packet with the number of chunks that follow it
             header[0] = DATATYPE_RDBPACKET;
-            header[1] = chunkcount;
+            header[1] = chunkcount-1;
             usb_purge();
             usb_write(DATATYPE_HEADER, &header, sizeof(u32)*2);
             
-            // We need to translate the address before trying to read it
-            addr = debug_rdb_translateaddr(addr);
-            
-            // Ensure we are reading a valid memory address
-            if (addr >= 0x80000000 && addr < 0x80000000 + osMemSize)
+            // Make sure what we read matches what's in RDRAM
+            if (validaddress)
             {
                 #ifndef LIBDRAGON
                     osWritebackDCache((u32*)addr, size);
                 #else
                     data_cache_hit_writeback((u32*)addr, size);
                 #endif
-                validaddress = TRUE;
             }
             
             // Read the memory address, one byte at a time
-            while (read < size)
+            do
             {
-                u8 val = 0;
-                if (validaddress)
-                    val = *((vu8*)(addr+read));
-                written += sprintf(debug_buffer+written, "%02x", val);
+                if (read < size)
+                {
+                    u8 val = 0;
+                    if (validaddress)
+                        val = *((vu8*)(addr+read));
+                    debug_buffer[written++] = debug_hexdigits[val >> 4];
+                    debug_buffer[written++] = debug_hexdigits[val & 0x0F];
+                    read++;
+                }
                 
-                // Send the partial address dump if we're almost overrunning the buffer, or if we've finished
-                read++;
-                if (written+3 >= BUFFER_SIZE || read == size)
+                // Send the partial address dump if we're about to overrun the buffer, or if we've finished
+                if (written+2 >= BUFFER_SIZE || read == size)
                 {
-                    usb_write(DATATYPE_RDBPACKET, &debug_buffer, strlen(debug_buffer)+1);
+                    debug_buffer[written] = '\0';
+                    usb_write(DATATYPE_RDBPACKET, &debug_buffer, written+1);
                     written = 0;
-                    chunkcount--;
                 }
             }
-            
-            // Finish sending the other chunks
-            for (i=chunkcount; i>=0; i--)
-                usb_write(DATATYPE_RDBPACKET, "\0", 1);
+            while (read < size);
         }
         
         
@@ -1876,40 +3361,26 @@ https://github.com/buu342/N64-UNFLoader
         
         static void debug_rdb_writememory(OSThread* t)
         {
-            int i;
+            u32 i;
             u32 addr;
             u32 size;
-            #ifdef LIBDRAGON
-                u32 osMemSize = get_memory_size();
-            #endif
-            char* commandp = &debug_buffer[0];
-            
-            // Skip the 'M' at the start of the command
-            commandp++;
-            
-            // Extract the address value
-            strtok(commandp, ",");
-            addr = (u32)hex2u64(commandp);
-            
-            // Extract the size value
-            commandp = strtok(NULL, ":");
-            size = (u32)hex2u64(commandp);
-            
-            // Finally, point to the data we're actually gonna write
-            commandp = strtok(NULL, "\0");
-            
-            // We need to translate the address before trying to read it
-            addr = debug_rdb_translateaddr(addr);
+            u32 offset = debug_rdb_parsememory(&addr, &size);
             
             // Ensure we are writing to a valid memory address
-            if (addr >= 0x80000000 && addr < 0x80000000 + osMemSize)
+            if (offset != 0)
             {
-                // Read the memory address, one byte at a time
-                for (i=0; i<size; i++)
+                // The hex data might not fit in the buffer, so go back to where it starts in the USB and read it bit by bit
+                usb_rewind(BUFFER_SIZE);
+                usb_skip(offset);
+                for (i=0; i<size; i+=BUFFER_SIZE/2)
                 {
-                    char byte[3];
-                    sprintf(byte, "%.2s", commandp+(i*2));
-                    *(((vu8*)addr)+i) = (u8)hex2u64(byte);
+                    u32 j;
+                    u32 count = size-i;
+                    if (count > BUFFER_SIZE/2)
+                        count = BUFFER_SIZE/2;
+                    usb_read(debug_buffer, count*2);
+                    for (j=0; j<count; j++)
+                        *(((vu8*)addr)+i+j) = (HEX2NIBBLE(debug_buffer[j*2]) << 4) | HEX2NIBBLE(debug_buffer[j*2+1]);
                 }
                 
                 // Done
@@ -1929,6 +3400,94 @@ https://github.com/buu342/N64-UNFLoader
         }
         
         
+        /*==============================
+            debug_rdb_readmemorybinary
+            Responds to GDB with a binary memory read.
+            The memory is sent through USB as is, no
+            conversion needed.
+            @param The affected thread, if any
+        ==============================*/
+        
+        static void debug_rdb_readmemorybinary(OSThread* t)
+        {
+            u32 addr;
+            u32 size;
+            u32 header[2];
+            
+            // Ensure we are reading a valid memory address
+            if (debug_rdb_parsememory(&addr, &size) == 0)
+            {
+                usb_purge();
+                usb_write(DATATYPE_RDBPACKET, "E00", 3+1);
+                return;
+            }
+            
+            // Nothing to send besides the reply marker if no data was requested
+            usb_purge();
+            if (size == 0)
+            {
+                usb_write(DATATYPE_RDBPACKET, "b", 1);
+                return;
+            }
+            
+            // Make sure what we send matches what's in RDRAM
+            #ifndef LIBDRAGON
+                osWritebackDCache((u32*)addr, size);
+            #else
+                data_cache_hit_writeback((u32*)addr, size);
+            #endif
+            
+            // Send the 'b' reply marker and the memory straight from RDRAM as two chunks
+            header[0] = DATATYPE_RDBPACKET;
+            header[1] = 1;
+            usb_write(DATATYPE_HEADER, &header, sizeof(u32)*2);
+            usb_write(DATATYPE_RDBPACKET, "b", 1);
+            usb_write(DATATYPE_RDBPACKET, (void*)addr, size);
+        }
+        
+        
+        /*==============================
+            debug_rdb_writememorybinary
+            Writes the memory from a binary GDB packet.
+            UNFLoader removes the packet escaping, so the
+            data can be read from USB directly into memory.
+            @param The affected thread, if any
+        ==============================*/
+        
+        static void debug_rdb_writememorybinary(OSThread* t)
+        {
+            u32 addr;
+            u32 size;
+            u32 offset = debug_rdb_parsememory(&addr, &size);
+            
+            // Ensure we are writing to a valid memory address
+            if (offset != 0)
+            {
+                // Go back to where the data starts in the USB, and read it into memory
+                if (size > 0)
+                {
+                    usb_rewind(BUFFER_SIZE);
+                    usb_skip(offset);
+                    usb_read((void*)addr, size);
+                    #ifndef LIBDRAGON
+                        osWritebackDCache((u32*)addr, size);
+                    #else
+                        data_cache_hit_writeback((u32*)addr, size);
+                    #endif
+                }
+                
+                // Done
+                usb_purge();
+                usb_write(DATATYPE_RDBPACKET, "OK", 2+1);
+            }
+            else
+            {
+                usb_purge();
+                usb_write(DATATYPE_RDBPACKET, "E00", 3+1);
+            }
+        }
+        
+        
         /*==============================
             debug_rdb_addbreakpoint
             Enables a breakpoint
@@ -10,14 +10,33 @@
         #define DEBUG_MODE    1   // Enable/Disable debug mode
     #endif
     
+    // Enable/Disable the profiler, zones and heap tracing
+    #ifndef USE_PROFILER
+        #define USE_PROFILER  0   // Sample what the CPU is running and send it to UNFLoader's --profile
+    #endif
+    #ifndef USE_ZONES
+        #define USE_ZONES     0   // Record the zones from debug_zone_begin/end and send them to UNFLoader's --trace
+    #endif
+    #ifndef USE_HEAPTRACE
+        #define USE_HEAPTRACE 0   // Record allocations and frees and send them to UNFLoader's --heap
+    #endif
+    
     // Settings
     #define DEBUG_INIT_MSG    1   // Print a message when debug mode has initialized
     #define AUTOPOLL_ENABLED  0   // Automatically poll the USB on a timer
     #define AUTOPOLL_TIME     200 // Time (in milliseconds) between auto polls
     #define USE_FAULTTHREAD   1   // Create a fault detection thread (libultra only)
+    #define USE_COREDUMP      0   // Send all of RDRAM and the registers to UNFLoader's --core when a thread faults (needs USE_FAULTTHREAD)
     #define USE_RDBTHREAD     0   // Create a remote debugger thread
     #define OVERWRITE_OSPRINT 1   // Replaces osSyncPrintf calls with debug_printf (libultra only)
     #define MAX_COMMANDS      25  // The max amount of user defined commands possible
+    #define PRINT_RING_SIZE   8192 // Size (in bytes, power of two) of the debug_printf ring buffer. 0 prints synchronously instead
+    #define PRINT_RING_FLUSH  16  // Time (in milliseconds) between automatic flushes of the debug_printf ring buffer (and on libdragon, of the other rings)
+    #define FS_TIMEOUT        2000 // Time (in milliseconds) that debug_fs_read waits for UNFLoader to answer
+    #define PROFILER_RATE     500 // Samples taken per second by the profiler
+    #define PROFILER_RING     256 // Number of samples (power of two) the profiler holds. They're sent once half of them are taken
+    #define ZONE_RING         1024 // Number of zone events (power of two) that are held until the USB thread sends them
+    #define HEAP_RING         1024 // Number of allocations and frees (power of two) that are held until the USB thread sends them
     
     // USB thread definitions (libultra only)
     #define USB_THREAD_ID    14
@@ -34,6 +53,11 @@
     #define RDB_THREAD_PRI   124
     #define RDB_THREAD_STACK 0x2000
     
+    // Profiler thread definitions (libultra only)
+    #define PROFILER_THREAD_ID    16
+    #define PROFILER_THREAD_PRI   127 // Threads with a higher priority than this aren't sampled while they're running
+    #define PROFILER_THREAD_STACK 0x800
+    
     
     /*********************************
              Debug Functions
@@ -53,7 +77,12 @@
         /*==============================
             debug_printf
             Prints a formatted message to the developer's command prompt.
-            Supports up to 256 characters.
+            Supports up to 256 characters. If PRINT_RING_SIZE is nonzero,
+            the message is queued and sent later by the USB thread.
+            Messages that don't fit in the ring are dropped and counted.
+            The message is formatted in a BUFFER_SIZE (256 byte) buffer
+            on the caller's stack, so leave room for it in the stacks of
+            threads that print.
             @param A string to print
             @param variadic arguments to print as well
         ==============================*/
@@ -147,6 +176,233 @@
         extern void debug_printcommands();
         
         
+        /*==============================
+            debug_segmenthandler
+            Assigns a function to receive files sent by UNFLoader with 
+            a lone @file@ command. Large files arrive in several segments,
+            and the function is called once per segment, in order. It must
+            read the segment's data itself with usb_read.
+            @param The function pointer to execute, which receives the transfer
+                   ID, the segment's offset and size, and the total file size
+        ==============================*/
+        
+        extern void debug_segmenthandler(void(*execute)(unsigned int transfer, unsigned int offset, unsigned int size, unsigned int total));
+        
+        
+        /*==============================
+            debug_segmentbuffer
+            Reassembles files sent by UNFLoader with a lone @file@ command
+            into a buffer. Used instead of the function from debug_segmenthandler.
+            @param The buffer to reassemble the file in
+            @param The size of the buffer
+            @param The function pointer to execute when the whole file has
+                   arrived, which receives the transfer ID and the file size
+        ==============================*/
+        
+        extern void debug_segmentbuffer(void* buffer, unsigned int size, void(*complete)(unsigned int transfer, unsigned int total));
+        
+        
+        /*==============================
+            debug_streamread
+            Reads data that UNFLoader streamed with --stream, through
+            the USB thread. Needs USB_STREAM_SIZE to be set in usb.h.
+            Data only arrives while commands are being polled.
+            @param  The buffer to put the read data in
+            @param  The number of bytes to read
+            @return The number of bytes that were read
+        ==============================*/
+        
+        extern int debug_streamread(void* buffer, int size);
+        
+        
+        /*==============================
+            debug_patchhandler
+            Assigns a function to call after UNFLoader writes a
+            patch straight into RDRAM with --patch, so that the
+            game can reload whatever was patched. With libultra,
+            the function is called from the USB thread.
+            @param The function pointer to execute, which receives
+                   the patched address and the size of the patch
+        ==============================*/
+        
+        extern void debug_patchhandler(void(*execute)(void* address, unsigned int size));
+        
+        
+        /*==============================
+            debug_fs_read
+            Reads part of a file from the folder that UNFLoader
+            serves with --fs. Blocks until the data arrives.
+            Don't use this from a command function.
+            @param  The path of the file, relative to the folder
+            @param  The offset in the file to start reading from
+            @param  The number of bytes to read
+            @param  The buffer to put the read data in
+            @return The number of bytes that were read, which is less
+                    than requested at the end of the file, or -1
+                    if the file couldn't be read
+        ==============================*/
+        
+        extern int debug_fs_read(const char* path, unsigned int offset, unsigned int size, void* buffer);
+        
+        
+        /*==============================
+            debug_profile
+            Pauses or resumes the profiler, which samples what the CPU
+            is running PROFILER_RATE times a second. Needs USE_PROFILER,
+            and starts running in debug_initialize unless paused before.
+            @param 1 to resume the profiler, 0 to pause it
+        ==============================*/
+        
+        #if USE_PROFILER
+            extern void debug_profile(char enable);
+        #else
+            #define debug_profile(a)
+        #endif
+        
+        
+        #if USE_ZONES
+            
+            /*==============================
+                debug_zone_begin
+                Marks the start of a zone, which shows up in the
+                timeline that UNFLoader writes with --trace.
+                Zones can be nested.
+                @param The ID of the zone
+            ==============================*/
+            
+            extern void debug_zone_begin(unsigned short id);
+            
+            
+            /*==============================
+                debug_zone_end
+                Marks the end of the zone that was begun last
+                on the current thread
+            ==============================*/
+            
+            extern void debug_zone_end();
+            
+            
+            /*==============================
+                debug_zone_name
+                Tells UNFLoader the name of a zone ID. Name your
+                zones before using them, as zones that were already
+                sent keep the name they had.
+                @param The ID of the zone
+                @param The name of the zone
+            ==============================*/
+            
+            extern void debug_zone_name(unsigned short id, const char* name);
+            
+        #else
+            #define debug_zone_begin(a)
+            #define debug_zone_end()
+            #define debug_zone_name(a, b)
+        #endif
+        
+        
+        #if USE_HEAPTRACE
+            
+            /*==============================
+                debug_heap_alloc
+                Tells UNFLoader's --heap about an allocation.
+                Call this from your own allocators.
+                @param The allocated memory
+                @param The size of the allocation. Sizes of 16MB or
+                       more are reported as 0xFFFFFF bytes
+                @param The address the allocator was called from,
+                       usually __builtin_return_address(0)
+            ==============================*/
+            
+            extern void debug_heap_alloc(void* ptr, unsigned int size, void* caller);
+            
+            
+            /*==============================
+                debug_heap_free
+                Tells UNFLoader's --heap that memory was freed.
+                Call this from your own allocators.
+                @param The freed memory
+                @param The address the allocator was called from,
+                       usually __builtin_return_address(0)
+            ==============================*/
+            
+            extern void debug_heap_free(void* ptr, void* caller);
+            
+            #ifdef LIBDRAGON
+                
+                /*==============================
+                    debug_malloc
+                    Calls malloc, and records the allocation
+                    @param  The size to allocate
+                    @return The allocated memory, or NULL
+                ==============================*/
+                
+                extern void* debug_malloc(unsigned int size);
+                
+                
+                /*==============================
+                    debug_calloc
+                    Calls calloc, and records the allocation
+                    @param  The number of elements to allocate
+                    @param  The size of each element
+                    @return The allocated memory, or NULL
+                ==============================*/
+                
+                extern void* debug_calloc(unsigned int count, unsigned int size);
+                
+                
+                /*==============================
+                    debug_realloc
+                    Calls realloc, and records the free and
+                    the new allocation
+                    @param  The memory to reallocate, or NULL
+                    @param  The new size
+                    @return The reallocated memory, or NULL
+                ==============================*/
+                
+                extern void* debug_realloc(void* ptr, unsigned int size);
+                
+                
+                /*==============================
+                    debug_free
+                    Calls free, and records the free
+                    @param The memory to free
+                ==============================*/
+                
+                extern void debug_free(void* ptr);
+            #else
+                
+                /*==============================
+                    debug_osMalloc
+                    Calls osMalloc, and records the allocation
+                    @param  The region to allocate from
+                    @return The allocated buffer, or NULL
+                ==============================*/
+                
+                extern void* debug_osMalloc(void* region);
+                
+                
+                /*==============================
+                    debug_osFree
+                    Calls osFree, and records the free
+                    @param The region the buffer belongs to
+                    @param The buffer to free
+                ==============================*/
+                
+                extern void debug_osFree(void* region, void* addr);
+            #endif
+            
+        #else
+            #define debug_heap_alloc(a, b, c)
+            #define debug_heap_free(a, b)
+            #define debug_malloc(a) malloc(a)
+            #define debug_calloc(a, b) calloc(a, b)
+            #define debug_realloc(a, b) realloc(a, b)
+            #define debug_free(a) free(a)
+            #define debug_osMalloc(a) osMalloc(a)
+            #define debug_osFree(a, b) osFree(a, b)
+        #endif
+        
+        
         // Ignore this, use the macro instead
         extern void _debug_assert(const char* expression, const char* file, int line);
         
@@ -165,6 +421,23 @@
         #define debug_parsecommand(a) NULL
         #define debug_sizecommand() 0
         #define debug_printcommands()
+        #define debug_segmenthandler(a)
+        #define debug_segmentbuffer(a, b, c)
+        #define debug_streamread(a, b) 0
+        #define debug_patchhandler(a)
+        #define debug_fs_read(a, b, c, d) -1
+        #define debug_profile(a)
+        #define debug_zone_begin(a)
+        #define debug_zone_end()
+        #define debug_zone_name(a, b)
+        #define debug_heap_alloc(a, b, c)
+        #define debug_heap_free(a, b)
+        #define debug_malloc(a) malloc(a)
+        #define debug_calloc(a, b) calloc(a, b)
+        #define debug_realloc(a, b) realloc(a, b)
+        #define debug_free(a) free(a)
+        #define debug_osMalloc(a) osMalloc(a)
+        #define debug_osFree(a, b) osFree(a, b)
         #define debug_64drivebutton(a, b)
         #define usb_initialize() 0
         #define usb_getcart() 0
@@ -174,6 +447,8 @@
         #define usb_skip(a)
         #define usb_rewind(a)
         #define usb_purge()
+        #define usb_stream_available() 0
+        #define usb_stream_read(a, b) 0
         
     #endif
     
@@ -19,18 +19,37 @@ https://github.com/buu342/N64-UNFLoader
            Data macros
 *********************************/
 
-// Input/Output buffer size. Always keep it at 512
-#define BUFFER_SIZE 512
+// Input/Output buffer size. There are two of these, so that one can be copied while the other is being transferred
+#define BUFFER_SIZE USB_BUFFER_SIZE
+#if (BUFFER_SIZE % 512) != 0
+    #error USB_BUFFER_SIZE must be a multiple of 512
+#endif
+
+// Reads and writes of at least this many bytes are DMA'd straight to or from the caller's buffer, if it is 8 byte aligned
+#define DIRECT_MINSIZE BUFFER_SIZE
 
 // USB Memory location
 #define DEBUG_ADDRESS (0x04000000 - DEBUG_ADDRESS_SIZE) // Put the debug area at the 64MB - DEBUG_ADDRESS_SIZE area in ROM space
+#define SDRAM_PIBASE  0x10000000 // Where all the supported flashcarts put their SDRAM
 
 // Data header related
 #define USBHEADER_CREATE(type, left) ((((type)<<24) | ((left) & 0x00FFFFFF)))
 
 // Protocol related
-#define USBPROTOCOL_VERSION 2
-#define HEARTBEAT_VERSION   1
+#define USBPROTOCOL_VERSION 3
+#define HEARTBEAT_VERSION   2
+
+// Protocol 3 related
+#define USBV3_HEADERSIZE 12 // Datatype, channel, sequence number, total length and offset of the chunk
+#define USBV3_MAXCHUNK   ((((DEBUG_ADDRESS_SIZE) < 0x00FFFFFF) ? (DEBUG_ADDRESS_SIZE) : 0x00FFFFFF) - USBV3_HEADERSIZE)
+
+// Streaming related
+#define STREAM_STATUSSIZE 12                  // Ring size, bytes received and bytes read
+#define STREAM_CAPACITY   (USB_STREAM_SIZE-2) // Leave a gap, so that padding an odd sized write never touches unread data
+#define STREAM_ACKSIZE    (USB_STREAM_SIZE/4) // Tell UNFLoader how much we've read every time this many bytes are read
+#if (USB_STREAM_SIZE % 512) != 0
+    #error USB_STREAM_SIZE must be a multiple of 512
+#endif
 
 
 /*********************************
@@ -65,7 +84,7 @@ https://github.com/buu342/N64-UNFLoader
     #define IO_READ(addr)       (*(vu32 *)PHYS_TO_K1(addr))
     
     // Data alignment
-    #define OS_DCACHE_ROUNDUP_ADDR(x) (void *)(((((u32)(x)+0xf)/0x10)*0x10))
+    #define OS_DCACHE_ROUNDUP_ADDR(x) (void *)(((((uintptr_t)(x)+0xf)/0x10)*0x10))
     #define OS_DCACHE_ROUNDUP_SIZE(x) (u32)(((((u32)(x)+0xf)/0x10)*0x10))
 #endif
 
@@ -143,6 +162,8 @@ https://github.com/buu342/N64-UNFLoader
 
 #define ED_REGKEY         0xAA55
 
+#define ED_USBDAT_SIZE    512 // Size of the EverDrive's own USB buffer
+
 #define ED25_VERSION      0xED640007        // V2.5
 #define ED3_VERSION       0xED640008        // V3
 #define EDX_VERSION       0xED640013        // X7, X5
@@ -220,20 +241,35 @@ https://github.com/buu342/N64-UNFLoader
 
 static void usb_findcart(void);
 static u32  usb_getaddr();
+static int  usb_getchannel(int datatype);
+static void usb_copyout(void* dest, const void* data, int offset, int size);
+static u32  usb_unwrap(void);
+static void usb_endpacket(void);
+static void usb_sendcredits(void);
+static void usb_dma_finish(void);
+static void usb_writeout(u32 pi_address, const void* data, int size, int padding);
+static void usb_fetchblock(void);
+static u32  usb_nextpacket(void);
+#if USB_STREAM_SIZE > 0
+    static void usb_stream_receive(void);
+    static void usb_stream_sendstatus(void);
+#endif
 
 static s8   usb_64drive_write(int datatype, const void* data, int size);
 static u32  usb_64drive_poll(void);
-static void usb_64drive_read(void);
+static void usb_64drive_read(void* buffer, int offset);
 static void usb_64drive_set_extendedaddress(u8 enable);
+static void usb_64drive_set_writable(u32 enable);
 static u32  usb_64drive_get_baseaddr();
 
 static s8   usb_everdrive_write(int datatype, const void* data, int size);
 static u32  usb_everdrive_poll(void);
-static void usb_everdrive_read(void);
+static void usb_everdrive_read(void* buffer, int offset);
 
 static s8   usb_sc64_write(int datatype, const void* data, int size);
 static u32  usb_sc64_poll(void);
-static void usb_sc64_read(void);
+static void usb_sc64_read(void* buffer, int offset);
+static u32  usb_sc64_set_writable(u32 enable);
 
 
 /*********************************
@@ -243,17 +279,37 @@ static void usb_sc64_read(void);
 // Function pointers
 s8   (*funcPointer_write)(int datatype, const void* data, int size);
 u32  (*funcPointer_poll)(void);
-void (*funcPointer_read)(void);
+void (*funcPointer_read)(void* buffer, int offset);
 
 // USB globals
 static s8 usb_cart = CART_NONE;
-static u8 usb_buffer_align[BUFFER_SIZE+16]; // IDO doesn't support GCC's __attribute__((aligned(x))), so this is a workaround
+static u8 usb_buffer_align[2*BUFFER_SIZE+16]; // IDO doesn't support GCC's __attribute__((aligned(x))), so this is a workaround
+static u8* usb_buffers[2];
 static u8* usb_buffer;
+static int usb_bufferindex = 0;
 static char usb_didtimeout = FALSE;
 static int usb_datatype = 0;
 static int usb_datasize = 0;
 static int usb_dataleft = 0;
 static int usb_readblock = -1;
+static int usb_prefetchblock = -1; // The block being read into the buffer that usb_buffer doesn't point to, or -1
+static char usb_dmapending = FALSE;
+
+// Protocol 3 globals
+static char usb_hostv3 = FALSE;    // Whether UNFLoader has told us it speaks protocol 3
+static int usb_datachannel = -1;   // The channel of the packet being read, or -1
+static int usb_dataoffset = 0;     // Where the packet's data starts, after the protocol 3 header
+static u8  usb_prefix[USBV3_HEADERSIZE];
+static int usb_prefixsize = 0;
+static u16 usb_sequence[USBCHANNEL_COUNT];
+static u8  usb_credits[USBCHANNEL_COUNT]; // Credits to hand back to UNFLoader
+
+// Streaming globals
+static u32  usb_stream_in = 0;          // Total bytes moved into the ring
+static u32  usb_stream_out = 0;         // Total bytes read from the ring
+static u32  usb_stream_acked = 0;       // What usb_stream_out was the last time UNFLoader was told about it
+static char usb_stream_announce = TRUE; // Whether UNFLoader needs to be told about the ring
+static u8   usb_stream_lastbyte = 0;    // The byte before usb_stream_in, for when it ends up on an odd address
 
 // Cart specific globals
 static vu8 d64_wasarmed = FALSE;
@@ -294,6 +350,7 @@ static u8 d64_extendedaddr = FALSE;
 
 static inline u32 usb_io_read(u32 pi_address)
 {
+    usb_dma_finish();
     #ifndef LIBDRAGON
         u32 value;
         #if USE_OSRAW
@@ -318,6 +375,7 @@ static inline u32 usb_io_read(u32 pi_address)
 
 static inline void usb_io_write(u32 pi_address, u32 value)
 {
+    usb_dma_finish();
     #ifndef LIBDRAGON
         #if USE_OSRAW
             osPiRawWriteIo(pi_address, value);
@@ -330,6 +388,84 @@ static inline void usb_io_write(u32 pi_address, u32 value)
 }
 
 
+/*==============================
+    usb_dma_finish
+    Waits for the DMA started by usb_dma_startread
+    or usb_dma_startwrite to finish, if there is one
+==============================*/
+
+static void usb_dma_finish(void)
+{
+    if (!usb_dmapending)
+        return;
+    #ifndef LIBDRAGON
+        #if USE_OSRAW
+            while (IO_READ(PI_STATUS_REG) & (PI_STATUS_DMA_BUSY | PI_STATUS_IO_BUSY));
+        #else
+            while (osRecvMesg(&dmaMessageQ, NULL, OS_MESG_NOBLOCK) != 0);
+        #endif
+    #else
+        dma_wait();
+    #endif
+    usb_dmapending = FALSE;
+}
+
+
+/*==============================
+    usb_dma_startread
+    Starts reading arbitrarily sized data from a given
+    address using DMA, without waiting for it to finish.
+    @param  The buffer to read into
+    @param  The address to read from
+    @param  The size of the data to read
+==============================*/
+
+static void usb_dma_startread(void *ram_address, u32 pi_address, size_t size)
+{
+    usb_dma_finish();
+    #ifndef LIBDRAGON
+        osWritebackDCache(ram_address, size);
+        osInvalDCache(ram_address, size);
+        #if USE_OSRAW
+            osPiRawStartDma(OS_READ, pi_address, ram_address, size);
+        #else
+            osPiStartDma(&dmaIOMessageBuf, OS_MESG_PRI_NORMAL, OS_READ, pi_address, ram_address, size, &dmaMessageQ);
+        #endif
+    #else
+        data_cache_hit_writeback_invalidate(ram_address, size);
+        dma_read_raw_async(ram_address, pi_address, size);
+    #endif
+    usb_dmapending = TRUE;
+}
+
+
+/*==============================
+    usb_dma_startwrite
+    Starts writing arbitrarily sized data to a given
+    address using DMA, without waiting for it to finish.
+    @param  The buffer to read from
+    @param  The address to write to
+    @param  The size of the data to write
+==============================*/
+
+static void usb_dma_startwrite(void *ram_address, u32 pi_address, size_t size)
+{
+    usb_dma_finish();
+    #ifndef LIBDRAGON
+        osWritebackDCache(ram_address, size);
+        #if USE_OSRAW
+            osPiRawStartDma(OS_WRITE, pi_address, ram_address, size);
+        #else
+            osPiStartDma(&dmaIOMessageBuf, OS_MESG_PRI_NORMAL, OS_WRITE, pi_address, ram_address, size, &dmaMessageQ);
+        #endif
+    #else
+        data_cache_hit_writeback(ram_address, size);
+        dma_write_raw_async(ram_address, pi_address, size);
+    #endif
+    usb_dmapending = TRUE;
+}
+
+
 /*==============================
     usb_dma_read
     Reads arbitrarily sized data from a
@@ -341,6 +477,7 @@ static inline void usb_io_write(u32 pi_address, u32 value)
 
 static inline void usb_dma_read(void *ram_address, u32 pi_address, size_t size)
 {
+    usb_dma_finish();
     #ifndef LIBDRAGON
         osWritebackDCache(ram_address, size);
         osInvalDCache(ram_address, size);
@@ -368,6 +505,7 @@ static inline void usb_dma_read(void *ram_address, u32 pi_address, size_t size)
 
 static inline void usb_dma_write(void *ram_address, u32 pi_address, size_t size)
 {
+    usb_dma_finish();
     #ifndef LIBDRAGON
         osWritebackDCache(ram_address, size);
         #if USE_OSRAW
@@ -383,6 +521,70 @@ static inline void usb_dma_write(void *ram_address, u32 pi_address, size_t size)
 }
 
 
+/*==============================
+    usb_writeout
+    Writes outgoing data (and its protocol 3 header, if any) to
+    the cartridge. The part of the data that is 8 byte aligned in
+    RDRAM is sent by DMA straight from the caller's buffer, and
+    only the unaligned head and tail go through the USB buffers.
+    Each block is copied into one buffer while the other one is
+    still being sent.
+    @param The address to write to
+    @param The data being sent
+    @param The size of the data, counting the header
+    @param The alignment to pad the end of the data to with zeroes
+==============================*/
+
+static void usb_writeout(u32 pi_address, const void* data, int size, int padding)
+{
+    int read = 0;
+    int direct = 0;
+    int directsize = 0;
+    int index = 0;
+    
+    // Find the part of the data that can skip usb_buffer. The PI needs it to start on an even cartridge address
+    if (size - usb_prefixsize >= DIRECT_MINSIZE)
+    {
+        direct = usb_prefixsize + ((8 - ((unsigned long)data & 7)) & 7);
+        directsize = (size - direct) & ~7;
+        if ((direct % 2) != 0 || directsize < DIRECT_MINSIZE)
+            directsize = 0;
+    }
+    
+    // Write data to SDRAM until we've finished
+    while (read < size)
+    {
+        int block, blocksend;
+        
+        // Send the aligned part in one go
+        if (directsize > 0 && read == direct)
+        {
+            usb_dma_startwrite((void*)((char*)data+read-usb_prefixsize), pi_address+read, directsize);
+            read += directsize;
+            continue;
+        }
+        
+        // Otherwise copy the data to the PI DMA aligned buffer, stopping where the aligned part starts
+        block = MIN(size-read, BUFFER_SIZE);
+        if (directsize > 0 && read < direct && read+block > direct)
+            block = direct-read;
+        usb_copyout(usb_buffers[index], data, read, block);
+        
+        // Pad the end of the data with zeroes
+        blocksend = block;
+        if (read+block == size)
+            while (blocksend%padding)
+                usb_buffers[index][blocksend++] = 0;
+        
+        // Start copying the block of data from RDRAM to SDRAM, and fill the other buffer in the meantime
+        usb_dma_startwrite(usb_buffers[index], pi_address+read, ALIGN(blocksend, 2));
+        index ^= 1;
+        read += block;
+    }
+    usb_dma_finish();
+}
+
+
 /*********************************
          Timeout helpers
 *********************************/
@@ -441,8 +643,11 @@ static char usb_timeout_check(u32 start_ticks, u32 duration)
 char usb_initialize(void)
 {
     // Initialize the debug related globals
-    usb_buffer = (u8*)OS_DCACHE_ROUNDUP_ADDR(usb_buffer_align);
-    memset(usb_buffer, 0, BUFFER_SIZE);
+    usb_buffers[0] = (u8*)OS_DCACHE_ROUNDUP_ADDR(usb_buffer_align);
+    usb_buffers[1] = usb_buffers[0] + BUFFER_SIZE;
+    usb_bufferindex = 0;
+    usb_buffer = usb_buffers[0];
+    memset(usb_buffer, 0, 2*BUFFER_SIZE);
         
     #ifndef LIBDRAGON
         // Create the message queue
@@ -600,6 +805,9 @@ u32 usb_getaddr()
 
 char usb_write(int datatype, const void* data, int size)
 {
+    int channel;
+    int sent = 0;
+    
     // If no debug cart exists, stop
     if (usb_cart == CART_NONE)
         return 0;
@@ -608,8 +816,44 @@ char usb_write(int datatype, const void* data, int size)
     if (usb_dataleft != 0)
         return 0;
     
-    // Call the correct write function
-    return funcPointer_write(datatype, data, size);
+    // Call the correct write function if UNFLoader doesn't speak protocol 3
+    if (!usb_hostv3)
+        return funcPointer_write(datatype, data, size);
+    
+    // Otherwise, wrap the data in protocol 3 headers, splitting it up if it doesn't fit in the debug area
+    channel = usb_getchannel(datatype);
+    do
+    {
+        s8 result;
+        int block = size - sent;
+        if (block > USBV3_MAXCHUNK)
+            block = USBV3_MAXCHUNK;
+        
+        // Build the header
+        usb_prefix[0]  = (u8)datatype;
+        usb_prefix[1]  = (u8)channel;
+        usb_prefix[2]  = (u8)((usb_sequence[channel]>>8)&0xFF);
+        usb_prefix[3]  = (u8)(usb_sequence[channel]&0xFF);
+        usb_prefix[4]  = (u8)((size>>24)&0xFF);
+        usb_prefix[5]  = (u8)((size>>16)&0xFF);
+        usb_prefix[6]  = (u8)((size>>8)&0xFF);
+        usb_prefix[7]  = (u8)(size&0xFF);
+        usb_prefix[8]  = (u8)((sent>>24)&0xFF);
+        usb_prefix[9]  = (u8)((sent>>16)&0xFF);
+        usb_prefix[10] = (u8)((sent>>8)&0xFF);
+        usb_prefix[11] = (u8)(sent&0xFF);
+        usb_sequence[channel]++;
+        
+        // Send the chunk, with the header in front of it
+        usb_prefixsize = USBV3_HEADERSIZE;
+        result = funcPointer_write(DATATYPE_CHANNEL, (void*)((char*)data+sent), USBV3_HEADERSIZE+block);
+        usb_prefixsize = 0;
+        if (result != 1)
+            return result;
+        sent += block;
+    }
+    while (sent < size);
+    return 1;
 }
 
 
@@ -620,7 +864,30 @@ char usb_write(int datatype, const void* data, int size)
     @return The data header, or 0
 ==============================*/
 
-u32 usb_poll(void)
+unsigned long usb_poll(void)
+{
+    u32 header = usb_nextpacket();
+    
+    // Streamed data goes into the stream ring instead of being handed to the caller, so that UNFLoader can send more of it right away
+    #if USB_STREAM_SIZE > 0
+        while (USBHEADER_GETTYPE(header) == DATATYPE_STREAM)
+        {
+            usb_stream_receive();
+            header = usb_nextpacket();
+        }
+    #endif
+    return header;
+}
+
+
+/*==============================
+    usb_nextpacket
+    Returns the header of the packet being read,
+    polling the flashcart for a new one if needed
+    @return The data header, or 0
+==============================*/
+
+static u32 usb_nextpacket(void)
 {
     // If no debug cart exists, stop
     if (usb_cart == CART_NONE)
@@ -629,18 +896,31 @@ u32 usb_poll(void)
     // If we're out of USB data to read, we don't need the header info anymore
     if (usb_dataleft <= 0)
     {
+        usb_endpacket();
         usb_dataleft = 0;
         usb_datatype = 0;
         usb_datasize = 0;
         usb_readblock = -1;
     }
         
-    // If there's still data that needs to be read, return the header with the data left
-    if (usb_dataleft != 0)
-        return USBHEADER_CREATE(usb_datatype, usb_dataleft);
+    // If there's no data that needs to be read, hand back any credits and call the correct read function
+    if (usb_dataleft == 0)
+    {
+        if (usb_hostv3)
+            usb_sendcredits();
+        #if USB_STREAM_SIZE > 0
+            usb_stream_sendstatus();
+        #endif
+        if (funcPointer_poll() == 0)
+            return 0;
+    }
+    
+    // Unwrap protocol 3 packets that we haven't looked inside of yet
+    if (usb_datatype == DATATYPE_CHANNEL && usb_datachannel == -1)
+        return usb_unwrap();
         
-    // Call the correct read function
-    return funcPointer_poll();
+    // Return the header with the data left
+    return USBHEADER_CREATE(usb_datatype, usb_dataleft);
 }
 
 
@@ -655,10 +935,6 @@ void usb_read(void* buffer, int nbytes)
 {
     int read = 0;
     int left = nbytes;
-    int offset = usb_datasize-usb_dataleft;
-    int copystart = offset%BUFFER_SIZE;
-    int block = BUFFER_SIZE-copystart;
-    int blockoffset = (offset/BUFFER_SIZE)*BUFFER_SIZE;
     
     // If no debug cart exists, stop
     if (usb_cart == CART_NONE)
@@ -668,37 +944,50 @@ void usb_read(void* buffer, int nbytes)
     if (usb_dataleft == 0)
         return;
     
+    // Ensure we don't read too much data
+    if (left > usb_dataleft)
+        left = usb_dataleft;
+    
     // Read chunks from ROM
     while (left > 0)
     {
-        // Ensure we don't read too much data
-        if (left > usb_dataleft)
-            left = usb_dataleft;
-        if (block > left)
-            block = left;
+        int offset = usb_dataoffset+usb_datasize-usb_dataleft;
+        int copystart = offset%BUFFER_SIZE;
+        int blockoffset = offset-copystart;
+        int block = MIN(BUFFER_SIZE-copystart, left);
+        char* dest = (char*)buffer+read;
         
-        // Call the read function if we're reading a new block
-        if (usb_readblock != blockoffset)
+        // Large reads into 8 byte aligned buffers skip usb_buffer, and are DMA'd straight from the cart. The PI needs it to start on an even cartridge address
+        if (left >= DIRECT_MINSIZE && ((unsigned long)dest & 7) == 0 && (offset % 2) == 0)
         {
-            usb_readblock = blockoffset;
-            funcPointer_read();
+            block = left & ~7;
+            usb_dma_read(dest, SDRAM_PIBASE + usb_getaddr() + offset, block);
+        }
+        else
+        {
+            // Fetch the block if we're reading a new one
+            if (usb_readblock != blockoffset)
+            {
+                usb_readblock = blockoffset;
+                usb_fetchblock();
+            }
+            
+            // Copy from the USB buffer to the supplied buffer
+            memcpy(dest, usb_buffer+copystart, block);
         }
-        
-        // Copy from the USB buffer to the supplied buffer
-        memcpy((void*)(((u32)buffer)+read), usb_buffer+copystart, block);
         
         // Increment/decrement all our counters
         read += block;
         left -= block;
         usb_dataleft -= block;
-        blockoffset += BUFFER_SIZE;
-        block = BUFFER_SIZE;
-        copystart = 0;
     }
     
     // Due to hardware issues, we should re-poll the 64Drive for data (which will unarm the buffer if there really isn't any more data)
     if (usb_dataleft == 0 && usb_cart == CART_64DRIVE)
+    {
+        usb_endpacket();
         usb_64drive_poll();
+    }
 }
 
 
@@ -718,7 +1007,10 @@ void usb_skip(int nbytes)
     
         // Due to hardware issues, we should re-poll the 64Drive for data (which will unarm the buffer if there really isn't any more data)
         if (usb_cart == CART_64DRIVE)
+        {
+            usb_endpacket();
             usb_64drive_poll();
+        }
     }
 }
 
@@ -745,6 +1037,7 @@ void usb_rewind(int nbytes)
 
 void usb_purge(void)
 {
+    usb_endpacket();
     usb_dataleft = 0;
     usb_datatype = 0;
     usb_datasize = 0;
@@ -779,7 +1072,8 @@ char usb_timedout()
 
 void usb_sendheartbeat(void)
 {
-    u8 buffer[4];
+    int i;
+    u8 buffer[8+USBCHANNEL_COUNT];
 
     // First two bytes describe the USB library protocol version
     buffer[0] = (u8)(((USBPROTOCOL_VERSION)>>8)&0xFF);
@@ -788,9 +1082,402 @@ void usb_sendheartbeat(void)
     // Next two bytes describe the heartbeat packet version
     buffer[2] = (u8)(((HEARTBEAT_VERSION)>>8)&0xFF);
     buffer[3] = (u8)(((HEARTBEAT_VERSION))&0xFF);
+    
+    // Next four bytes describe the largest packet UNFLoader can send us
+    buffer[4] = (u8)(((USBV3_MAXCHUNK)>>24)&0xFF);
+    buffer[5] = (u8)(((USBV3_MAXCHUNK)>>16)&0xFF);
+    buffer[6] = (u8)(((USBV3_MAXCHUNK)>>8)&0xFF);
+    buffer[7] = (u8)(((USBV3_MAXCHUNK))&0xFF);
+    
+    // The rest describe how many packets UNFLoader can send on each channel
+    for (i=0; i<USBCHANNEL_COUNT; i++)
+        buffer[8+i] = USB_CREDITS;
+    
+    // The heartbeat restarts the protocol negotiation, so it's always sent without a protocol 3 header
+    usb_hostv3 = FALSE;
+    for (i=0; i<USBCHANNEL_COUNT; i++)
+    {
+        usb_sequence[i] = 0;
+        usb_credits[i] = 0;
+    }
 
     // Send through USB
     usb_write(DATATYPE_HEARTBEAT, buffer, sizeof(buffer)/sizeof(buffer[0]));
+    
+    // UNFLoader forgets about the stream ring with every heartbeat, so tell it about it again
+    #if USB_STREAM_SIZE > 0
+        usb_stream_announce = TRUE;
+        usb_stream_sendstatus();
+    #endif
+}
+
+
+/*********************************
+      Protocol 3 functions
+*********************************/
+
+/*==============================
+    usb_getchannel
+    Decides which channel outgoing data is sent on
+    @param  The DATATYPE that is being sent
+    @return The USBCHANNEL to send the data on
+==============================*/
+
+static int usb_getchannel(int datatype)
+{
+    switch (datatype)
+    {
+        case DATATYPE_TEXT:
+        case DATATYPE_HEADER:
+            return USBCHANNEL_LOG;
+        case DATATYPE_RAWBINARY:
+        case DATATYPE_SCREENSHOT:
+        case DATATYPE_PROFILE:
+        case DATATYPE_ZONES:
+        case DATATYPE_ZONENAME:
+        case DATATYPE_HEAP:
+        case DATATYPE_COREREGS:
+        case DATATYPE_COREMEM:
+            return USBCHANNEL_BULK;
+        case DATATYPE_RDBPACKET:
+            return USBCHANNEL_RDB;
+        case DATATYPE_HEARTBEAT:
+        case DATATYPE_CREDIT:
+        case DATATYPE_STREAM:
+            return USBCHANNEL_CONTROL;
+        default:
+            return USBCHANNEL_USER;
+    }
+}
+
+
+/*==============================
+    usb_copyout
+    Copies outgoing data into a buffer, as if the
+    protocol 3 header was placed right before it
+    @param The buffer to copy to
+    @param The data being sent
+    @param The offset to start copying from, counting the header
+    @param The number of bytes to copy
+==============================*/
+
+static void usb_copyout(void* dest, const void* data, int offset, int size)
+{
+    // Copy the part of the header that's in this block
+    if (offset < usb_prefixsize)
+    {
+        int block = usb_prefixsize - offset;
+        if (block > size)
+            block = size;
+        memcpy(dest, usb_prefix+offset, block);
+        dest = (char*)dest+block;
+        offset += block;
+        size -= block;
+    }
+    
+    // Then the data itself
+    if (size > 0)
+        memcpy(dest, (char*)data+offset-usb_prefixsize, size);
+}
+
+
+/*==============================
+    usb_unwrap
+    Reads the protocol 3 header of the incoming packet,
+    so that the rest of the library only sees its data
+    @return The data header, or 0
+==============================*/
+
+static u32 usb_unwrap(void)
+{
+    u8  header[USBV3_HEADERSIZE];
+    u32 length, offset;
+    
+    // UNFLoader sent us a protocol 3 packet, so we can start using it to reply
+    usb_hostv3 = TRUE;
+    
+    // Read the header straight from the first block, since usb_read would re-poll the 64Drive if the packet has no data
+    if (usb_datasize < USBV3_HEADERSIZE)
+    {
+        usb_purge();
+        return 0;
+    }
+    usb_readblock = 0;
+    usb_fetchblock();
+    memcpy(header, usb_buffer, USBV3_HEADERSIZE);
+    length = (header[4]<<24) | (header[5]<<16) | (header[6]<<8) | header[7];
+    offset = (header[8]<<24) | (header[9]<<16) | (header[10]<<8) | header[11];
+    
+    // UNFLoader splits large files into segments itself, so we only expect whole messages here
+    if (header[1] >= USBCHANNEL_COUNT || offset != 0 || length > (u32)(usb_datasize - USBV3_HEADERSIZE))
+    {
+        usb_purge();
+        return 0;
+    }
+    
+    // Point the read functions at the data
+    usb_datatype = header[0];
+    usb_datachannel = header[1];
+    usb_dataoffset = USBV3_HEADERSIZE;
+    usb_datasize = length;
+    usb_dataleft = length;
+    
+    // Credit packets only confirm that UNFLoader speaks protocol 3, so we don't need to show them
+    if (usb_datatype == DATATYPE_CREDIT || usb_dataleft == 0)
+    {
+        usb_purge();
+        return 0;
+    }
+    return USBHEADER_CREATE(usb_datatype, usb_dataleft);
+}
+
+
+/*==============================
+    usb_endpacket
+    Marks the incoming packet as read, so that its
+    channel's credit can be handed back to UNFLoader
+==============================*/
+
+static void usb_endpacket(void)
+{
+    usb_dma_finish();
+    usb_prefetchblock = -1;
+    if (usb_datachannel >= 0 && usb_credits[usb_datachannel] < 0xFF)
+        usb_credits[usb_datachannel]++;
+    usb_datachannel = -1;
+    usb_dataoffset = 0;
+}
+
+
+/*==============================
+    usb_fetchblock
+    Gets the block at usb_readblock into usb_buffer, and
+    starts reading the block after it into the other buffer
+    so that it arrives while this one is being copied
+==============================*/
+
+static void usb_fetchblock(void)
+{
+    int next = usb_readblock + BUFFER_SIZE;
+    
+    // Use the block if we already started reading it, otherwise read it now
+    usb_dma_finish();
+    if (usb_prefetchblock == usb_readblock)
+    {
+        usb_bufferindex ^= 1;
+        usb_buffer = usb_buffers[usb_bufferindex];
+    }
+    else
+    {
+        funcPointer_read(usb_buffer, usb_readblock);
+        usb_dma_finish();
+    }
+    usb_prefetchblock = -1;
+    
+    // If the packet doesn't end in this block, start reading the next one
+    if (next < usb_dataoffset + usb_datasize)
+    {
+        funcPointer_read(usb_buffers[usb_bufferindex^1], next);
+        usb_prefetchblock = next;
+    }
+}
+
+
+/*==============================
+    usb_sendcredits
+    Hands back the credits of the packets
+    we've read since the last time
+==============================*/
+
+static void usb_sendcredits(void)
+{
+    int i;
+    char pending = FALSE;
+    
+    // Check if there's anything to hand back
+    for (i=0; i<USBCHANNEL_COUNT; i++)
+        if (usb_credits[i] > 0)
+            pending = TRUE;
+    if (!pending)
+        return;
+    
+    // Send the credits, and only forget them if they made it through
+    if (usb_write(DATATYPE_CREDIT, usb_credits, USBCHANNEL_COUNT) == 1)
+        for (i=0; i<USBCHANNEL_COUNT; i++)
+            usb_credits[i] = 0;
+}
+
+
+/*********************************
+        Streaming functions
+*********************************/
+
+#if USB_STREAM_SIZE > 0
+
+    /*==============================
+        usb_stream_setwritable
+        Allows or forbids writing to the SDRAM
+        that the stream ring is in
+        @param  A boolean with whether to enable or disable
+        @return The previous setting, to restore it with
+    ==============================*/
+
+    static u32 usb_stream_setwritable(u32 enable)
+    {
+        switch (usb_cart)
+        {
+            case CART_64DRIVE:
+                usb_64drive_set_writable(enable);
+                return !enable;
+            case CART_SC64:
+                return usb_sc64_set_writable(enable);
+            default:
+                return 0;
+        }
+    }
+
+
+    /*==============================
+        usb_stream_receive
+        Moves the stream packet that's being read from the
+        debug area into the stream ring, and marks it as read
+    ==============================*/
+
+    static void usb_stream_receive(void)
+    {
+        int read = 0;
+        int size = usb_dataleft;
+        u32 base = SDRAM_PIBASE + usb_getaddr();
+        u32 source = usb_dataoffset + usb_datasize - usb_dataleft;
+        u32 restore;
+        u8* in = usb_buffers[0];
+        u8* out = usb_buffers[1];
+        
+        // UNFLoader only sends as much as we told it there's room for, so drop anything else
+        if (size > (int)(STREAM_CAPACITY - (usb_stream_in - usb_stream_out)))
+        {
+            usb_purge();
+            return;
+        }
+        
+        // Copy the data block by block. The PI only works with even cartridge addresses, so odd positions take the byte before them along
+        usb_dma_finish();
+        usb_prefetchblock = -1;
+        restore = usb_stream_setwritable(TRUE);
+        while (read < size)
+        {
+            u32 pos = usb_stream_in % USB_STREAM_SIZE;
+            int lead = pos & 1;
+            int sourcelead = (source + read) & 1;
+            int block = MIN(size-read, BUFFER_SIZE-2);
+            if (block > (int)(USB_STREAM_SIZE - pos))
+                block = USB_STREAM_SIZE - pos;
+            usb_dma_read(in, base + source + read - sourcelead, ALIGN(sourcelead+block, 2));
+            out[0] = usb_stream_lastbyte;
+            memcpy(out+lead, in+sourcelead, block);
+            out[lead+block] = 0;
+            usb_dma_write(out, base - USB_STREAM_SIZE + pos - lead, ALIGN(lead+block, 2));
+            usb_stream_lastbyte = out[lead+block-1];
+            usb_stream_in += block;
+            read += block;
+        }
+        usb_stream_setwritable(restore);
+        usb_dataleft = 0;
+        usb_purge();
+    }
+
+
+    /*==============================
+        usb_stream_sendstatus
+        Tells UNFLoader how big the stream ring is and how much
+        of it has been read, if it needs to know, so that it
+        knows how much more data it can send
+    ==============================*/
+
+    static void usb_stream_sendstatus(void)
+    {
+        int i;
+        u8 buffer[STREAM_STATUSSIZE];
+        u32 values[3];
+        
+        // Only bother UNFLoader once enough has been read, or the ring is empty
+        if (!usb_stream_announce && usb_stream_out - usb_stream_acked < STREAM_ACKSIZE && (usb_stream_out != usb_stream_in || usb_stream_out == usb_stream_acked))
+            return;
+        values[0] = STREAM_CAPACITY;
+        values[1] = usb_stream_in;
+        values[2] = usb_stream_out;
+        for (i=0; i<3; i++)
+        {
+            buffer[i*4+0] = (values[i] >> 24) & 0xFF;
+            buffer[i*4+1] = (values[i] >> 16) & 0xFF;
+            buffer[i*4+2] = (values[i] >> 8) & 0xFF;
+            buffer[i*4+3] = values[i] & 0xFF;
+        }
+        if (usb_write(DATATYPE_STREAM, buffer, STREAM_STATUSSIZE) == 1)
+        {
+            usb_stream_acked = usb_stream_out;
+            usb_stream_announce = FALSE;
+        }
+    }
+
+#endif
+
+
+/*==============================
+    usb_stream_available
+    Returns how many bytes of streamed data have arrived
+    and are waiting to be read with usb_stream_read.
+    Streamed data is only received while calling usb_poll
+    @return The number of bytes that can be read
+==============================*/
+
+int usb_stream_available(void)
+{
+    return usb_stream_in - usb_stream_out;
+}
+
+
+/*==============================
+    usb_stream_read
+    Reads streamed data into the provided buffer, without
+    waiting for more data to arrive
+    @param  The buffer to put the read data in
+    @param  The number of bytes to read
+    @return The number of bytes that were read
+==============================*/
+
+int usb_stream_read(void* buffer, int size)
+{
+    #if USB_STREAM_SIZE > 0
+        int read = 0;
+        u32 ring = SDRAM_PIBASE + usb_getaddr() - USB_STREAM_SIZE;
+        u8* temp;
+        
+        // If no debug cart exists, stop
+        if (usb_cart == CART_NONE)
+            return 0;
+        
+        // Read through the buffer that usb_read isn't using, which means throwing away the block it fetched ahead of time
+        usb_dma_finish();
+        usb_prefetchblock = -1;
+        temp = usb_buffers[usb_bufferindex^1];
+        size = MIN(size, usb_stream_available());
+        while (read < size)
+        {
+            u32 pos = usb_stream_out % USB_STREAM_SIZE;
+            int lead = pos & 1;
+            int block = MIN(size-read, BUFFER_SIZE-2);
+            if (block > (int)(USB_STREAM_SIZE - pos))
+                block = USB_STREAM_SIZE - pos;
+            usb_dma_read(temp, ring + pos - lead, ALIGN(lead+block, 2));
+            memcpy((char*)buffer+read, temp+lead, block);
+            usb_stream_out += block;
+            read += block;
+        }
+        return read;
+    #else
+        return 0;
+    #endif
 }
 
 
@@ -1040,7 +1727,6 @@ static u32 usb_64drive_cui_read(u32 offset)
 
 static s8 usb_64drive_write(int datatype, const void* data, int size)
 {
-    s32 left = size;
     u32 pi_address = D64_BASE + usb_getaddr();
     u32 comstat = usb_io_read(D64_REG_USBCOMSTAT);
     
@@ -1058,27 +1744,8 @@ static s8 usb_64drive_write(int datatype, const void* data, int size)
     // Set the cartridge to write mode
     usb_64drive_set_writable(TRUE);
 
-    // Write data to SDRAM until we've finished
-    while (left > 0)
-    {
-        // Calculate transfer size
-        u32 block = MIN(left, BUFFER_SIZE);
-
-        // Copy data to PI DMA aligned buffer
-        memcpy(usb_buffer, data, block);
-        
-        // Pad the buffer with zeroes if it wasn't 4 byte aligned
-        while (block%4)
-            usb_buffer[block++] = 0;
-
-        // Copy block of data from RDRAM to SDRAM
-        usb_dma_write(usb_buffer, pi_address, ALIGN(block, 2));
-
-        // Update pointers and variables
-        data = (void*)(((u32)data) + block);
-        left -= block;
-        pi_address += block;
-    }
+    // Write data to SDRAM, padded with zeroes to be 4 byte aligned
+    usb_writeout(pi_address, data, size, 4);
 
     // Disable write mode
     usb_64drive_set_writable(FALSE);
@@ -1126,13 +1793,16 @@ static u32 usb_64drive_poll(void)
 
 /*==============================
     usb_64drive_read
-    Reads bytes from the 64Drive ROM into the global buffer with the block offset
+    Starts reading a block from the 64Drive ROM into a buffer.
+    Use usb_dma_finish to wait for it to arrive
+    @param The buffer to put the read data in
+    @param The offset of the block in the debug area
 ==============================*/
 
-static void usb_64drive_read(void)
+static void usb_64drive_read(void* buffer, int offset)
 {
     // Set up DMA transfer between RDRAM and the PI
-    usb_dma_read(usb_buffer, D64_BASE + usb_getaddr() + usb_readblock, BUFFER_SIZE);
+    usb_dma_startread(buffer, D64_BASE + usb_getaddr() + offset, BUFFER_SIZE);
 }
 
 
@@ -1199,10 +1869,10 @@ static void usb_everdrive_readusb(void* buffer, int size)
     while (size) 
     {
         // Get the block size
-        block = BUFFER_SIZE;
+        block = ED_USBDAT_SIZE;
         if (block > size)
             block = size;
-        addr = BUFFER_SIZE - block;
+        addr = ED_USBDAT_SIZE - block;
         
         // Request to read from the USB
         usb_io_write(ED_REG_USBCFG, ED_USBMODE_RD | addr);
@@ -1253,11 +1923,14 @@ static s8 usb_everdrive_write(int datatype, const void* data, int size)
     {
         int block = left;
         int blocksend, baddr;
-        if (block+offset > BUFFER_SIZE)
-            block = BUFFER_SIZE-offset;
+        if (block+offset > ED_USBDAT_SIZE)
+            block = ED_USBDAT_SIZE-offset;
             
         // Copy the data to the next available spots in the global buffer
-        memcpy(usb_buffer+offset, (void*)((char*)data+read), block);
+        if (wrotecmp)
+            memcpy(usb_buffer+offset, (void*)((char*)data+read), block);
+        else
+            usb_copyout(usb_buffer+offset, data, read, block);
         
         // Restart the loop to write the CMP signal if we've finished
         if (!wrotecmp && read+block >= size)
@@ -1272,7 +1945,7 @@ static s8 usb_everdrive_write(int datatype, const void* data, int size)
         
         // Ensure the data is 2 byte aligned and the block address is correct
         blocksend = ALIGN((block+offset), 2);
-        baddr = BUFFER_SIZE - blocksend;
+        baddr = ED_USBDAT_SIZE - blocksend;
 
         // Set USB to write mode and send data through USB
         usb_io_write(ED_REG_USBCFG, ED_USBMODE_WRNOP);
@@ -1369,13 +2042,16 @@ static u32 usb_everdrive_poll(void)
 
 /*==============================
     usb_everdrive_read
-    Reads bytes from the EverDrive ROM into the global buffer with the block offset
+    Starts reading a block from the EverDrive ROM into a buffer.
+    Use usb_dma_finish to wait for it to arrive
+    @param The buffer to put the read data in
+    @param The offset of the block in the debug area
 ==============================*/
 
-static void usb_everdrive_read(void)
+static void usb_everdrive_read(void* buffer, int offset)
 {
     // Set up DMA transfer between RDRAM and the PI
-    usb_dma_read(usb_buffer, ED_BASE + usb_getaddr() + usb_readblock, BUFFER_SIZE);
+    usb_dma_startread(buffer, ED_BASE + usb_getaddr() + offset, BUFFER_SIZE);
 }
 
 
@@ -1463,7 +2139,6 @@ static u32 usb_sc64_set_writable(u32 enable)
 
 static s8 usb_sc64_write(int datatype, const void* data, int size)
 {
-    u32 left = size;
     u32 pi_address = SC64_BASE + usb_getaddr();
     u32 writable_restore;
     u32 timeout;
@@ -1481,22 +2156,8 @@ static s8 usb_sc64_write(int datatype, const void* data, int size)
     // Enable SDRAM writes and get previous setting
     writable_restore = usb_sc64_set_writable(TRUE);
 
-    while (left > 0)
-    {
-        // Calculate transfer size
-        u32 block = MIN(left, BUFFER_SIZE);
-
-        // Copy data to PI DMA aligned buffer
-        memcpy(usb_buffer, data, block);
-
-        // Copy block of data from RDRAM to SDRAM
-        usb_dma_write(usb_buffer, pi_address, ALIGN(block, 2));
-
-        // Update pointers and variables
-        data = (void*)(((u32)data) + block);
-        left -= block;
-        pi_address += block;
-    }
+    // Write data to SDRAM
+    usb_writeout(pi_address, data, size, 2);
 
     // Restore previous SDRAM writable setting
     usb_sc64_set_writable(writable_restore);
@@ -1577,11 +2238,14 @@ static u32 usb_sc64_poll(void)
 
 /*==============================
     usb_sc64_read
-    Reads bytes from the SC64 SDRAM into the global buffer with the block offset
+    Starts reading a block from the SC64 SDRAM into a buffer.
+    Use usb_dma_finish to wait for it to arrive
+    @param The buffer to put the read data in
+    @param The offset of the block in the debug area
 ==============================*/
 
-static void usb_sc64_read(void)
+static void usb_sc64_read(void* buffer, int offset)
 {
     // Set up DMA transfer between RDRAM and the PI
-    usb_dma_read(usb_buffer, SC64_BASE + usb_getaddr() + usb_readblock, BUFFER_SIZE);
+    usb_dma_startread(buffer, SC64_BASE + usb_getaddr() + offset, BUFFER_SIZE);
 }
@@ -13,6 +13,21 @@
     #define DEBUG_ADDRESS_SIZE 8*1024*1024 // Max size of USB I/O. The bigger this value, the more ROM you lose!
     #define CHECK_EMULATOR     0           // Stops the USB library from working if it detects an emulator to prevent problems
     
+    // How many packets UNFLoader can send on each channel before it must wait for them to be read
+    #ifndef USB_CREDITS
+        #define USB_CREDITS 1
+    #endif
+    
+    // Size of the two buffers that USB data is moved through. Must be a multiple of 512
+    #ifndef USB_BUFFER_SIZE
+        #define USB_BUFFER_SIZE 512
+    #endif
+    
+    // Size of the ring that streamed data is received into, which sits right below the debug area in SDRAM. 0 disables streaming
+    #ifndef USB_STREAM_SIZE
+        #define USB_STREAM_SIZE 0
+    #endif
+    
     // Cart definitions
     #define CART_NONE      0
     #define CART_64DRIVE   1
@@ -26,6 +41,27 @@
     #define DATATYPE_SCREENSHOT  0x04
     #define DATATYPE_HEARTBEAT   0x05
     #define DATATYPE_RDBPACKET   0x06
+    #define DATATYPE_SEGMENT     0x09
+    #define DATATYPE_CHANNEL     0x0A
+    #define DATATYPE_CREDIT      0x0B
+    #define DATATYPE_STREAM      0x0D
+    #define DATATYPE_PATCH       0x0E
+    #define DATATYPE_FSREQUEST   0x0F
+    #define DATATYPE_FSDATA      0x10
+    #define DATATYPE_PROFILE     0x11
+    #define DATATYPE_ZONES       0x12
+    #define DATATYPE_ZONENAME    0x13
+    #define DATATYPE_HEAP        0x14
+    #define DATATYPE_COREREGS    0x15
+    #define DATATYPE_COREMEM     0x16
+    
+    // Channel definitions (USB protocol 3 and up)
+    #define USBCHANNEL_CONTROL 0
+    #define USBCHANNEL_LOG     1
+    #define USBCHANNEL_RDB     2
+    #define USBCHANNEL_BULK    3
+    #define USBCHANNEL_USER    4
+    #define USBCHANNEL_COUNT   5
     
     
     /*********************************
@@ -137,5 +173,28 @@
     ==============================*/
 
     extern void usb_sendheartbeat(void);
+    
+    
+    /*==============================
+        usb_stream_available
+        Returns how many bytes of streamed data have arrived
+        and are waiting to be read with usb_stream_read.
+        Streamed data is only received while calling usb_poll
+        @return The number of bytes that can be read
+    ==============================*/
+    
+    extern int usb_stream_available(void);
+    
+    
+    /*==============================
+        usb_stream_read
+        Reads streamed data into the provided buffer, without
+        waiting for more data to arrive
+        @param  The buffer to put the read data in
+        @param  The number of bytes to read
+        @return The number of bytes that were read
+    ==============================*/
+    
+    extern int usb_stream_read(void* buffer, int size);
 
 #endif